@@ -30,26 +30,41 @@ bool PROBE = true;
 // Software version
 #include "version.h"
 
+// Deferred formatting log
+#include "dlog.h"
+
+// Blocking call detector and loop stall watchdog
+#include "stall.h"
+
 // WiFi
 #include <ESP8266WiFi.h>
 #include <WiFiUdp.h>
 #include <WiFiManager.h>
+extern "C" {
+#include "user_interface.h"
+}
 
-#ifdef WIFI_SSIDPASS
-static const char wifiSP[] PROGMEM = WIFI_SSIDPASS;
-const char *wifiRS          = WIFI_RS;
-const char *wifiFS          = WIFI_FS;
-#endif
+// Shared DNS cache, for all the network clients
+#include "dnscache.h"
+DNSCache dnsCache;
+
+// Shared TLS context, for the HTTPS check and the geolocation
+#include "tls.h"
+TLS tls;
+
+// Joining the networks, in the background
+#include "wlan.h"
+WLAN wlan;
 
 // OTA
 #include <ESP8266mDNS.h>
 #include <ArduinoOTA.h>
 int otaPort     = 8266;
 
-// TCP server
-#include "server.h"
+// TCP fan-out server
+#include "rawserver.h"
 // NMEA-0183 Navigational Data Server
-TCPServer nmeaServer(10110);
+RawServer nmeaServer(10110);
 
 // UDP Broadcast
 WiFiUDP   bcastUDP;
@@ -60,6 +75,52 @@ const int bcastPort = 10110;
 #include "mls.h"
 MLS mls;
 
+// Offline AP database
+#include "tiles.h"
+Tiles tiles;
+
+// Passive AP collector
+#include "beacons.h"
+Beacons beacons;
+
+// Serial GPS receiver
+#include "gps.h"
+GPS gps;
+
+// Data budget
+#include "budget.h"
+Budget budget;
+
+// Uplink shaper
+#include "shaper.h"
+Shaper shaper;
+
+// Uplink quality, the timeouts of the exchanges
+#include "link.h"
+Link uplink;
+
+// LAN geolocation cache
+#include "lancache.h"
+LANCache lanCache;
+
+// I/O trace, for the host replay
+#include "trace.h"
+Trace trace;
+
+// Energy accounting
+#include "energy.h"
+Energy energy;
+
+// The last fix, clock and AP, kept over resets
+#include "resume.h"
+Resume resume;
+unsigned long rsmLast = 0;        // Last time the restored fix was served
+bool          svcUp   = false;    // The network services are started
+
+// Online track simplification
+#include "track.h"
+Track track;
+
 // Network Time Protocol
 #include "ntp.h"
 NTP ntp;
@@ -71,14 +132,10 @@ APRS aprs;
 // NMEA
 #include "nmea.h"
 NMEA nmea;
-struct nmeaReports {
-  bool gga: 1;
-  bool rmc: 1;
-  bool gll: 1;
-  bool vtg: 1;
-  bool zda: 1;
-};
-nmeaReports nmeaReport = {1, 1, 0, 0, 0};
+
+// The fix cycle, the sentences sent with each fix
+#include "cycle.h"
+Cycle cycle;
 
 #ifdef HAVE_OLED
 // OLED
@@ -89,20 +146,6 @@ U8X8_SSD1306_128X32_UNIVISION_HW_I2C u8x8(16);
 // Set ADC to Voltage
 ADC_MODE(ADC_VCC);
 
-// Timings
-unsigned long geoNextTime = 0;    // Next time to geolocate
-unsigned long geoDelay    = 20;   // Delay between geolocating
-unsigned long rpNextTime  = 0;    // Next time to report
-unsigned long rpDelay     = 60;   // Delay between reporting
-unsigned long rpDelayStep = 30;   // Step to increase the delay between reporting
-unsigned long rpDelayMin  = 60;   // Minimum delay between reporting
-unsigned long rpDelayMax  = 1800; // Maximum delay between reporting
-
-// Smooth accuracy and course
-int sAcc = -1;
-int sCrs = -1;
-
-
 /**
   Convert IPAddress to char array
 */
@@ -119,22 +162,22 @@ void showWiFi() {
     char ipbuf[16] = "";
     char gwbuf[16] = "";
     char nsbuf[16] = "";
+    char ssid[WL_SSID_MAX_LENGTH + 1] = "";
 
-    // Get the IPs as char arrays
+    // Get the SSID and the IPs as char arrays
+    wlan.ssid(ssid, sizeof(ssid));
     charIP(WiFi.localIP(),   ipbuf, sizeof(ipbuf), false);
     charIP(WiFi.gatewayIP(), gwbuf, sizeof(gwbuf), false);
     charIP(WiFi.dnsIP(),     nsbuf, sizeof(nsbuf), false);
     yield();
 
     // Print
-    Serial.printf_P(PSTR("$PWIFI,CON,%s,%d,%ddBm,%s,%s,%s\r\n"),
-                    WiFi.SSID().c_str(), WiFi.channel(), WiFi.RSSI(),
-                    ipbuf, gwbuf, nsbuf);
+    DLOG_P(WIFI_CON, ssid, WiFi.channel(), WiFi.RSSI(), ipbuf, gwbuf, nsbuf);
 
 #ifdef HAVE_OLED
     // Display
     u8x8.clear();
-    u8x8.draw1x2String(0, 0, WiFi.SSID().c_str());
+    u8x8.draw1x2String(0, 0, ssid);
     u8x8.setCursor(0, 2); u8x8.print("IP "); u8x8.print(ipbuf);
     //u8x8.setCursor(0, 3); u8x8.print("GW "); u8x8.print(gwbuf);
     //u8x8.setCursor(0, 4); u8x8.print("NS "); u8x8.print(nsbuf);
@@ -142,10 +185,38 @@ void showWiFi() {
 #endif
   }
   else
-    Serial.print(F("$PWIFI,ERR\r\n"));
+    DLOG_P(WIFI_NOC);
   yield();
 }
 
+/**
+  Show the joins of the networks
+
+  @param arg not used
+  @param event joining, waiting or joined
+  @param ssid the network
+*/
+void wifiShow(void *arg, uint8_t event, const char *ssid) {
+  if (event == WLAN_JOINED) {
+    showWiFi();
+    return;
+  }
+#ifdef HAVE_OLED
+  if (event == WLAN_BEGIN) {
+    // Display
+    u8x8.clear();
+    u8x8.draw1x2String(0, 0, "WiFi");
+    u8x8.setCursor(0, 2);
+    u8x8.print(ssid);
+    u8x8.setCursor(0, 3);
+    u8x8.print("---------------");
+    u8x8.setCursor(0, 3);
+  }
+  else
+    u8x8.print("|");
+#endif
+}
+
 /**
   Turn the built-in led on, analog
 */
@@ -159,14 +230,14 @@ void setLED(int load) {
   TODO
 */
 bool tryWPSPBC() {
-  Serial.print(F("$PWIFI,WPS,START\r\n"));
+  DLOG_P(WIFI_WPSB);
   bool wpsSuccess = WiFi.beginWPSConfig();
   if (wpsSuccess) {
     // Well this means not always success :-/ in case of a timeout we have an empty ssid
-    String newSSID = WiFi.SSID();
-    if (newSSID.length() > 0) {
+    char newSSID[WL_SSID_MAX_LENGTH + 1] = "";
+    if (wlan.ssid(newSSID, sizeof(newSSID)) > 0) {
       // WPSConfig has already connected in STA mode successfully to the new station.
-      Serial.printf_P(PSTR("$PWIFI,WPS,%s\r\n"), newSSID.c_str());
+      DLOG_P(WIFI_WPS, newSSID);
     }
     else
       wpsSuccess = false;
@@ -174,269 +245,11 @@ bool tryWPSPBC() {
   return wpsSuccess;
 }
 
-/**
-  Try to connect to a HTTPS server
-
-  @param timeout connection timeout
-*/
-bool wifiCheckHTTP(char* server, int port, int timeout = 10000) {
-  bool result = false;
-  WiFiClientSecure testClient;
-  testClient.setTimeout(timeout);
-  testClient.setInsecure();
-  char buf[64] = "";
-  if (testClient.connect(server, port)) {
-    Serial.printf_P(PSTR("$PHTTP,CON,%s,%d\r\n"), server, port);
-    // Send a request
-    testClient.print("HEAD / HTTP/1.1\r\n");
-    testClient.print("Host: "); testClient.print(server); testClient.print("\r\n");
-    testClient.print("Connection: close\r\n\r\n");
-    // Check the response
-    int rlen = testClient.readBytesUntil('\r', buf, 64);
-    if (rlen > 0) {
-      buf[rlen] = '\0';
-      result = true;
-      Serial.printf_P(PSTR("$PHTTP,RSP,%s\r\n"), buf);
-    }
-    else
-      Serial.printf_P(PSTR("$PHTTP,DIS,%s,%d\r\n"), server, port);
-  }
-  else
-    Serial.printf_P(PSTR("$PHTTP,ERR,%s,%d\r\n"), server, port);
-  // Stop the test
-  testClient.stop();
-  // Return the result
-  return result;
-}
-
-/**
-  Try to connect to WiFi network
-
-  @param ssid the WiFi SSID
-  @param pass the WiFi psk
-  @param timeout connection timeout
-  @return connection result
-*/
-bool wifiTryConnect(const char* ssid = NULL, const char* pass = NULL, int timeout = 15) {
-  bool result = false;
-
-  // Need a name for default SSID
-  char _ssid[WL_SSID_MAX_LENGTH] = "";
-
-  if (ssid == NULL) {
-    // Connect to stored SSID
-    if (WiFi.SSID() != "") {
-      strncpy(_ssid, WiFi.SSID().c_str(), WL_SSID_MAX_LENGTH);
-    }
-    else {
-      // No stored and no specified SSID
-      return result;
-    }
-  }
-  else {
-    // Keep the specified SSID, for convenience
-    strncpy(_ssid, ssid, WL_SSID_MAX_LENGTH);
-  }
-
-  // Try to connect
-  Serial.printf_P(PSTR("$PWIFI,BGN,%s\r\n"), _ssid);
-#ifdef HAVE_OLED
-  u8x8.clear();
-  u8x8.draw1x2String(0, 0, "WiFi");
-#endif
-  // Different calls for different configurations
-  if (ssid == NULL) WiFi.begin();
-  else              WiFi.begin(_ssid, pass);
-#ifdef HAVE_OLED
-  // Display
-  u8x8.setCursor(0, 2);
-  u8x8.print(_ssid);
-  u8x8.setCursor(0, 3);
-  u8x8.print("---------------");
-  u8x8.setCursor(0, 3);
-#endif
-  // Check the status
-  int tries = 0;
-  while (!WiFi.isConnected() and tries < timeout) {
-    tries++;
-    Serial.printf_P(PSTR("$PWIFI,TRY,%d/%d,%s\r\n"), tries, timeout, _ssid);
-#ifdef HAVE_OLED
-    u8x8.print("|");
-#endif
-    delay(1000);
-  };
-  // Check the internet connection
-  if (WiFi.isConnected()) {
-    showWiFi();
-    result = wifiCheckHTTP(GEO_SERVER, GEO_PORT);
-    //result = (mls.geoLocation() >= 0);
-    if (!result)
-      Serial.printf_P(PSTR("$PWIFI,ERR,%s\r\n"), _ssid);
-  }
-  else
-    // Timed out
-    Serial.printf_P(PSTR("$PWIFI,END,%s\r\n"), _ssid);
-  return result;
-}
-
-/**
-  Try to connect to a list of known wifi networks
-
-  @result connection result to a known WiFi
-*/
-bool wifiTryKnownNetworks() {
-  bool result = false;
-  if (strlen_P(wifiSP) > 0) {
-    // Scan the networks
-    int netCount = WiFi.scanNetworks();
-    if (netCount > 0) {
-      Serial.printf_P(PSTR("$SWIFI,CNT,%d\r\n"), netCount);
-      for (size_t i = 0; i < netCount; i++)
-        Serial.printf_P(PSTR("$SWIFI,%d,%d,%d,%s,%s\r\n"),
-                        i + 1,
-                        WiFi.channel(i),
-                        WiFi.RSSI(i),
-                        WiFi.encryptionType(i) == ENC_TYPE_NONE ? "open" : "",
-                        WiFi.SSID(i).c_str());
-      // Temporary buffers for SSID, password and credentials list
-      char ssid[WL_SSID_MAX_LENGTH]    = "";
-      char pass[WL_WPA_KEY_MAX_LENGTH] = "";
-      char sspa[250] = "";
-      // Copy the credentials to RAM
-      strncpy_P(sspa, wifiSP, 250);
-      // The substrings/fields
-      char *f1, *f2;
-      char *fs, *rs;
-
-      // Start from beginning
-      f1 = sspa;
-      // Find the record separator
-      rs = strstr(f1, wifiRS);
-      // While valid...
-      while (rs != NULL) {
-        // Find the field separator
-        fs = strstr(f1, wifiFS);
-        if (fs != NULL) {
-          f2 = fs + strlen(wifiFS);
-          // Check for valid lenghts
-          if ((fs - f1 <= WL_SSID_MAX_LENGTH) and
-              (rs - f2 <= WL_WPA_KEY_MAX_LENGTH)) {
-            // Make a copy of SSID and password and make sure
-            // they are null terminated
-            strncpy(ssid, f1, fs - f1); ssid[fs - f1] = 0;
-            strncpy(pass, f2, rs - f2); pass[rs - f2] = 0;
-            // Check if we know any network
-            for (size_t i = 0; i < netCount; i++) {
-              // Check if we the SSID match
-              if ((strncmp(ssid, WiFi.SSID(i).c_str(), WL_SSID_MAX_LENGTH) == 0) and
-                  (strlen(ssid) == strlen(WiFi.SSID(i).c_str()))) {
-                // Try to connect to wifi
-                if (wifiTryConnect(ssid, pass)) {
-                  result = true;
-                  break;
-                }
-              }
-              yield();
-            }
-          }
-        }
-        if (result) break;
-        // Find the next record separator
-        f1 = rs + strlen(wifiRS);
-        rs = strstr(f1, wifiRS);
-        // If null, maybe it's because the list ends with no RS
-        if (rs == NULL and f1 < sspa + strlen(sspa))
-          rs = sspa + strlen(sspa);
-        yield();
-      }
-      // Return if we have a connection
-      if (result) return result;
-
-#ifdef WIFI_GREYHAT
-      // Start again, this time trying all
-      f1 = sspa;
-      // Find the record separator
-      rs = strstr(f1, wifiRS);
-      // While valid...
-      while (rs != NULL) {
-        // Find the field separator
-        fs = strstr(f1, wifiFS);
-        if (fs != NULL) {
-          f2 = fs + strlen(wifiFS);
-          // Check for valid lenghts
-          if ((fs - f1 <= WL_SSID_MAX_LENGTH) and
-              (rs - f2 <= WL_WPA_KEY_MAX_LENGTH)) {
-            // Make a copy of SSID and password and make sure
-            // they are null terminated
-            strncpy(ssid, f1, fs - f1); ssid[fs - f1] = 0;
-            strncpy(pass, f2, rs - f2); pass[rs - f2] = 0;
-            // Try all the networks
-            for (size_t i = 0; i < netCount; i++) {
-              // Try to connect to wifi
-              if (wifiTryConnect(WiFi.SSID(i).c_str(), pass)) {
-                result = true;
-                break;
-              }
-              yield();
-            }
-          }
-        }
-        if (result) break;
-        // Find the next record separator
-        f1 = rs + strlen(wifiRS);
-        rs = strstr(f1, wifiRS);
-        // If null, maybe it's because the list ends with no RS
-        if (rs == NULL and f1 < sspa + strlen(sspa))
-          rs = sspa + strlen(sspa);
-        yield();
-      }
-#endif
-    }
-  }
-  // Clear the scan results
-  WiFi.scanDelete();
-  // Return the result
-  return result;
-}
-
-/**
-  Try to connect to open wifi networks
-
-  @result connection result to an open WiFi
-*/
-bool wifiTryOpenNetworks() {
-  bool result = false;
-  // Scan
-  int netCount = WiFi.scanNetworks();
-  if (netCount > 0) {
-    char ssid[WL_SSID_MAX_LENGTH] = "";
-    for (size_t i = 1; i < netCount; i++) {
-      // Find the open networks
-      if (WiFi.encryptionType(i) == ENC_TYPE_NONE) {
-        // Keep the SSID
-        strncpy(ssid, WiFi.SSID(i).c_str(), WL_SSID_MAX_LENGTH);
-        Serial.printf_P(PSTR("$PWIFI,OPN,%s\r\n"), ssid);
-        // Try to connect to wifi
-        if (wifiTryConnect(ssid)) {
-          result = true;
-          break;
-        }
-      }
-      yield();
-    }
-  }
-  // Clear the scan results
-  WiFi.scanDelete();
-  // Return the result
-  return result;
-}
-
 /**
   Feedback notification when SoftAP is started
 */
 void wifiCallback(WiFiManager * wifiMgr) {
-  Serial.printf_P(PSTR("$PWIFI,SRV,%s\r\n"),
-                  wifiMgr->getConfigPortalSSID().c_str());
+  DLOG_P(WIFI_SRV, wifiMgr->getConfigPortalSSID().c_str());
 #ifdef HAVE_OLED
   u8x8.clear();
   u8x8.draw1x2String(0, 0, wifiMgr->getConfigPortalSSID().c_str());
@@ -445,61 +258,57 @@ void wifiCallback(WiFiManager * wifiMgr) {
 }
 
 /**
-  Try to connect to WiFi
+  Try to connect to WiFi, blocking: the stored network, the known ones
+  around, the open ones, then the portal
 */
 bool wifiConnect(int timeout = 300) {
-  // Set the host name
-  WiFi.hostname(NODENAME);
-  // Set the mode
-  WiFi.mode(WIFI_STA);
-  // Do not try to auto-connect on power on
-  //WiFi.setAutoConnect(false);
   // Led ON
   setLED(1);
 
   // Keep the connection result
   bool result = true;
-  // Try to connect to WiFi
-#ifdef WIFI_SSID
-  wifiTryConnect(WIFI_SSID, WIFI_PASS);
-#else
   // Check if already connected, then try to connect to the last known AP
-  if (!WiFi.isConnected()) {
-    // Keep the saved credentials
-    char savedSSID[WL_SSID_MAX_LENGTH];
-    char savedPSK[WL_WPA_KEY_MAX_LENGTH];
-    strncpy(savedSSID, WiFi.SSID().c_str(), WL_SSID_MAX_LENGTH);
-    strncpy(savedPSK, WiFi.psk().c_str(), WL_WPA_KEY_MAX_LENGTH);
-    // Try to connect with saved credentials
-    if (not wifiTryConnect()) {
-      // Try the known networks
-      if (not wifiTryKnownNetworks()) {
-        // Try the open networks
-        if (not wifiTryOpenNetworks()) {
-          // Use the WiFi Manager
-          WiFiManager wifiManager;
-          wifiManager.setTimeout(timeout);
-          wifiManager.setAPCallback(wifiCallback);
-          setLED(10);
-          if (not wifiManager.startConfigPortal(NODENAME)) {
-            setLED(2);
-            result = false;
-          }
-        }
+  if (not WiFi.isConnected()) {
+    // Try the stored network, the known networks, then the open networks
+    if (not wlan.join() and not wlan.joinKnown() and not wlan.joinOpen()) {
+      // Use the WiFi Manager
+      WiFiManager wifiManager;
+      wifiManager.setTimeout(timeout);
+      wifiManager.setAPCallback(wifiCallback);
+      setLED(10);
+      if (not wifiManager.startConfigPortal(NODENAME)) {
+        setLED(2);
+        result = false;
       }
     }
   }
-#endif
   // Led OFF
   setLED(0);
 
   return result;
 }
 
+/**
+  Join the AP of the last run on its channel, without a scan
+
+  @return connection result
+*/
+bool wifiResume() {
+  if (not resume.valid or resume.state.channel == 0) return false;
+  if (not wlan.begin(resume.state.channel, resume.state.bssid)) return false;
+  // As long as the associations take
+  unsigned long start = millis();
+  while (!WiFi.isConnected() and millis() - start < uplink.timeout(LNK_WIFI))
+    stall.wait(100);
+  // Time it and show it, else the stored network in the background
+  if (WiFi.isConnected()) wlan.loop();
+  return WiFi.isConnected();
+}
+
 /**
   UDP broadcast
 */
-void broadcast(char *buf, size_t len) {
+void broadcast(const char *buf, size_t len) {
   // Find the broadcast IP
   bcastIP = IPAddress((~ (uint32_t)WiFi.subnetMask()) | ((uint32_t)WiFi.gatewayIP()));
 
@@ -512,44 +321,92 @@ void broadcast(char *buf, size_t len) {
 }
 
 /**
-  Main Arduino setup function
+  Serve the restored fix, as an estimated one, until a new one; with no
+  time until the clock is restored or synced, the uptime is not one
 */
-void setup() {
-  // Do not save the last WiFi settings
-  WiFi.persistent(false);
-  // Init the serial communication
-  Serial.begin(9600, SERIAL_8N1, SERIAL_TX_ONLY);
-  Serial.print("\r\n");
-#ifdef HAVE_OLED
-  // Init the display
-  u8x8.begin();
-  u8x8.setFont(u8x8_font_chroma48medium8_r);
-  u8x8.setContrast(2);
-#endif
-  // Compose the NMEA welcome message
-  nmea.getWelcome(NODENAME, VERSION);
-  Serial.print(nmea.welcome);
-  Serial.print(F("$PGPL3,This program comes with ABSOLUTELY NO WARRANTY.\r\n"));
-  Serial.print(F("$PGPL3,This is free software, and you are welcome \r\n"));
-  Serial.print(F("$PGPL3,to redistribute it under certain conditions.\r\n"));
-#ifdef HAVE_OLED
-  // Display
-  u8x8.draw2x2String(4, 0, NODENAME);
-#ifdef CALLSIGN
-  u8x8.drawString((16 - strlen(CALLSIGN)) / 2, 3, CALLSIGN);
-#else
-  u8x8.drawString((16 - strlen(VERSION)) / 2, 3, VERSION);
-#endif
-#endif
-  delay(1000);
+void provisional() {
+  if (not (cycle.sentences & CYC_GGA)) return;
+  char buf[100];
+  int len = nmea.getGGA(buf, sizeof(buf), ntp.set ? ntp.getSeconds(false) : 0,
+                        resume.latitude(), resume.longitude(), 6, 0);
+  Serial.print(buf);
+  if (nmeaServer.clients) {
+    nmeaServer.sendAll(buf);
+    nmeaServer.flush();
+  }
+  if (WiFi.isConnected()) broadcast(buf, len);
+  rsmLast = millis();
+}
 
-  // Initialize the LED pin as an output
-  pinMode(LED, OUTPUT);
-  setLED(0);
+/**
+  Send a sentence of the fix: serial, the NMEA clients and broadcast
+
+  @param arg not used
+  @param buf the sentence
+  @param len its length
+*/
+void cycleSend(void *arg, char *buf, size_t len) {
+  Serial.print(buf);
+  if (nmeaServer.clients) nmeaServer.sendAll(buf);
+  broadcast(buf, len);
+}
 
-  // Try to connect, for ever
-  while (not wifiConnect(300));
+/**
+  Show the steps of the fix cycle, on the led and the display
+
+  @param arg not used
+  @param event the step
+*/
+void cycleShow(void *arg, uint8_t event) {
+  if (event == CYC_BEGIN or event == CYC_LOCATED)
+    setLED(4);
+  else if (event == CYC_GEO)
+    setLED(6);
+  else if (event == CYC_REPORT)
+    setLED(8);
+  else if (event == CYC_REPORTED or event == CYC_END)
+    setLED(0);
+  else if (event == CYC_SENT)
+    // Send all the sentences of this fix at once
+    nmeaServer.flush();
+#ifdef HAVE_OLED
+  if (event == CYC_LOCATED) {
+    // Display
+    u8x8.clear();
+    char bufClock[20];
+    ntp.getClock(bufClock, 20, cycle.utm);
+    u8x8.setCursor(0, 3); u8x8.print("UTC "); u8x8.print(bufClock);
+  }
+  else if (event == CYC_FIX) {
+    // Display
+    u8x8.print(" FIX");
+    u8x8.setCursor(0, 0);
+    u8x8.print("Lat ");
+    u8x8.print(mls.current.latitude  >= 0 ? "N " : "S ");
+    u8x8.print(fabs(mls.current.latitude),  6);
+    u8x8.setCursor(0, 1);
+    u8x8.print("Lng ");
+    u8x8.print(mls.current.longitude >= 0 ? "E" : "W");
+    if (abs(mls.current.longitude) < 100) u8x8.print(" ");
+    u8x8.print(fabs(mls.current.longitude), 6);
+    // The speed and the course if moving, else the locator
+    if (cycle.moving) {
+      u8x8.setCursor(0, 2); u8x8.print("Spd "); u8x8.print(mls.speed, 2);
+      u8x8.setCursor(9, 2); u8x8.print("Crs "); u8x8.print(cycle.sCrs);
+    }
+    else {
+      u8x8.setCursor(0, 2); u8x8.print("Loc "); u8x8.print(mls.locator);
+    }
+  }
+  else if (event == CYC_NOFIX)
+    u8x8.print(" NFX");
+#endif
+}
 
+/**
+  Start the network services, once connected
+*/
+void services() {
   // OTA Update
   ArduinoOTA.setPort(otaPort);
   ArduinoOTA.setHostname(NODENAME);
@@ -558,7 +415,9 @@ void setup() {
 #endif
 
   ArduinoOTA.onStart([]() {
-    Serial.print(F("$POTA,STA\r\n"));
+    DLOG_P(OTA_STA);
+    // The update comes on a port chosen by the uploader
+    budget.setDefault(BDG_OTA);
 #ifdef HAVE_OLED
     u8x8.clear();
     u8x8.draw1x2String(3, 0, "OTA Update");
@@ -567,7 +426,8 @@ void setup() {
   });
 
   ArduinoOTA.onEnd([]() {
-    Serial.print(F("\r\n$POTA,FIN\r\n"));
+    DLOG_P(OTA_FIN);
+    budget.setDefault(BDG_OTHER);
 #ifdef HAVE_OLED
     u8x8.clear();
 #endif
@@ -578,7 +438,7 @@ void setup() {
     int otaPrg = progress / (total / 100);
     if (otaProgress != otaPrg) {
       otaProgress = otaPrg;
-      Serial.printf_P(PSTR("$POTA,PRG,%u%%\r\n"), otaProgress);
+      DLOG_P(OTA_PRG, otaProgress);
 #ifdef HAVE_OLED
       if (otaProgress < 100)
         u8x8.drawString(3 + otaProgress / 10, 3, "|");
@@ -587,278 +447,273 @@ void setup() {
   });
 
   ArduinoOTA.onError([](ota_error_t error) {
-    Serial.printf_P(PSTR("$POTA,ERR,%u,"), error);
-    if      (error == OTA_AUTH_ERROR)     Serial.print(F("Auth Failed\r\n"));
-    else if (error == OTA_BEGIN_ERROR)    Serial.print(F("Begin Failed\r\n"));
-    else if (error == OTA_CONNECT_ERROR)  Serial.print(F("Connect Failed\r\n"));
-    else if (error == OTA_RECEIVE_ERROR)  Serial.print(F("Receive Failed\r\n"));
-    else if (error == OTA_END_ERROR)      Serial.print(F("End Failed\r\n"));
+    budget.setDefault(BDG_OTHER);
+    if      (error == OTA_AUTH_ERROR)     DLOG_P(OTA_EAUTH,  error);
+    else if (error == OTA_BEGIN_ERROR)    DLOG_P(OTA_EBEGIN, error);
+    else if (error == OTA_CONNECT_ERROR)  DLOG_P(OTA_ECONN,  error);
+    else if (error == OTA_RECEIVE_ERROR)  DLOG_P(OTA_ERECV,  error);
+    else if (error == OTA_END_ERROR)      DLOG_P(OTA_EEND,   error);
   });
 
   ArduinoOTA.begin();
-  Serial.print(F("$POTA,RDY\r\n"));
+  DLOG_P(OTA_RDY);
+
+#ifdef LAN_CACHE
+  // Ask the LAN resolver before the server, mDNS is up with OTA
+#ifdef LAN_PEER
+  lanCache.init(true);
+#else
+  lanCache.init();
+#endif
+#ifdef LAN_SERVER
+  IPAddress lanIP;
+  if (lanIP.fromString(LAN_SERVER)) lanCache.setServer(lanIP);
+#endif
+  mls.setLAN(&lanCache);
+#endif
+
+#ifdef TRACE
+  // Record the scans and the exchanges, served over mDNS too
+#ifdef TRACE_STREAM
+  trace.init(true);
+#else
+  trace.init();
+#endif
+  mls.setTrace(&trace);
+  ntp.setTrace(&trace);
+  aprs.setTrace(&trace);
+#endif
 
-  // Configure NTP
-  ntp.init(NTP_SERVER);
+  // Resolve the server names before they are needed
+  dnsCache.prefetch(GEO_SERVER);
+  dnsCache.prefetch(NTP_SERVER);
+  dnsCache.prefetch(APRS_SERVER);
+#ifdef TILE_SERVER
+  dnsCache.prefetch(TILE_SERVER);
+#endif
+
+  // Start NMEA TCP server
+  nmeaServer.init("nmea-0183", nmea.welcome);
+  svcUp = true;
+}
+void setup() {
+  // Do not save the last WiFi settings
+  WiFi.persistent(false);
+  // Init the serial communication
+#ifdef GPS_SERIAL
+  // The GPS receiver sends on the RX pin, buffered over the blocking calls
+  Serial.setRxBufferSize(GPS_RXBUF);
+  Serial.begin(9600, SERIAL_8N1, SERIAL_FULL);
+#else
+  Serial.begin(9600, SERIAL_8N1, SERIAL_TX_ONLY);
+#endif
+  Serial.print("\r\n");
+  // Report where the previous run got stuck, if it did
+  stall.init();
+  // Charge the stages of the loop to the subsystems
+  energy.init();
+  stall.setEnergy(&energy);
+#ifdef HAVE_OLED
+  // Init the display
+  u8x8.begin();
+  u8x8.setFont(u8x8_font_chroma48medium8_r);
+  u8x8.setContrast(2);
+#endif
+  // Compose the NMEA welcome message
+  nmea.getWelcome(NODENAME, VERSION);
+  Serial.print(nmea.welcome);
+  Serial.print(F("$PGPL3,This program comes with ABSOLUTELY NO WARRANTY.\r\n"));
+  Serial.print(F("$PGPL3,This is free software, and you are welcome \r\n"));
+  Serial.print(F("$PGPL3,to redistribute it under certain conditions.\r\n"));
+  // Restore the last fix, the clock and the AP, and serve the fix at once
+  if (resume.init()) {
+    if (resume.clock != 0) ntp.setSeconds(resume.clock);
+    provisional();
+  }
+#ifdef HAVE_OLED
+  // Display
+  u8x8.draw2x2String(4, 0, NODENAME);
+#ifdef CALLSIGN
+  u8x8.drawString((16 - strlen(CALLSIGN)) / 2, 3, CALLSIGN);
+#else
+  u8x8.drawString((16 - strlen(VERSION)) / 2, 3, VERSION);
+#endif
+  delay(1000);
+#endif
+
+  // Time the exchanges from the first association
+  uplink.init();
+
+  // Initialize the LED pin as an output
+  pinMode(LED, OUTPUT);
+  setLED(0);
+
+  // Configure the shared DNS cache and TLS context once, they are reused for each fix
+  dnsCache.init();
+  tls.init();
+  tls.setResolver(&dnsCache);
+  mls.init(&tls);
+  // Join the networks with the stored credentials, checked with the same context
+  wlan.init();
+  wlan.setLink(&uplink);
+  wlan.setTLS(&tls);
+  wlan.setResolver(&dnsCache);
+  wlan.setShow(wifiShow, NULL);
+#ifdef TILE_SERVER
+  tiles.setResolver(&dnsCache);
+  if (tiles.init(TILE_SERVER, TILE_PORT)) mls.setTiles(&tiles);
+#endif
+#ifdef BCN_PASSIVE
+  beacons.init();
+  mls.setBeacons(&beacons);
+  energy.setBeacons(&beacons);
+#endif
+#ifdef GPS_SERIAL
+  gps.init(&Serial);
+  mls.setGPS(&gps);
+  stall.setGPS(&gps);
+#endif
+  // Count the traffic per destination, the link is hooked once up
+  budget.init();
+  budget.setPort(GEO_PORT, BDG_GEO);
+  budget.setPort(APRS_PORT, BDG_APRS);
+  budget.setPort(123, BDG_NTP);
+  budget.setPort(bcastPort, BDG_NMEA);
+  budget.setPort(otaPort, BDG_OTA);
+  budget.setPort(53, BDG_DNS);
+#ifdef TILE_SERVER
+  budget.setPort(TILE_PORT, BDG_TILE);
+#endif
+  budget.setEnergy(&energy);
+  mls.setBudget(&budget);
+  mls.setLink(&uplink);
+  aprs.setLink(&uplink);
+  ntp.setLink(&uplink);
+  tiles.setLink(&uplink);
+  // The live work first, the bulk on a good link
+  shaper.init();
+  tiles.setShaper(&shaper);
+  ntp.setShaper(&shaper);
+  track.init();
+  ntp.setResolver(&dnsCache);
+  aprs.setResolver(&dnsCache);
+  // The fix cycle, with the modules it reports with
+  cycle.init(&mls, &nmea, &aprs, &ntp);
+  cycle.setTrack(&track);
+  cycle.setBudget(&budget);
+  cycle.setShaper(&shaper);
+  cycle.setTiles(&tiles);
+  cycle.setEnergy(&energy);
+  cycle.setResume(&resume);
+#ifdef GPS_SERIAL
+  cycle.setGPS(&gps);
+#endif
+  cycle.setSend(cycleSend, NULL);
+  cycle.setShow(cycleShow, NULL);
+  cycle.probed = PROBE;
+
+  // Configure NTP, the time is synced with the fixes
+  ntp.setServer(NTP_SERVER);
 
   // Configure APRS
   aprs.init(APRS_SERVER, APRS_PORT);
   // Use an automatic callsign
   aprs.setCallSign(CALLSIGN);
-  Serial.print(F("$PAPRS,AUTH,")); Serial.print(aprs.aprsCallSign);
-  Serial.print(","); Serial.print(aprs.aprsPassCode);
-  //Serial.print(","); Serial.print(aprs.aprsObjectNm);
-  Serial.print("\r\n");
+  DLOG_P(APRS_AUTH, aprs.aprsCallSign, aprs.aprsPassCode);
 
   // Hardware data
   int hwVcc  = ESP.getVcc();
-  Serial.print(F("$PHWMN,VCC,"));
-  Serial.print((float)hwVcc / 1000, 3);
-  Serial.print("\r\n");
+  DLOG_P(HWMN_VCC, (float)hwVcc / 1000);
 
   // Initialize the random number generator and set the APRS telemetry start sequence
   randomSeed(ntp.getSeconds(false) + hwVcc + millis());
   aprs.aprsTlmSeq = random(1000);
-  Serial.printf_P(PSTR("$PHWMN,TLM,%d\r\n"), aprs.aprsTlmSeq);
+  DLOG_P(HWMN_TLM, aprs.aprsTlmSeq);
 
-  // Start NMEA TCP server
-  nmeaServer.init("nmea-0183", nmea.welcome);
+  // Join the AP of the last run, fast, or else the stored network in the
+  // background, the loop checks it and, failing, looks for the known and
+  // the open networks around; the long way, with the portal, only with
+  // neither a fix to serve meanwhile nor a network to join
+  WiFi.hostname(NODENAME);
+  WiFi.mode(WIFI_STA);
+  if (not wifiResume() and not wlan.begin() and not resume.valid)
+    while (not wifiConnect(300));
+  // The rest once connected, in the loop if not yet
+  if (WiFi.isConnected()) services();
 }
 
 /**
   Main Arduino loop
 */
 void loop() {
+  // Time the loop pass
+  stall.begin();
+
+  // Start the network services, once connected
+  if (not svcUp and WiFi.isConnected()) {
+    stall.stage(STALL_WIFI);
+    services();
+  }
+
   // Handle OTA
+  stall.stage(STALL_OTA);
   ArduinoOTA.handle();
   yield();
 
   // Handle NMEA clients
+  stall.stage(STALL_SRV);
   nmeaServer.check();
+  // Serve the restored fix until a new one
+  if (resume.valid and millis() - rsmLast >= RSM_REPEAT) provisional();
+#ifdef LAN_CACHE
+  // Answer the peers, look for a resolver
+  lanCache.loop();
+#endif
+#ifdef TRACE
+  // Send the trace to its client
+  trace.loop();
+#endif
 
   // Uptime
   unsigned long now = millis() / 1000;
 
-  // Check if we should geolocate
-  if (now >= geoNextTime) {
-    // Make sure we are connected, shorter timeout
-    if (!WiFi.isConnected()) wifiConnect(60);
+  // Deliver the DNS answers and refresh the names about to expire
+  stall.stage(STALL_DNS);
+  dnsCache.loop();
 
-    // Set the telemetry bit 7 if the tracker is being probed
-    if (PROBE) aprs.aprsTlmBits = B10000000;
-    else       aprs.aprsTlmBits = B00000000;
+  // Connect, log in and drain the APRS-IS session, in the background
+  stall.stage(STALL_APRS);
+  aprs.loop();
 
-    // Check the time and set the telemetry bit 0 if time is not accurate
-    if (!ntp.valid) aprs.aprsTlmBits |= B00000001;
-    // Set the telemetry bit 1 if the uptime is less than one day (recent reboot)
-    if (millis() < 86400000UL) aprs.aprsTlmBits |= B00000010;
-
-    // Led on
-    setLED(4);
-
-    // Get the time of the fix
-    unsigned long utm = ntp.getSeconds();
+#ifdef GPS_SERIAL
+  // Read the sentences from the GPS receiver
+  stall.stage(STALL_GPS);
+  gps.loop();
+#endif
 
-    // Scan the WiFi access points
-    Serial.print(F("$PSCAN,WIFI,"));
-    int found = mls.wifiScan(false);
+#ifdef BCN_PASSIVE
+  // Listen for the beacons between the fixes, not during them
+  stall.stage(STALL_BCN);
+  if (now < cycle.geoNextTime) beacons.loop();
+  else                         beacons.stop();
+#endif
 
-    // Get the coordinates
-    if (found > 0) {
-      // Led on
-      setLED(6);
-      Serial.print(found);
-      Serial.print(","); Serial.print(ntp.getSeconds() - utm);
-      Serial.print("s\r\n");
+  // Fill the shaper buckets, the next live work is the fix
+  shaper.update(WiFi.RSSI(), cycle.geoNextTime * 1000, uplink.lossy());
 
-      // Geolocate
-      int acc = mls.geoLocation();
-      // Led off
-      setLED(4);
+  // Download the AP tiles around, between the fixes
+  stall.stage(STALL_TILE);
+  if (now < cycle.geoNextTime and mls.current.valid and not beacons.listening)
+    tiles.loop(mls.current.latitude, mls.current.longitude, cycle.sCrs, mls.speed);
 
-      // Exponential smooth the accuracy
-      if (sAcc < 0) sAcc = acc;
-      else          sAcc = (((sAcc << 2) - sAcc + acc) + 2) >> 2;
+  // Join a network in the background, the stored one or the ones around
+  stall.stage(STALL_WIFI);
+  wlan.loop();
 
-#ifdef HAVE_OLED
-      // Display
-      u8x8.clear();
-      char bufClock[20];
-      ntp.getClock(bufClock, 20, utm);
-      u8x8.setCursor(0, 3); u8x8.print("UTC "); u8x8.print(bufClock);
-#endif
+  // Scan, geolocate and report, if due
+  cycle.loop();
 
-      if (mls.current.valid) {
-        // Report
-        Serial.print(F("$PSCAN,FIX,"));
-        Serial.print(mls.current.latitude, 6);  Serial.print(",");
-        Serial.print(mls.current.longitude, 6); Serial.print(",");
-        Serial.print(mls.locator);              Serial.print(",");
-        Serial.print(acc);                      Serial.print("m,");
-        Serial.print(ntp.getSeconds() - utm);   Serial.print("s");
-#ifdef HAVE_OLED
-        // Display
-        u8x8.print(" FIX");
-        u8x8.setCursor(0, 0);
-        u8x8.print("Lat ");
-        u8x8.print(mls.current.latitude  >= 0 ? "N " : "S ");
-        u8x8.print(fabs(mls.current.latitude),  6);
-        u8x8.setCursor(0, 1);
-        u8x8.print("Lng ");
-        u8x8.print(mls.current.longitude >= 0 ? "E" : "W");
-        if (abs(mls.current.longitude) < 100) u8x8.print(" ");
-        u8x8.print(fabs(mls.current.longitude), 6);
-#endif
-
-        // Check if moving
-        bool moving = mls.getMovement() >= (sAcc >> 2);
-        if (moving) {
-          // Exponential smooth the bearing (75%)
-          if (sCrs < 0) sCrs = mls.bearing;
-          else          sCrs = ((sCrs + (mls.bearing << 2) - mls.bearing) + 2) >> 2;
-          // Report
-          Serial.print(",");
-          Serial.print(mls.distance, 2);  Serial.print("m,");
-          Serial.print(mls.speed, 2);     Serial.print("m/s,");
-          Serial.print(mls.bearing);      Serial.print("'");
-#ifdef HAVE_OLED
-          // Display
-          u8x8.setCursor(0, 2); u8x8.print("Spd "); u8x8.print(mls.speed, 2);
-          u8x8.setCursor(9, 2); u8x8.print("Crs "); u8x8.print(sCrs);
-#endif
-        }
-#ifdef HAVE_OLED
-        else {
-          // Display the locator
-          u8x8.setCursor(0, 2); u8x8.print("Loc "); u8x8.print(mls.locator);
-        }
-#endif
-        Serial.print("\r\n");
-
-        // Compose and send the NMEA sentences
-        char bufServer[200];
-        int lenServer;
-        // GGA
-        if (nmeaReport.gga) {
-          lenServer = nmea.getGGA(bufServer, 200, utm, mls.current.latitude, mls.current.longitude, 1, found);
-          Serial.print(bufServer);
-          if (nmeaServer.clients) nmeaServer.sendAll(bufServer);
-          broadcast(bufServer, lenServer);
-        }
-        // RMC
-        if (nmeaReport.rmc) {
-          lenServer = nmea.getRMC(bufServer, 200, utm, mls.current.latitude, mls.current.longitude, mls.knots, sCrs);
-          Serial.print(bufServer);
-          if (nmeaServer.clients) nmeaServer.sendAll(bufServer);
-          broadcast(bufServer, lenServer);
-        }
-        // GLL
-        if (nmeaReport.gll) {
-          lenServer = nmea.getGLL(bufServer, 200, utm, mls.current.latitude, mls.current.longitude);
-          Serial.print(bufServer);
-          if (nmeaServer.clients) nmeaServer.sendAll(bufServer);
-          broadcast(bufServer, lenServer);
-        }
-        // VTG
-        if (nmeaReport.vtg) {
-          lenServer = nmea.getVTG(bufServer, 200, sCrs, mls.knots, (int)(mls.speed * 3.6));
-          Serial.print(bufServer);
-          if (nmeaServer.clients) nmeaServer.sendAll(bufServer);
-          broadcast(bufServer, lenServer);
-        }
-        // ZDA
-        if (nmeaReport.zda) {
-          lenServer = nmea.getZDA(bufServer, 200, utm);
-          Serial.print(bufServer);
-          if (nmeaServer.clients) nmeaServer.sendAll(bufServer);
-          broadcast(bufServer, lenServer);
-        }
-
-        // Read the Vcc (mV)
-        int vcc  = ESP.getVcc();
-        // Set the bit 3 to show whether the battery is wrong (3.3V +/- 10%)
-        if (vcc < 3000 or vcc > 3600) aprs.aprsTlmBits |= B00001000;
-        // Get RSSI
-        int rssi = WiFi.RSSI();
-        // Get free heap
-        int heap = ESP.getFreeHeap();
-
-        // APRS if moving or time expired
-        if ((moving or (now >= rpNextTime)) and acc >= 0) {
-          // Led ON
-          setLED(8);
-
-          // Connect to the server
-          if (aprs.connect()) {
-            // Authenticate
-            if (aprs.authenticate()) {
-              // Local buffer, max comment length is 43 bytes
-              char buf[45] = "";
-              // Prepare the comment
-              snprintf_P(buf, sizeof(buf), PSTR("Acc:%d Dst:%d Spd:%d Crs:%s Vcc:%d.%d RSSI:%d"),
-                         acc, (int)(mls.distance), (int)(3.6 * mls.speed), mls.getCardinal(sCrs),
-                         vcc / 1000, (vcc % 1000) / 100, rssi);
-              // Report course and speed
-              aprs.sendPosition(utm, mls.current.latitude, mls.current.longitude, sCrs, mls.knots, acc, buf);
-              // Send the telemetry
-              //   mls.speed / 0.0008 = mls.speed * 1250
-              aprs.sendTelemetry((vcc - 2500) / 4, -rssi, heap / 256, acc, (int)(sqrt(mls.speed * 1250)), aprs.aprsTlmBits);
-              // Send the status
-              //snprintf_P(buf, sizeof(buf), PSTR("%s/%s, Vcc: %d.%3dV, RSSI: %ddBm"),
-              //           NODENAME, VERSION, vcc / 1000, vcc % 1000, rssi);
-              //aprs.sendStatus(buf);
-              // Adjust the delay (aka SmartBeaconing)
-              if (moving) {
-                // Reset the delay to minimum
-                rpDelay = rpDelayMin;
-                // Set the telemetry bits 4 and 5 if moving, according to the speed
-                if (mls.speed > 10) aprs.aprsTlmBits |= B00100000;
-                else                aprs.aprsTlmBits |= B00010000;
-              }
-              else {
-                // Not moving, increase the delay up to a maximum
-                rpDelay += rpDelayStep;
-                if (rpDelay > rpDelayMax) rpDelay = rpDelayMax;
-              }
-            }
-            // Close the connection
-            aprs.stop();
-          }
-
-          // On error, reset the delay to the minimum
-          if (aprs.error) {
-            rpDelay = rpDelayMin;
-            aprs.error = false;
-          }
-
-          // Repeat the report after the delay
-          rpNextTime = now + rpDelay;
-
-          // Led OFF
-          setLED(0);
-        }
-      }
-      else {
-        Serial.printf_P(PSTR("$PSCAN,NOFIX,%dm,%ds\r\n"), acc, ntp.getSeconds() - utm);
-#ifdef HAVE_OLED
-        u8x8.print(" NFX");
-#endif
-      }
-      // Repeat the geolocation after a delay
-      geoNextTime = now + geoDelay;
-    }
-    else {
-      // No WiFi networks
-      Serial.print(F("0"));
-      Serial.print(",");
-      Serial.print(ntp.getSeconds() - utm);
-      Serial.print("s\r\n");
-      // Repeat the geolocation now
-      geoNextTime = now;
-    }
-
-    // Led off
-    setLED(0);
-  };
+  // End the loop pass
+  stall.end();
 }
 // vim: set ft=arduino ai ts=2 sts=2 et sw=2 sta nowrap nu :
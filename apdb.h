@@ -0,0 +1,121 @@
+/**
+  apdb.h - AP database file, read in place
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  The whole AP database in one file, used as it is: mapped in memory by
+  the host tools, seeked in the flash file by the trackers.  All little
+  endian, each section starting at a multiple of 8 bytes, at the offset
+  in the header:
+
+    header    apdb_hdr_t
+    keys      count x uint8[6], the BSSIDs, sorted
+    lat       count x int32, 1e-7 degrees
+    lng       count x int32, 1e-7 degrees
+    acc       count x uint16, m
+    tiles     tiles x apdb_tile_t, sorted by lat, then lng
+    members   count x uint32, the APs by tile, by BSSID within the tile
+
+  The keys are followed by at least 2 bytes of padding, so 8 bytes can
+  be read at any key.  The tile index, tiles and members, is optional:
+  with no tiles, scale is zero and both sections are empty.  A tile is
+  1/scale degrees, named after its south-west corner, as in tiles.h.
+*/
+
+#ifndef APDB_H
+#define APDB_H
+
+#include <stdint.h>
+
+// "WAD1"
+#define APDB_MAGIC    0x31444157UL
+#define APDB_VERSION  1
+// The key bytes, a BSSID
+#define APDB_KEYLEN   6
+
+struct __attribute__((packed)) apdb_hdr_t {
+  uint32_t  magic;
+  uint16_t  version;
+  uint16_t  scale;                    // Tiles per degree, zero if no index
+  uint32_t  count;                    // APs
+  uint32_t  tiles;                    // Tile index entries
+  uint32_t  keys;                     // The section offsets (bytes)
+  uint32_t  lat;
+  uint32_t  lng;
+  uint32_t  acc;
+  uint32_t  tile;
+  uint32_t  member;
+  uint32_t  size;                     // The file size (bytes)
+  uint32_t  reserved;
+};
+
+struct __attribute__((packed)) apdb_tile_t {
+  int16_t   lat;
+  int16_t   lng;
+  uint32_t  first;                    // The first member
+  uint32_t  count;
+};
+
+/**
+  Lay out the sections, the same for the writers and the readers
+
+  @param hdr the header to fill
+  @param count the number of APs
+  @param tiles the number of tile index entries
+  @param scale the tiles per degree
+*/
+static inline void apdb_layout(apdb_hdr_t *hdr, uint32_t count, uint32_t tiles, uint16_t scale) {
+  hdr->magic    = APDB_MAGIC;
+  hdr->version  = APDB_VERSION;
+  hdr->scale    = tiles ? scale : 0;
+  hdr->count    = count;
+  hdr->tiles    = tiles;
+  hdr->reserved = 0;
+  uint32_t at = sizeof(apdb_hdr_t);
+  hdr->keys   = at;
+  at = (at + count * APDB_KEYLEN + 2 + 7) & ~7UL;
+  hdr->lat    = at;
+  at = (at + count * sizeof(int32_t) + 7) & ~7UL;
+  hdr->lng    = at;
+  at = (at + count * sizeof(int32_t) + 7) & ~7UL;
+  hdr->acc    = at;
+  at = (at + count * sizeof(uint16_t) + 7) & ~7UL;
+  hdr->tile   = at;
+  at = (at + tiles * sizeof(apdb_tile_t) + 7) & ~7UL;
+  hdr->member = at;
+  at += tiles ? count * sizeof(uint32_t) : 0;
+  hdr->size   = at;
+}
+
+/**
+  Check a header against the layout and the file size
+
+  @param hdr the header read
+  @param size the file size
+  @return true if valid
+*/
+static inline bool apdb_valid(const apdb_hdr_t *hdr, uint32_t size) {
+  if (hdr->magic != APDB_MAGIC or hdr->version != APDB_VERSION or
+      hdr->count > (UINT32_MAX - sizeof(apdb_hdr_t)) / 32 or hdr->tiles > hdr->count)
+    return false;
+  apdb_hdr_t lay;
+  apdb_layout(&lay, hdr->count, hdr->tiles, hdr->scale);
+  return lay.scale == hdr->scale and lay.keys == hdr->keys and lay.lat == hdr->lat and
+         lay.lng == hdr->lng and lay.acc == hdr->acc and lay.tile == hdr->tile and
+         lay.member == hdr->member and lay.size == hdr->size and hdr->size == size;
+}
+
+#endif /* APDB_H */
@@ -19,6 +19,8 @@
 
 #include "Arduino.h"
 #include "aprs.h"
+#include "dlog.h"
+#include "stall.h"
 
 const char eol[]    PROGMEM = "\r\n";
 
@@ -29,6 +31,34 @@ void APRS::init(const char *server, int port) {
   setServer(server, port);
 }
 
+/**
+  Resolve the server name through the shared DNS cache
+
+  @param resolver the DNS cache
+*/
+void APRS::setResolver(DNSCache *resolver) {
+  dns = resolver;
+}
+
+/**
+  Time the connections to the server, the timeouts and the retries
+  follow the uplink quality
+
+  @param lnk the uplink quality estimator
+*/
+void APRS::setLink(Link *lnk) {
+  link = lnk;
+}
+
+/**
+  Record the handshakes and the session
+
+  @param trc the I/O trace
+*/
+void APRS::setTrace(Trace *trc) {
+  trace = trc;
+}
+
 void APRS::setServer(const char *server) {
   strncpy(aprsServer, (char*)server, sizeof(aprsServer));
 }
@@ -43,14 +73,256 @@ bool APRS::connect(const char *server, int port) {
   return connect();
 }
 
+/**
+  Connect to the server and send the login, waiting for the handshake
+  if not done in the background already
+
+  @return true if connected
+*/
 bool APRS::connect() {
-  bool result = aprsClient.connect(aprsServer, aprsPort);
-  if (!result) error = true;
-  return result;
+  if (state == APRS_IDLE or state == APRS_CLOSING) begin();
+  await(APRS_CONN);
+  return state == APRS_LOGIN or state == APRS_READY;
+}
+
+/**
+  Start a session in the background, the login is sent when connected
+
+  @return true if started, or already started
+*/
+bool APRS::begin() {
+  if (state == APRS_CONN or state == APRS_LOGIN or state == APRS_READY) return true;
+  // The previous session is still draining, it is too late for it
+  if (state == APRS_CLOSING) drop();
+  // Connect to the cached address
+  uint8_t res = DNS_OK;
+  if (dns != NULL)                              res = dns->resolve(aprsServer, aprsIP);
+  else if (not WiFi.hostByName(aprsServer, aprsIP)) res = DNS_ERR;
+  if (res != DNS_OK and res != DNS_OLD) {
+    error = true;
+    return false;
+  }
+  // More tries on a lossy link, each with the timeout the link allows
+  tries = link != NULL ? 1 + link->retries(LNK_APRS) : 1;
+  return open();
 }
 
+/**
+  Start the TCP handshake, one try
+
+  @return true if started
+*/
+bool APRS::open() {
+  tries--;
+  pcb = tcp_new();
+  if (pcb == NULL) {
+    error = true;
+    return false;
+  }
+  tcp_arg(pcb, this);
+  tcp_recv(pcb, onRecv);
+  tcp_sent(pcb, onSent);
+  tcp_err(pcb, onError);
+  ip_addr_t addr;
+  ip_addr_set_ip4_u32(&addr, (uint32_t)aprsIP);
+  unacked = 0;
+  rxLen   = 0;
+  started = millis();
+  state   = APRS_CONN;
+  if (tcp_connect(pcb, &addr, aprsPort, onConnect) != ERR_OK) {
+    drop();
+    error = true;
+    return false;
+  }
+  return true;
+}
+
+/**
+  Check the steps in flight, retry the handshake or give up when they
+  time out, and close the session when drained
+*/
+void APRS::loop() {
+  if (state == APRS_IDLE) return;
+  if (pcb != NULL) {
+    if (state == APRS_READY) return;
+    if (state == APRS_CLOSING and unacked == 0) {
+      close();
+      return;
+    }
+    unsigned long timeout = link != NULL ? link->timeout(LNK_APRS) : APRS_TIMEOUT;
+    if (millis() - started < timeout) return;
+  }
+  // Timed out, or the connection is gone
+  uint8_t step = state;
+  drop();
+  if (step == APRS_CLOSING) return;
+  if (step == APRS_CONN) {
+    if (link != NULL) link->lost(LNK_APRS);
+    if (trace != NULL) {
+      uint16_t ms = millis() - started;
+      trace->record(TRC_APRSCONN, 0, &ms, sizeof(ms));
+    }
+    if (tries > 0 and open()) return;
+  }
+  error = true;
+}
+
+/**
+  Wait while a step is in flight
+*/
+void APRS::await(uint8_t step) {
+  while (state == step) {
+    stall.wait(10);
+    loop();
+  }
+}
+
+/**
+  Check if logged in, the reports can be sent
+*/
+bool APRS::ready() {
+  return state == APRS_READY;
+}
+
+/**
+  End the session: let the reports written drain and close in the
+  background, or close now
+*/
 void APRS::stop() {
-  aprsClient.stop();
+  if (state == APRS_READY and unacked > 0) {
+    state   = APRS_CLOSING;
+    started = millis();
+  }
+  else if (state != APRS_IDLE and state != APRS_CLOSING)
+    close();
+}
+
+/**
+  Close the connection gracefully, abort it if lwIP can not
+*/
+void APRS::close() {
+  // A handshake given up, not timed out
+  if (state == APRS_CONN and trace != NULL) {
+    uint16_t ms = millis() - started;
+    trace->record(TRC_APRSCONN, 0, &ms, sizeof(ms));
+  }
+  if (pcb != NULL) {
+    tcp_arg(pcb, NULL);
+    tcp_recv(pcb, NULL);
+    tcp_sent(pcb, NULL);
+    tcp_err(pcb, NULL);
+    if (tcp_close(pcb) != ERR_OK) tcp_abort(pcb);
+    pcb = NULL;
+  }
+  state = APRS_IDLE;
+}
+
+/**
+  Abort the connection, if any
+*/
+void APRS::drop() {
+  if (pcb != NULL) {
+    tcp_arg(pcb, NULL);
+    tcp_recv(pcb, NULL);
+    tcp_sent(pcb, NULL);
+    tcp_err(pcb, NULL);
+    tcp_abort(pcb);
+    pcb = NULL;
+  }
+  state = APRS_IDLE;
+}
+
+/**
+  Write to the connection, copied, lwIP keeps it until acknowledged
+
+  @return true if queued
+*/
+bool APRS::write(const char *data, uint16_t len) {
+  if (pcb == NULL or tcp_sndbuf(pcb) < len) return false;
+  if (tcp_write(pcb, data, len, TCP_WRITE_FLAG_COPY) != ERR_OK) return false;
+  unacked += len;
+  if (trace != NULL) trace->record(TRC_APRSOUT, 0, data, len);
+  tcp_output(pcb);
+  return true;
+}
+
+/**
+  Connected, time the handshake and send the login
+  user FW0690 pass -1 vers WxSta 0.2
+*/
+err_t APRS::onConnect(void *arg, tcp_pcb *pcb, err_t err) {
+  APRS *aprs = (APRS*)arg;
+  if (aprs->link != NULL) aprs->link->sample(LNK_APRS, millis() - aprs->started);
+  if (aprs->trace != NULL) {
+    uint16_t ms = millis() - aprs->started;
+    aprs->trace->record(TRC_APRSCONN, TRC_OK, &ms, sizeof(ms));
+  }
+  aprs->state   = APRS_LOGIN;
+  aprs->started = millis();
+  // Not in the packet buffer, the callback may run while a packet is composed
+  char login[80];
+  snprintf_P(login, sizeof(login), PSTR("user %s pass %s vers %s %s\r\n"),
+             aprs->aprsCallSign, aprs->aprsPassCode, NODENAME, VERSION);
+  uint16_t len = strlen(login);
+  aprs->sent += len;
+  if (not aprs->write(login, len)) {
+    aprs->drop();
+    aprs->error = true;
+    return ERR_ABRT;
+  }
+  return ERR_OK;
+}
+
+/**
+  The server lines, the login is verified by the first one saying so,
+  the end of the stream ends the session
+*/
+err_t APRS::onRecv(void *arg, tcp_pcb *pcb, pbuf *p, err_t err) {
+  APRS *aprs = (APRS*)arg;
+  if (p == NULL) {
+    if (aprs->state != APRS_CLOSING) aprs->error = true;
+    aprs->drop();
+    return ERR_ABRT;
+  }
+  for (pbuf *q = p; q != NULL; q = q->next) {
+    const char *c = (const char*)q->payload;
+    for (uint16_t i = 0; i < q->len; i++)
+      if (c[i] == '\n') aprs->line();
+      else if (aprs->rxLen < APRS_LINELEN - 1) aprs->rxLine[aprs->rxLen++] = c[i];
+  }
+  tcp_recved(pcb, p->tot_len);
+  pbuf_free(p);
+  return ERR_OK;
+}
+
+/**
+  A complete server line
+*/
+void APRS::line() {
+  rxLine[rxLen] = '\0';
+  if (trace != NULL)
+    trace->record(TRC_APRSIN, 0, rxLine, rxLen > 0 and rxLine[rxLen - 1] == '\r' ? rxLen - 1 : rxLen);
+  rxLen = 0;
+  if (state == APRS_LOGIN and strstr(rxLine, "verified") != NULL)
+    state = APRS_READY;
+}
+
+/**
+  Data acknowledged, loop() closes when all is
+*/
+err_t APRS::onSent(void *arg, tcp_pcb *pcb, uint16_t len) {
+  APRS *aprs = (APRS*)arg;
+  aprs->unacked -= len < aprs->unacked ? len : aprs->unacked;
+  return ERR_OK;
+}
+
+/**
+  The connection is reset or aborted, lwIP has freed the PCB; loop()
+  retries or gives up
+*/
+void APRS::onError(void *arg, err_t err) {
+  APRS *aprs = (APRS*)arg;
+  aprs->pcb = NULL;
 }
 
 /**
@@ -131,15 +403,15 @@ void APRS::setObjectName(const char *object) {
 */
 bool APRS::send(const char *pkt) {
   bool result;
-  if (result = aprsClient.connected()) {
+  if (result = ready()) {
     int plen = strlen(pkt);
+    sent += plen;
 #ifndef DEVEL
-    // Write the packet and check the number of bytes written
-    if (aprsClient.write(pkt) != plen) error = true;
-    yield();
+    // Queue the packet, lwIP sends it while the loop goes on
+    if (not write(pkt, plen)) error = true;
 #endif
 #ifdef DEBUG
-    Serial.printf_P(PSTR("$PAPRS,%03d,%s"), plen, pkt);
+    DLOG_P(APRS_PKT, plen, pkt);
 #endif
   }
   else
@@ -168,8 +440,8 @@ void APRS::time(unsigned long utm, char *buf, size_t len) {
 }
 
 /**
-  Send APRS authentication data
-  user FW0690 pass -1 vers WxSta 0.2"
+  Store the APRS credentials, for the next logins, and wait for the
+  current one
 */
 bool APRS::authenticate(const char *callsign, const char *passcode) {
   // Store the APRS callsign and passkey
@@ -177,47 +449,13 @@ bool APRS::authenticate(const char *callsign, const char *passcode) {
   strncpy(aprsPassCode, (char*)passcode, sizeof(aprsPassCode));
   return authenticate();
 }
+
 /**
-  Send APRS authentication data
-  user FW0690 pass -1 vers WxSta 0.2"
+  Wait for the server to verify the login, sent when connected
 */
 bool APRS::authenticate() {
-  bool result = false;
-  // Only authenticate if connected
-  if (aprsClient.connected()) {
-    // Send the credentials
-    strcpy_P(aprsPkt, PSTR("user "));
-    strcat_P(aprsPkt, aprsCallSign);
-    strcat_P(aprsPkt, PSTR(" pass "));
-    strcat_P(aprsPkt, aprsPassCode);
-    strcat_P(aprsPkt, PSTR(" vers "));
-    strcat  (aprsPkt, NODENAME);
-    strcat_P(aprsPkt, pstrSP);
-    strcat  (aprsPkt, VERSION);
-    strcat_P(aprsPkt, eol);
-    // Send the credentials
-    if (send(aprsPkt)) {
-      while (aprsClient.connected() and (not result))
-        // Check the response
-        result = aprsClient.findUntil("verified", "\r");
-      /*
-        int rlen = aprsClient.readBytesUntil('\n', aprsPkt, sizeof(aprsPkt));
-        aprsPkt[rlen] = '\0';
-        Serial.printf_P(PSTR("$PAPRS,%03d,%s\r\n"), rlen, aprsPkt);
-        // Tokenize the response
-        char* pch;
-        pch = strtok(aprsPkt, " ");
-        while (pch != NULL) {
-        if (strcmp(pch, "verified") == 0) {
-          result = true;
-          break;
-        }
-        pch = strtok(NULL, " ");
-        }
-      */
-    }
-  }
-  return result;
+  await(APRS_LOGIN);
+  return ready();
 }
 
 /**
@@ -245,6 +483,7 @@ bool APRS::sendStatus(const char *message) {
     strcat_P(aprsPkt, eol);
     return send(aprsPkt);
   }
+  return false;
 }
 
 /**
@@ -257,7 +496,7 @@ bool APRS::sendStatus(const char *message) {
 bool APRS::sendMessage(const char *dest, const char *title, const char *message) {
   // The object's call sign has to be padded with spaces until 9 chars long
   const int padSize = 9;
-  char padCallSign[padSize] = " ";
+  char padCallSign[padSize + 1] = " ";
   // Check if the destination is specified
   if (dest == NULL) strcpy_P(padCallSign, aprsCallSign);  // Copy the own call sign from PROGMEM
   else              strncpy(padCallSign, dest, padSize);  // Use the specified destination
@@ -302,6 +541,39 @@ void APRS::coordinates(char *buf, float lat, float lng, char table, char symbol)
   coordinates(buf, lat, lng);
 }
 
+/**
+  Create the compressed position, base 91, with the course and speed,
+  using the current symbol
+  /YYYYXXXX>csT
+
+  @param buf the buffer, at least 14 bytes
+  @param lat the latitude
+  @param lng the longitude
+  @param cse the course, negative if unknown
+  @param spd the speed (knots), negative if unknown
+*/
+void APRS::compress(char *buf, float lat, float lng, int cse, int spd) {
+  uint32_t y = (uint32_t)(380926.0 * (90.0 - lat));
+  uint32_t x = (uint32_t)(190463.0 * (180.0 + lng));
+  buf[0] = aprsTable;
+  for (int i = 4; i > 0; i--, y /= 91)
+    buf[i] = y % 91 + 33;
+  for (int i = 8; i > 4; i--, x /= 91)
+    buf[i] = x % 91 + 33;
+  buf[9] = aprsSymbol;
+  if (spd >= 0 and cse >= 0) {
+    buf[10] = (cse % 360) / 4 + 33;
+    buf[11] = (int)(log(spd + 1) / log(1.08) + 0.5) + 33;
+  }
+  else {
+    buf[10] = ' ';
+    buf[11] = ' ';
+  }
+  // Current fix, other source, software compressed
+  buf[12] = 0x22 + 33;
+  buf[13] = '\0';
+}
+
 void APRS::setLocation(float lat, float lng) {
   coordinates(aprsLocation, lat, lng);
 }
@@ -335,15 +607,22 @@ bool APRS::sendPosition(unsigned long utm, float lat, float lng, int cse, int sp
 
   // Coordinates in APRS format
   setSymbol('/', '>');
-  setLocation(lat, lng);
-  strcat_P(aprsPkt, aprsLocation);
-  // Course and speed
-  if (spd >= 0 and cse >= 0) {
-    snprintf_P(buf, bufSize, PSTR("%03d/%03d"), cse, spd);
+  if (compressed) {
+    // Coordinates, course and speed in 13 bytes, no altitude
+    compress(buf, lat, lng, cse, spd);
     strncat(aprsPkt, buf, bufSize);
   }
+  else {
+    setLocation(lat, lng);
+    strcat_P(aprsPkt, aprsLocation);
+    // Course and speed
+    if (spd >= 0 and cse >= 0) {
+      snprintf_P(buf, bufSize, PSTR("%03d/%03d"), cse, spd);
+      strncat(aprsPkt, buf, bufSize);
+    }
+  }
   // Altitude
-  if (alt >= 0) {
+  if (alt >= 0 and not compressed) {
     strcat_P(aprsPkt, PSTR("/A="));
     sprintf_P(buf, PSTR("%06d"), (long)(alt * 3.28084));
     strncat(aprsPkt, buf, bufSize);
@@ -465,7 +744,7 @@ bool APRS::sendTelemetrySetup() {
   bool result = true;
   // The object's call sign has to be padded with spaces until 9 chars long
   const int padSize = 9;
-  char padCallSign[padSize] = " ";
+  char padCallSign[padSize + 1] = " ";
   // Copy the call sign or object name
   strcpy_P(padCallSign, aprsCallSign);
   // Pad with spaces, then make sure it ends with '\0'
@@ -15,6 +15,13 @@
 
   You should have received a copy of the GNU General Public License
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  The connection to the server runs in the background, on the lwIP raw
+  API: begin() starts the handshake and the login goes out as soon as it
+  completes, so both overlap with the scan and the geolocation.  After
+  the reports, stop() lets them drain and closes when they are all
+  acknowledged, while the main loop goes on.  connect() and
+  authenticate() wait for the steps still in flight.
 */
 
 #ifndef APRS_H
@@ -24,13 +31,17 @@
 
 #include "Arduino.h"
 #include <ESP8266WiFi.h>
+#include <lwip/tcp.h>
 #include "version.h"
+#include "dnscache.h"
+#include "link.h"
+#include "trace.h"
 
 // APRS constants
 const char aprsPath[]     PROGMEM = ">WIDE1-1,TCPIP*:";
-const char aprsTlmPARM[]  PROGMEM = "PARM.Vcc,RSSI,Heap,Acc,Spd,PROBE,FIX,FST,SLW,VCC,HT,RB,TM";
+const char aprsTlmPARM[]  PROGMEM = "PARM.Vcc,RSSI,Heap,Acc,Spd,PROBE,FIX,FST,SLW,VCC,BDG,RB,TM";
 const char aprsTlmEQNS[]  PROGMEM = "EQNS.0,0.004,2.5,0,-1,0,0,256,0,0,1,0,0.0008,0,0";
-const char aprsTlmUNIT[]  PROGMEM = "UNIT.V,dBm,Bytes,m,m/s,prb,on,fst,slw,bad,ht,rb,er";
+const char aprsTlmUNIT[]  PROGMEM = "UNIT.V,dBm,Bytes,m,m/s,prb,on,fst,slw,bad,low,rb,er";
 const char aprsTlmBITS[]  PROGMEM = "BITS.11111111, ";
 
 // Various constants
@@ -41,14 +52,27 @@ const char pstrCL[] PROGMEM = ":";
 const char pstrSL[] PROGMEM = "/";
 //const char eol[]    PROGMEM = "\r\n";
 
+// The session: the TCP handshake, the login, ready, draining the reports
+enum aprs_state_t {APRS_IDLE, APRS_CONN, APRS_LOGIN, APRS_READY, APRS_CLOSING};
+// The timeout of each step, without a link estimator (ms)
+#define APRS_TIMEOUT  5000
+// The longest server line checked, the rest is dropped
+#define APRS_LINELEN  100
+
 class APRS {
   public:
     APRS();
     void init(const char *server, int port);
+    void setResolver(DNSCache *resolver);
+    void setLink(Link *lnk);
+    void setTrace(Trace *trc);
     void setServer(const char *server);
     void setServer(const char *server, int port);
     bool connect(const char *server, int port);
     bool connect();
+    bool begin();
+    bool ready();
+    void loop();
     void stop();
     void setCallSign(const char *callsign = NULL);
     void setPassCode(const char *passcode);
@@ -64,6 +88,7 @@ class APRS {
     bool sendMessage(const char *dest, const char *title, const char *message);
     void coordinates(char *buf, float lat, float lng, char table, char symbol);
     void coordinates(char *buf, float lat, float lng);
+    void compress(char *buf, float lat, float lng, int cse, int spd);
     void setLocation(float lat, float lng);
     bool sendPosition(unsigned long utm, float lat, float lng, int cse = 0, int spd = 0, float alt = -1, const char *comment = NULL, const char *object = NULL);
     bool sendObjectPosition(unsigned long utm, float lat, float lng, int cse = 0, int spd = 0, float alt = -1, const char *comment = NULL);
@@ -75,10 +100,32 @@ class APRS {
     char aprsObjectNm[10];
     char aprsTlmBits        = B00000000;  // Telemetry bits
     int  aprsTlmSeq         = 999;        // Telemetry sequence mumber
+    bool compressed         = false;      // Send the positions compressed
+    unsigned long sent      = 0;          // Bytes written
+    uint8_t state           = APRS_IDLE;  // The session
     bool error;
 
   private:
-    WiFiClient aprsClient;
+    static err_t onConnect(void *arg, tcp_pcb *pcb, err_t err);
+    static err_t onRecv(void *arg, tcp_pcb *pcb, pbuf *p, err_t err);
+    static err_t onSent(void *arg, tcp_pcb *pcb, uint16_t len);
+    static void  onError(void *arg, err_t err);
+    bool  open();
+    void  close();
+    void  drop();
+    void  await(uint8_t step);
+    bool  write(const char *data, uint16_t len);
+    void  line();
+    tcp_pcb    *pcb = NULL;
+    IPAddress   aprsIP;                // The server address, resolved once a session
+    uint32_t    unacked;               // Bytes written, not acknowledged
+    unsigned long started;             // The start of the current step (ms)
+    uint8_t     tries;                 // Handshakes left
+    char  rxLine[APRS_LINELEN];        // The server line being received
+    uint8_t     rxLen;
+    DNSCache   *dns = NULL;
+    Link       *link = NULL;
+    Trace      *trace = NULL;
     char  aprsPkt[250];
     char  aprsServer[50];             // CWOP APRS-IS server address to connect to
     int   aprsPort;                   // CWOP APRS-IS port
@@ -0,0 +1,183 @@
+/**
+  beacons.cpp - Passive AP collector, from the beacon frames
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "beacons.h"
+
+// The collector the SDK callback feeds, it takes no argument
+static Beacons *listener = NULL;
+
+Beacons::Beacons() {
+}
+
+/**
+  Empty the table
+*/
+void Beacons::init() {
+  memset(table, 0, sizeof(table));
+  heard   = 0;
+  dropped = 0;
+  started = millis() - BCN_PERIOD;
+}
+
+/**
+  Parse an 802.11 beacon or probe response frame.  It does not need the
+  whole frame, the SDK only gives the first bytes of it.  The APs that
+  opted out of geolocation, with the SSID ending in "_nomap", are left out.
+
+  @param frame the frame, from the frame control field
+  @param len the frame length
+  @param info the fields found
+  @return true if the frame is from an AP to keep
+*/
+bool Beacons::parse(const uint8_t *frame, size_t len, bcn_frame_t *info) {
+  // The MAC header and the fixed fields
+  if (len < 36) return false;
+  if (frame[0] != BCN_BEACON and frame[0] != BCN_PROBERSP) return false;
+  // Only infrastructure networks, not ad hoc
+  if ((frame[34] & 0x01) == 0) return false;
+  memcpy(info->bssid, frame + 16, WL_MAC_ADDR_LENGTH);
+  info->channel = 0;
+  info->ssid[0] = '\0';
+  // The tagged fields, as many as there are
+  size_t pos = 36;
+  while (pos + 2 <= len) {
+    uint8_t id   = frame[pos];
+    uint8_t flen = frame[pos + 1];
+    if (pos + 2 + flen > len) break;
+    const uint8_t *data = frame + pos + 2;
+    if (id == 0 and flen <= 32) {
+      memcpy(info->ssid, data, flen);
+      info->ssid[flen] = '\0';
+    }
+    else if (id == 3 and flen == 1)
+      info->channel = data[0];
+    pos += 2 + flen;
+  }
+  size_t slen = strlen(info->ssid);
+  if (slen >= 6 and strcmp(info->ssid + slen - 6, "_nomap") == 0) return false;
+  return true;
+}
+
+/**
+  An AP was heard, add it to the table or refresh it
+
+  @param bssid the AP BSSID
+  @param rssi the signal strength (dBm)
+  @param channel the AP channel, 0 if not known
+*/
+void Beacons::add(const uint8_t *bssid, int8_t rssi, uint8_t channel) {
+  unsigned long now = millis();
+  bcn_ap_t *slot = NULL;
+  for (uint8_t i = 0; i < BCN_SLOTS; i++) {
+    bcn_ap_t *ap = &table[i];
+    if (ap->rssi != 0 and memcmp(ap->bssid, bssid, WL_MAC_ADDR_LENGTH) == 0) {
+      // Average the frames heard close together
+      if (now - ap->seen < BCN_RSSIAVG)
+        ap->rssi = (3 * ap->rssi + rssi - 2) / 4;
+      else
+        ap->rssi = rssi;
+      if (channel != 0) ap->channel = channel;
+      ap->seen = now;
+      return;
+    }
+    // An empty slot, or the AP not heard for the longest time
+    if (slot == NULL or (slot->rssi != 0 and (ap->rssi == 0 or now - ap->seen > now - slot->seen)))
+      slot = ap;
+  }
+  memcpy(slot->bssid, bssid, WL_MAC_ADDR_LENGTH);
+  slot->rssi    = rssi < 0 ? rssi : -1;
+  slot->channel = channel;
+  slot->seen    = now;
+}
+
+/**
+  Get the strongest APs heard recently
+
+  @param list the APs
+  @param max the list size
+  @param maxAge the oldest AP to use (ms)
+  @return the number of APs in the list
+*/
+uint8_t Beacons::collect(bcn_ap_t *list, uint8_t max, unsigned long maxAge) {
+  unsigned long now = millis();
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < BCN_SLOTS; i++) {
+    bcn_ap_t *ap = &table[i];
+    if (ap->rssi == 0 or now - ap->seen >= maxAge) continue;
+    // Insert by RSSI, descending, the weakest falls out
+    uint8_t j = count < max ? count++ : max;
+    while (j > 0 and list[j - 1].rssi < ap->rssi) {
+      if (j < max) list[j] = list[j - 1];
+      j--;
+    }
+    if (j < max) list[j] = *ap;
+  }
+  return count;
+}
+
+/**
+  The SDK promiscuous callback.  The management frames come with the
+  radio metadata, the first 112 bytes of the frame and its length.
+
+  @param buf the metadata and the frame
+  @param len the buffer length
+*/
+void Beacons::onFrame(uint8_t *buf, uint16_t len) {
+  if (listener == NULL) return;
+  if (len != 128) {
+    listener->dropped++;
+    return;
+  }
+  uint16_t flen = buf[126] | buf[127] << 8;
+  bcn_frame_t info;
+  if (parse(buf + 12, flen < 112 ? flen : 112, &info)) {
+    listener->add(info.bssid, (int8_t)buf[0], info.channel);
+    listener->heard++;
+  }
+  else
+    listener->dropped++;
+}
+
+/**
+  Listen in a short window of each period, on the current channel.  Call
+  it between the fixes, the station traffic may be lost while listening.
+*/
+void Beacons::loop() {
+  unsigned long now = millis();
+  if (listening) {
+    if (now - started >= BCN_LISTEN) stop();
+  }
+  else if (now - started >= BCN_PERIOD and WiFi.isConnected()) {
+    started   = now;
+    listener  = this;
+    listening = true;
+    wifi_set_promiscuous_rx_cb(onFrame);
+    wifi_promiscuous_enable(1);
+  }
+}
+
+/**
+  Stop listening, before any network operation
+*/
+void Beacons::stop() {
+  if (not listening) return;
+  wifi_promiscuous_enable(0);
+  listening = false;
+}
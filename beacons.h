@@ -0,0 +1,88 @@
+/**
+  beacons.h - Passive AP collector, from the beacon frames
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  Between the fixes, the radio listens in promiscuous mode, in short
+  windows, on the channel of the connected AP.  The beacon and probe
+  response frames heard there, and the results of the active scans, are
+  kept in one table with the time each AP was last heard.  A fix uses the
+  APs heard recently, and only scans again if there are too few of them.
+*/
+
+#ifndef BEACONS_H
+#define BEACONS_H
+
+#include "Arduino.h"
+#include <ESP8266WiFi.h>
+extern "C" {
+#include "user_interface.h"
+}
+#include "config.h"
+
+// APs kept
+#define BCN_SLOTS     48
+// Use an AP heard this long ago (s) at most
+#ifndef BCN_MAXAGE
+#define BCN_MAXAGE    60
+#endif
+// and not farther than this (m) from where it was heard
+#define BCN_MAXDIST   30
+// Scan again with fewer APs heard
+#define BCN_MINAPS    4
+// Listen this long (ms) out of each period (ms), between the fixes
+#define BCN_LISTEN    300
+#define BCN_PERIOD    2000
+// Average the RSSI of the frames heard this close (ms)
+#define BCN_RSSIAVG   2000
+// The management frames kept
+#define BCN_BEACON    0x80
+#define BCN_PROBERSP  0x50
+
+// The fields of a frame, as parsed
+struct bcn_frame_t {
+  uint8_t bssid[WL_MAC_ADDR_LENGTH];
+  uint8_t channel;                    // 0 if not found
+  char    ssid[33];
+};
+
+// An AP heard
+struct bcn_ap_t {
+  uint8_t       bssid[WL_MAC_ADDR_LENGTH];
+  int8_t        rssi;
+  uint8_t       channel;
+  unsigned long seen;                 // Time it was last heard (ms)
+};
+
+class Beacons {
+  public:
+    Beacons();
+    void    init();
+    static bool parse(const uint8_t *frame, size_t len, bcn_frame_t *info);
+    void    add(const uint8_t *bssid, int8_t rssi, uint8_t channel);
+    uint8_t collect(bcn_ap_t *list, uint8_t max, unsigned long maxAge);
+    void    loop();
+    void    stop();
+    bool    listening = false;
+    unsigned long heard;              // Frames kept
+    unsigned long dropped;            // Frames not kept
+  private:
+    static void onFrame(uint8_t *buf, uint16_t len);
+    bcn_ap_t      table[BCN_SLOTS];
+    unsigned long started;            // Start of the last window (ms)
+};
+
+#endif /* BEACONS_H */
@@ -0,0 +1,294 @@
+/**
+  budget.cpp - Data budget, the bytes sent and received per destination
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include <LittleFS.h>
+#include "budget.h"
+#include "energy.h"
+#include "dlog.h"
+
+// The budget the hooks charge, and the functions they replace
+static Budget *meter = NULL;
+static netif_linkoutput_fn linkOutput = NULL;
+static netif_input_fn      linkInput  = NULL;
+
+Budget::Budget() {
+}
+
+/**
+  Load the counts and set the budgets
+
+  @param dailyKB the daily budget (KB), no limit if zero
+  @param monthlyKB the monthly budget (KB), no limit if zero
+*/
+void Budget::init(uint32_t dailyKB, uint32_t monthlyKB) {
+  daily     = dailyKB * 1024UL;
+  monthly   = monthlyKB * 1024UL;
+  portCount = 0;
+  deflt     = BDG_OTHER;
+  saved     = millis();
+  // The counts kept over the reset, or the ones saved to flash
+  ESP.rtcUserMemoryRead(BDG_RTCOFF, (uint32_t*)&data, sizeof(data));
+  if (data.magic != BDG_MAGIC or data.check != checksum()) {
+    File file;
+    if (LittleFS.begin() and (file = LittleFS.open(BDG_FILE, "r"))) {
+      if (file.read((uint8_t*)&data, sizeof(data)) != sizeof(data)) data.magic = 0;
+      file.close();
+    }
+    if (data.magic != BDG_MAGIC or data.check != checksum()) {
+      memset(&data, 0, sizeof(data));
+      data.magic = BDG_MAGIC;
+    }
+  }
+  hook();
+}
+
+/**
+  Charge the frames to or from a port to a destination
+
+  @param port the TCP or UDP port, remote or local
+  @param dest the destination
+*/
+void Budget::setPort(uint16_t port, uint8_t dest) {
+  if (portCount < BDG_PORTS and dest < BDG_DESTS) {
+    ports[portCount].port = port;
+    ports[portCount].dest = dest;
+    portCount++;
+  }
+}
+
+/**
+  Charge the frames of the unknown ports to a destination, such as OTA
+  while the update is running
+
+  @param dest the destination
+*/
+void Budget::setDefault(uint8_t dest) {
+  if (dest < BDG_DESTS) deflt = dest;
+}
+
+/**
+  Charge the frames sent to the energy accounting too
+
+  @param nrg the energy accounting
+*/
+void Budget::setEnergy(Energy *nrg) {
+  energy = nrg;
+}
+
+/**
+  Hook the link layer of the station interface, once it is up, and again
+  if it was brought up anew
+
+  @return true if hooked
+*/
+bool Budget::hook() {
+  if (netif_default == NULL) return false;
+  meter = this;
+  if (netif_default->linkoutput != onOutput) {
+    linkOutput = netif_default->linkoutput;
+    linkInput  = netif_default->input;
+    netif_default->linkoutput = onOutput;
+    netif_default->input      = onInput;
+  }
+  return true;
+}
+
+/**
+  The frames sent
+*/
+err_t Budget::onOutput(struct netif *nif, struct pbuf *p) {
+  if (meter != NULL) meter->frame(p, true);
+  return linkOutput(nif, p);
+}
+
+/**
+  The frames received
+*/
+err_t Budget::onInput(struct pbuf *p, struct netif *nif) {
+  if (meter != NULL) meter->frame(p, false);
+  return linkInput(p, nif);
+}
+
+/**
+  Charge an Ethernet frame to the destination of its ports: the remote
+  port first, then the local one, for the servers
+
+  @param p the frame, the headers in the first buffer
+  @param out true if sent
+*/
+void Budget::frame(const struct pbuf *p, bool out) {
+  const uint8_t *f = (const uint8_t*)p->payload;
+  uint8_t dest = deflt;
+  // IPv4, TCP or UDP
+  if (p->len >= 34 and f[12] == 0x08 and f[13] == 0x00 and (f[23] == 6 or f[23] == 17)) {
+    uint8_t ihl = (f[14] & 0x0F) * 4;
+    if (p->len >= 14 + ihl + 4) {
+      const uint8_t *l4 = f + 14 + ihl;
+      uint16_t src = l4[0] << 8 | l4[1];
+      uint16_t dst = l4[2] << 8 | l4[3];
+      uint16_t remote = out ? dst : src;
+      uint16_t local  = out ? src : dst;
+      uint8_t i;
+      for (i = 0; i < portCount and ports[i].port != remote; i++);
+      if (i == portCount)
+        for (i = 0; i < portCount and ports[i].port != local; i++);
+      if (i < portCount) dest = ports[i].dest;
+    }
+  }
+  if (out) count(dest, p->tot_len, 0);
+  else     count(dest, 0, p->tot_len);
+  if (out and energy != NULL) energy->frame(dest, p->tot_len);
+}
+
+/**
+  Charge some bytes to a destination
+
+  @param dest the destination
+  @param tx the bytes sent
+  @param rx the bytes received
+*/
+void Budget::count(uint8_t dest, uint32_t tx, uint32_t rx) {
+  if (dest >= BDG_DESTS) return;
+  data.dest[dest].tx += tx;
+  data.dest[dest].rx += rx;
+}
+
+/**
+  The month of a day
+
+  @param day the days since the Unix epoch
+  @return the months since year 0
+*/
+uint16_t Budget::monthOf(uint16_t day) {
+  // The civil date, with the years starting in March
+  uint32_t z   = day + 719468UL;
+  uint32_t era = z / 146097;
+  uint32_t doe = z - era * 146097;
+  uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  uint32_t mp  = (5 * doy + 2) / 153;
+  uint32_t m   = mp < 10 ? mp + 3 : mp - 9;
+  uint32_t y   = yoe + era * 400 + (m <= 2);
+  return y * 12 + m - 1;
+}
+
+/**
+  Start a new day or month when the time comes, and keep the counts
+
+  @param utm the Unix time, 0 if not known yet
+*/
+void Budget::update(unsigned long utm) {
+  hook();
+  if (utm > 0) {
+    uint16_t day = utm / 86400;
+    if (day != data.day) {
+      uint16_t mon = monthOf(day);
+      // The counts before the time was known are today's
+      if (data.day != 0) {
+        if (mon == data.month) data.past += today();
+        else                   data.past = 0;
+        memset(data.dest, 0, sizeof(data.dest));
+      }
+      data.day   = day;
+      data.month = mon;
+      save(true);
+    }
+  }
+  save(millis() - saved >= BDG_SAVE * 1000UL);
+}
+
+/**
+  Keep the counts in RTC memory and, if asked, in flash
+
+  @param flash also save to flash
+*/
+void Budget::save(bool flash) {
+  data.check = checksum();
+  ESP.rtcUserMemoryWrite(BDG_RTCOFF, (uint32_t*)&data, sizeof(data));
+  if (flash) {
+    File file = LittleFS.open(BDG_FILE, "w");
+    if (file) {
+      file.write((uint8_t*)&data, sizeof(data));
+      file.close();
+    }
+    saved = millis();
+  }
+}
+
+/**
+  The checksum of the counts, to tell them from what a cold boot leaves
+  in RTC memory
+*/
+uint32_t Budget::checksum() {
+  const uint32_t *w = (const uint32_t*)&data;
+  uint32_t sum = 0x811C9DC5UL;
+  for (size_t i = 0; i < offsetof(bdg_data_t, check) / 4; i++)
+    sum = (sum ^ w[i]) * 16777619UL;
+  return sum;
+}
+
+/**
+  The bytes sent and received today
+
+  @return the bytes
+*/
+uint32_t Budget::today() {
+  uint32_t total = 0;
+  for (uint8_t i = 0; i < BDG_DESTS; i++)
+    total += data.dest[i].tx + data.dest[i].rx;
+  return total;
+}
+
+/**
+  The bytes sent and received today for a destination
+
+  @param dest the destination
+  @return the bytes
+*/
+uint32_t Budget::today(uint8_t dest) {
+  if (dest >= BDG_DESTS) return 0;
+  return data.dest[dest].tx + data.dest[dest].rx;
+}
+
+/**
+  The bytes sent and received this month
+
+  @return the bytes
+*/
+uint32_t Budget::month() {
+  return data.past + today();
+}
+
+/**
+  The budget level, of the budget closest to its limit
+
+  @return BDG_OK, BDG_LOW or BDG_OUT
+*/
+uint8_t Budget::level() {
+  uint8_t lvl = BDG_OK;
+  uint32_t used[2]  = {today(), month()};
+  uint32_t limit[2] = {daily, monthly};
+  for (uint8_t i = 0; i < 2; i++) {
+    if (limit[i] == 0) continue;
+    if (used[i] >= limit[i]) return BDG_OUT;
+    if (used[i] >= limit[i] / 100 * BDG_LOWPCT) lvl = BDG_LOW;
+  }
+  return lvl;
+}
@@ -0,0 +1,125 @@
+/**
+  budget.h - Data budget, the bytes sent and received per destination
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  The frames of the station interface are counted as they pass the link
+  layer, hooked under lwIP, so the TCP, TLS and UDP overheads and the
+  retransmissions are all in, as the mobile operator bills them.  Each
+  frame is charged to a destination by its TCP or UDP port.  The counts
+  of the current day, and the total of the current month, are kept in
+  RTC memory over resets, and saved to flash now and then.
+
+  Near the daily or the monthly budget, the level goes LOW and the
+  tracker lowers its rates, reuses the fixes and compresses the reports.
+  Over it, the level goes OUT and only the essential traffic is left.
+*/
+
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include "Arduino.h"
+#include <lwip/netif.h>
+#include "config.h"
+
+class Energy;
+
+// The destinations
+enum bdg_dest_t {
+  BDG_GEO, BDG_APRS, BDG_NTP, BDG_NMEA, BDG_OTA, BDG_TILE, BDG_DNS, BDG_OTHER,
+  BDG_DESTS
+};
+
+// The budget levels
+enum bdg_level_t {BDG_OK, BDG_LOW, BDG_OUT};
+
+// Daily and monthly budgets (KB), no limit if zero
+#ifndef BDG_DAILY
+#define BDG_DAILY     0
+#endif
+#ifndef BDG_MONTHLY
+#define BDG_MONTHLY   0
+#endif
+// The level goes LOW at this percent of a budget
+#define BDG_LOWPCT    80
+// Divide the rates by this on a LOW budget, and by this when OUT
+#define BDG_RATELOW   3
+#define BDG_RATEOUT   10
+// Report the counts this often (s)
+#define BDG_REPORT    3600
+// Ports charged to a destination
+#define BDG_PORTS     8
+// Save the counts to flash this often (s)
+#define BDG_SAVE      3600
+// RTC user memory offset of the counts (4 bytes blocks), after the stall breadcrumb
+#define BDG_RTCOFF    36
+#define BDG_MAGIC     0x54474442UL
+// The counts file
+#define BDG_FILE      "/budget"
+
+struct bdg_count_t {
+  uint32_t  tx;
+  uint32_t  rx;
+};
+
+// The counts, as kept in RTC memory and in flash
+struct bdg_data_t {
+  uint32_t    magic;
+  uint16_t    day;                    // Days since the Unix epoch, 0 if unknown
+  uint16_t    month;                  // Months since year 0
+  uint32_t    past;                   // Bytes of the month, before today
+  bdg_count_t dest[BDG_DESTS];        // Today
+  uint32_t    check;
+};
+
+// A port charged to a destination
+struct bdg_port_t {
+  uint16_t  port;
+  uint8_t   dest;
+};
+
+class Budget {
+  public:
+    Budget();
+    void      init(uint32_t daily = BDG_DAILY, uint32_t monthly = BDG_MONTHLY);
+    void      setPort(uint16_t port, uint8_t dest);
+    void      setDefault(uint8_t dest);
+    void      setEnergy(Energy *nrg);
+    void      count(uint8_t dest, uint32_t tx, uint32_t rx);
+    void      update(unsigned long utm);
+    uint8_t   level();
+    uint32_t  today();
+    uint32_t  today(uint8_t dest);
+    uint32_t  month();
+    bdg_data_t  data;
+  private:
+    bool      hook();
+    void      frame(const struct pbuf *p, bool out);
+    void      save(bool flash);
+    uint32_t  checksum();
+    static uint16_t monthOf(uint16_t day);
+    static err_t onOutput(struct netif *nif, struct pbuf *p);
+    static err_t onInput(struct pbuf *p, struct netif *nif);
+    bdg_port_t    ports[BDG_PORTS];
+    uint8_t       portCount;
+    uint8_t       deflt;
+    Energy       *energy = NULL;      // Charged the airtime of the frames sent
+    uint32_t      daily;              // Bytes, 0 if no limit
+    uint32_t      monthly;
+    unsigned long saved;              // Last time saved to flash
+};
+
+#endif /* BUDGET_H */
@@ -29,15 +29,65 @@
 #define GEO_APIKEY    "USE_YOUR_KEY"
 #define GEO_MAXACC    250
 #define GEO_MINACC    50
+// A self-hosted geolocation server (tools/geoserver), behind a TLS proxy
+//#define GEO_SERVER    "geo.example.lan"
+//#define GEO_PORT      443
+
+// Offline AP tiles server, plain HTTP
+//#define TILE_SERVER   "192.168.1.2"
+//#define TILE_PORT     8080
+
+// Collect the APs from the beacon frames between the fixes, and scan
+// only when too few were heard
+//#define BCN_PASSIVE
+
+// A GPS receiver on the serial RX pin, at 9600 baud, used instead of the
+// WiFi geolocation while it has a good fix
+//#define GPS_SERIAL
+
+// Daily and monthly data budgets (KB), for the metered links
+//#define BDG_DAILY     10240
+//#define BDG_MONTHLY   204800
+
+// The current model of the energy accounting (mA), for the module used
+//#define NRG_IDLE_MA   15
+//#define NRG_CPU_MA    20
+//#define NRG_RX_MA     56
+//#define NRG_SCAN_MA   75
+//#define NRG_TX_MA     170
+
+// Ask a LAN resolver, found by mDNS or configured, before the server,
+// answer the peer trackers too
+//#define LAN_CACHE
+//#define LAN_PEER
+//#define LAN_SERVER    "192.168.1.2"
+
+// Record the I/O for the host replay, in flash or only to the client
+//#define TRACE
+//#define TRACE_STREAM
+
+// Track simplification tolerance (m)
+#define TRACK_TOL     50
 
 // APRS settings
 #define APRS_SERVER   "cbaprs.de"
 #define APRS_PORT     27235
 
+// Pinned server public keys (PEM), several per server for key rotation,
+// as X(id, server, key).  Without pins, the servers are not authenticated.
+/*
+#define TLS_PINS(X) \
+  X(GEO1, "location.services.mozilla.com", "-----BEGIN PUBLIC KEY-----\n...\n-----END PUBLIC KEY-----\n") \
+  X(GEO2, "location.services.mozilla.com", "-----BEGIN PUBLIC KEY-----\n...\n-----END PUBLIC KEY-----\n")
+*/
+
 // NTP
 #define NTP_SERVER    "europe.pool.ntp.org"
 
 // OTA
 #define OTA_PASS      "OTA_PASS"
 
+// Log binary frames instead of text, decode them with tools/dlogdec
+//#define DLOG_BINARY
+
 #endif /* CONFIG_H */
@@ -0,0 +1,412 @@
+/**
+  cycle.cpp - The fix cycle: scan, geolocate, report
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "cycle.h"
+#include "dlog.h"
+#include "stall.h"
+
+Cycle::Cycle() {
+}
+
+/**
+  Set the modules of the cycle
+
+  @param geo the geolocation
+  @param snt the NMEA sentences
+  @param rpt the APRS-IS client
+  @param clk the network time
+*/
+void Cycle::init(MLS *geo, NMEA *snt, APRS *rpt, NTP *clk) {
+  mls = geo;
+  nmea = snt;
+  aprs = rpt;
+  ntp = clk;
+}
+
+/**
+  Report only the fixes bending the track, and the expired ones
+
+  @param trk the track simplification
+*/
+void Cycle::setTrack(Track *trk) {
+  track = trk;
+}
+
+/**
+  Slow down and compress the reports on a low budget
+
+  @param bdg the data budget
+*/
+void Cycle::setBudget(Budget *bdg) {
+  budget = bdg;
+}
+
+/**
+  Send the telemetry and the status only when admitted
+
+  @param shp the uplink shaper
+*/
+void Cycle::setShaper(Shaper *shp) {
+  shaper = shp;
+}
+
+/**
+  Pause the tile downloads when out of budget
+
+  @param tls the AP tiles
+*/
+void Cycle::setTiles(Tiles *tls) {
+  tiles = tls;
+}
+
+/**
+  Geolocate by GPS off the network
+
+  @param rcv the GPS receiver
+*/
+void Cycle::setGPS(GPS *rcv) {
+  gps = rcv;
+}
+
+/**
+  Mark the cycles and report the currents
+
+  @param nrg the energy accounting
+*/
+void Cycle::setEnergy(Energy *nrg) {
+  energy = nrg;
+}
+
+/**
+  Keep the fixes over the resets, sync the clock restored
+
+  @param rsm the resume state
+*/
+void Cycle::setResume(Resume *rsm) {
+  resume = rsm;
+}
+
+/**
+  Send the NMEA sentences of each fix
+
+  @param fn the function to call
+  @param arg its argument
+*/
+void Cycle::setSend(cyc_send_t fn, void *arg) {
+  sendFn = fn;
+  sendArg = arg;
+}
+
+/**
+  Show the steps of the cycle, on a display or a led
+
+  @param fn the function to call
+  @param arg its argument
+*/
+void Cycle::setShow(cyc_show_t fn, void *arg) {
+  showFn = fn;
+  showArg = arg;
+}
+
+void Cycle::send(char *buf, size_t len) {
+  if (sendFn != NULL) sendFn(sendArg, buf, len);
+}
+
+void Cycle::show(uint8_t event) {
+  if (showFn != NULL) showFn(showArg, event);
+}
+
+/**
+  The telemetry and the status may be sent
+*/
+bool Cycle::admit() {
+  return shaper == NULL or shaper->admit(SHP_INFO);
+}
+
+/**
+  Run the fix cycle, if due
+
+  @return true if it ran
+*/
+bool Cycle::loop() {
+  unsigned long now = millis() / 1000;
+  located = reported = moving = false;
+  if (now < geoNextTime) return false;
+  // Not connected and without a GPS fix, skip the fix, the restored one is
+  // served meanwhile
+  if (not WiFi.isConnected() and (gps == NULL or not gps->good())) {
+    geoNextTime = now + 1;
+    return false;
+  }
+
+  // Set the telemetry bit 7 if the tracker is being probed
+  if (probed) aprs->aprsTlmBits = B10000000;
+  else        aprs->aprsTlmBits = B00000000;
+  // Check the time and set the telemetry bit 0 if time is not accurate
+  if (!ntp->valid) aprs->aprsTlmBits |= B00000001;
+  // Set the telemetry bit 1 if the uptime is less than one day (recent reboot)
+  if (millis() < 86400000UL) aprs->aprsTlmBits |= B00000010;
+
+  show(CYC_BEGIN);
+
+  // Get the time of the fix
+  stall.stage(STALL_NTP);
+  // Sync after the first fix if the clock was restored
+  utm = ntp->getSeconds(resume == NULL or not resume->valid or resume->clock == 0);
+
+  // Count the traffic of the day, the rates depend on what is left
+  if (budget != NULL) {
+    budget->update(ntp->valid ? utm : 0);
+    if (budget->level() != bdgLevel) {
+      bdgLevel = budget->level();
+      DLOG_P(BDG_LVL, bdgLevel, budget->today() / 1024, budget->month() / 1024);
+    }
+  }
+  unsigned long bdgRate = bdgLevel == BDG_OK ? 1 : bdgLevel == BDG_LOW ? BDG_RATELOW : BDG_RATEOUT;
+  // Set the telemetry bit 2 and compress the reports if the budget is low,
+  // stop downloading the tiles when out
+  if (bdgLevel != BDG_OK) aprs->aprsTlmBits |= B00000100;
+  aprs->compressed = bdgLevel != BDG_OK;
+  if (tiles != NULL) tiles->paused = bdgLevel == BDG_OUT;
+
+  // Connect and log in to APRS-IS while scanning and geolocating, if a
+  // report is due or moving, when the session is kept
+  stall.stage(STALL_APRS);
+  if (not sequential and (now >= rpNextTime or (rpMoving and bdgLevel == BDG_OK))) aprs->begin();
+
+  // Scan the WiFi access points
+  stall.stage(STALL_SCAN);
+  found = mls->wifiScan(false);
+  DLOG_P(SCAN_WIFI, found, ntp->getSeconds() - utm);
+
+  // Get the coordinates, from the GPS even if no networks were found
+  if (found > 0 or mls->gpsGood) {
+    locate(now, bdgRate);
+    // Keep the session while moving, for the next reports, or let the
+    // reports drain and close it
+    if (sequential or not rpMoving or bdgLevel != BDG_OK) aprs->stop();
+    // Repeat the geolocation after a delay, longer on a low budget
+    geoNextTime = now + geoDelay * bdgRate;
+  }
+  else {
+    // No WiFi networks, repeat the geolocation now
+    geoNextTime = now;
+  }
+
+  show(CYC_END);
+  // Report what the fix cycle took
+  if (energy != NULL) energy->cycle();
+  return true;
+}
+
+/**
+  Geolocate, then send and keep the fix
+
+  @param now the uptime (s)
+  @param bdgRate the rate of the cycles, on the budget left
+*/
+void Cycle::locate(unsigned long now, unsigned long bdgRate) {
+  show(CYC_GEO);
+  stall.stage(STALL_GEO);
+  acc = mls->geoLocation();
+  located = true;
+
+  // Exponential smooth the accuracy
+  if (sAcc < 0) sAcc = acc;
+  else          sAcc = (((sAcc << 2) - sAcc + acc) + 2) >> 2;
+  show(CYC_LOCATED);
+
+  if (not mls->current.valid) {
+    DLOG_P(SCAN_NOFIX, acc, ntp->getSeconds() - utm);
+    show(CYC_NOFIX);
+    return;
+  }
+
+  // Check if moving
+  moving = mls->getMovement() >= (sAcc >> 2);
+  rpMoving = moving;
+  if (moving) {
+    // Exponential smooth the bearing (75%)
+    if (sCrs < 0) sCrs = mls->bearing;
+    else          sCrs = ((sCrs + (mls->bearing << 2) - mls->bearing) + 2) >> 2;
+    DLOG_P(SCAN_MOV, mls->current.latitude, mls->current.longitude, mls->locator,
+           acc, ntp->getSeconds() - utm, mls->distance, mls->speed, mls->bearing);
+  }
+  else
+    DLOG_P(SCAN_FIX, mls->current.latitude, mls->current.longitude, mls->locator,
+           acc, ntp->getSeconds() - utm);
+  show(CYC_FIX);
+
+  sendSentences();
+  // Keep the fix over the resets
+  if (resume != NULL)
+    resume->save(mls->current.latitude, mls->current.longitude, acc, utm, ntp->valid);
+  report(now, bdgRate);
+}
+
+/**
+  Compose and send the NMEA sentences of the fix
+*/
+void Cycle::sendSentences() {
+  stall.stage(STALL_NMEA);
+  char buf[200];
+  int len;
+  // GGA
+  if (sentences & CYC_GGA) {
+    len = nmea->getGGA(buf, sizeof(buf), utm, mls->current.latitude, mls->current.longitude, 1, found);
+    send(buf, len);
+  }
+  // RMC
+  if (sentences & CYC_RMC) {
+    len = nmea->getRMC(buf, sizeof(buf), utm, mls->current.latitude, mls->current.longitude, mls->knots, sCrs);
+    send(buf, len);
+  }
+  // GLL
+  if (sentences & CYC_GLL) {
+    len = nmea->getGLL(buf, sizeof(buf), utm, mls->current.latitude, mls->current.longitude);
+    send(buf, len);
+  }
+  // VTG
+  if (sentences & CYC_VTG) {
+    len = nmea->getVTG(buf, sizeof(buf), sCrs, mls->knots, (int)(mls->speed * 3.6));
+    send(buf, len);
+  }
+  // ZDA
+  if (sentences & CYC_ZDA) {
+    len = nmea->getZDA(buf, sizeof(buf), utm);
+    send(buf, len);
+  }
+  // All the sentences of this fix are out
+  show(CYC_SENT);
+}
+
+/**
+  Report the fix to APRS-IS if the track bends or the time expired, only
+  the latter when out of budget, and adjust the delay (SmartBeaconing)
+
+  @param now the uptime (s)
+  @param bdgRate the rate of the reports, on the budget left
+*/
+void Cycle::report(unsigned long now, unsigned long bdgRate) {
+  // Read the Vcc (mV)
+  int vcc  = ESP.getVcc();
+  // Set the bit 3 to show whether the battery is wrong (3.3V +/- 10%)
+  if (vcc < 3000 or vcc > 3600) aprs->aprsTlmBits |= B00001000;
+  // Get RSSI
+  int rssi = WiFi.RSSI();
+  // Get free heap
+  int heap = ESP.getFreeHeap();
+
+  // Hold back the fixes on a straight line, only the ones
+  // bending the track are reported
+  track_pt_t fix = {mls->current.latitude, mls->current.longitude, utm,
+                    (int16_t)sCrs, (int16_t)mls->knots
+                   };
+  track_pt_t vtx;
+  bool bend = moving and track != NULL and track->add(fix, max(TRACK_TOL, sAcc >> 1), &vtx);
+  if (not (((bend and bdgLevel != BDG_OUT) or (now >= rpNextTime)) and acc >= 0)) return;
+
+  // Report the current fix if the time expired
+  if (not bend) {
+    vtx = fix;
+    if (track != NULL) track->reset(fix);
+  }
+  reported = true;
+  show(CYC_REPORT);
+  stall.stage(STALL_APRS);
+
+  // Connect to the server, if not already in the background, and wait
+  // for the login to be verified
+  if (aprs->connect() and aprs->authenticate()) {
+    // Local buffer, max comment length is 43 bytes
+    char buf[45] = "";
+    // Prepare the comment, none on a low budget
+    if (bdgLevel == BDG_OK)
+      snprintf_P(buf, sizeof(buf), PSTR("Acc:%d Dst:%d Spd:%d Crs:%s Vcc:%d.%d RSSI:%d"),
+                 acc, (int)(mls->distance), (int)(3.6 * mls->speed), mls->getCardinal(sCrs),
+                 vcc / 1000, (vcc % 1000) / 100, rssi);
+    // Report course and speed
+    aprs->sendPosition(vtx.utm, vtx.lat, vtx.lng, vtx.crs, vtx.knots, acc, buf);
+    // Send the telemetry, less often on a low budget, not on a poor link
+    //   mls->speed / 0.0008 = mls->speed * 1250
+    unsigned long sent = aprs->sent;
+    if (++rpCount % bdgRate == 0 and admit())
+      aprs->sendTelemetry((vcc - 2500) / 4, -rssi, heap / 256, acc, (int)(sqrt(mls->speed * 1250)), aprs->aprsTlmBits);
+    // Report the traffic and the currents of the period
+    if (now >= bdgNextTime and admit()) status(now);
+    if (shaper != NULL) shaper->charge(SHP_INFO, aprs->sent - sent);
+    if (moving) {
+      // Reset the delay to minimum
+      rpDelay = rpDelayMin;
+      // Set the telemetry bits 4 and 5 if moving, according to the speed
+      if (mls->speed > 10) aprs->aprsTlmBits |= B00100000;
+      else                 aprs->aprsTlmBits |= B00010000;
+    }
+    else {
+      // Not moving, increase the delay up to a maximum
+      rpDelay += rpDelayStep;
+      if (rpDelay > rpDelayMax) rpDelay = rpDelayMax;
+    }
+  }
+
+  // On error, reset the delay to the minimum
+  if (aprs->error) {
+    rpDelay = rpDelayMin;
+    aprs->error = false;
+  }
+
+  // Repeat the report after the delay, longer on a low budget
+  rpNextTime = now + rpDelay * bdgRate;
+  show(CYC_REPORTED);
+}
+
+/**
+  Send the status: the traffic of the day (KB) and the average currents
+  of the period (uA), the latter not on a low budget
+
+  @param now the uptime (s)
+*/
+void Cycle::status(unsigned long now) {
+  char sts[64];
+  if (budget != NULL) {
+    snprintf_P(sts, sizeof(sts), PSTR("Data %luKB/%luKB geo:%lu aprs:%lu tile:%lu ota:%lu"),
+               budget->today() / 1024UL, budget->month() / 1024UL,
+               budget->today(BDG_GEO) / 1024UL, budget->today(BDG_APRS) / 1024UL,
+               budget->today(BDG_TILE) / 1024UL, budget->today(BDG_OTA) / 1024UL);
+    aprs->sendStatus(sts);
+    DLOG_P(BDG_DST, budget->today(BDG_GEO) / 1024, budget->today(BDG_APRS) / 1024,
+           budget->today(BDG_NTP) / 1024, budget->today(BDG_NMEA) / 1024,
+           budget->today(BDG_OTA) / 1024, budget->today(BDG_TILE) / 1024,
+           budget->today(BDG_DNS) / 1024, budget->today(BDG_OTHER) / 1024);
+  }
+  if (shaper != NULL)
+    DLOG_P(SHP_DEF, shaper->deferred[SHP_TIME], shaper->deferred[SHP_INFO], shaper->deferred[SHP_BULK]);
+  if (energy != NULL) {
+    if (bdgLevel == BDG_OK) {
+      snprintf_P(sts, sizeof(sts), PSTR("Energy %luuA scan:%lu geo:%lu aprs:%lu bcn:%lu"),
+                 (unsigned long)energy->current(NRG_SUBS), (unsigned long)energy->current(NRG_SCAN),
+                 (unsigned long)energy->current(NRG_GEO), (unsigned long)energy->current(NRG_APRS),
+                 (unsigned long)energy->current(NRG_BCN));
+      aprs->sendStatus(sts);
+    }
+    energy->report();
+  }
+  bdgNextTime = now + BDG_REPORT;
+}
@@ -0,0 +1,129 @@
+/**
+  cycle.h - The fix cycle: scan, geolocate, report
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  When due, the loop gets the time, counts the budget, scans, geolocates,
+  sends the NMEA sentences and keeps the fix over the resets.  The fix is
+  reported to APRS-IS if the track bends or the time expired, with the
+  telemetry and, hourly, the data and energy status.  The reports come
+  often while moving and less and less often while standing, all of them
+  rarer on a low budget.  Off the network and without a GPS fix, there is
+  no cycle.  The sketch and the simulator run the same cycle, the output
+  of the sentences and the display are theirs.
+*/
+
+#ifndef CYCLE_H
+#define CYCLE_H
+
+#include "Arduino.h"
+#include <ESP8266WiFi.h>
+#include "config.h"
+#include "mls.h"
+#include "nmea.h"
+#include "aprs.h"
+#include "ntp.h"
+#include "track.h"
+#include "budget.h"
+#include "shaper.h"
+#include "tiles.h"
+#include "gps.h"
+#include "energy.h"
+#include "resume.h"
+
+// The NMEA sentences sent with each fix
+#define CYC_GGA       0x01
+#define CYC_RMC       0x02
+#define CYC_GLL       0x04
+#define CYC_VTG       0x08
+#define CYC_ZDA       0x10
+
+// What to show: the cycle, the geolocation, the fix, the report
+enum cyc_event_t {CYC_BEGIN, CYC_GEO, CYC_LOCATED, CYC_FIX, CYC_NOFIX,
+                  CYC_SENT, CYC_REPORT, CYC_REPORTED, CYC_END
+                 };
+
+// Called with each NMEA sentence of a fix
+typedef void (*cyc_send_t)(void *arg, char *buf, size_t len);
+// Called on the steps of the cycle, to show them
+typedef void (*cyc_show_t)(void *arg, uint8_t event);
+
+class Cycle {
+  public:
+    Cycle();
+    void    init(MLS *geo, NMEA *snt, APRS *rpt, NTP *clk);
+    void    setTrack(Track *trk);
+    void    setBudget(Budget *bdg);
+    void    setShaper(Shaper *shp);
+    void    setTiles(Tiles *tls);
+    void    setGPS(GPS *rcv);
+    void    setEnergy(Energy *nrg);
+    void    setResume(Resume *rsm);
+    void    setSend(cyc_send_t fn, void *arg);
+    void    setShow(cyc_show_t fn, void *arg);
+    bool    loop();
+    // Timings
+    unsigned long geoNextTime = 0;    // Next time to geolocate
+    unsigned long geoDelay    = 20;   // Delay between geolocating
+    unsigned long rpNextTime  = 0;    // Next time to report
+    unsigned long rpDelay     = 60;   // Delay between reporting
+    unsigned long rpDelayStep = 30;   // Step to increase the delay between reporting
+    unsigned long rpDelayMin  = 60;   // Minimum delay between reporting
+    unsigned long rpDelayMax  = 1800; // Maximum delay between reporting
+    unsigned long rpCount     = 0;    // Reports sent
+    bool          rpMoving    = false;// Moving at the last fix, a report is likely
+    unsigned long bdgNextTime = 0;    // Next time to report the data budget
+    uint8_t       bdgLevel    = BDG_OK;
+    // Smooth accuracy and course
+    int           sAcc        = -1;
+    int           sCrs        = -1;
+    // Settings
+    uint8_t       sentences   = CYC_GGA | CYC_RMC;
+    bool          probed      = true; // Telemetry bit 7, the tracker is being probed
+    bool          sequential  = false;// The APRS-IS session only to report, not kept
+    // The last cycle
+    int           found       = 0;    // Networks scanned
+    int           acc         = -1;   // Accuracy of the fix (m)
+    unsigned long utm         = 0;    // Time of the fix, Unix
+    bool          moving      = false;
+    bool          located     = false;// Geolocated, with or without a fix
+    bool          reported    = false;// Reported to APRS-IS
+  private:
+    void    locate(unsigned long now, unsigned long bdgRate);
+    void    sendSentences();
+    void    report(unsigned long now, unsigned long bdgRate);
+    void    status(unsigned long now);
+    bool    admit();
+    void    send(char *buf, size_t len);
+    void    show(uint8_t event);
+    MLS          *mls     = NULL;
+    NMEA         *nmea    = NULL;
+    APRS         *aprs    = NULL;
+    NTP          *ntp     = NULL;
+    Track        *track   = NULL;
+    Budget       *budget  = NULL;
+    Shaper       *shaper  = NULL;
+    Tiles        *tiles   = NULL;
+    GPS          *gps     = NULL;
+    Energy       *energy  = NULL;
+    Resume       *resume  = NULL;
+    cyc_send_t    sendFn  = NULL;
+    void         *sendArg = NULL;
+    cyc_show_t    showFn  = NULL;
+    void         *showArg = NULL;
+};
+
+#endif /* CYCLE_H */
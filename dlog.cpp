@@ -0,0 +1,109 @@
+/**
+  dlog.cpp - Deferred formatting log
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "dlog.h"
+
+#ifdef DLOG_BINARY
+// Only the argument signatures are kept in flash
+#define DLOG_STR(id, sig, fmt) static const char dlogStr_##id[] PROGMEM = sig;
+#else
+// The full format strings
+#define DLOG_STR(id, sig, fmt) static const char dlogStr_##id[] PROGMEM = fmt;
+#endif
+DLOG_CATALOG(DLOG_STR)
+#undef DLOG_STR
+
+// Catalog table, indexed by message identifier
+#define DLOG_PTR(id, sig, fmt) dlogStr_##id,
+static const char* const dlogTable[] PROGMEM = {
+  DLOG_CATALOG(DLOG_PTR)
+};
+#undef DLOG_PTR
+
+DLOG dlog;
+
+DLOG::DLOG() {
+}
+
+/**
+  Write a log message.  In text mode, format it and print it.  In binary
+  mode, only frame the message identifier and the raw arguments:
+
+    SYNC ID LEN ARGS... CKSUM
+
+  where the checksum is the XOR of ID, LEN and ARGS.
+
+  @param id the catalog message identifier
+*/
+void DLOG::write(uint8_t id, ...) {
+  if (id >= DLOG_COUNT) return;
+  const char *str = (const char*)pgm_read_ptr(&dlogTable[id]);
+  va_list args;
+  va_start(args, id);
+#ifdef DLOG_BINARY
+  // Leave room for the header and the checksum
+  const size_t maxLen = sizeof(buf) - 1;
+  size_t len = 3;
+  char sig;
+  while ((sig = pgm_read_byte(str++)) != '\0') {
+    if (sig == 's') {
+      // String, length prefixed
+      const char *s = va_arg(args, const char*);
+      size_t slen = strnlen(s, 255);
+      // Truncate to fit the frame
+      if (len + 1 > maxLen) break;
+      if (len + 1 + slen > maxLen) slen = maxLen - len - 1;
+      buf[len++] = (uint8_t)slen;
+      memcpy(buf + len, s, slen);
+      len += slen;
+    }
+    else {
+      // Numbers, little endian, as they are in memory
+      union {
+        int32_t   i;
+        uint32_t  u;
+        float     f;
+      } val;
+      if      (sig == 'i') val.i = va_arg(args, int);
+      else if (sig == 'u') val.u = va_arg(args, unsigned int);
+      else if (sig == 'f') val.f = (float)va_arg(args, double);
+      else break;
+      if (len + sizeof(val) > maxLen) break;
+      memcpy(buf + len, &val, sizeof(val));
+      len += sizeof(val);
+    }
+  }
+  // Header
+  buf[0] = DLOG_SYNC;
+  buf[1] = id;
+  buf[2] = len - 3;
+  // Checksum
+  uint8_t ck = 0;
+  for (size_t i = 1; i < len; i++)
+    ck ^= (uint8_t)buf[i];
+  buf[len++] = ck;
+  Serial.write((const uint8_t*)buf, len);
+#else
+  // Format the text here
+  vsnprintf_P(buf, sizeof(buf), str, args);
+  Serial.print(buf);
+#endif
+  va_end(args);
+}
@@ -0,0 +1,48 @@
+/**
+  dlog.h - Deferred formatting log
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DLOG_H
+#define DLOG_H
+
+#include "Arduino.h"
+#include "config.h"
+#include "dlogmsg.h"
+
+// Message identifiers, in catalog order
+enum dlog_id_t {
+#define DLOG_ID(id, sig, fmt) DLOG_##id,
+  DLOG_CATALOG(DLOG_ID)
+#undef DLOG_ID
+  DLOG_COUNT
+};
+
+class DLOG {
+  public:
+    DLOG();
+    void  write(uint8_t id, ...);
+  private:
+    char  buf[DLOG_MAXLEN];
+};
+
+extern DLOG dlog;
+
+// Log a catalog message, formatted here or, with DLOG_BINARY, on the host
+#define DLOG_P(id, ...) dlog.write(DLOG_##id, ##__VA_ARGS__)
+
+#endif /* DLOG_H */
@@ -0,0 +1,113 @@
+/**
+  dlogmsg.h - Deferred log message catalog
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DLOGMSG_H
+#define DLOGMSG_H
+
+/*
+  The binary frame, with DLOG_BINARY:
+
+    DLOG_SYNC, id, payload length, payload, XOR of id, length and payload
+*/
+// Frame sync byte, never found in the text output
+#define DLOG_SYNC   0xA5
+// Maximum text line or binary frame length
+#define DLOG_MAXLEN 200
+
+/*
+  The message catalog, shared by the firmware and by the host decoder,
+  so the message identifiers are generated from the same list on both
+  sides.  Never reorder, only append, or old logs will decode wrong.
+
+  X(id, signature, format)
+
+  The signature describes the binary arguments, one char each:
+    i  signed 32 bits integer
+    u  unsigned 32 bits integer
+    f  32 bits float
+    s  string, at most 255 chars
+*/
+#define DLOG_CATALOG(X) \
+  X(WIFI_CON,   "siisss",   "$PWIFI,CON,%s,%d,%ddBm,%s,%s,%s\r\n") \
+  X(WIFI_NOC,   "",         "$PWIFI,ERR\r\n") \
+  X(WIFI_WPSB,  "",         "$PWIFI,WPS,START\r\n") \
+  X(WIFI_WPS,   "s",        "$PWIFI,WPS,%s\r\n") \
+  X(WIFI_BGN,   "s",        "$PWIFI,BGN,%s\r\n") \
+  X(WIFI_TRY,   "iis",      "$PWIFI,TRY,%d/%d,%s\r\n") \
+  X(WIFI_ERR,   "s",        "$PWIFI,ERR,%s\r\n") \
+  X(WIFI_END,   "s",        "$PWIFI,END,%s\r\n") \
+  X(WIFI_OPN,   "s",        "$PWIFI,OPN,%s\r\n") \
+  X(WIFI_SRV,   "s",        "$PWIFI,SRV,%s\r\n") \
+  X(SWIFI_CNT,  "i",        "$SWIFI,CNT,%d\r\n") \
+  X(SWIFI_NET,  "iiiss",    "$SWIFI,%d,%d,%d,%s,%s\r\n") \
+  X(HTTP_CON,   "si",       "$PHTTP,CON,%s,%d\r\n") \
+  X(HTTP_RSP,   "s",        "$PHTTP,RSP,%s\r\n") \
+  X(HTTP_DIS,   "si",       "$PHTTP,DIS,%s,%d\r\n") \
+  X(HTTP_ERR,   "si",       "$PHTTP,ERR,%s,%d\r\n") \
+  X(OTA_STA,    "",         "$POTA,STA\r\n") \
+  X(OTA_FIN,    "",         "\r\n$POTA,FIN\r\n") \
+  X(OTA_PRG,    "u",        "$POTA,PRG,%u%%\r\n") \
+  X(OTA_EAUTH,  "u",        "$POTA,ERR,%u,Auth Failed\r\n") \
+  X(OTA_EBEGIN, "u",        "$POTA,ERR,%u,Begin Failed\r\n") \
+  X(OTA_ECONN,  "u",        "$POTA,ERR,%u,Connect Failed\r\n") \
+  X(OTA_ERECV,  "u",        "$POTA,ERR,%u,Receive Failed\r\n") \
+  X(OTA_EEND,   "u",        "$POTA,ERR,%u,End Failed\r\n") \
+  X(OTA_RDY,    "",         "$POTA,RDY\r\n") \
+  X(APRS_AUTH,  "ss",       "$PAPRS,AUTH,%s,%s\r\n") \
+  X(APRS_PKT,   "is",       "$PAPRS,%03d,%s") \
+  X(HWMN_VCC,   "f",        "$PHWMN,VCC,%.3f\r\n") \
+  X(HWMN_TLM,   "i",        "$PHWMN,TLM,%d\r\n") \
+  X(SCAN_WIFI,  "iu",       "$PSCAN,WIFI,%d,%lus\r\n") \
+  X(SCAN_FIX,   "ffsiu",    "$PSCAN,FIX,%.6f,%.6f,%s,%dm,%lus\r\n") \
+  X(SCAN_MOV,   "ffsiuffi", "$PSCAN,FIX,%.6f,%.6f,%s,%dm,%lus,%.2fm,%.2fm/s,%d'\r\n") \
+  X(SCAN_NOFIX, "iu",       "$PSCAN,NOFIX,%dm,%lus\r\n") \
+  X(NTP_CLK,    "uiiiiii",  "$PNTPC,0x%08X,%d.%02d.%02d,%02d.%02d.%02d\r\n") \
+  X(SRV_MDNS,   "suu",      "$PMDNS,%s,%u,TCP,%u\r\n") \
+  X(SRV_DIS,    "suu",      "$PSRVD,%s,%u,%u\r\n") \
+  X(SRV_CON,    "suuiiii",  "$PSRVC,%s,%u,%u,%d.%d.%d.%d\r\n") \
+  X(SRV_REJ,    "suuiiii",  "$PSRVR,%s,%u,%u,%d.%d.%d.%d\r\n") \
+  X(STAL_RST,   "ussu",     "$PSTAL,RST,%u,%s,%s,%lums\r\n") \
+  X(STAL_LOOP,  "ussu",     "$PSTAL,LOOP,%lums,%s,%s,%lums\r\n") \
+  X(STAL_CALL,  "ssu",      "$PSTAL,CALL,%s,%s,%lums\r\n") \
+  X(TLS_MFLN,   "siu",      "$PTLS,MFLN,%s,%d,%u\r\n") \
+  X(TLS_HEAP,   "uuu",      "$PTLS,HEAP,%u,%u,%u\r\n") \
+  X(TLS_PIN,    "siu",      "$PTLS,PIN,%s,%d,%u\r\n") \
+  X(TLS_NOPIN,  "si",       "$PTLS,NOPIN,%s,%d\r\n") \
+  X(DNS_OLD,    "siiii",    "$PDNS,OLD,%s,%d.%d.%d.%d\r\n") \
+  X(DNS_ERR,    "s",        "$PDNS,ERR,%s\r\n") \
+  X(TILE_GET,   "iii",      "$PTILE,GET,%d,%d,%d\r\n") \
+  X(TILE_ERR,   "iii",      "$PTILE,ERR,%d,%d,%d\r\n") \
+  X(TILE_FIX,   "ii",       "$PTILE,FIX,%d,%dm\r\n") \
+  X(BCN_USE,    "uu",       "$PBCN,USE,%u,%us\r\n") \
+  X(TILE_LRN,   "iii",      "$PTILE,LRN,%d,%d,%d\r\n") \
+  X(GPS_FIX,    "ui",       "$PGPS,FIX,%u,%dm\r\n") \
+  X(GEO_SAME,   "iii",      "$PGEO,SAME,%d/%d,%dm\r\n") \
+  X(BDG_LVL,    "uuu",      "$PBDG,LVL,%u,%uKB,%uKB\r\n") \
+  X(BDG_DST,    "uuuuuuuu", "$PBDG,DST,%u,%u,%u,%u,%u,%u,%u,%uKB\r\n") \
+  X(SHP_DEF,    "uuu",      "$PSHP,DEF,%lu,%lu,%lu\r\n") \
+  X(LNK_LOST,   "uuuu",     "$PLNK,LOST,%u,%u,%lums,%u%%\r\n") \
+  X(LAN_SRV,    "iiiiu",    "$PLAN,SRV,%d.%d.%d.%d,%u\r\n") \
+  X(LAN_FIX,    "uu",       "$PLAN,FIX,%um,%us\r\n") \
+  X(LAN_LOST,   "iiii",     "$PLAN,LOST,%d.%d.%d.%d\r\n") \
+  X(TRC_FULL,   "u",        "$PTRC,FULL,%u\r\n") \
+  X(NRG_CYC,    "uuuuuuuu", "$PNRG,CYC,%uuAh,%u,%u,%uuAh,%ums,%ums,%ums,%uB\r\n") \
+  X(NRG_SUB,    "uuuuuuuuuu", "$PNRG,SUB,%u,%u,%u,%u,%u,%u,%u,%u,%u,%uuAh\r\n") \
+  X(RSM_FIX,    "ffiisu",   "$PRSM,FIX,%.6f,%.6f,%dm,%d,%s,%u\r\n")
+
+#endif /* DLOGMSG_H */
@@ -0,0 +1,272 @@
+/**
+  dnscache.cpp - Shared DNS cache
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "dnscache.h"
+#include "dlog.h"
+#include "stall.h"
+
+DNSCache::DNSCache() {
+}
+
+/**
+  Empty the cache
+*/
+void DNSCache::init() {
+  for (uint8_t i = 0; i < DNS_SLOTS; i++) {
+    entries[i].name[0] = '\0';
+    entries[i].valid   = false;
+    entries[i].pending = false;
+    entries[i].done    = false;
+    entries[i].updated = 0;
+    entries[i].count   = 0;
+  }
+  next = 0;
+}
+
+/**
+  Find the entry of a name, or take the oldest one for it
+
+  @param name the host name
+  @return the entry
+*/
+dns_entry_t *DNSCache::lookup(const char *name) {
+  for (uint8_t i = 0; i < DNS_SLOTS; i++)
+    if (strncmp(entries[i].name, name, DNS_NAMELEN) == 0)
+      return &entries[i];
+  // Not known, replace the oldest entry
+  dns_entry_t *entry = &entries[next];
+  next = (next + 1) % DNS_SLOTS;
+  // Its waiters will not get an answer
+  entry->valid   = false;
+  entry->pending = false;
+  notify(entry);
+  strncpy(entry->name, name, DNS_NAMELEN - 1);
+  entry->name[DNS_NAMELEN - 1] = '\0';
+  entry->tried = millis() - DNS_RETRY * 1000UL;
+  return entry;
+}
+
+/**
+  The lwIP resolver answer.  It runs out of the loop, so the waiters are
+  only called from loop().
+
+  @param name the host name
+  @param addr the address, NULL if not resolved
+  @param arg the entry
+*/
+void DNSCache::onFound(const char *name, const ip_addr_t *addr, void *arg) {
+  dns_entry_t *entry = (dns_entry_t*)arg;
+  // A late answer, the lookup timed out or the entry was reused
+  if (not entry->pending or strncmp(entry->name, name, DNS_NAMELEN) != 0)
+    return;
+  if (addr != NULL) {
+    entry->ip      = IPAddress(ip4_addr_get_u32(ip_2_ip4(addr)));
+    entry->valid   = true;
+    entry->updated = millis();
+  }
+  entry->pending = false;
+  entry->done    = true;
+}
+
+/**
+  Start resolving the name of an entry, the old address is kept until
+  the lookup succeeds
+
+  @param entry the entry
+*/
+void DNSCache::query(dns_entry_t *entry) {
+  if (entry->pending) return;
+  ip_addr_t addr;
+  entry->tried   = millis();
+  entry->pending = true;
+  switch (dns_gethostbyname(entry->name, &addr, onFound, entry)) {
+    case ERR_OK:
+      // Known to lwIP, no answer to wait for
+      onFound(entry->name, &addr, entry);
+      break;
+    case ERR_INPROGRESS:
+      break;
+    default:
+      entry->pending = false;
+      entry->done    = true;
+  }
+}
+
+/**
+  The address of an entry, as it is now
+
+  @param entry the entry
+  @param ip the address
+  @return DNS_OK, DNS_OLD for an expired address, DNS_WAIT or DNS_ERR
+*/
+uint8_t DNSCache::result(dns_entry_t *entry, IPAddress &ip) {
+  unsigned long age = millis() - entry->updated;
+  if (entry->valid and age < DNS_MAXSTALE * 1000UL) {
+    ip = entry->ip;
+    return age < DNS_TTL * 1000UL ? DNS_OK : DNS_OLD;
+  }
+  return entry->pending ? DNS_WAIT : DNS_ERR;
+}
+
+/**
+  Call the waiters of an entry
+
+  @param entry the entry
+*/
+void DNSCache::notify(dns_entry_t *entry) {
+  entry->done = false;
+  if (entry->count == 0) return;
+  IPAddress ip;
+  uint8_t res = result(entry, ip);
+  // A waiter may ask again
+  uint8_t count = entry->count;
+  dns_waiter_t waiters[DNS_WAITERS];
+  memcpy(waiters, entry->waiters, sizeof(waiters));
+  entry->count = 0;
+  for (uint8_t i = 0; i < count; i++)
+    waiters[i].found(waiters[i].arg, res, ip);
+}
+
+/**
+  Get the address of a name, without waiting.  A fresh cached address is
+  returned right away.  An expired one is still returned for a while, and
+  refreshed in the background.  An unknown name is looked up, and DNS_WAIT
+  returned until the lookup ends.
+
+  @param name the host name
+  @param ip the address
+  @return DNS_OK, DNS_OLD for an expired address, DNS_WAIT or DNS_ERR
+*/
+uint8_t DNSCache::resolve(const char *name, IPAddress &ip) {
+  dns_entry_t *entry = lookup(name);
+  entry->used = millis();
+  uint8_t res = result(entry, ip);
+  // Do not insist on a failing name
+  if (res != DNS_OK and millis() - entry->tried >= DNS_RETRY * 1000UL) {
+    query(entry);
+    res = result(entry, ip);
+  }
+  if (res == DNS_OLD) DLOG_P(DNS_OLD, name, ip[0], ip[1], ip[2], ip[3]);
+  return res;
+}
+
+/**
+  Get the address of a name, waiting for the lookup if it is not known.
+  Only for where there is nothing else to do, as checking a network.
+
+  @param name the host name
+  @param ip the address
+  @param timeout the longest wait (ms)
+  @return DNS_OK, DNS_OLD for an expired address, DNS_WAIT if timed out or DNS_ERR
+*/
+uint8_t DNSCache::wait(const char *name, IPAddress &ip, unsigned long timeout) {
+  unsigned long start = millis();
+  uint8_t res = resolve(name, ip);
+  // Waiting anyway, as on a network just joined, a failed name is looked up again
+  if (res == DNS_ERR) {
+    dns_entry_t *entry = lookup(name);
+    query(entry);
+    res = result(entry, ip);
+  }
+  while (res == DNS_WAIT and millis() - start < timeout) {
+    stall.wait(DNS_POLL);
+    res = result(lookup(name), ip);
+  }
+  return res;
+}
+
+/**
+  Get the address of a name, and be called when it is known.  If the name
+  can be used now, the callback is called right away.
+
+  @param name the host name
+  @param found the callback
+  @param arg the callback argument
+  @return false if the name has too many waiters
+*/
+bool DNSCache::request(const char *name, dns_found_t found, void *arg) {
+  IPAddress ip;
+  uint8_t res = resolve(name, ip);
+  if (res != DNS_WAIT) {
+    found(arg, res, ip);
+    return true;
+  }
+  dns_entry_t *entry = lookup(name);
+  if (entry->count >= DNS_WAITERS) return false;
+  entry->waiters[entry->count].found = found;
+  entry->waiters[entry->count].arg   = arg;
+  entry->count++;
+  return true;
+}
+
+/**
+  Add a name to the cache and start resolving it, so it is kept fresh
+  before it is needed
+
+  @param name the host name
+*/
+void DNSCache::prefetch(const char *name) {
+  dns_entry_t *entry = lookup(name);
+  entry->used = millis();
+  query(entry);
+}
+
+/**
+  Check if any lookup is in flight
+
+  @return true if waiting for an answer
+*/
+bool DNSCache::busy() {
+  for (uint8_t i = 0; i < DNS_SLOTS; i++)
+    if (entries[i].pending) return true;
+  return false;
+}
+
+/**
+  Call the waiters of the ended lookups, give up the slow ones, and start
+  refreshing one of the recently used names about to expire.  It does not
+  wait, call it on each loop pass.
+*/
+void DNSCache::loop() {
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < DNS_SLOTS; i++) {
+    dns_entry_t *entry = &entries[i];
+    if (entry->pending and now - entry->tried >= DNS_TIMEOUT) {
+      entry->pending = false;
+      entry->done    = true;
+    }
+    if (entry->done) {
+      if (not entry->valid) DLOG_P(DNS_ERR, entry->name);
+      notify(entry);
+    }
+  }
+  for (uint8_t i = 0; i < DNS_SLOTS; i++) {
+    dns_entry_t *entry = &entries[i];
+    if (entry->name[0] == '\0' or entry->pending) continue;
+    // Only the names still in use
+    if (now - entry->used >= DNS_KEEP * 1000UL) continue;
+    // Do not insist on a failing name
+    if (now - entry->tried < DNS_RETRY * 1000UL) continue;
+    if (not entry->valid or now - entry->updated >= (DNS_TTL - DNS_PREFETCH) * 1000UL) {
+      query(entry);
+      return;
+    }
+  }
+}
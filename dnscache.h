@@ -0,0 +1,97 @@
+/**
+  dnscache.h - Shared DNS cache
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+#include "Arduino.h"
+#include <ESP8266WiFi.h>
+#include <lwip/dns.h>
+#include "config.h"
+
+// Number of names kept
+#define DNS_SLOTS     4
+// Longest name kept, as the server names of the clients
+#define DNS_NAMELEN   50
+// Keep an address this long (s), the core does not expose the record TTL
+#ifndef DNS_TTL
+#define DNS_TTL       300
+#endif
+// Use an expired address this long (s) if the name can not be resolved
+#ifndef DNS_MAXSTALE
+#define DNS_MAXSTALE  86400
+#endif
+// Refresh the names this long (s) before they expire
+#define DNS_PREFETCH  60
+// Only refresh the names used in this interval (s)
+#define DNS_KEEP      900
+// Do not retry a failed refresh sooner than this (s)
+#define DNS_RETRY     30
+// Lookup timeout (ms)
+#define DNS_TIMEOUT   2000
+// Check a lookup this often (ms) when waiting for it
+#define DNS_POLL      50
+// Callbacks waiting for each name
+#define DNS_WAITERS   2
+
+// Resolution results
+enum dns_result_t {DNS_ERR, DNS_OK, DNS_OLD, DNS_WAIT};
+
+// Called when a requested name is resolved, or could not be
+typedef void (*dns_found_t)(void *arg, uint8_t result, const IPAddress &ip);
+
+struct dns_waiter_t {
+  dns_found_t   found;
+  void         *arg;
+};
+
+struct dns_entry_t {
+  char          name[DNS_NAMELEN];
+  IPAddress     ip;
+  bool          valid;                // The address was resolved at least once
+  bool          pending;              // A lookup is in flight
+  bool          done;                 // A lookup ended, the waiters are to be called
+  unsigned long updated;              // Time of the last resolution (ms)
+  unsigned long tried;                // Time of the last lookup (ms)
+  unsigned long used;                 // Time of the last use (ms)
+  dns_waiter_t  waiters[DNS_WAITERS];
+  uint8_t       count;                // Waiters
+};
+
+class DNSCache {
+  public:
+    DNSCache();
+    void    init();
+    uint8_t resolve(const char *name, IPAddress &ip);
+    uint8_t wait(const char *name, IPAddress &ip, unsigned long timeout = DNS_TIMEOUT);
+    bool    request(const char *name, dns_found_t found, void *arg);
+    void    prefetch(const char *name);
+    bool    busy();
+    void    loop();
+  private:
+    static void onFound(const char *name, const ip_addr_t *addr, void *arg);
+    dns_entry_t *lookup(const char *name);
+    void    query(dns_entry_t *entry);
+    uint8_t result(dns_entry_t *entry, IPAddress &ip);
+    void    notify(dns_entry_t *entry);
+    dns_entry_t entries[DNS_SLOTS];
+    uint8_t next;
+};
+
+#endif /* DNSCACHE_H */
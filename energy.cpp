@@ -0,0 +1,225 @@
+/**
+  energy.cpp - Energy accounting, the charge drawn per subsystem
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "energy.h"
+#include "stall.h"
+#include "budget.h"
+#include "dlog.h"
+
+// The subsystem of each loop stage, the setup and the idle passes are the base
+static const uint8_t nrgStage[STALL_STAGES] = {
+  NRG_BASE, NRG_BASE, NRG_OTHER, NRG_NMEA, NRG_BASE,
+  NRG_NTP, NRG_SCAN, NRG_GEO, NRG_NMEA, NRG_APRS,
+  NRG_DNS, NRG_TILE, NRG_BCN, NRG_OTHER
+};
+// The subsystem of each data budget destination
+static const uint8_t nrgDest[BDG_DESTS] = {
+  NRG_GEO, NRG_APRS, NRG_NTP, NRG_NMEA, NRG_OTHER, NRG_TILE, NRG_DNS, NRG_OTHER
+};
+
+Energy::Energy() {
+}
+
+/**
+  Start counting, from the setup
+*/
+void Energy::init() {
+  memset(count, 0, sizeof(count));
+  memset(last, 0, sizeof(last));
+  memset(past, 0, sizeof(past));
+  mark      = millis();
+  reported  = mark;
+  scanMs    = 0;
+  waitMs    = 0;
+  idleMs    = 0;
+  sub       = NRG_BASE;
+  call      = STALL_NONE;
+}
+
+/**
+  The radio listens while the beacons are collected
+
+  @param bcn the beacon listener
+*/
+void Energy::setBeacons(Beacons *bcn) {
+  beacons = bcn;
+}
+
+/**
+  Charge the stage that ends and start the next one
+
+  @param stage the loop stage starting
+*/
+void Energy::stage(uint8_t stage) {
+  close();
+  if (stage < STALL_STAGES) sub = nrgStage[stage];
+}
+
+/**
+  Mark the start of a blocking call
+
+  @param call the blocking call
+*/
+void Energy::enter(uint8_t call) {
+  this->call = call;
+  callStart  = millis();
+}
+
+/**
+  Mark the end of a blocking call, its time by what the radio did
+*/
+void Energy::leave() {
+  uint32_t ms = millis() - callStart;
+  if      (call == STALL_WSCAN) scanMs += ms;
+  else if (call == STALL_DELAY) idleMs += ms;
+  else if (call != STALL_NONE)  waitMs += ms;
+  call = STALL_NONE;
+}
+
+/**
+  Charge the time of the stage so far to its subsystem
+
+  The stage may have ended inside a call, so the parts are kept in the
+  time of the stage.
+*/
+void Energy::close() {
+  unsigned long now = millis();
+  uint32_t ms = now - mark;
+  mark = now;
+  if (scanMs > ms) scanMs = ms;
+  if (waitMs > ms - scanMs) waitMs = ms - scanMs;
+  if (idleMs > ms - scanMs - waitMs) idleMs = ms - scanMs - waitMs;
+  uint32_t cpuMs = ms - scanMs - waitMs - idleMs;
+  nrg_count_t *c = &count[sub];
+  c->charge += 1000ULL * ((uint64_t)scanMs * NRG_SCAN_MA + (uint64_t)waitMs * NRG_RX_MA +
+                          (uint64_t)idleMs * NRG_IDLE_MA + (uint64_t)cpuMs * NRG_CPU_MA);
+  c->scan   += scanMs;
+  c->radio  += waitMs;
+  c->cpu    += cpuMs;
+  // Listening, the radio is on instead of sleeping
+  if (beacons != NULL and beacons->listening) {
+    nrg_count_t *b = &count[NRG_BCN];
+    b->charge += 1000ULL * ((uint64_t)idleMs * (NRG_RX_MA - NRG_IDLE_MA) +
+                            (uint64_t)cpuMs * (NRG_RX_MA - NRG_CPU_MA));
+    b->radio  += idleMs + cpuMs;
+  }
+  scanMs = 0;
+  waitMs = 0;
+  idleMs = 0;
+}
+
+/**
+  Charge a frame sent, its time on the air
+
+  @param dest the data budget destination
+  @param len the frame length (bytes)
+*/
+void Energy::frame(uint8_t dest, uint16_t len) {
+  nrg_count_t *c = &count[dest < BDG_DESTS ? nrgDest[dest] : NRG_OTHER];
+  uint32_t us = NRG_TXUS + (uint32_t)len * 8 / NRG_TXMBPS;
+  c->charge += (uint64_t)us * (NRG_TX_MA - NRG_RX_MA);
+  c->tx     += len;
+}
+
+/**
+  End a fix cycle and report what it took, since the previous one
+*/
+void Energy::cycle() {
+  close();
+  nrg_count_t cyc = {0, 0, 0, 0, 0};
+  for (uint8_t s = 0; s < NRG_SUBS; s++) {
+    cyc.charge += count[s].charge - last[s].charge;
+    cyc.radio  += count[s].radio  - last[s].radio;
+    cyc.scan   += count[s].scan   - last[s].scan;
+    cyc.cpu    += count[s].cpu    - last[s].cpu;
+    cyc.tx     += count[s].tx     - last[s].tx;
+  }
+  DLOG_P(NRG_CYC, uAh(cyc.charge),
+         uAh(count[NRG_SCAN].charge - last[NRG_SCAN].charge),
+         uAh(count[NRG_GEO].charge  - last[NRG_GEO].charge),
+         uAh(count[NRG_APRS].charge - last[NRG_APRS].charge),
+         cyc.radio, cyc.scan, cyc.cpu, cyc.tx);
+  memcpy(last, count, sizeof(last));
+}
+
+/**
+  Report the charge of each subsystem since the boot and start a new
+  period for the average currents
+*/
+void Energy::report() {
+  close();
+  DLOG_P(NRG_SUB, charge(NRG_BASE), charge(NRG_SCAN), charge(NRG_GEO), charge(NRG_APRS),
+         charge(NRG_NTP), charge(NRG_NMEA), charge(NRG_TILE), charge(NRG_DNS),
+         charge(NRG_BCN), charge(NRG_OTHER));
+  for (uint8_t s = 0; s < NRG_SUBS; s++)
+    past[s] = count[s].charge;
+  reported = millis();
+}
+
+/**
+  The charge since the boot
+
+  @return the charge (uAh)
+*/
+uint32_t Energy::charge() {
+  uint64_t nC = 0;
+  for (uint8_t s = 0; s < NRG_SUBS; s++)
+    nC += count[s].charge;
+  return uAh(nC);
+}
+
+/**
+  The charge of a subsystem since the boot
+
+  @param sub the subsystem
+  @return the charge (uAh)
+*/
+uint32_t Energy::charge(uint8_t sub) {
+  if (sub >= NRG_SUBS) return 0;
+  return uAh(count[sub].charge);
+}
+
+/**
+  The average current of a subsystem since the last report, the
+  stage in progress left out
+
+  @param sub the subsystem, NRG_SUBS for all
+  @return the current (uA)
+*/
+uint32_t Energy::current(uint8_t sub) {
+  uint32_t ms = mark - reported;
+  if (ms == 0) return 0;
+  uint64_t nC = 0;
+  for (uint8_t s = 0; s < NRG_SUBS; s++)
+    if (s == sub or sub == NRG_SUBS)
+      nC += count[s].charge - past[s];
+  // nC / ms = uA
+  return nC / ms;
+}
+
+/**
+  Convert a charge
+
+  @param nC the charge (nC)
+  @return the charge (uAh)
+*/
+uint32_t Energy::uAh(uint64_t nC) {
+  return (nC + 1800000ULL) / 3600000ULL;
+}
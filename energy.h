@@ -0,0 +1,112 @@
+/**
+  energy.h - Energy accounting, the charge drawn per subsystem
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  An estimate, not a measure: the time of the main loop is split by the
+  marks of the stall detector, each stage charged to a subsystem, and
+  each part of it at the current of what the chip was doing:
+
+    scan      the active scans                            NRG_SCAN_MA
+    radio     waiting for the network, listening          NRG_RX_MA
+    idle      the delays, the radio in modem sleep        NRG_IDLE_MA
+    cpu       the rest, running                           NRG_CPU_MA
+
+  The frames sent, from the link layer hooks of the data budget, are
+  on the air for their bytes at NRG_TXMBPS, plus NRG_TXUS each, at
+  NRG_TX_MA instead of NRG_RX_MA.  While listening for the beacons, the
+  radio is on all the time, the difference charged to the beacons.
+*/
+
+#ifndef ENERGY_H
+#define ENERGY_H
+
+#include "Arduino.h"
+#include "config.h"
+#include "beacons.h"
+
+// The subsystems
+enum nrg_sub_t {
+  NRG_BASE, NRG_SCAN, NRG_GEO, NRG_APRS, NRG_NTP, NRG_NMEA, NRG_TILE,
+  NRG_DNS, NRG_BCN, NRG_OTHER,
+  NRG_SUBS
+};
+
+// The current model (mA), an ESP8266 module at 3.3V, in modem sleep
+#ifndef NRG_IDLE_MA
+#define NRG_IDLE_MA   15
+#endif
+#ifndef NRG_CPU_MA
+#define NRG_CPU_MA    20
+#endif
+#ifndef NRG_RX_MA
+#define NRG_RX_MA     56
+#endif
+#ifndef NRG_SCAN_MA
+#define NRG_SCAN_MA   75
+#endif
+#ifndef NRG_TX_MA
+#define NRG_TX_MA     170
+#endif
+// The PHY rate (Mbps) and the overhead of a frame sent (us), preamble and ACK
+#ifndef NRG_TXMBPS
+#define NRG_TXMBPS    11
+#endif
+#ifndef NRG_TXUS
+#define NRG_TXUS      250
+#endif
+
+// The counts of a subsystem
+struct nrg_count_t {
+  uint64_t  charge;                   // nC, mA x us
+  uint32_t  radio;                    // Radio on, not scanning (ms)
+  uint32_t  scan;                     // Scanning (ms)
+  uint32_t  cpu;                      // Running, the radio off (ms)
+  uint32_t  tx;                       // Bytes sent
+};
+
+class Energy {
+  public:
+    Energy();
+    void      init();
+    void      setBeacons(Beacons *bcn);
+    void      stage(uint8_t stage);
+    void      enter(uint8_t call);
+    void      leave();
+    void      frame(uint8_t dest, uint16_t len);
+    void      cycle();
+    void      report();
+    uint32_t  charge();
+    uint32_t  charge(uint8_t sub);
+    uint32_t  current(uint8_t sub);
+    nrg_count_t count[NRG_SUBS];      // Since the boot
+  private:
+    void      close();
+    static uint32_t uAh(uint64_t nC);
+    Beacons  *beacons = NULL;
+    nrg_count_t last[NRG_SUBS];       // At the end of the last cycle
+    uint64_t  past[NRG_SUBS];         // The charge at the last report
+    unsigned long reported;           // The last report (ms)
+    unsigned long mark;               // The start of the stage (ms)
+    unsigned long callStart;
+    uint32_t  scanMs;                 // The parts of the stage so far (ms)
+    uint32_t  waitMs;
+    uint32_t  idleMs;
+    uint8_t   sub;                    // The subsystem of the stage
+    uint8_t   call;
+};
+
+#endif /* ENERGY_H */
@@ -0,0 +1,186 @@
+/**
+  gps.cpp - NMEA-0183 input from a serial GPS receiver
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "gps.h"
+
+GPS::GPS() {
+}
+
+/**
+  Read the sentences from a serial port
+
+  @param stream the serial port the receiver is connected to
+*/
+void GPS::init(Stream *stream) {
+  port = stream;
+  len  = 0;
+  sentences  = 0;
+  errors     = 0;
+  fix.valid  = false;
+  fix.hdop   = 0;
+  fix.knots  = 0;
+  fix.course = -1;
+  fix.sats   = 0;
+}
+
+/**
+  Feed one character received, parse the sentence when complete
+
+  @param c the character
+  @return true if the sentence updated the fix
+*/
+bool GPS::feed(char c) {
+  // A new sentence, drop any partial one
+  if (c == '$') {
+    line[0] = c;
+    len = 1;
+    return false;
+  }
+  // Wait for the start of a sentence
+  if (len == 0) return false;
+  if (c == '\r' or c == '\n') {
+    line[len] = '\0';
+    len = 0;
+    return parse();
+  }
+  if (len < GPS_LINELEN)
+    line[len++] = c;
+  else {
+    // Too long, some characters were lost
+    len = 0;
+    errors++;
+  }
+  return false;
+}
+
+/**
+  Read all the characters received since the last call
+*/
+void GPS::loop() {
+  if (port == NULL) return;
+  while (port->available() > 0)
+    feed(port->read());
+}
+
+/**
+  Convert a NMEA coordinate, degrees and minutes, to degrees
+
+  @param val the coordinate, as (d)ddmm.mmmm
+  @param hemi the hemisphere, N, S, E or W
+  @return the coordinate in signed degrees
+*/
+float GPS::coord(const char *val, const char *hemi) {
+  double v = atof(val);
+  int deg = (int)(v / 100);
+  v = deg + (v - deg * 100) / 60;
+  if (hemi[0] == 'S' or hemi[0] == 'W') v = -v;
+  return v;
+}
+
+/**
+  Parse a complete sentence: check the checksum, split the fields and
+  update the fix from GGA and RMC
+
+  @return true if the sentence updated the fix
+*/
+bool GPS::parse() {
+  // The checksum, XOR of all the characters between '$' and '*'
+  char *star = strrchr(line, '*');
+  if (star == NULL or strlen(star) < 3) {
+    errors++;
+    return false;
+  }
+  uint8_t ck = 0;
+  for (char *p = line + 1; p < star; p++)
+    ck ^= *p;
+  if (ck != strtol(star + 1, NULL, 16)) {
+    errors++;
+    return false;
+  }
+  *star = '\0';
+  // Split the fields in place, the first is the talker and the type
+  char *f[GPS_FIELDS];
+  uint8_t n = 0;
+  char *p = line + 1;
+  f[n++] = p;
+  while (n < GPS_FIELDS and (p = strchr(p, ',')) != NULL) {
+    *p++ = '\0';
+    f[n++] = p;
+  }
+  if (strlen(f[0]) != 5) return false;
+  sentences++;
+  const char *type = f[0] + 2;
+  if (strcmp_P(type, PSTR("GGA")) == 0 and n >= 9) {
+    // Time, position, quality, satellites, HDOP
+    if (atoi(f[6]) == 0 or f[2][0] == '\0') {
+      fix.valid = false;
+      return false;
+    }
+    fix.lat  = coord(f[2], f[3]);
+    fix.lng  = coord(f[4], f[5]);
+    fix.sats = atoi(f[7]);
+    fix.hdop = atof(f[8]);
+  }
+  else if (strcmp_P(type, PSTR("RMC")) == 0 and n >= 9) {
+    // Time, status, position, speed, course
+    if (f[2][0] != 'A' or f[3][0] == '\0') {
+      fix.valid = false;
+      return false;
+    }
+    fix.lat    = coord(f[3], f[4]);
+    fix.lng    = coord(f[5], f[6]);
+    fix.knots  = atof(f[7]);
+    fix.course = f[8][0] != '\0' ? atoi(f[8]) : -1;
+  }
+  else
+    return false;
+  fix.valid = true;
+  fix.uptm  = millis();
+  return true;
+}
+
+/**
+  Check the fix is valid and fresh
+
+  @param maxAge the oldest fix to use (ms)
+  @return true if the fix can be used
+*/
+bool GPS::valid(unsigned long maxAge) {
+  return fix.valid and millis() - fix.uptm < maxAge;
+}
+
+/**
+  The fix accuracy, estimated from the HDOP
+
+  @return the accuracy (m)
+*/
+int GPS::accuracy() {
+  if (fix.hdop <= 0) return GPS_MAXACC;
+  return (int)(fix.hdop * GPS_UERE + 0.5);
+}
+
+/**
+  Check the fix is good enough to be used instead of the WiFi geolocation
+
+  @return true if fresh and accurate
+*/
+bool GPS::good() {
+  return valid() and accuracy() <= GPS_MAXACC;
+}
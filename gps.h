@@ -0,0 +1,82 @@
+/**
+  gps.h - NMEA-0183 input from a serial GPS receiver
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  The GGA and RMC sentences of any talker are read from a serial port,
+  validated by their checksum, and kept as the last fix.  The accuracy is
+  estimated from the horizontal dilution of precision.  The fix is usable
+  only while it is fresh, so the WiFi geolocation takes over as soon as
+  the receiver loses the sky, indoors.
+*/
+
+#ifndef GPS_H
+#define GPS_H
+
+#include "Arduino.h"
+#include "config.h"
+
+// The longest sentence, with the line ending
+#define GPS_LINELEN   83
+// The most fields in a sentence
+#define GPS_FIELDS    20
+// The serial receive buffer (bytes), about 2s at 9600 bps, a scan
+#ifndef GPS_RXBUF
+#define GPS_RXBUF     2048
+#endif
+// Use a fix this old (ms) at most
+#define GPS_MAXAGE    3000
+// User equivalent range error (m), times the HDOP for the accuracy
+#define GPS_UERE      5
+// Use the GPS instead of the WiFi with this accuracy (m) or better
+#ifndef GPS_MAXACC
+#define GPS_MAXACC    30
+#endif
+// Label the scanned APs with this accuracy (m) or better
+#define GPS_LABELACC  15
+
+struct gps_fix_t {
+  float         lat;
+  float         lng;
+  float         hdop;                 // 0 if unknown
+  float         knots;
+  int           course;               // Negative if unknown
+  uint8_t       sats;
+  bool          valid;
+  unsigned long uptm;                 // The internal time of the fix
+};
+
+class GPS {
+  public:
+    GPS();
+    void  init(Stream *port);
+    bool  feed(char c);
+    void  loop();
+    bool  valid(unsigned long maxAge = GPS_MAXAGE);
+    int   accuracy();
+    bool  good();
+    gps_fix_t     fix;
+    unsigned long sentences;          // Valid sentences
+    unsigned long errors;             // Bad checksums and overruns
+  private:
+    bool  parse();
+    float coord(const char *val, const char *hemi);
+    Stream *port = NULL;
+    char    line[GPS_LINELEN + 1];
+    uint8_t len;
+};
+
+#endif /* GPS_H */
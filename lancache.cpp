@@ -0,0 +1,224 @@
+/**
+  lancache.cpp - LAN geolocation cache, a peer or a gateway resolver
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "lancache.h"
+#include "stall.h"
+#include "dlog.h"
+
+LANCache::LANCache() {
+}
+
+/**
+  Open the socket, and answer the peers from the own fixes
+
+  @param serve answer the peers, and advertise the service
+*/
+void LANCache::init(bool serve) {
+  udp.begin(LAN_PORT);
+  serving = serve;
+  if (serving) MDNS.addService(LAN_SERVICE, "udp", LAN_PORT);
+}
+
+/**
+  Use a resolver on the LAN, instead of looking for one
+
+  @param ip the resolver address
+  @param port the resolver port
+*/
+void LANCache::setServer(IPAddress ip, uint16_t port) {
+  server     = ip;
+  this->port = port;
+  fixed      = true;
+}
+
+/**
+  Answer the peers and look for a resolver, between the fixes
+*/
+void LANCache::loop() {
+  int len;
+  while ((len = udp.parsePacket()) > 0) {
+    uint8_t msg[LAN_MSGLEN];
+    len = udp.read(msg, sizeof(msg));
+    if (serving) answer(msg, len);
+  }
+  if (port == 0 and not fixed and millis() / 1000 >= nextDiscover) discover();
+}
+
+/**
+  Look for a resolver by mDNS, this blocks for about a second
+*/
+void LANCache::discover() {
+  nextDiscover = millis() / 1000 + LAN_DISCOVER;
+  int found = STALL_CALL(STALL_LOOKUP, MDNS.queryService(LAN_SERVICE, "udp"));
+  for (int i = 0; i < found; i++) {
+    // Not the own service
+    if ((uint32_t)MDNS.IP(i) == (uint32_t)WiFi.localIP()) continue;
+    server = MDNS.IP(i);
+    port   = MDNS.port(i);
+    fails  = 0;
+    DLOG_P(LAN_SRV, server[0], server[1], server[2], server[3], port);
+    break;
+  }
+}
+
+/**
+  Start the fingerprint of a new fix
+*/
+void LANCache::begin() {
+  count = 0;
+}
+
+/**
+  Add an AP to the fingerprint
+
+  @param bssid the AP BSSID
+  @param rssi the AP RSSI (dBm)
+*/
+void LANCache::add(const uint8_t *bssid, int8_t rssi) {
+  if (count >= LAN_APS) return;
+  memcpy(aps[count].bssid, bssid, WL_MAC_ADDR_LENGTH);
+  aps[count].rssi = rssi;
+  count++;
+}
+
+/**
+  Ask the resolver for a fix of the fingerprint
+
+  @param lat the latitude, if found
+  @param lng the longitude, if found
+  @return the accuracy, or -1 if not found
+*/
+int LANCache::lookup(float *lat, float *lng) {
+  if (port == 0 or count == 0) return -1;
+  if (not send(LAN_QUERY, NULL)) return -1;
+  queries++;
+  unsigned long start = millis();
+  while (millis() - start < LAN_TIMEOUT) {
+    int len = udp.parsePacket();
+    if (len <= 0) {
+      stall.wait(5);
+      continue;
+    }
+    uint8_t msg[LAN_MSGLEN];
+    len = udp.read(msg, sizeof(msg));
+    lan_hdr_t hdr;
+    if (len < (int)sizeof(hdr)) continue;
+    memcpy(&hdr, msg, sizeof(hdr));
+    if (hdr.magic != LAN_MAGIC) continue;
+    // A peer asking meanwhile
+    if (hdr.op == LAN_QUERY) {
+      if (serving) answer(msg, len);
+      continue;
+    }
+    // A late answer, to an older query
+    if (hdr.seq != seq) continue;
+    fails = 0;
+    if (hdr.op != LAN_FIX or len < (int)(sizeof(hdr) + sizeof(lan_fix_t))) return -1;
+    lan_fix_t fix;
+    memcpy(&fix, msg + sizeof(hdr), sizeof(fix));
+    *lat = fix.lat / 1e7;
+    *lng = fix.lng / 1e7;
+    hits++;
+    DLOG_P(LAN_FIX, fix.acc, fix.age);
+    return fix.acc;
+  }
+  // No answer, look for another resolver after a few
+  if (++fails >= LAN_FAILS and not fixed) {
+    DLOG_P(LAN_LOST, server[0], server[1], server[2], server[3]);
+    port = 0;
+    nextDiscover = millis() / 1000;
+  }
+  return -1;
+}
+
+/**
+  Keep a fix from the server, for the peers, and store it at the resolver
+
+  @param lat the latitude
+  @param lng the longitude
+  @param acc the accuracy
+*/
+void LANCache::store(float lat, float lng, int acc) {
+  if (count == 0 or acc < 0) return;
+  own.lat = lround(lat * 1e7);
+  own.lng = lround(lng * 1e7);
+  own.acc = acc;
+  own.age = 0;
+  memcpy(ownAps, aps, count * sizeof(lan_ap_t));
+  ownCount = count;
+  ownTime  = millis();
+  if (port != 0) send(LAN_STORE, &own);
+}
+
+/**
+  Send the fingerprint to the resolver, with a fix or not
+
+  @param op the message type
+  @param fix the fix, NULL if none
+  @return true if sent
+*/
+bool LANCache::send(uint8_t op, const lan_fix_t *fix) {
+  uint8_t msg[LAN_MSGLEN];
+  lan_hdr_t hdr = {LAN_MAGIC, op, count, ++seq};
+  size_t len = 0;
+  memcpy(msg, &hdr, sizeof(hdr));
+  len += sizeof(hdr);
+  if (fix != NULL) {
+    memcpy(msg + len, fix, sizeof(lan_fix_t));
+    len += sizeof(lan_fix_t);
+  }
+  memcpy(msg + len, aps, count * sizeof(lan_ap_t));
+  len += count * sizeof(lan_ap_t);
+  return udp.beginPacket(server, port) and
+         udp.write(msg, len) == len and
+         udp.endPacket();
+}
+
+/**
+  Answer a peer query from the own last fix, if it shares enough APs
+*/
+void LANCache::answer(const uint8_t *msg, int len) {
+  lan_hdr_t hdr;
+  if (len < (int)sizeof(hdr)) return;
+  memcpy(&hdr, msg, sizeof(hdr));
+  if (hdr.magic != LAN_MAGIC or hdr.op != LAN_QUERY or hdr.count == 0 or
+      len < (int)(sizeof(hdr) + hdr.count * sizeof(lan_ap_t))) return;
+  const lan_ap_t *query = (const lan_ap_t*)(msg + sizeof(hdr));
+  int same = 0;
+  for (int i = 0; i < hdr.count; i++)
+    for (int j = 0; j < ownCount; j++)
+      if (memcmp(query[i].bssid, ownAps[j].bssid, WL_MAC_ADDR_LENGTH) == 0) {
+        same++;
+        break;
+      }
+  unsigned long age = (millis() - ownTime) / 1000;
+  bool hit = ownCount > 0 and age <= LAN_MAXAGE and same * 100 >= hdr.count * LAN_SAMEPCT;
+  uint8_t rsp[sizeof(lan_hdr_t) + sizeof(lan_fix_t)];
+  lan_hdr_t rhdr = {LAN_MAGIC, (uint8_t)(hit ? LAN_FIX : LAN_MISS), 0, hdr.seq};
+  memcpy(rsp, &rhdr, sizeof(rhdr));
+  if (hit) {
+    lan_fix_t fix = own;
+    fix.age = age;
+    memcpy(rsp + sizeof(rhdr), &fix, sizeof(fix));
+  }
+  udp.beginPacket(udp.remoteIP(), udp.remotePort());
+  udp.write(rsp, hit ? sizeof(rsp) : sizeof(rhdr));
+  udp.endPacket();
+}
@@ -0,0 +1,78 @@
+/**
+  lancache.h - LAN geolocation cache, a peer or a gateway resolver
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  The trackers in the same building or depot hear the same APs.  Before
+  asking the geolocation server, the fingerprint is looked up on the LAN,
+  at the resolver found by mDNS, or configured: the host cache service
+  or a peer tracker.  The fixes from the server are stored back.  A
+  peer answers from its own last fix from the server.
+*/
+
+#ifndef LANCACHE_H
+#define LANCACHE_H
+
+#include "Arduino.h"
+#include <ESP8266WiFi.h>
+#include <ESP8266mDNS.h>
+#include <WiFiUdp.h>
+#include "lanmsg.h"
+
+// Wait this long for the answer (ms)
+#define LAN_TIMEOUT   250
+// Look for a resolver again after this long (s)
+#define LAN_DISCOVER  600
+// Forget the resolver after this many queries without an answer
+#define LAN_FAILS     3
+// Answer the peers from the own fix up to this old (s)
+#define LAN_MAXAGE    3600
+
+class LANCache {
+  public:
+    LANCache();
+    void  init(bool serve = false);
+    void  setServer(IPAddress ip, uint16_t port = LAN_PORT);
+    void  loop();
+    void  begin();
+    void  add(const uint8_t *bssid, int8_t rssi);
+    int   lookup(float *lat, float *lng);
+    void  store(float lat, float lng, int acc);
+    unsigned long queries = 0;        // Queries sent
+    unsigned long hits    = 0;        // Answered with a fix
+  private:
+    void  discover();
+    void  answer(const uint8_t *msg, int len);
+    bool  send(uint8_t op, const lan_fix_t *fix);
+    WiFiUDP   udp;
+    IPAddress server;
+    uint16_t  port    = 0;            // The resolver port, none if zero
+    bool      fixed   = false;        // Configured, not discovered
+    bool      serving = false;        // Answering the peers
+    unsigned long nextDiscover = 0;   // Next time to look for a resolver (s)
+    uint8_t   fails   = 0;
+    uint16_t  seq     = 0;
+    // The fingerprint of the current fix
+    lan_ap_t  aps[LAN_APS];
+    uint8_t   count   = 0;
+    // The last fix from the server, for the peers
+    lan_ap_t  ownAps[LAN_APS];
+    uint8_t   ownCount = 0;
+    lan_fix_t own;
+    unsigned long ownTime;
+};
+
+#endif /* LANCACHE_H */
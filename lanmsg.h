@@ -0,0 +1,72 @@
+/**
+  lanmsg.h - LAN geolocation cache messages
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  The datagrams between the trackers and a LAN resolver, a peer tracker
+  or the host cache service (tools/geocache), shared by both sides.  All
+  in UDP, little endian as both the ESP8266 and the hosts are:
+
+    query   header, the APs                   tracker -> resolver
+    store   header, the fix, the APs          tracker -> resolver
+    fix     header, the fix                   resolver -> tracker
+    miss    header                            resolver -> tracker
+
+  The resolver answers with the fix of a fingerprint sharing at least
+  LAN_SAMEPCT of the APs of the query.
+*/
+
+#ifndef LANMSG_H
+#define LANMSG_H
+
+#include <stdint.h>
+
+// The UDP port and the mDNS service, _wipsgeo._udp
+#define LAN_PORT      10111
+#define LAN_SERVICE   "wipsgeo"
+// "WGC1"
+#define LAN_MAGIC     0x31434757UL
+// The most APs in a message
+#define LAN_APS       32
+// The share of the query APs a cached fingerprint needs (%)
+#define LAN_SAMEPCT   60
+
+// The message types
+enum lan_op_t {LAN_QUERY, LAN_STORE, LAN_FIX, LAN_MISS};
+
+struct __attribute__((packed)) lan_hdr_t {
+  uint32_t  magic;
+  uint8_t   op;
+  uint8_t   count;                    // APs following
+  uint16_t  seq;                      // Copied in the answer
+};
+
+struct __attribute__((packed)) lan_fix_t {
+  int32_t   lat;                      // 1e-7 degrees
+  int32_t   lng;                      // 1e-7 degrees
+  uint16_t  acc;                      // m
+  uint16_t  age;                      // s since the fix, in the answers
+};
+
+struct __attribute__((packed)) lan_ap_t {
+  uint8_t   bssid[6];
+  int8_t    rssi;
+};
+
+// The longest message, a store
+#define LAN_MSGLEN    (sizeof(lan_hdr_t) + sizeof(lan_fix_t) + LAN_APS * sizeof(lan_ap_t))
+
+#endif /* LANMSG_H */
@@ -0,0 +1,132 @@
+/**
+  link.cpp - Uplink quality, the round trip and loss of each destination
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "link.h"
+#include "dlog.h"
+
+// The timeout limits of each destination (ms)
+struct lnk_conf_t {
+  uint16_t  dflt;                     // Before the first exchange
+  uint16_t  min;
+  uint16_t  max;
+};
+static const lnk_conf_t lnkConf[LNK_DESTS] = {
+  {15000, 5000, 30000},               // The association
+  { 5000, 1500, 15000},               // The TLS handshake
+  { 5000, 1000, 15000},               // The TCP handshake
+  { 2250,  450,  6000},               // The request and its answer
+  { 5000, 1500, 15000},               // The TCP handshake
+};
+
+Link::Link() {
+}
+
+/**
+  Start with nothing known
+*/
+void Link::init() {
+  memset(est, 0, sizeof(est));
+}
+
+/**
+  An exchange completed
+
+  @param dest the destination
+  @param ms the time it took
+*/
+void Link::sample(uint8_t dest, unsigned long ms) {
+  if (dest >= LNK_DESTS) return;
+  lnk_est_t *e = &est[dest];
+  if (not e->known) {
+    e->srtt   = ms;
+    e->rttvar = ms / 2;
+    e->known  = true;
+  }
+  else {
+    uint32_t dev = ms > e->srtt ? ms - e->srtt : e->srtt - ms;
+    e->rttvar = e->rttvar - (e->rttvar >> 2) + (dev >> 2);
+    e->srtt   = e->srtt - (e->srtt >> 3) + (ms >> 3);
+  }
+  e->loss -= e->loss >> 4;
+  e->fails = 0;
+}
+
+/**
+  An exchange failed, timed out or refused
+
+  @param dest the destination
+*/
+void Link::lost(uint8_t dest) {
+  if (dest >= LNK_DESTS) return;
+  lnk_est_t *e = &est[dest];
+  e->loss += (65535 - e->loss) >> 4;
+  if (e->fails < 255) e->fails++;
+  DLOG_P(LNK_LOST, dest, e->fails, timeout(dest), loss(dest));
+}
+
+/**
+  The timeout of the next exchange
+
+  @param dest the destination
+  @return the timeout (ms)
+*/
+unsigned long Link::timeout(uint8_t dest) {
+  if (dest >= LNK_DESTS) return 0;
+  const lnk_est_t *e = &est[dest];
+  unsigned long rto = e->known ? e->srtt + LNK_K * e->rttvar : lnkConf[dest].dflt;
+  if (rto < lnkConf[dest].min) rto = lnkConf[dest].min;
+  // Back off, the link got worse
+  rto <<= e->fails < LNK_BACKOFF ? e->fails : LNK_BACKOFF;
+  if (rto > lnkConf[dest].max) rto = lnkConf[dest].max;
+  return rto;
+}
+
+/**
+  The retries of an exchange, more on a lossy link
+
+  @param dest the destination
+  @return the retries, 0 for one try
+*/
+uint8_t Link::retries(uint8_t dest) {
+  uint8_t pct = loss(dest);
+  if (pct < LNK_RETRYLOSS) return 0;
+  if (pct < LNK_LOSSY)     return 1;
+  return LNK_RETRIES;
+}
+
+/**
+  The loss rate
+
+  @param dest the destination
+  @return the loss rate (%)
+*/
+uint8_t Link::loss(uint8_t dest) {
+  if (dest >= LNK_DESTS) return 0;
+  return ((uint32_t)est[dest].loss * 100 + 32768) >> 16;
+}
+
+/**
+  Check if the exchanges with the servers are often lost
+
+  @return true if lossy
+*/
+bool Link::lossy() {
+  return loss(LNK_GEO) >= LNK_LOSSY or loss(LNK_APRS) >= LNK_LOSSY;
+}
@@ -0,0 +1,67 @@
+/**
+  link.h - Uplink quality, the round trip and loss of each destination
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  The time of each completed exchange (the association, a handshake, a
+  request and its answer) is smoothed as TCP does with its round trip
+  (RFC 6298), and the failed ones make a loss rate.  The timeout of the
+  next exchange is the smoothed time plus four deviations, doubled after
+  each failure in a row, within the limits of the destination.  Before
+  the first exchange, the timeouts are the fixed ones of old.
+*/
+
+#ifndef LINK_H
+#define LINK_H
+
+#include "Arduino.h"
+
+// The destinations, each its own exchange
+enum lnk_dest_t {LNK_WIFI, LNK_GEO, LNK_APRS, LNK_NTP, LNK_TILE, LNK_DESTS};
+
+// The timeout is the smoothed time plus this many deviations
+#define LNK_K         4
+// Double the timeout at most this many times, after failures in a row
+#define LNK_BACKOFF   3
+// The loss rate (%) to retry at, and to call the link lossy at
+#define LNK_RETRYLOSS 10
+#define LNK_LOSSY     25
+// Retry an exchange at most this many times
+#define LNK_RETRIES   2
+
+// The estimate for a destination
+struct lnk_est_t {
+  uint32_t  srtt;                     // Smoothed exchange time (ms)
+  uint32_t  rttvar;                   // Its mean deviation (ms)
+  uint16_t  loss;                     // Loss rate, 1/65536
+  uint8_t   fails;                    // Failures in a row
+  bool      known;                    // Any exchange completed
+};
+
+class Link {
+  public:
+    Link();
+    void          init();
+    void          sample(uint8_t dest, unsigned long ms);
+    void          lost(uint8_t dest);
+    unsigned long timeout(uint8_t dest);
+    uint8_t       retries(uint8_t dest);
+    uint8_t       loss(uint8_t dest);
+    bool          lossy();
+    lnk_est_t     est[LNK_DESTS];
+};
+
+#endif /* LINK_H */
@@ -19,15 +19,88 @@
 
 #include "Arduino.h"
 #include "mls.h"
+#include "stall.h"
+#include "dlog.h"
 
 MLS::MLS() {
 }
 
-void MLS::init() {
+/**
+  Use the shared TLS context for the geolocation requests
+
+  @param ctx the TLS context
+*/
+void MLS::init(TLS *ctx) {
+  tls = ctx;
+}
+
+/**
+  Try the offline AP database before asking the geolocation server
+
+  @param db the tile database
+*/
+void MLS::setTiles(Tiles *db) {
+  tiles = db;
+}
+
+/**
+  Use the APs heard passively, scan only when they are too few
+
+  @param bcn the passive AP collector
+*/
+void MLS::setBeacons(Beacons *bcn) {
+  beacons = bcn;
+}
+
+/**
+  Use the GPS fixes while good, and label the scanned APs with them
+
+  @param rcv the GPS receiver
+*/
+void MLS::setGPS(GPS *rcv) {
+  gps = rcv;
+}
+
+/**
+  Reuse the fixes and stop asking the server as the data budget runs out
+
+  @param bdg the data budget
+*/
+void MLS::setBudget(Budget *bdg) {
+  budget = bdg;
 }
 
 /**
-  Scan the WiFi networks and store them in an array of structs
+  Time the exchanges with the server, the timeouts and the retries
+  follow the uplink quality
+
+  @param lnk the uplink quality estimator
+*/
+void MLS::setLink(Link *lnk) {
+  link = lnk;
+}
+
+/**
+  Ask the LAN resolver before the server, and store the server fixes there
+
+  @param lc the LAN cache
+*/
+void MLS::setLAN(LANCache *lc) {
+  lan = lc;
+}
+
+/**
+  Record the scans and the exchanges with the server
+
+  @param trc the I/O trace
+*/
+void MLS::setTrace(Trace *trc) {
+  trace = trc;
+}
+
+/**
+  Scan the WiFi networks and store them in an array of structs.  With
+  the passive collector, use the APs it heard instead, if enough.
 
   @return the number of networks found
 */
@@ -35,13 +108,61 @@ int MLS::wifiScan(bool sort) {
   // Keep the AP BSSID
   uint8_t apBSSID[WL_MAC_ADDR_LENGTH];
   memcpy(apBSSID, WiFi.BSSID(), WL_MAC_ADDR_LENGTH);
+  int scanCount = 0, storeCount = 0;
+  // Decide on the GPS once, before the scan, the fix may get old during it
+  gpsGood = gps != NULL and gps->good();
+  if (gpsGood) {
+    gpsFix = gps->fix;
+    gpsAcc = gps->accuracy();
+  }
+  // A good GPS fix, scan only if there is a database to label the APs in
+  if (gpsGood and tiles == NULL) {
+    netCount = 0;
+    return netCount;
+  }
+  // The APs heard recently, and not too far away
+  if (beacons != NULL) {
+    unsigned long maxAge = BCN_MAXAGE * 1000UL;
+    if (speed > 0 and BCN_MAXDIST * 1000.0 / speed < maxAge)
+      maxAge = BCN_MAXDIST * 1000.0 / speed;
+    bcn_ap_t list[MAXNETS];
+    uint8_t count = beacons->collect(list, MAXNETS, maxAge);
+    for (uint8_t i = 0; i < count; i++)
+      if (memcmp(list[i].bssid, apBSSID, WL_MAC_ADDR_LENGTH) != 0) {
+        memcpy(nets[storeCount].bssid, list[i].bssid, WL_MAC_ADDR_LENGTH);
+        nets[storeCount].rssi = list[i].rssi;
+        storeCount++;
+      }
+    // Enough, and already sorted
+    if (storeCount >= BCN_MINAPS) {
+      netCount = storeCount;
+      DLOG_P(BCN_USE, netCount, maxAge / 1000);
+      return netCount;
+    }
+    storeCount = 0;
+  }
   // Scan
-  netCount = WiFi.scanNetworks();
+  unsigned long scanStart = millis();
+  netCount = STALL_CALL(STALL_WSCAN, WiFi.scanNetworks());
+  // Record the scan as it is, the AP too
+  if (trace != NULL) {
+    trc_ap_t aps[TRC_APS];
+    trc_scan_t scan = {(uint16_t)(millis() - scanStart), 0, 0};
+    for (int i = 0; i < netCount and scan.count < TRC_APS; i++, scan.count++) {
+      memcpy(aps[i].bssid, WiFi.BSSID(i), WL_MAC_ADDR_LENGTH);
+      aps[i].rssi    = (int8_t)(WiFi.RSSI(i));
+      aps[i].channel = WiFi.channel(i);
+    }
+    trace->record(TRC_SCAN, 0, &scan, sizeof(scan), aps, scan.count * sizeof(trc_ap_t));
+  }
   // Keep only BSSID and RSSI
-  int scanCount = 0, storeCount = 0;
   // Only if there are any networks found
   if (netCount > 0) {
     // Limit to a maximum
+    // Keep them all in the passive table too
+    if (beacons != NULL)
+      for (int i = 0; i < netCount; i++)
+        beacons->add(WiFi.BSSID(i), WiFi.RSSI(i), WiFi.channel(i));
     while (storeCount < MAXNETS and scanCount < netCount) {
       // Exclude the AP BSSID from the list
       if (memcmp(WiFi.BSSID(scanCount), apBSSID, WL_MAC_ADDR_LENGTH) != 0) {
@@ -59,8 +180,8 @@ int MLS::wifiScan(bool sort) {
   if (sort) {
     // Sort the networks by RSSI, descending
     BSSID_RSSI tmp;
-    for (size_t i = 1; i < netCount; i++) {
-      for (size_t j = i; j > 0 && (nets[j - 1].rssi < nets[j].rssi); j--) {
+    for (int i = 1; i < netCount; i++) {
+      for (int j = i; j > 0 && (nets[j - 1].rssi < nets[j].rssi); j--) {
         memcpy(tmp.bssid, nets[j - 1].bssid, WL_MAC_ADDR_LENGTH);
         tmp.rssi = nets[j - 1].rssi;
         memcpy(nets[j - 1].bssid, nets[j].bssid, WL_MAC_ADDR_LENGTH);
@@ -85,18 +206,65 @@ int MLS::geoLocation() {
   float lat = 0.0;
   float lng = 0.0;
 
-  // Create the secure WiFi
-  WiFiClientSecure geoClient;
-  geoClient.setTimeout(5000);
-  geoClient.setInsecure();
+  // A good GPS fix first, as taken before the scan, no need to ask
+  if (gpsGood) {
+    acc = gpsAcc;
+    // Label the APs heard here
+    if (tiles != NULL and acc <= GPS_LABELACC)
+      for (int i = 0; i < netCount; i++)
+        tiles->learn(gpsFix.lat, gpsFix.lng, nets[i].bssid, nets[i].rssi);
+    setCurrent(gpsFix.lat, gpsFix.lng, gpsFix.uptm);
+    DLOG_P(GPS_FIX, gpsFix.sats, acc);
+    return acc;
+  }
+
+  // Try the tiles around the last fix first
+  if (tiles != NULL and current.valid) {
+    acc = localLocation(current.latitude, current.longitude);
+    if (acc >= 0) return acc;
+  }
+
+  // Near the data budget, reuse the last fix if the APs are the same
+  if (budget != NULL and budget->level() != BDG_OK) {
+    acc = cachedLocation();
+    if (acc >= 0) return acc;
+  }
+
+  // Ask the LAN resolver, some tracker around may have asked already
+  if (lan != NULL) {
+    acc = lanLocation();
+    if (acc >= 0) return acc;
+  }
+
+  // Over the data budget, do not ask the server at all
+  if (budget != NULL and budget->level() == BDG_OUT) {
+    current.valid = false;
+    return acc;
+  }
 
-  // Try to connect
-  if (geoClient.connect(geoServer, geoPort)) {
+  // Try to connect, again on a lossy link
+  WiFiClientSecure &geoClient = tls->client;
+  bool conn = false;
+  unsigned long connStart = millis(), rspStart = 0, rspWait = 0;
+  uint8_t tries = link != NULL ? 1 + link->retries(LNK_GEO) : 1;
+  uint8_t i = 0;
+  for (; i < tries and not conn; i++) {
+    unsigned long start = millis();
+    conn = tls->connect(geoServer, geoPort, link != NULL ? link->timeout(LNK_GEO) : 5000);
+    // The name is still being looked up, not a loss, try on the next cycle
+    if (not conn and tls->resolving) break;
+    if (link != NULL) {
+      if (conn) link->sample(LNK_GEO, millis() - start);
+      else      link->lost(LNK_GEO);
+    }
+  }
+  if (conn) {
     // Local buffer
     const int bufSize = 250;
     char buf[bufSize] = "";
     // Keep the internal time
     unsigned long now = millis();
+    rspStart = now;
 
     // The geolocation request header
     strcpy_P(buf, geoPOST);
@@ -147,7 +315,7 @@ int MLS::geoLocation() {
     geoClient.print(buf);
     //Serial.print(buf);
     // One line per network
-    for (size_t i = 0; i < netCount; ++i) {
+    for (int i = 0; i < netCount; ++i) {
       char sbuf[4] = "";
       // Open line
       strcpy_P(buf, PSTR("{\"macAddress\": \""));
@@ -179,51 +347,52 @@ int MLS::geoLocation() {
     // Get the geolocation response
     //Serial.println();
     while (geoClient.connected()) {
-      int rlen = geoClient.readBytesUntil('\r', buf, bufSize);
+      int rlen = STALL_CALL(STALL_READ, geoClient.readBytesUntil('\r', buf, bufSize));
       buf[rlen] = '\0';
       //Serial.print(buf);
       if (rlen == 1) break;
     }
+    rspWait = millis() - now;
 
     // Parse the result
     while (geoClient.connected()) {
-      int rlen = geoClient.readBytesUntil(':', buf, bufSize);
+      int rlen = STALL_CALL(STALL_READ, geoClient.readBytesUntil(':', buf, bufSize));
       buf[rlen] = '\0';
-      if      (strstr_P(buf, PSTR("\"lat\"")))      lat = geoClient.parseFloat();
-      else if (strstr_P(buf, PSTR("\"lng\"")))      lng = geoClient.parseFloat();
-      else if (strstr_P(buf, PSTR("\"accuracy\""))) acc = geoClient.parseInt();
-      else if (strstr_P(buf, PSTR("\"code\"")))     err = geoClient.parseInt();
+      if      (strstr_P(buf, PSTR("\"lat\"")))      lat = STALL_CALL(STALL_PARSE, geoClient.parseFloat());
+      else if (strstr_P(buf, PSTR("\"lng\"")))      lng = STALL_CALL(STALL_PARSE, geoClient.parseFloat());
+      else if (strstr_P(buf, PSTR("\"accuracy\""))) acc = STALL_CALL(STALL_PARSE, geoClient.parseInt());
+      else if (strstr_P(buf, PSTR("\"code\"")))     err = STALL_CALL(STALL_PARSE, geoClient.parseInt());
     }
     //Serial.println();
 
-    // Close the connection
-    geoClient.stop();
-
-    // Check if previous valid coordinates are too old (over one hour) and invalidate them
-    if (now - previous.uptm > 3600000UL) previous.valid = false;
-
     // Check the data
     if (acc >= 0 and acc <= GEO_MAXACC) {
-      if (current.valid) {
-        // Store previous coordinates
-        previous.valid      = current.valid;
-        previous.latitude   = current.latitude;
-        previous.longitude  = current.longitude;
-        previous.uptm       = current.uptm;
-      }
-      // Store new coordinates
-      current.valid     = true;
-      current.latitude  = lat;
-      current.longitude = lng;
-      current.uptm      = now;
-      // Get the locator
-      getLocator(current.latitude, current.longitude);
+      setCurrent(lat, lng, now);
+      // Keep the APs, to know the place again
+      for (int i = 0; i < netCount; i++)
+        memcpy(fixNets[i], nets[i].bssid, WL_MAC_ADDR_LENGTH);
+      fixCount = netCount;
+      fixAcc   = acc;
+      fixLat   = lat;
+      fixLng   = lng;
+      if (lan != NULL) lan->store(lat, lng, acc);
     }
     else {
       // No current valid coordinates
       current.valid     = false;
     }
   }
+  // Close the connection
+  tls->stop();
+
+  // Record the exchange, with the APs asked for
+  if (trace != NULL) {
+    trc_geo_t geo = {(uint16_t)((conn ? rspStart : millis()) - connStart),
+                     (uint16_t)(conn ? millis() - rspStart : 0), (uint16_t)rspWait,
+                     (int32_t)lround(lat * 1e7), (int32_t)lround(lng * 1e7),
+                     (int16_t)acc, (int16_t)(err > 0 ? err : 0), i, (uint8_t)netCount};
+    trace->record(TRC_GEO, conn ? TRC_OK : 0, &geo, sizeof(geo), nets, netCount * sizeof(trc_net_t));
+  }
 
   // Check the error and return it as negative accuracy
   if (err > 0) acc = -err;
@@ -232,6 +401,106 @@ int MLS::geoLocation() {
   return acc;
 }
 
+/**
+  Geolocation from the offline AP database: the centroid of the APs found,
+  weighted by the signal strength
+
+  @param lat the latitude to look around
+  @param lng the longitude to look around
+  @return the geolocation accuracy, negative if there are too few APs
+*/
+int MLS::localLocation(float lat, float lng) {
+  tile_query_t query[MAXNETS];
+  for (int i = 0; i < netCount; i++)
+    query[i].bssid = nets[i].bssid;
+  int found = tiles->lookup(lat, lng, query, netCount);
+  if (found < TILE_MINAPS) return -1;
+  // Weighted centroid, relative to the search position
+  float kx = 111194.93 * cos(radians(lat));
+  float sw = 0, sx = 0, sy = 0, sxx = 0, syy = 0;
+  for (int i = 0; i < netCount; i++) {
+    if (not query[i].found) continue;
+    float w = pow(10.0, nets[i].rssi / 20.0);
+    float x = (query[i].lng - lng) * kx;
+    float y = (query[i].lat - lat) * 111194.93;
+    sw  += w;
+    sx  += w * x;
+    sy  += w * y;
+    sxx += w * x * x;
+    syy += w * y * y;
+  }
+  float x = sx / sw, y = sy / sw;
+  // The spread of the APs, plus the uncertainty of their positions
+  int acc = (int)(sqrt(fabs(sxx / sw - x * x) + fabs(syy / sw - y * y))) + TILE_APACC;
+  if (acc > GEO_MAXACC) return -1;
+  setCurrent(lat + y / 111194.93, lng + x / kx, millis());
+  DLOG_P(TILE_FIX, found, acc);
+  return acc;
+}
+
+/**
+  Reuse the last fix from the server if most of the APs are the same,
+  the tracker is still there
+
+  @return the accuracy of the last fix, negative if the place changed
+*/
+int MLS::cachedLocation() {
+  if (fixCount == 0 or netCount == 0) return -1;
+  int same = 0;
+  for (int i = 0; i < netCount; i++)
+    for (int j = 0; j < fixCount; j++)
+      if (memcmp(nets[i].bssid, fixNets[j], WL_MAC_ADDR_LENGTH) == 0) {
+        same++;
+        break;
+      }
+  if (same * 100 < netCount * GEO_SAMEPCT) return -1;
+  setCurrent(fixLat, fixLng, millis());
+  DLOG_P(GEO_SAME, same, netCount, fixAcc);
+  return fixAcc;
+}
+
+/**
+  Ask the LAN resolver for a fix of the APs found
+
+  @return the accuracy of the fix, negative if none
+*/
+int MLS::lanLocation() {
+  lan->begin();
+  for (int i = 0; i < netCount; i++)
+    lan->add(nets[i].bssid, nets[i].rssi);
+  float lat, lng;
+  int acc = lan->lookup(&lat, &lng);
+  if (acc < 0 or acc > GEO_MAXACC) return -1;
+  setCurrent(lat, lng, millis());
+  return acc;
+}
+
+/**
+  Store the new coordinates, keep the old ones as previous
+
+  @param lat the latitude
+  @param lng the longitude
+  @param now the internal time of the fix
+*/
+void MLS::setCurrent(float lat, float lng, unsigned long now) {
+  // Check if previous valid coordinates are too old (over one hour) and invalidate them
+  if (now - previous.uptm > 3600000UL) previous.valid = false;
+  if (current.valid) {
+    // Store previous coordinates
+    previous.valid      = current.valid;
+    previous.latitude   = current.latitude;
+    previous.longitude  = current.longitude;
+    previous.uptm       = current.uptm;
+  }
+  // Store new coordinates
+  current.valid     = true;
+  current.latitude  = lat;
+  current.longitude = lng;
+  current.uptm      = now;
+  // Get the locator
+  getLocator(current.latitude, current.longitude);
+}
+
 /**
   Get the navigation distance, bearing and speed using the equirectangular approximation
 */
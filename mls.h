@@ -24,12 +24,30 @@
 
 #include "Arduino.h"
 #include <ESP8266WiFi.h>
-#include <WiFiClientSecure.h>
 #include "config.h"
+#include "tls.h"
+#include "tiles.h"
+#include "beacons.h"
+#include "gps.h"
+#include "budget.h"
+#include "link.h"
+#include "lancache.h"
+#include "trace.h"
 
-// Define GeoLocation server
+// Fix locally only with this many APs found in the tiles
+#define TILE_MINAPS   3
+// Uncertainty of the AP positions in the tiles (m)
+#define TILE_APACC    25
+// Reuse the last fix, on a low data budget, if this percent of the APs are the same
+#define GEO_SAMEPCT   60
+
+// Define GeoLocation server, or a self-hosted one in the configuration
+#ifndef GEO_SERVER
 #define GEO_SERVER    "location.services.mozilla.com"
+#endif
+#ifndef GEO_PORT
 #define GEO_PORT      443
+#endif
 #define GEO_POST      "POST /v1/geolocate?key=" GEO_APIKEY " HTTP/1.1"
 
 const char geoServer[]        = GEO_SERVER;
@@ -47,7 +65,14 @@ struct geo_t {
 class MLS {
   public:
     MLS();
-    void  init();
+    void  init(TLS *ctx);
+    void  setTiles(Tiles *db);
+    void  setBeacons(Beacons *bcn);
+    void  setGPS(GPS *rcv);
+    void  setBudget(Budget *bdg);
+    void  setLink(Link *lnk);
+    void  setLAN(LANCache *lc);
+    void  setTrace(Trace *trc);
     int   wifiScan(bool sort = false);
     int   geoLocation();
     long  getMovement();
@@ -62,12 +87,33 @@ class MLS {
     int   knots;
     int   bearing;
     char  locator[7];
+    bool  gpsGood = false;            // A good GPS fix, taken before the scan
   private:
+    int   localLocation(float lat, float lng);
+    int   cachedLocation();
+    int   lanLocation();
+    void  setCurrent(float lat, float lng, unsigned long now);
     struct  BSSID_RSSI {
       uint8_t bssid[WL_MAC_ADDR_LENGTH];
       int8_t  rssi;
     } nets[MAXNETS];
     int           netCount;
+    TLS          *tls;
+    Tiles        *tiles = NULL;
+    Beacons      *beacons = NULL;
+    GPS          *gps = NULL;
+    gps_fix_t     gpsFix;             // The GPS fix of this cycle and its accuracy
+    int           gpsAcc;
+    Budget       *budget = NULL;
+    Link         *link = NULL;
+    LANCache     *lan = NULL;
+    Trace        *trace = NULL;
+    // The APs of the last fix from the server
+    uint8_t       fixNets[MAXNETS][WL_MAC_ADDR_LENGTH];
+    int           fixCount = 0;
+    int           fixAcc;
+    float         fixLat;
+    float         fixLng;
 };
 
 #endif /* MLS_H */
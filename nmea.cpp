@@ -105,18 +105,22 @@ void NMEA::getTime(unsigned long utm) {
 }
 
 /*
-  Compose the GGA sentence
+  Compose the GGA sentence, with no time if the clock is not set (utm 0)
   $GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*47
 */
 int NMEA::getGGA(char *buf, size_t len, unsigned long utm, float lat, float lng, int fix, int sat) {
   // Get integer and fractional coordinates
   getCoords(lat, lng);
-  // Get time
-  getTime(utm);
+  // Get time, if known
+  char hms[12] = "";
+  if (utm != 0) {
+    getTime(utm);
+    snprintf_P(hms, sizeof(hms), PSTR("%02d%02d%02d.0"), hh, mm, ss);
+  }
 
   // GGA
-  snprintf_P(buf, len, PSTR("$GPGGA,%02d%02d%02d.0,%02d%02d.%04d,%c,%03d%02d.%04d,%c,%d,%d,1,0,M,0,M,,"),
-             hh, mm, ss,
+  snprintf_P(buf, len, PSTR("$GPGGA,%s,%02d%02d.%04d,%c,%03d%02d.%04d,%c,%d,%d,1,0,M,0,M,,"),
+             hms,
              latDD, latMM, latFF, lat >= 0 ? 'N' : 'S',
              lngDD, lngMM, lngFF, lng >= 0 ? 'E' : 'W',
              fix, sat);
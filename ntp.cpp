@@ -19,6 +19,8 @@
 
 #include "Arduino.h"
 #include "ntp.h"
+#include "dlog.h"
+#include "stall.h"
 
 NTP::NTP() {
 }
@@ -31,7 +33,7 @@ NTP::NTP() {
 */
 unsigned long NTP::init(const char *ntpServer, int ntpPort) {
   setServer(ntpServer, ntpPort);
-  getSeconds(true);
+  return getSeconds(true);
 }
 
 /**
@@ -45,6 +47,42 @@ void NTP::setServer(const char *ntpServer, int ntpPort) {
   strncpy(server, (char*)ntpServer, sizeof(server));
 }
 
+/**
+  Resolve the server name through the shared DNS cache
+
+  @param resolver the DNS cache
+*/
+void NTP::setResolver(DNSCache *resolver) {
+  dns = resolver;
+}
+
+/**
+  Sync again, once the time is known, only when the uplink shaper lets it
+
+  @param shp the uplink shaper
+*/
+void NTP::setShaper(Shaper *shp) {
+  shaper = shp;
+}
+
+/**
+  Time the requests, the wait for the answer follows the uplink quality
+
+  @param lnk the uplink quality estimator
+*/
+void NTP::setLink(Link *lnk) {
+  link = lnk;
+}
+
+/**
+  Record the exchanges with the server
+
+  @param trc the I/O trace
+*/
+void NTP::setTrace(Trace *trc) {
+  trace = trc;
+}
+
 /**
   Set the time zone
 
@@ -54,6 +92,16 @@ void NTP::setTZ(float tz) {
   TZ = tz;
 }
 
+/**
+  Set the clock from a time kept over a reset, still to be synced
+
+  @param utm UNIX time
+*/
+void NTP::setSeconds(unsigned long utm) {
+  delta = utm - (millis() / 1000);
+  set   = true;
+}
+
 /**
   Report the time
 
@@ -61,8 +109,7 @@ void NTP::setTZ(float tz) {
 */
 void NTP::report(unsigned long utm) {
   datetime_t dt = getDateTime(utm);
-  Serial.printf_P(PSTR("$PNTPC,0x%08X,%d.%02d.%02d,%02d.%02d.%02d\r\n"),
-                  utm, dt.yy + 2000, dt.ll, dt.dd, dt.hh, dt.mm, dt.ss);
+  DLOG_P(NTP_CLK, utm, dt.yy + 2000, dt.ll, dt.dd, dt.hh, dt.mm, dt.ss);
 }
 
 /**
@@ -82,9 +129,16 @@ uint8_t NTP::getClock(char *buf, size_t len, unsigned long utm) {
 */
 unsigned long NTP::getSeconds(bool sync) {
   // Check if we need to sync
-  if (millis() >= nextSync and sync) {
+  if (millis() >= nextSync and sync and valid and
+      shaper != NULL and not shaper->admit(SHP_TIME)) {
+    // The time is still good, sync later, the link is poor or busy
+    nextSync = millis() + 60000UL;
+  }
+  else if (millis() >= nextSync and sync) {
     // Try to get the time from Internet
     unsigned long utm = getNTP();
+    // The request and the response, with the UDP, IP and Ethernet headers
+    if (shaper != NULL) shaper->charge(SHP_TIME, 2 * (48 + 42));
     if (utm == 0) {
       // Time sync has failed, sync again over one minute
       nextSync = millis() + 60000UL;
@@ -96,6 +150,7 @@ unsigned long NTP::getSeconds(bool sync) {
       // Time sync has succeeded, sync again in 8 hours
       nextSync = millis() + 28800000UL;
       valid = true;
+      set   = true;
       report(utm);
     }
   }
@@ -116,8 +171,6 @@ unsigned long NTP::getSeconds(bool sync) {
   The Unix time is returned, that is, seconds from 1970-01-01T00:00.
 */
 unsigned long NTP::getNTP() {
-  // NTP UDP client
-  WiFiUDP client;
   // Open socket on arbitrary port
   bool ok = client.begin(12321);
   // NTP request header: Only the first four bytes of an outgoing
@@ -128,21 +181,42 @@ unsigned long NTP::getNTP() {
   // Clear received data from possible stray received packets
   client.flush();
   // Send an NTP request
-  char ntpServerBuf[strlen_P((char*)server) + 1];
-  strncpy(ntpServerBuf, (char*)server, sizeof(ntpServerBuf));
-  if (!(client.beginPacket(ntpServerBuf, port) &&
+  unsigned long start = millis();
+  IPAddress ip;
+  if (dns != NULL) {
+    uint8_t res = dns->resolve(server, ip);
+    // Sync as soon as the name is known
+    if (res == DNS_WAIT) dns->request(server, onResolved, this);
+    ok = (res == DNS_OK or res == DNS_OLD) and
+         STALL_CALL(STALL_UDP, client.beginPacket(ip, port));
+  }
+  else
+    ok = STALL_CALL(STALL_UDP, client.beginPacket(server, port));
+  if (!(ok &&
         client.write((byte *)&ntpFirstFourBytes, 48) == 48 &&
-        client.endPacket()))
+        client.endPacket())) {
+    client.stop();
     return 0UL;                             // sending request failed
-  // Wait for response; check every pollIntv ms up to maxPoll times
+  }
+  // Wait for response; check every pollIntv ms up to maxPoll times,
+  // as long as the uplink allows
   const int pollIntv = 150;                 // poll every this many ms
-  const byte maxPoll = 15;                  // poll up to this many times
-  int pktLen;                               // received packet length
+  const byte maxPoll = (link != NULL ? link->timeout(LNK_NTP) : 2250) / pollIntv;
+  int pktLen = 0;                           // received packet length
   for (byte i = 0; i < maxPoll; i++) {
     if ((pktLen = client.parsePacket()) == 48) break;
-    delay(pollIntv);
+    stall.wait(pollIntv);
+  }
+  if (pktLen != 48) {
+    client.stop();
+    if (link != NULL) link->lost(LNK_NTP);
+    if (trace != NULL) {
+      trc_ntp_t rec = {(uint16_t)(millis() - start), 0, 0, 0};
+      trace->record(TRC_NTP, 0, &rec, sizeof(rec));
+    }
+    return 0UL;                             // no correct packet received
   }
-  if (pktLen != 48) return 0UL;             // no correct packet received
+  if (link != NULL) link->sample(LNK_NTP, millis() - start);
   // Read and discard the first useless bytes (32 for speed, 40 for accuracy)
   for (byte i = 0; i < 40; ++i) client.read();
   // Read the integer part of sending time
@@ -155,13 +229,29 @@ unsigned long NTP::getNTP() {
   // for an assumed network delay of 50ms, and (0.5-0.05)*256=115;
   // additionally, we account for how much we delayed reading the packet
   // since its arrival, which we assume on average to be pollIntv/2.
-  ntpTime += (client.read() > 115 - pollIntv / 8);
+  int frac = client.read();
+  if (trace != NULL) {
+    trc_ntp_t rec = {(uint16_t)(millis() - start), (uint8_t)frac, 0, (uint32_t)ntpTime};
+    trace->record(TRC_NTP, TRC_OK, &rec, sizeof(rec));
+  }
+  ntpTime += (frac > 115 - pollIntv / 8);
   // Discard the rest of the packet and stop
   client.flush();
   client.stop();
   return ntpTime - 2208988800UL;            // convert to Unix time
 }
 
+/**
+  The server name is known, sync on the next call
+
+  @param arg the NTP object
+  @param result the resolution result
+  @param ip the server address
+*/
+void NTP::onResolved(void *arg, uint8_t result, const IPAddress &ip) {
+  if (result != DNS_ERR) ((NTP*)arg)->nextSync = millis();
+}
+
 /**
   Get the uptime
 
@@ -22,6 +22,10 @@
 
 #include "Arduino.h"
 #include <WiFiUdp.h>
+#include "dnscache.h"
+#include "shaper.h"
+#include "link.h"
+#include "trace.h"
 
 struct datetime_t {
   uint8_t yy;
@@ -37,7 +41,12 @@ class NTP {
     NTP();
     unsigned long init(const char *ntpServer, int ntpPort = 123);
     void          setServer(const char *ntpServer, int ntpPort = 123);
+    void          setResolver(DNSCache *resolver);
+    void          setShaper(Shaper *shp);
+    void          setLink(Link *lnk);
+    void          setTrace(Trace *trc);
     void          setTZ(float tz);
+    void          setSeconds(unsigned long utm);
     void          report(unsigned long utm);
     unsigned long getSeconds(bool sync = true);
     unsigned long getUptime(char *buf, size_t len);
@@ -46,8 +55,15 @@ class NTP {
     uint8_t       getDOW(uint16_t year, uint8_t month, uint8_t day);
     bool          dstCheck(uint16_t year, uint8_t month, uint8_t day, uint8_t hour);
     bool          valid       = false;               // Flag to know the time is accurate
+    bool          set         = false;               // The clock was restored or synced, not the uptime
   private:
     unsigned long getNTP();
+    static void   onResolved(void *arg, uint8_t result, const IPAddress &ip);
+    WiFiUDP       client;                            // NTP UDP client
+    DNSCache     *dns      = NULL;                   // Shared DNS cache
+    Shaper       *shaper   = NULL;                   // Uplink shaper
+    Link         *link     = NULL;                   // Uplink quality
+    Trace        *trace    = NULL;                   // I/O trace
     char          server[50];                        // NTP server to connect to (RFC5905)
     int           port     = 123;                    // NTP port
     unsigned long nextSync = 0UL;                    // Next time to syncronize
@@ -0,0 +1,244 @@
+/**
+  rawserver.cpp - TCP fan-out server on the lwIP raw API
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  The sentences of one fix are collected into an epoch, copied once into
+  a pbuf and written to all the client PCBs without copying: lwIP only
+  references the pbuf payload.  Each client holds a reference to the pbuf
+  until its data is acknowledged, so the pbuf is freed by the last client
+  to acknowledge it.  The lwIP callbacks run between the loop passes, as
+  for the core WiFiClient.
+*/
+
+#include <Arduino.h>
+#include "rawserver.h"
+#include "dlog.h"
+
+RawServer::RawServer(uint16_t serverPort) {
+  port     = serverPort;
+  clients  = 0;
+  skipped  = 0;
+  listener = NULL;
+  epochLen = 0;
+  for (uint8_t i = 0; i < RAW_CLIENTS; i++) {
+    slots[i].server = this;
+    slots[i].pcb    = NULL;
+    slots[i].head   = 0;
+    slots[i].count  = 0;
+    slots[i].index  = i;
+  }
+}
+
+/**
+  Initialize the server
+
+  @param serverName the name the server is known as
+  @param welcome the welcome message to send to the new clients
+*/
+void RawServer::init(const char *serverName, const char *welcome) {
+  // Keep the server name
+  strncpy(name, serverName, sizeof(name));
+  name[sizeof(name) - 1] = '\0';
+  // Keep the welcome message
+  strncpy(wlcm, welcome, sizeof(wlcm));
+  wlcm[sizeof(wlcm) - 1] = '\0';
+  // Configure mDNS
+  MDNS.addService((const char*)name, "tcp", (int)port);
+  DLOG_P(SRV_MDNS, name, RAW_CLIENTS, port);
+  // Listen
+  tcp_pcb *pcb = tcp_new();
+  if (pcb == NULL) return;
+  if (tcp_bind(pcb, IP_ADDR_ANY, port) != ERR_OK or
+      (listener = tcp_listen(pcb)) == NULL) {
+    tcp_close(pcb);
+    return;
+  }
+  tcp_arg(listener, this);
+  tcp_accept(listener, onAccept);
+}
+
+/**
+  Count the connected clients, they are handled in the lwIP callbacks
+
+  @return the number of clients
+*/
+int RawServer::check() {
+  return clients;
+}
+
+/**
+  Add a message to the current epoch, it is sent to all clients on flush
+
+  @param buf the message to send to all clients
+*/
+void RawServer::sendAll(char *buf) {
+  size_t len = strlen(buf);
+  if (epochLen + len > RAW_EPOCHLEN) flush();
+  if (len > RAW_EPOCHLEN) return;
+  memcpy(epoch + epochLen, buf, len);
+  epochLen += len;
+}
+
+/**
+  Send the current epoch to all the clients, from one shared pbuf
+*/
+void RawServer::flush() {
+  if (epochLen == 0) return;
+  if (clients > 0) {
+    pbuf *p = pbuf_alloc(PBUF_RAW, epochLen, PBUF_RAM);
+    if (p != NULL) {
+      memcpy(p->payload, epoch, epochLen);
+      for (uint8_t i = 0; i < RAW_CLIENTS; i++) {
+        if (slots[i].pcb == NULL) continue;
+        if (queue(&slots[i], p, (const char*)p->payload, epochLen))
+          tcp_output(slots[i].pcb);
+        else
+          skipped++;
+      }
+      // The clients hold their own references
+      pbuf_free(p);
+    }
+  }
+  epochLen = 0;
+}
+
+/**
+  Write data to a client and remember it until acknowledged
+
+  @param client the client
+  @param p the shared epoch, or NULL to copy the data
+  @param data the data
+  @param len the data length
+  @return true if the data was queued
+*/
+bool RawServer::queue(raw_client_t *client, pbuf *p, const char *data, uint16_t len) {
+  // A slow client skips the data, the memory does not grow
+  if (client->count == RAW_QUEUE or tcp_sndbuf(client->pcb) < len) return false;
+  if (tcp_write(client->pcb, data, len, p == NULL ? TCP_WRITE_FLAG_COPY : 0) != ERR_OK)
+    return false;
+  if (p != NULL) pbuf_ref(p);
+  raw_sent_t *sent = &client->queue[(client->head + client->count) % RAW_QUEUE];
+  sent->p   = p;
+  sent->len = len;
+  client->count++;
+  return true;
+}
+
+/**
+  Drop the references of a client to the epochs
+*/
+void RawServer::release(raw_client_t *client) {
+  while (client->count > 0) {
+    if (client->queue[client->head].p != NULL)
+      pbuf_free(client->queue[client->head].p);
+    client->head = (client->head + 1) % RAW_QUEUE;
+    client->count--;
+  }
+  client->head = 0;
+}
+
+/**
+  Abort a client connection.  Closing it gracefully would leave lwIP
+  sending from the epochs after they are released.
+*/
+void RawServer::close(raw_client_t *client) {
+  tcp_arg(client->pcb, NULL);
+  tcp_recv(client->pcb, NULL);
+  tcp_sent(client->pcb, NULL);
+  tcp_err(client->pcb, NULL);
+  tcp_abort(client->pcb);
+  release(client);
+  client->pcb = NULL;
+  clients--;
+  DLOG_P(SRV_DIS, name, clients, client->index);
+}
+
+/**
+  A new connection, take a free slot or reject it
+*/
+err_t RawServer::onAccept(void *arg, tcp_pcb *pcb, err_t err) {
+  RawServer *srv = (RawServer*)arg;
+  if (err != ERR_OK or pcb == NULL) return ERR_VAL;
+  uint32_t ip = ip4_addr_get_u32(ip_2_ip4(&pcb->remote_ip));
+  for (uint8_t i = 0; i < RAW_CLIENTS; i++) {
+    raw_client_t *client = &srv->slots[i];
+    if (client->pcb != NULL) continue;
+    client->pcb = pcb;
+    tcp_arg(pcb, client);
+    tcp_recv(pcb, onRecv);
+    tcp_sent(pcb, onSent);
+    tcp_err(pcb, onError);
+    tcp_nagle_disable(pcb);
+    srv->clients++;
+    DLOG_P(SRV_CON, srv->name, srv->clients, i,
+           ip & 0xFF, (ip >> 8) & 0xFF, (ip >> 16) & 0xFF, ip >> 24);
+    // The welcome message is small, copy it
+    srv->queue(client, NULL, srv->wlcm, strlen(srv->wlcm));
+    tcp_output(pcb);
+    return ERR_OK;
+  }
+  DLOG_P(SRV_REJ, srv->name, srv->clients, RAW_CLIENTS,
+         ip & 0xFF, (ip >> 8) & 0xFF, (ip >> 16) & 0xFF, ip >> 24);
+  tcp_abort(pcb);
+  return ERR_ABRT;
+}
+
+/**
+  Data from a client is dropped, the end of the stream closes the client
+*/
+err_t RawServer::onRecv(void *arg, tcp_pcb *pcb, pbuf *p, err_t err) {
+  raw_client_t *client = (raw_client_t*)arg;
+  if (p == NULL) {
+    client->server->close(client);
+    return ERR_ABRT;
+  }
+  tcp_recved(pcb, p->tot_len);
+  pbuf_free(p);
+  return ERR_OK;
+}
+
+/**
+  Data acknowledged, release the epochs fully acknowledged by the client
+*/
+err_t RawServer::onSent(void *arg, tcp_pcb *pcb, uint16_t len) {
+  raw_client_t *client = (raw_client_t*)arg;
+  while (len > 0 and client->count > 0) {
+    raw_sent_t *sent = &client->queue[client->head];
+    if (len < sent->len) {
+      sent->len -= len;
+      break;
+    }
+    len -= sent->len;
+    if (sent->p != NULL) pbuf_free(sent->p);
+    client->head = (client->head + 1) % RAW_QUEUE;
+    client->count--;
+  }
+  return ERR_OK;
+}
+
+/**
+  The connection failed, lwIP already freed the PCB
+*/
+void RawServer::onError(void *arg, err_t err) {
+  raw_client_t *client = (raw_client_t*)arg;
+  if (client == NULL) return;
+  RawServer *srv = client->server;
+  srv->release(client);
+  client->pcb = NULL;
+  srv->clients--;
+  DLOG_P(SRV_DIS, srv->name, srv->clients, client->index);
+}
@@ -0,0 +1,79 @@
+/**
+  rawserver.h - TCP fan-out server on the lwIP raw API
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RAWSERVER_H
+#define RAWSERVER_H
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESP8266mDNS.h>
+#include <lwip/tcp.h>
+#include "version.h"
+
+// Maximum number of clients
+#define RAW_CLIENTS   8
+// Longest epoch, all the sentences of one fix
+#define RAW_EPOCHLEN  512
+// Epochs queued per client, a slower client skips the new ones
+#define RAW_QUEUE     4
+
+// A block of data sent to a client, not acknowledged yet
+struct raw_sent_t {
+  pbuf     *p;                        // The shared epoch, NULL if copied
+  uint16_t  len;                      // Bytes not acknowledged
+};
+
+class RawServer;
+
+struct raw_client_t {
+  RawServer  *server;
+  tcp_pcb    *pcb;
+  raw_sent_t  queue[RAW_QUEUE];
+  uint8_t     head;
+  uint8_t     count;
+  uint8_t     index;
+};
+
+class RawServer {
+  public:
+    RawServer(uint16_t serverPort);
+    void  init(const char *serverName, const char *welcome);
+    int   check();
+    void  sendAll(char *buf);
+    void  flush();
+    int   clients;
+    unsigned long skipped;              // Epochs not sent to slow clients
+  private:
+    static err_t onAccept(void *arg, tcp_pcb *pcb, err_t err);
+    static err_t onRecv(void *arg, tcp_pcb *pcb, pbuf *p, err_t err);
+    static err_t onSent(void *arg, tcp_pcb *pcb, uint16_t len);
+    static void  onError(void *arg, err_t err);
+    bool  queue(raw_client_t *client, pbuf *p, const char *data, uint16_t len);
+    void  release(raw_client_t *client);
+    void  close(raw_client_t *client);
+    int   port;
+    char  name[16];
+    char  wlcm[100];
+    tcp_pcb      *listener;
+    raw_client_t  slots[RAW_CLIENTS];
+    char          epoch[RAW_EPOCHLEN];
+    uint16_t      epochLen;
+};
+
+#endif /* RAWSERVER_H */
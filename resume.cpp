@@ -0,0 +1,148 @@
+/**
+  resume.cpp - Boot state, the last fix, clock and AP kept over resets
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "resume.h"
+#include "dlog.h"
+
+Resume::Resume() {
+}
+
+/**
+  Restore the state, from RTC memory after a reset, or from flash
+
+  @return true if a fix was restored
+*/
+bool Resume::init() {
+  struct rst_info *ri = ESP.getResetInfoPtr();
+  valid = false;
+  clock = 0;
+  bool warm = false;
+  ESP.rtcUserMemoryRead(RSM_RTCOFF, (uint32_t*)&state, sizeof(state));
+  if (state.magic == RSM_MAGIC and state.check == checksum(&state)) warm = true;
+  bool stored = load();
+  if (not warm) {
+    if (not stored) return false;
+    state = saved;
+  }
+  valid = true;
+  // The RTC timer ran on over a reset, not over a cold boot or the reset pin
+  if (warm and (state.flags & RSM_TIME) and
+      ri->reason != REASON_DEFAULT_RST and ri->reason != REASON_EXT_SYS_RST) {
+    // The calibration is in us per cycle, Q12
+    uint64_t us = ((uint64_t)(system_get_rtc_time() - state.rtc) * system_rtc_clock_cali_proc()) >> 12;
+    clock = state.utm + us / 1000000UL;
+  }
+  DLOG_P(RSM_FIX, latitude(), longitude(), state.acc, state.channel, warm ? "RTC" : "FLASH", (uint32_t)clock);
+  return true;
+}
+
+/**
+  Read the state saved in flash
+
+  @return true if valid
+*/
+bool Resume::load() {
+  File file;
+  bool ok = false;
+  if (LittleFS.begin() and (file = LittleFS.open(RSM_FILE, "r"))) {
+    ok = file.read((uint8_t*)&saved, sizeof(saved)) == sizeof(saved);
+    file.close();
+  }
+  ok = ok and saved.magic == RSM_MAGIC and saved.check == checksum(&saved);
+  if (not ok) memset(&saved, 0, sizeof(saved));
+  return ok;
+}
+
+/**
+  Keep a fix, and the AP the station is on, in RTC memory and, when it
+  moved or changed the AP, in flash
+
+  @param lat the latitude
+  @param lng the longitude
+  @param acc the accuracy (m)
+  @param utm the time of the fix, Unix
+  @param accurate the time is accurate
+*/
+void Resume::save(float lat, float lng, int acc, unsigned long utm, bool accurate) {
+  state.magic   = RSM_MAGIC;
+  state.lat     = lround(lat * 1e7);
+  state.lng     = lround(lng * 1e7);
+  state.acc     = acc;
+  state.flags   = accurate ? RSM_TIME : 0;
+  state.utm     = utm;
+  state.rtc     = system_get_rtc_time();
+  state.reserved = 0;
+  if (WiFi.isConnected()) {
+    state.channel = WiFi.channel();
+    memcpy(state.bssid, WiFi.BSSID(), sizeof(state.bssid));
+  }
+  else {
+    state.channel = 0;
+    memset(state.bssid, 0, sizeof(state.bssid));
+  }
+  state.check = checksum(&state);
+  ESP.rtcUserMemoryWrite(RSM_RTCOFF, (uint32_t*)&state, sizeof(state));
+  // A new fix, the restored one is not served any more
+  valid = false;
+  // Flash wears, save a move, about 90 x 1e-7 degrees a meter, or another AP
+  bool moved = labs(state.lat - saved.lat) > RSM_MOVE * 90L or
+               labs(state.lng - saved.lng) > RSM_MOVE * 90L;
+  bool other = state.channel != 0 and
+               (state.channel != saved.channel or memcmp(state.bssid, saved.bssid, sizeof(state.bssid)) != 0);
+  if (saved.magic == RSM_MAGIC and
+      (millis() - savedTime < RSM_SAVE * 1000UL or not (moved or other))) return;
+  File file = LittleFS.open(RSM_FILE, "w");
+  if (file) {
+    file.write((uint8_t*)&state, sizeof(state));
+    file.close();
+    saved = state;
+  }
+  savedTime = millis();
+}
+
+/**
+  The latitude of the state
+
+  @return the latitude (degrees)
+*/
+float Resume::latitude() {
+  return state.lat / 1e7;
+}
+
+/**
+  The longitude of the state
+
+  @return the longitude (degrees)
+*/
+float Resume::longitude() {
+  return state.lng / 1e7;
+}
+
+/**
+  The checksum of a state, to tell it from what a cold boot leaves
+  in RTC memory
+*/
+uint32_t Resume::checksum(const rsm_state_t *s) {
+  const uint32_t *w = (const uint32_t*)s;
+  uint32_t sum = 0x811C9DC5UL;
+  for (size_t i = 0; i < offsetof(rsm_state_t, check) / 4; i++)
+    sum = (sum ^ w[i]) * 16777619UL;
+  return sum;
+}
@@ -0,0 +1,84 @@
+/**
+  resume.h - Boot state, the last fix, clock and AP kept over resets
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  The last fix, the time it was taken and the AP the station was on are
+  kept in RTC memory with each fix, and saved to flash now and then, as
+  the tracker moves.  At boot, the tracker serves the last fix as an
+  estimated one until it gets a new one, and joins the same AP on its
+  channel, without a scan.  After a reset, not a cold boot, the RTC timer
+  ran on, so the clock is restored too.
+*/
+
+#ifndef RESUME_H
+#define RESUME_H
+
+#include "Arduino.h"
+#include <ESP8266WiFi.h>
+#include <LittleFS.h>
+extern "C" {
+#include "user_interface.h"
+}
+#include "config.h"
+
+// RTC user memory offset of the state (4 bytes blocks), after the data budget
+#define RSM_RTCOFF    56
+#define RSM_MAGIC     0x4D535352UL
+// The state file
+#define RSM_FILE      "/resume"
+// Save to flash at most this often (s), if moved this far (m) or on another AP
+#define RSM_SAVE      600
+#define RSM_MOVE      100
+// Serve the restored fix this often (ms), until a new one
+#define RSM_REPEAT    1000
+
+// The state flags
+#define RSM_TIME      0x01              // The time of the fix is accurate
+
+// The state, as kept in RTC memory and in flash
+struct rsm_state_t {
+  uint32_t  magic;
+  int32_t   lat;                        // 1e-7 degrees
+  int32_t   lng;
+  int16_t   acc;                        // m
+  uint8_t   channel;                    // The channel of the AP, 0 if none
+  uint8_t   flags;
+  uint8_t   bssid[6];                   // The AP
+  uint16_t  reserved;
+  uint32_t  utm;                        // The time of the fix, Unix
+  uint32_t  rtc;                        // The RTC timer then (cycles)
+  uint32_t  check;
+};
+
+class Resume {
+  public:
+    Resume();
+    bool      init();
+    void      save(float lat, float lng, int acc, unsigned long utm, bool accurate);
+    float     latitude();
+    float     longitude();
+    bool      valid   = false;          // A fix was restored, no new one yet
+    unsigned long clock = 0;            // The restored time, Unix, 0 if not known
+    rsm_state_t state;
+  private:
+    bool      load();
+    uint32_t  checksum(const rsm_state_t *s);
+    rsm_state_t   saved;                // As in flash
+    unsigned long savedTime = 0;        // Last time saved to flash (ms)
+};
+
+#endif /* RESUME_H */
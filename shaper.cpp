@@ -0,0 +1,95 @@
+/**
+  shaper.cpp - Uplink shaper, the network work in priority classes
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "shaper.h"
+
+// The bucket rates (bytes/s) and bursts (bytes), no bucket for the live work
+static const uint16_t shpRate[SHP_CLASSES]  = {0, SHP_RATETIME, SHP_RATEINFO, SHP_RATEBULK};
+static const uint16_t shpBurst[SHP_CLASSES] = {0, SHP_BURSTTIME, SHP_BURSTINFO, SHP_BURSTBULK};
+// The worst link each class may use
+static const uint8_t  shpLink[SHP_CLASSES]  = {SHP_POOR, SHP_FAIR, SHP_FAIR, SHP_GOOD};
+
+Shaper::Shaper() {
+}
+
+/**
+  Start with the buckets full
+*/
+void Shaper::init() {
+  for (uint8_t c = 0; c < SHP_CLASSES; c++) {
+    tokens[c]   = shpBurst[c];
+    deferred[c] = 0;
+  }
+  filled = millis();
+  due    = filled;
+}
+
+/**
+  Fill the buckets and take the link quality, on each loop pass
+
+  @param rssi the RSSI of the station (dBm)
+  @param due the time of the next live work (ms)
+  @param lossy the exchanges with the servers are often lost
+*/
+void Shaper::update(int rssi, unsigned long due, bool lossy) {
+  this->due = due;
+  if      (rssi >= SHP_GOODRSSI) link = SHP_GOOD;
+  else if (rssi >= SHP_FAIRRSSI) link = SHP_FAIR;
+  else                           link = SHP_POOR;
+  // A strong signal, but a congested or a lossy path
+  if (lossy and link > SHP_POOR) link--;
+  // Whole seconds only, the rates are small
+  unsigned long secs = (millis() - filled) / 1000;
+  if (secs == 0) return;
+  filled += secs * 1000;
+  for (uint8_t c = 1; c < SHP_CLASSES; c++) {
+    tokens[c] += (long)secs * shpRate[c];
+    if (tokens[c] > shpBurst[c]) tokens[c] = shpBurst[c];
+  }
+}
+
+/**
+  Check if a transfer of a class may start now
+
+  @param cls the priority class
+  @return true if it may
+*/
+bool Shaper::admit(uint8_t cls) {
+  if (cls == SHP_LIVE) return true;
+  if (cls >= SHP_CLASSES) return false;
+  bool ok = tokens[cls] > 0 and link >= shpLink[cls];
+  // The bulk transfers would delay the live work
+  if (cls == SHP_BULK and (long)(due - millis()) < SHP_GUARD) ok = false;
+  if (not ok) deferred[cls]++;
+  return ok;
+}
+
+/**
+  Charge a class for a transfer done
+
+  @param cls the priority class
+  @param bytes the bytes sent and received
+*/
+void Shaper::charge(uint8_t cls, uint32_t bytes) {
+  if (cls == SHP_LIVE or cls >= SHP_CLASSES) return;
+  tokens[cls] -= bytes;
+  // Do not hold a class back longer than it takes to fill its bucket
+  if (tokens[cls] < -(long)shpBurst[cls]) tokens[cls] = -(long)shpBurst[cls];
+}
@@ -0,0 +1,67 @@
+/**
+  shaper.h - Uplink shaper, the network work in priority classes
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  The live work, the geolocation and the APRS positions, is never held
+  back.  The other classes each have a token bucket, in bytes: a class
+  may start a transfer while its bucket is not empty, the transfer is
+  charged afterwards, when its size is known.  The time sync also needs
+  a usable link, once the time is known, the telemetry and the status a
+  fair link, and the bulk transfers a good one and enough time left
+  before the next live work.  The link is rated by the RSSI, one step
+  lower if the exchanges are often lost.
+*/
+
+#ifndef SHAPER_H
+#define SHAPER_H
+
+#include "Arduino.h"
+
+// The priority classes, the highest first
+enum shp_class_t {SHP_LIVE, SHP_TIME, SHP_INFO, SHP_BULK, SHP_CLASSES};
+
+// The link, by the RSSI of the station (dBm)
+enum shp_link_t {SHP_POOR, SHP_FAIR, SHP_GOOD};
+#define SHP_FAIRRSSI  -85
+#define SHP_GOODRSSI  -72
+
+// The token buckets: the rate (bytes/s) and the burst (bytes)
+#define SHP_RATETIME  1
+#define SHP_BURSTTIME 512
+#define SHP_RATEINFO  4
+#define SHP_BURSTINFO 1024
+#define SHP_RATEBULK  512
+#define SHP_BURSTBULK 32768
+// No bulk transfer this close to the next live work (ms)
+#define SHP_GUARD     8000
+
+class Shaper {
+  public:
+    Shaper();
+    void      init();
+    void      update(int rssi, unsigned long due, bool lossy = false);
+    bool      admit(uint8_t cls);
+    void      charge(uint8_t cls, uint32_t bytes);
+    uint8_t   link = SHP_GOOD;
+    unsigned long deferred[SHP_CLASSES];  // Transfers held back
+  private:
+    long      tokens[SHP_CLASSES];        // Bytes, negative if in debt
+    unsigned long filled;                 // Last time the buckets were filled
+    unsigned long due;                    // The next live work (ms)
+};
+
+#endif /* SHAPER_H */
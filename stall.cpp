@@ -0,0 +1,170 @@
+/**
+  stall.cpp - Blocking call detector and loop stall watchdog
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "stall.h"
+#include "energy.h"
+#include "gps.h"
+#include "dlog.h"
+
+// Stage and call names, for reporting
+static const char *stallStages[] = {"SETUP", "IDLE", "OTA", "SRV", "WIFI",
+                                    "NTP", "SCAN", "GEO", "NMEA", "APRS",
+                                    "DNS", "TILE", "BCN", "GPS"
+                                   };
+static const char *stallCalls[]  = {"NONE", "DELAY", "WSCAN", "CONN", "READ",
+                                    "FIND", "PARSE", "UDP", "LOOKUP"
+                                   };
+
+STALL stall;
+
+STALL::STALL() {
+}
+
+/**
+  Check the breadcrumb left by the previous run and report it if
+  the reset was caused by a watchdog or an exception
+*/
+void STALL::init() {
+  struct rst_info *ri = ESP.getResetInfoPtr();
+  ESP.rtcUserMemoryRead(STALL_RTCOFF, (uint32_t*)&crumb, sizeof(crumb));
+  if (crumb.magic == STALL_MAGIC and
+      crumb.stage < STALL_STAGES and crumb.call < STALL_CALLS and
+      (ri->reason == REASON_WDT_RST or
+       ri->reason == REASON_EXCEPTION_RST or
+       ri->reason == REASON_SOFT_WDT_RST))
+    DLOG_P(STAL_RST, ri->reason, stallStages[crumb.stage], stallCalls[crumb.call], crumb.since);
+  // Start a new trail
+  crumb.magic = STALL_MAGIC;
+  crumb.stage = STALL_SETUP;
+  crumb.call  = STALL_NONE;
+  crumb.since = millis();
+  save();
+}
+
+/**
+  Charge the time of the stages and of the calls to the subsystems
+
+  @param nrg the energy accounting
+*/
+void STALL::setEnergy(Energy *nrg) {
+  energy = nrg;
+}
+
+/**
+  Read the GPS receiver around the blocking calls and in the delays, its
+  serial buffer would overflow during the long ones
+
+  @param rcv the GPS receiver
+*/
+void STALL::setGPS(GPS *rcv) {
+  gps = rcv;
+}
+
+/**
+  Write the breadcrumb to RTC memory
+*/
+void STALL::save() {
+  ESP.rtcUserMemoryWrite(STALL_RTCOFF, (uint32_t*)&crumb, sizeof(crumb));
+}
+
+/**
+  Start timing a loop pass
+*/
+void STALL::begin() {
+  loopStart = millis();
+  passMax   = 0;
+  passStage = STALL_IDLE;
+  passCall  = STALL_NONE;
+}
+
+/**
+  End a loop pass and report it if it took too long
+*/
+void STALL::end() {
+  unsigned long pass = millis() - loopStart;
+  if (pass > worst) worst = pass;
+  if (pass >= STALL_LOOPMS) {
+    stalls++;
+    DLOG_P(STAL_LOOP, pass, stallStages[passStage], stallCalls[passCall], passMax);
+  }
+  stage(STALL_IDLE);
+}
+
+/**
+  Set the current loop stage
+
+  @param stage the loop stage
+*/
+void STALL::stage(uint8_t stage) {
+  if (energy != NULL) energy->stage(stage);
+  crumb.stage = stage;
+  crumb.call  = STALL_NONE;
+  crumb.since = millis();
+  save();
+}
+
+/**
+  Mark the start of a blocking call
+
+  @param call the blocking call
+*/
+void STALL::enter(uint8_t call) {
+  // Empty the serial buffer, for the call to fill
+  if (gps != NULL) gps->loop();
+  if (energy != NULL) energy->enter(call);
+  callStart   = millis();
+  crumb.call  = call;
+  crumb.since = callStart;
+  save();
+}
+
+/**
+  Mark the end of a blocking call, keep the longest one in this pass
+  and report it if it took too long
+*/
+void STALL::leave() {
+  unsigned long ms = millis() - callStart;
+  if (ms > passMax) {
+    passMax   = ms;
+    passStage = crumb.stage;
+    passCall  = crumb.call;
+  }
+  if (ms >= STALL_CALLMS)
+    DLOG_P(STAL_CALL, stallStages[crumb.stage], stallCalls[crumb.call], ms);
+  if (energy != NULL) energy->leave();
+  crumb.call = STALL_NONE;
+  save();
+  if (gps != NULL) gps->loop();
+}
+
+/**
+  Timed delay
+
+  @param ms the delay (ms)
+*/
+void STALL::wait(unsigned long ms) {
+  enter(STALL_DELAY);
+  unsigned long start = millis();
+  while (millis() - start < ms) {
+    delay(min(ms - (millis() - start), (unsigned long)STALL_DRAINMS));
+    if (gps != NULL) gps->loop();
+  }
+  leave();
+}
@@ -0,0 +1,104 @@
+/**
+  stall.h - Blocking call detector and loop stall watchdog
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STALL_H
+#define STALL_H
+
+#include "Arduino.h"
+#include "config.h"
+
+// Report a loop pass longer than this (ms)
+#ifndef STALL_LOOPMS
+#define STALL_LOOPMS  5000
+#endif
+// Report a single blocking call longer than this (ms)
+#ifndef STALL_CALLMS
+#define STALL_CALLMS  2000
+#endif
+// Read the GPS receiver this often (ms) in the timed delays
+#ifndef STALL_DRAINMS
+#define STALL_DRAINMS 100
+#endif
+// RTC user memory offset of the breadcrumb (4 bytes blocks)
+#define STALL_RTCOFF  32
+#define STALL_MAGIC   0x5741544CUL
+
+class Energy;
+class GPS;
+
+// The stages of the main loop
+enum stall_stage_t {
+  STALL_SETUP, STALL_IDLE, STALL_OTA, STALL_SRV, STALL_WIFI,
+  STALL_NTP, STALL_SCAN, STALL_GEO, STALL_NMEA, STALL_APRS,
+  STALL_DNS, STALL_TILE, STALL_BCN, STALL_GPS,
+  STALL_STAGES
+};
+
+// The blocking calls
+enum stall_call_t {
+  STALL_NONE, STALL_DELAY, STALL_WSCAN, STALL_CONN, STALL_READ,
+  STALL_FIND, STALL_PARSE, STALL_UDP, STALL_LOOKUP,
+  STALL_CALLS
+};
+
+// The breadcrumb, kept in RTC memory over resets
+struct stall_rtc_t {
+  uint32_t  magic;
+  uint8_t   stage;
+  uint8_t   call;
+  uint16_t  reserved;
+  uint32_t  since;
+};
+
+class STALL {
+  public:
+    STALL();
+    void  init();
+    void  setEnergy(Energy *nrg);
+    void  setGPS(GPS *rcv);
+    void  begin();
+    void  end();
+    void  stage(uint8_t stage);
+    void  enter(uint8_t call);
+    void  leave();
+    template <typename T> T leave(T result) {
+      leave();
+      return result;
+    }
+    void  wait(unsigned long ms);
+    unsigned long worst;              // The longest loop pass (ms)
+    uint16_t      stalls;             // Number of stalled loop passes
+  private:
+    void  save();
+    stall_rtc_t   crumb;
+    Energy       *energy = NULL;      // Charged by the stages and the calls
+    GPS          *gps    = NULL;      // Read around the calls and in the delays
+    unsigned long loopStart;
+    unsigned long callStart;
+    unsigned long passMax;            // The longest call in this pass (ms)
+    uint8_t       passStage;
+    uint8_t       passCall;
+};
+
+extern STALL stall;
+
+// Time a blocking call, returning its result
+#define STALL_CALL(call, expr) (stall.enter(call), stall.leave(expr))
+
+#endif /* STALL_H */
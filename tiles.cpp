@@ -0,0 +1,502 @@
+/**
+  tiles.cpp - Offline AP database, in tiles
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include <LittleFS.h>
+#include "tiles.h"
+#include "dlog.h"
+#include "stall.h"
+
+// Meters per degree of latitude
+#define TILE_MDEG     111194.93
+
+Tiles::Tiles() {
+}
+
+/**
+  Mount the file system and set the tile server
+
+  @param tileServer the tile server
+  @param tilePort the tile server port
+  @return true if the file system is ready
+*/
+bool Tiles::init(const char *tileServer, int tilePort) {
+  server = tileServer;
+  port   = tilePort;
+  for (uint8_t i = 0; i < TILE_FAILS; i++) {
+    fails[i].lat  = INT16_MAX;
+    fails[i].lng  = INT16_MAX;
+    fails[i].time = 0;
+  }
+  next    = 0;
+  checked = millis() - TILE_CHECK * 1000UL;
+  learnCount = 0;
+  ready   = LittleFS.begin();
+  if (ready) LittleFS.mkdir(TILE_DIR);
+  return ready;
+}
+
+/**
+  Download the tiles from the tile server through the shared DNS cache
+
+  @param resolver the DNS cache
+*/
+void Tiles::setResolver(DNSCache *resolver) {
+  dns = resolver;
+}
+
+/**
+  Download the tiles only when the uplink shaper lets the bulk through
+
+  @param shp the uplink shaper
+*/
+void Tiles::setShaper(Shaper *shp) {
+  shaper = shp;
+}
+
+/**
+  Time the connections to the server, the timeout follows the uplink
+  quality
+
+  @param lnk the uplink quality estimator
+*/
+void Tiles::setLink(Link *lnk) {
+  link = lnk;
+}
+
+/**
+  The file name of a tile
+
+  @param buf the buffer
+  @param len the buffer length
+  @param lat the tile latitude
+  @param lng the tile longitude
+  @param tmp the name of the file being downloaded
+*/
+void Tiles::path(char *buf, size_t len, int16_t lat, int16_t lng, bool tmp) {
+  snprintf_P(buf, len, PSTR(TILE_DIR "/%d_%d%s"), lat, lng, tmp ? ".tmp" : "");
+}
+
+/**
+  Look up the APs not found yet in one tile, by binary search in the file
+
+  @param lat the tile latitude
+  @param lng the tile longitude
+  @param query the APs
+  @param count the number of APs
+  @return the number of APs found in this tile
+*/
+int Tiles::search(int16_t lat, int16_t lng, tile_query_t *query, int count) {
+  char name[32];
+  path(name, sizeof(name), lat, lng);
+  File file = LittleFS.open(name, "r");
+  if (not file) return 0;
+  int found = 0;
+  tile_hdr_t hdr;
+  if (file.read((uint8_t*)&hdr, sizeof(hdr)) == sizeof(hdr) and hdr.magic == TILE_MAGIC and
+      file.size() == sizeof(hdr) + hdr.count * sizeof(tile_ap_t)) {
+    for (int q = 0; q < count; q++) {
+      if (query[q].found) continue;
+      int lo = 0, hi = hdr.count - 1;
+      while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        tile_ap_t ap;
+        file.seek(sizeof(hdr) + mid * sizeof(ap));
+        if (file.read((uint8_t*)&ap, sizeof(ap)) != sizeof(ap)) break;
+        int cmp = memcmp(query[q].bssid, ap.bssid, WL_MAC_ADDR_LENGTH);
+        if (cmp == 0) {
+          query[q].lat   = (float)hdr.lat / TILE_SCALE + ap.dlat * 1e-6;
+          query[q].lng   = (float)hdr.lng / TILE_SCALE + ap.dlng * 1e-6;
+          query[q].found = true;
+          found++;
+          break;
+        }
+        if (cmp < 0) hi = mid - 1;
+        else         lo = mid + 1;
+      }
+    }
+  }
+  file.close();
+  return found;
+}
+
+/**
+  Look up the APs not found yet in the database file, by binary search
+  in its keys
+
+  @param query the APs
+  @param count the number of APs
+  @return the number of APs found in the file
+*/
+int Tiles::searchDB(tile_query_t *query, int count) {
+  File file = LittleFS.open(TILE_APDB, "r");
+  if (not file) return 0;
+  int found = 0;
+  apdb_hdr_t hdr;
+  if (file.read((uint8_t*)&hdr, sizeof(hdr)) == sizeof(hdr) and apdb_valid(&hdr, file.size())) {
+    for (int q = 0; q < count; q++) {
+      if (query[q].found) continue;
+      int32_t lo = 0, hi = (int32_t)hdr.count - 1;
+      while (lo <= hi) {
+        int32_t mid = (lo + hi) / 2;
+        uint8_t key[APDB_KEYLEN];
+        file.seek(hdr.keys + mid * APDB_KEYLEN);
+        if (file.read(key, sizeof(key)) != sizeof(key)) break;
+        int cmp = memcmp(query[q].bssid, key, APDB_KEYLEN);
+        if (cmp == 0) {
+          int32_t lat, lng;
+          file.seek(hdr.lat + mid * sizeof(lat));
+          file.read((uint8_t*)&lat, sizeof(lat));
+          file.seek(hdr.lng + mid * sizeof(lng));
+          file.read((uint8_t*)&lng, sizeof(lng));
+          query[q].lat   = lat * 1e-7;
+          query[q].lng   = lng * 1e-7;
+          query[q].found = true;
+          found++;
+          break;
+        }
+        if (cmp < 0) hi = mid - 1;
+        else         lo = mid + 1;
+      }
+    }
+  }
+  file.close();
+  return found;
+}
+
+/**
+  Look up the scanned APs in the tiles around a position, then in the
+  database file
+
+  @param lat the latitude
+  @param lng the longitude
+  @param query the APs
+  @param count the number of APs
+  @return the number of APs found
+*/
+int Tiles::lookup(float lat, float lng, tile_query_t *query, int count) {
+  if (not ready) return 0;
+  for (int q = 0; q < count; q++)
+    query[q].found = false;
+  int16_t tlat = (int16_t)floor(lat * TILE_SCALE);
+  int16_t tlng = (int16_t)floor(lng * TILE_SCALE);
+  int found = 0;
+  // The tile of the position first, then the ones around it
+  for (uint8_t i = 0; i < 9 and found < count; i++)
+    found += search(tlat + (i + 4) % 9 / 3 - 1, tlng + (i + 4) % 3 - 1, query, count);
+  if (found < count)
+    found += searchDB(query, count);
+  return found;
+}
+
+/**
+  Check if a tile should be downloaded
+
+  @param lat the tile latitude
+  @param lng the tile longitude
+  @return true if the tile is not in flash and did not fail recently
+*/
+bool Tiles::missing(int16_t lat, int16_t lng) {
+  for (uint8_t i = 0; i < TILE_FAILS; i++)
+    if (fails[i].lat == lat and fails[i].lng == lng and
+        millis() - fails[i].time < TILE_RETRY * 1000UL)
+      return false;
+  char name[32];
+  path(name, sizeof(name), lat, lng);
+  return not LittleFS.exists(name);
+}
+
+/**
+  Remove the tiles farthest from a tile, until there is enough free flash
+
+  @param lat the tile latitude
+  @param lng the tile longitude
+*/
+void Tiles::evict(int16_t lat, int16_t lng) {
+  FSInfo info;
+  while (LittleFS.info(info) and info.totalBytes - info.usedBytes < TILE_MINFREE) {
+    int far = -1, flat = 0, flng = 0;
+    Dir dir = LittleFS.openDir(TILE_DIR);
+    while (dir.next()) {
+      int dlat, dlng;
+      if (sscanf(dir.fileName().c_str(), "%d_%d", &dlat, &dlng) != 2) continue;
+      int d = max(abs(dlat - lat), abs(dlng - lng));
+      if (d > far) {
+        far  = d;
+        flat = dlat;
+        flng = dlng;
+      }
+    }
+    if (far < 0) break;
+    char name[32];
+    path(name, sizeof(name), flat, flng);
+    LittleFS.remove(name);
+  }
+}
+
+/**
+  Download a tile into flash.  A tile the server does not have is kept
+  empty, so it is not asked for again.
+
+  @param lat the tile latitude
+  @param lng the tile longitude
+  @return the number of APs in the tile, or -1 on error or while the
+          server name is resolved
+*/
+int Tiles::download(int16_t lat, int16_t lng) {
+  // Not a failure, the name is still being resolved
+  IPAddress ip;
+  uint8_t res = DNS_OK;
+  if (dns != NULL and (res = dns->resolve(server, ip)) == DNS_WAIT) return -1;
+  int count = -1;
+  int code  = 0;
+  evict(lat, lng);
+  char name[32], temp[32];
+  path(name, sizeof(name), lat, lng);
+  path(temp, sizeof(temp), lat, lng, true);
+  // Connect to the cached address
+  bool conn;
+  unsigned long timeout = link != NULL ? link->timeout(LNK_TILE) : TILE_TIMEOUT;
+  client.setTimeout(timeout);
+  unsigned long start = millis();
+  if (dns != NULL)
+    conn = res != DNS_ERR and
+           STALL_CALL(STALL_CONN, client.connect(ip, port));
+  else
+    conn = STALL_CALL(STALL_CONN, client.connect(server, port));
+  if (link != NULL and res != DNS_ERR) {
+    if (conn) link->sample(LNK_TILE, millis() - start);
+    else      link->lost(LNK_TILE);
+  }
+  if (conn) {
+    char buf[128];
+    snprintf_P(buf, sizeof(buf), PSTR("GET " TILE_DIR "/%d/%d.bin HTTP/1.0\r\nHost: %s\r\n\r\n"),
+               lat, lng, server);
+    client.print(buf);
+    // The status code
+    int rlen = STALL_CALL(STALL_READ, client.readBytesUntil('\n', buf, sizeof(buf) - 1));
+    buf[rlen] = '\0';
+    char *sp = strchr(buf, ' ');
+    if (sp != NULL) code = atoi(sp + 1);
+    // Skip the headers, up to the empty line
+    while (client.connected() or client.available()) {
+      rlen = STALL_CALL(STALL_READ, client.readBytesUntil('\n', buf, sizeof(buf) - 1));
+      if (rlen <= 1) break;
+    }
+    if (code == 200) {
+      // Write to a temporary file, the tile is kept only if complete
+      File file = LittleFS.open(temp, "w");
+      if (file) {
+        // Copy what is available, until the server closes or stops sending
+        unsigned long last = millis();
+        while ((client.connected() or client.available()) and millis() - last < timeout) {
+          int n = client.read((uint8_t*)buf, sizeof(buf));
+          if (n > 0) {
+            if (file.write((uint8_t*)buf, n) != (size_t)n) break;
+            last = millis();
+          }
+          else
+            stall.wait(10);
+        }
+        file.close();
+        // Check the header against the file size
+        file = LittleFS.open(temp, "r");
+        tile_hdr_t hdr;
+        if (file and file.read((uint8_t*)&hdr, sizeof(hdr)) == sizeof(hdr) and
+            hdr.magic == TILE_MAGIC and hdr.lat == lat and hdr.lng == lng and
+            file.size() == sizeof(hdr) + hdr.count * sizeof(tile_ap_t))
+          count = hdr.count;
+        if (file) file.close();
+        if (count >= 0) LittleFS.rename(temp, name);
+        else            LittleFS.remove(temp);
+      }
+    }
+    else if (code == 404) {
+      // No APs known there
+      tile_hdr_t hdr = {TILE_MAGIC, lat, lng, 0, 0};
+      File file = LittleFS.open(name, "w");
+      if (file) {
+        if (file.write((uint8_t*)&hdr, sizeof(hdr)) == sizeof(hdr)) count = 0;
+        file.close();
+      }
+    }
+    client.stop();
+  }
+  if (count >= 0)
+    DLOG_P(TILE_GET, lat, lng, count);
+  else {
+    // Do not insist
+    fails[next].lat  = lat;
+    fails[next].lng  = lng;
+    fails[next].time = millis();
+    next = (next + 1) % TILE_FAILS;
+    DLOG_P(TILE_ERR, lat, lng, code);
+  }
+  return count;
+}
+
+/**
+  Label an AP with the position where it was heard, if it is not in the
+  tiles around yet.  Only the tiles already in flash are extended.
+
+  @param lat the latitude
+  @param lng the longitude
+  @param bssid the AP BSSID
+  @param rssi the AP signal strength (dBm)
+*/
+void Tiles::learn(float lat, float lng, const uint8_t *bssid, int8_t rssi) {
+  if (not ready or rssi < TILE_LEARNRSSI) return;
+  int16_t tlat = (int16_t)floor(lat * TILE_SCALE);
+  int16_t tlng = (int16_t)floor(lng * TILE_SCALE);
+  tile_ap_t ap;
+  memcpy(ap.bssid, bssid, WL_MAC_ADDR_LENGTH);
+  ap.dlat = (uint16_t)min(lround((lat - (double)tlat / TILE_SCALE) * 1e6), 1000000L / TILE_SCALE - 1);
+  ap.dlng = (uint16_t)min(lround((lng - (double)tlng / TILE_SCALE) * 1e6), 1000000L / TILE_SCALE - 1);
+  // Already labelled, keep the position where it was the strongest
+  for (uint8_t i = 0; i < learnCount; i++)
+    if (memcmp(learned[i].ap.bssid, bssid, WL_MAC_ADDR_LENGTH) == 0) {
+      if (rssi > learned[i].rssi) {
+        learned[i].lat  = tlat;
+        learned[i].lng  = tlng;
+        learned[i].ap   = ap;
+        learned[i].rssi = rssi;
+      }
+      return;
+    }
+  if (learnCount >= TILE_LEARN) return;
+  // Only into a tile in flash, and only if not known around
+  char name[32];
+  path(name, sizeof(name), tlat, tlng);
+  if (not LittleFS.exists(name)) return;
+  tile_query_t query = {bssid, 0, 0, false};
+  if (lookup(lat, lng, &query, 1) > 0) return;
+  if (learnCount == 0) learnTime = millis();
+  learned[learnCount].lat  = tlat;
+  learned[learnCount].lng  = tlng;
+  learned[learnCount].ap   = ap;
+  learned[learnCount].rssi = rssi;
+  learnCount++;
+}
+
+/**
+  Write the labelled APs of one tile into its file, keeping the APs
+  sorted by BSSID
+
+  @return true if the tile was written
+*/
+bool Tiles::merge() {
+  int16_t lat = learned[0].lat;
+  int16_t lng = learned[0].lng;
+  // Take the APs of this tile out of the table, sorted
+  tile_ap_t aps[TILE_LEARN];
+  uint8_t count = 0, keep = 0;
+  for (uint8_t i = 0; i < learnCount; i++) {
+    if (learned[i].lat != lat or learned[i].lng != lng) {
+      learned[keep++] = learned[i];
+      continue;
+    }
+    uint8_t j = count++;
+    for (; j > 0 and memcmp(aps[j - 1].bssid, learned[i].ap.bssid, WL_MAC_ADDR_LENGTH) > 0; j--)
+      aps[j] = aps[j - 1];
+    aps[j] = learned[i].ap;
+  }
+  learnCount = keep;
+  learnTime  = millis();
+  // Copy the tile to a temporary file, inserting the APs on the way
+  char name[32], temp[32];
+  path(name, sizeof(name), lat, lng);
+  path(temp, sizeof(temp), lat, lng, true);
+  File in = LittleFS.open(name, "r");
+  if (not in) return false;
+  bool done = false;
+  tile_hdr_t hdr;
+  if (in.read((uint8_t*)&hdr, sizeof(hdr)) == sizeof(hdr) and hdr.magic == TILE_MAGIC and
+      in.size() == sizeof(hdr) + hdr.count * sizeof(tile_ap_t)) {
+    File out = LittleFS.open(temp, "w");
+    if (out) {
+      uint16_t total = hdr.count;
+      hdr.count += count;
+      done = out.write((uint8_t*)&hdr, sizeof(hdr)) == sizeof(hdr);
+      uint8_t a = 0;
+      tile_ap_t ap;
+      for (uint16_t i = 0; i < total and done; i++) {
+        if (in.read((uint8_t*)&ap, sizeof(ap)) != sizeof(ap)) done = false;
+        while (done and a < count and memcmp(aps[a].bssid, ap.bssid, WL_MAC_ADDR_LENGTH) < 0)
+          done = out.write((uint8_t*)&aps[a++], sizeof(ap)) == sizeof(ap);
+        if (done) done = out.write((uint8_t*)&ap, sizeof(ap)) == sizeof(ap);
+      }
+      while (done and a < count)
+        done = out.write((uint8_t*)&aps[a++], sizeof(ap)) == sizeof(ap);
+      out.close();
+    }
+  }
+  in.close();
+  if (done) {
+    LittleFS.rename(temp, name);
+    labelled += count;
+    DLOG_P(TILE_LRN, lat, lng, count);
+  }
+  else
+    LittleFS.remove(temp);
+  return done;
+}
+
+/**
+  Write the labelled APs, or download one of the missing tiles around the
+  current position and the position predicted from the course and speed.
+  Call it between the fixes, the downloads only work on a good network.
+
+  @param lat the latitude
+  @param lng the longitude
+  @param bearing the course, negative if unknown
+  @param speed the speed (m/s)
+*/
+void Tiles::loop(float lat, float lng, int bearing, float speed) {
+  if (not ready or server == NULL) return;
+  // Write the labelled APs, when many or after a while
+  if (learnCount > 0 and (learnCount >= TILE_LEARN or millis() - learnTime >= TILE_LEARNSAVE * 1000UL)) {
+    merge();
+    return;
+  }
+  // Nothing was missing recently, or no data left to download
+  if (paused or millis() - checked < TILE_CHECK * 1000UL) return;
+  if (not WiFi.isConnected() or WiFi.RSSI() < TILE_MINRSSI) return;
+  // The predicted position
+  float ahead = bearing < 0 ? 0 : speed * TILE_AHEAD;
+  float plat  = lat + ahead * cos(radians(bearing)) / TILE_MDEG;
+  float plng  = lng + ahead * sin(radians(bearing)) / (TILE_MDEG * cos(radians(lat)));
+  float pos[2][2] = {{lat, lng}, {plat, plng}};
+  for (uint8_t p = 0; p < 2; p++) {
+    int16_t tlat = (int16_t)floor(pos[p][0] * TILE_SCALE);
+    int16_t tlng = (int16_t)floor(pos[p][1] * TILE_SCALE);
+    for (uint8_t i = 0; i < 9; i++) {
+      int16_t dlat = tlat + (i + 4) % 9 / 3 - 1;
+      int16_t dlng = tlng + (i + 4) % 3 - 1;
+      if (missing(dlat, dlng)) {
+        // Bulk, after the live work and on a good link
+        if (shaper != NULL and not shaper->admit(SHP_BULK)) return;
+        int count = download(dlat, dlng);
+        if (shaper != NULL)
+          shaper->charge(SHP_BULK, TILE_HTTPLEN + sizeof(tile_hdr_t) + max(count, 0) * sizeof(tile_ap_t));
+        return;
+      }
+    }
+  }
+  checked = millis();
+}
@@ -0,0 +1,152 @@
+/**
+  tiles.h - Offline AP database, in tiles
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  A tile covers 1/TILE_SCALE degrees of latitude and longitude and is
+  kept in a flash file named after its south-west corner, in tile units.
+  The file, all little endian, is a header followed by the APs sorted by
+  BSSID, each with its position as 1e-6 degrees from the tile corner:
+
+    magic "WPT1", int16 lat, int16 lng, uint16 count, uint16 reserved
+    count x (uint8 bssid[6], uint16 dlat, uint16 dlng)
+
+  The server serves the same bytes as /tiles/LAT/LNG.bin
+
+  The APs a good GPS fix finds missing from the tiles in flash are labelled
+  with the position where they were heard strongest, and merged into the
+  tile files later, between the fixes.
+
+  The APs not in the tiles are looked up in the whole database file, if
+  uploaded to the flash as TILE_APDB, in the format of apdb.h.
+*/
+
+#ifndef TILES_H
+#define TILES_H
+
+#include "Arduino.h"
+#include <ESP8266WiFi.h>
+#include "config.h"
+#include "dnscache.h"
+#include "shaper.h"
+#include "link.h"
+#include "apdb.h"
+
+// Tiles per degree
+#define TILE_SCALE    100
+#define TILE_MAGIC    0x31545057UL
+// Download only with a signal stronger than this (dBm)
+#ifndef TILE_MINRSSI
+#define TILE_MINRSSI  -75
+#endif
+// Look ahead this long (s) to predict the position
+#define TILE_AHEAD    300
+// Keep this much flash (bytes) free, evict the farthest tiles for it
+#define TILE_MINFREE  32768
+// Do not retry a failed download sooner than this (s)
+#define TILE_RETRY    600
+// Failed downloads remembered
+#define TILE_FAILS    4
+// Look for missing tiles again after this long (s)
+#define TILE_CHECK    60
+// Download timeout (ms), until the uplink is timed
+#define TILE_TIMEOUT  5000
+// The request and the response headers, about (bytes)
+#define TILE_HTTPLEN  512
+// The tile files directory
+#define TILE_DIR      "/tiles"
+// The database file, optional
+#define TILE_APDB     "/apdb.bin"
+// Label the APs heard this strong (dBm) or stronger
+#define TILE_LEARNRSSI  -80
+// Labelled APs kept until written to the tiles
+#define TILE_LEARN    16
+// Write the labelled APs after this long (s)
+#define TILE_LEARNSAVE  300
+
+struct __attribute__((packed)) tile_hdr_t {
+  uint32_t  magic;
+  int16_t   lat;
+  int16_t   lng;
+  uint16_t  count;
+  uint16_t  reserved;
+};
+
+struct __attribute__((packed)) tile_ap_t {
+  uint8_t   bssid[WL_MAC_ADDR_LENGTH];
+  uint16_t  dlat;
+  uint16_t  dlng;
+};
+
+// A scanned AP to look up
+struct tile_query_t {
+  const uint8_t *bssid;
+  float     lat;
+  float     lng;
+  bool      found;
+};
+
+// An AP labelled with a position, not in the tiles yet
+struct tile_learn_t {
+  int16_t   lat;
+  int16_t   lng;
+  tile_ap_t ap;
+  int8_t    rssi;
+};
+
+// A failed download
+struct tile_fail_t {
+  int16_t       lat;
+  int16_t       lng;
+  unsigned long time;
+};
+
+class Tiles {
+  public:
+    Tiles();
+    bool  init(const char *server, int port);
+    void  setResolver(DNSCache *resolver);
+    void  setShaper(Shaper *shp);
+    void  setLink(Link *lnk);
+    int   lookup(float lat, float lng, tile_query_t *query, int count);
+    void  learn(float lat, float lng, const uint8_t *bssid, int8_t rssi);
+    void  loop(float lat, float lng, int bearing, float speed);
+    bool  ready = false;                // The file system is mounted
+    unsigned long labelled = 0;         // APs added to the tiles
+    bool  paused = false;               // No downloads, out of data budget
+  private:
+    void  path(char *buf, size_t len, int16_t lat, int16_t lng, bool tmp = false);
+    int   search(int16_t lat, int16_t lng, tile_query_t *query, int count);
+    int   searchDB(tile_query_t *query, int count);
+    bool  missing(int16_t lat, int16_t lng);
+    int   download(int16_t lat, int16_t lng);
+    void  evict(int16_t lat, int16_t lng);
+    bool  merge();
+    WiFiClient  client;
+    DNSCache   *dns = NULL;
+    Shaper     *shaper = NULL;
+    Link       *link = NULL;
+    const char *server = NULL;
+    int         port;
+    tile_fail_t fails[TILE_FAILS];
+    uint8_t     next;
+    unsigned long checked;              // Last time nothing was missing
+    tile_learn_t  learned[TILE_LEARN];
+    uint8_t       learnCount;
+    unsigned long learnTime;            // The first AP labelled and not written
+};
+
+#endif /* TILES_H */
@@ -0,0 +1,223 @@
+/**
+  tls.cpp - Shared TLS client context
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "tls.h"
+#include "dlog.h"
+#include "stall.h"
+
+#ifdef TLS_PINS
+// The pinned keys, in flash
+#define TLS_PINSTR(id, server, key) \
+  static const char tlsServer_##id[] PROGMEM = server; \
+  static const char tlsKey_##id[] PROGMEM = key;
+TLS_PINS(TLS_PINSTR)
+#undef TLS_PINSTR
+
+// Pin table
+#define TLS_PINPTR(id, server, key) {tlsServer_##id, tlsKey_##id},
+static const tls_pin_t tlsPins[] PROGMEM = {
+  TLS_PINS(TLS_PINPTR)
+};
+#undef TLS_PINPTR
+static const uint8_t tlsPinCount = sizeof(tlsPins) / sizeof(tlsPins[0]);
+#else
+static const tls_pin_t *tlsPins = NULL;
+static const uint8_t tlsPinCount = 0;
+#endif
+
+TLS::TLS() {
+}
+
+/**
+  Configure the client, it is shared by all the HTTPS connections so
+  there is only one BearSSL context and one stack for the whole sketch
+*/
+void TLS::init() {
+  client.setInsecure();
+  for (uint8_t i = 0; i < TLS_HOSTS; i++) {
+    hosts[i].hash = 0;
+    hosts[i].port = 0;
+    hosts[i].size = 0;
+    hosts[i].pin  = TLS_NOPIN;
+  }
+  next = 0;
+}
+
+/**
+  Resolve the server names through the shared DNS cache
+
+  @param resolver the DNS cache
+*/
+void TLS::setResolver(DNSCache *resolver) {
+  dns = resolver;
+}
+
+/**
+  Open the connection.  Use the name while its address is fresh, it is
+  also sent for SNI and the core finds it in the lwIP cache.  Otherwise,
+  fall back to the expired address, without SNI.
+
+  @param server the server name
+  @param port the server port
+  @param ip the cached address
+  @param stale the cached address is expired
+  @return the connection result
+*/
+bool TLS::open(const char *server, int port, IPAddress &ip, bool stale) {
+  if (stale)
+    return STALL_CALL(STALL_CONN, client.connect(ip, port));
+  return STALL_CALL(STALL_CONN, client.connect(server, port));
+}
+
+/**
+  Find the MFLN record of a server, or take the oldest one
+
+  @param server the server name
+  @param port the server port
+  @return the server record
+*/
+tls_host_t *TLS::lookup(const char *server, int port) {
+  // FNV-1a hash of the server name
+  uint32_t hash = 2166136261UL;
+  while (*server) {
+    hash ^= (uint8_t)(*server++);
+    hash *= 16777619UL;
+  }
+  for (uint8_t i = 0; i < TLS_HOSTS; i++)
+    if (hosts[i].hash == hash and hosts[i].port == port)
+      return &hosts[i];
+  // Not known, replace the oldest record
+  tls_host_t *host = &hosts[next];
+  next = (next + 1) % TLS_HOSTS;
+  host->hash = hash;
+  host->port = port;
+  host->size = 0;
+  host->pin  = TLS_NOPIN;
+  host->session = BearSSL::Session();
+  return host;
+}
+
+/**
+  List the pinned keys of a server
+
+  @param server the server name
+  @param list the pin indices
+  @return the number of pins
+*/
+uint8_t TLS::pins(const char *server, uint8_t *list) {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < tlsPinCount and count < TLS_MAXPINS; i++)
+    if (strcmp_P(server, (const char*)pgm_read_ptr(&tlsPins[i].server)) == 0)
+      list[count++] = i;
+  return count;
+}
+
+/**
+  Connect to a HTTPS server.  The first time, probe if the server accepts
+  a small maximum fragment length, then size the receive buffer to it.
+  Refuse to connect if the heap can not hold the buffers, instead of
+  failing inside the handshake.  The core allocates the buffers on each
+  connection and frees them on stop, the same sizes for a server.
+
+  If the server has pinned keys, the handshake only succeeds if the server
+  proves it owns one of them, starting with the one that matched last.  The
+  session is kept and resumed, so the key is checked once per session and
+  there is no certificate chain to validate.
+
+  @param server the server name
+  @param port the server port
+  @param timeout the connection and read timeout (ms)
+  @return the connection result
+*/
+bool TLS::connect(const char *server, int port, unsigned long timeout) {
+  // Resolve the name first, a failure needs no probe or handshake
+  IPAddress ip;
+  uint8_t res = DNS_OK;
+  if (dns != NULL) res = dns->resolve(server, ip);
+  resolving = res == DNS_WAIT;
+  if (res == DNS_ERR or res == DNS_WAIT)
+    return false;
+  bool stale = res == DNS_OLD;
+  tls_host_t *host = lookup(server, port);
+  // Probe the server only once
+  if (host->size == 0) {
+    if (STALL_CALL(STALL_CONN, WiFiClientSecure::probeMaxFragmentLength(server, port, TLS_MFLN)))
+      host->size = TLS_MFLN;
+    else
+      host->size = TLS_RECSIZE;
+    DLOG_P(TLS_MFLN, server, port, host->size);
+  }
+  // Check the heap, the receive buffer needs a contiguous block
+  uint32_t rcv  = host->size + TLS_RCVOVER;
+  uint32_t need = rcv + TLS_XMTSIZE + TLS_XMTOVER + TLS_HEAPMIN;
+  uint32_t have = ESP.getFreeHeap();
+  uint32_t blk  = ESP.getMaxFreeBlockSize();
+  if (have < need or blk < rcv) {
+    DLOG_P(TLS_HEAP, need, have, blk);
+    return false;
+  }
+  client.setBufferSizes(host->size, TLS_XMTSIZE);
+  client.setTimeout(timeout);
+  // The pinned keys of this server
+  uint8_t list[TLS_MAXPINS];
+  uint8_t count = pins(server, list);
+  if (count == 0) {
+    // Not pinned, only encrypt
+    client.setInsecure();
+    client.setSession(&host->session);
+    if (open(server, port, ip, stale))
+      return true;
+  }
+  else {
+    // Start with the pin that matched last
+    uint8_t first = 0;
+    for (uint8_t i = 0; i < count; i++)
+      if (list[i] == host->pin) first = i;
+    for (uint8_t i = 0; i < count; i++) {
+      uint8_t pin = list[(first + i) % count];
+      key.parse((const char*)pgm_read_ptr(&tlsPins[pin].key));
+      client.setKnownKey(&key);
+      client.setSession(&host->session);
+      if (open(server, port, ip, stale)) {
+        if (pin != host->pin) {
+          DLOG_P(TLS_PIN, server, port, pin);
+          host->pin = pin;
+        }
+        return true;
+      }
+      // No handshake error, the server was not reached at all
+      if (client.getLastSSLError() == 0) break;
+      // The key did not match, forget the session and try the next one
+      host->session = BearSSL::Session();
+      if (i == count - 1)
+        DLOG_P(TLS_NOPIN, server, port);
+    }
+  }
+  // Probe again next time, the failure may have been the network
+  host->size = 0;
+  return false;
+}
+
+/**
+  Close the connection and release the buffers
+*/
+void TLS::stop() {
+  client.stop();
+}
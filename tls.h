@@ -0,0 +1,82 @@
+/**
+  tls.h - Shared TLS client context
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TLS_H
+#define TLS_H
+
+#include "Arduino.h"
+#include <WiFiClientSecure.h>
+#include "config.h"
+#include "dnscache.h"
+
+// Maximum fragment length to negotiate: 512, 1024, 2048 or 4096
+#ifndef TLS_MFLN
+#define TLS_MFLN      512
+#endif
+// Record size for the servers not supporting MFLN
+#define TLS_RECSIZE   16384
+// Transmit record size, the requests are small
+#define TLS_XMTSIZE   512
+// BearSSL per record overhead, receive and transmit
+#define TLS_RCVOVER   325
+#define TLS_XMTOVER   85
+// Heap needed besides the buffers, for the engine and the certificate context
+#define TLS_HEAPMIN   6144
+// Number of servers to remember the MFLN support and the session for
+#define TLS_HOSTS     4
+// Pinned keys per server
+#define TLS_MAXPINS   4
+// No pinned key matched
+#define TLS_NOPIN     0xFF
+
+// A pinned public key, both strings in flash
+struct tls_pin_t {
+  const char *server;
+  const char *key;
+};
+
+// What is known about a server
+struct tls_host_t {
+  uint32_t  hash;
+  uint16_t  port;
+  uint16_t  size;                     // Receive record size, 0 if unknown
+  uint8_t   pin;                      // The pin that matched last
+  BearSSL::Session session;           // For resuming the TLS session
+};
+
+class TLS {
+  public:
+    TLS();
+    void  init();
+    void  setResolver(DNSCache *resolver);
+    bool  connect(const char *server, int port, unsigned long timeout);
+    void  stop();
+    WiFiClientSecure client;
+    bool  resolving = false;          // The last connection waits for the name
+  private:
+    tls_host_t *lookup(const char *server, int port);
+    bool        open(const char *server, int port, IPAddress &ip, bool stale);
+    uint8_t     pins(const char *server, uint8_t *list);
+    tls_host_t  hosts[TLS_HOSTS];
+    BearSSL::PublicKey key;
+    DNSCache   *dns = NULL;
+    uint8_t     next;
+};
+
+#endif /* TLS_H */
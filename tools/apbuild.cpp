@@ -0,0 +1,695 @@
+/**
+  apbuild.cpp - AP database builder, from the scan and fix observations
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  Build:  g++ -O2 -pthread -o apbuild tools/apbuild.cpp
+  Usage:  apbuild [-t THREADS] [-s STATE] [-o DIR] [-d DB] [-c FILE] [-f] [FILE...]
+
+  Reads the observations, one AP heard at a fix per line, from the FILEs
+  or stdin:
+
+    lat,lng,acc,bssid,rssi
+
+  with lat/lng in degrees, acc in m and rssi in dBm, and estimates the
+  position of each AP and the log distance path loss, the RSSI at 1 m
+  and the exponent.  Weighted least squares: the ranges follow from the
+  RSSI and the path loss, the position is fitted to them by Gauss-Newton,
+  each observation weighted by the accuracy of its fix and of its range;
+  the path loss is fitted again to the new position, a few times.  The
+  observations far off, over 3 MAD, are dropped and the AP fitted again.
+
+  The APs are written as tiles, DIR/LAT/LNG.bin in the format of tiles.h,
+  for the tile server and tools/geoserver, as one database file, DB in
+  the format of apdb.h, with its tile index, and as CSV to FILE:
+
+    bssid,lat,lng,acc,p0,n,obs
+
+  With STATE, the observations and the APs are kept in the directory,
+  and a run adds the new observations and fits again only the APs they
+  heard, writing only the tiles these were or are in.  With -f, all the
+  APs are fitted again.
+
+  The observations are split in buckets by BSSID, a bucket is sorted and
+  fitted by one thread.  The buckets are dealt to the threads, each with
+  its own queue, and an idle thread steals from the others.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <unordered_set>
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "../apdb.h"
+
+// The tile files, as in tiles.h
+#define AB_TILEMAGIC  0x31545057UL
+#define AB_TILESCALE  100
+// The state files
+#define AB_OBSMAGIC   0x31424F57UL    // "WOB1"
+#define AB_APSMAGIC   0x31424157UL    // "WAB1"
+// Fit only the APs heard this many times
+#define AB_MINOBS     2
+// Fit the path loss with this many observations, else use the defaults
+#define AB_FITOBS     6
+#define AB_P0         -35.0
+#define AB_PATHN      2.7
+#define AB_MINN       1.6
+#define AB_MAXN       4.5
+// The error of a range from the RSSI, relative to the range
+#define AB_RANGEERR   0.35
+// The longest range (m)
+#define AB_MAXRANGE   500.0
+// The least fix accuracy (m)
+#define AB_MINACC     5.0
+// Drop the observations over this many MAD, and at least this far (m)
+#define AB_OUTMAD     3.0
+#define AB_OUTMIN     20.0
+// Fit rounds, each after dropping the outliers, and steps per round
+#define AB_ROUNDS     3
+#define AB_STEPS      8
+// Buckets of observations, the unit of work
+#define AB_BUCKETS    4096
+
+// An observation, an AP heard at a fix
+struct __attribute__((packed)) ab_obs_t {
+  uint64_t  key;                      // 48 bit BSSID
+  int32_t   lat;                      // 1e-7 degrees
+  int32_t   lng;                      // 1e-7 degrees
+  uint16_t  acc;                      // m
+  int8_t    rssi;                     // dBm
+  uint8_t   reserved;
+};
+
+// An AP, as fitted
+struct __attribute__((packed)) ab_ap_t {
+  uint64_t  key;
+  int32_t   lat;                      // 1e-7 degrees
+  int32_t   lng;                      // 1e-7 degrees
+  uint16_t  acc;                      // m
+  int16_t   p0;                       // RSSI at 1 m, 1/10 dBm
+  uint16_t  n;                        // Path loss exponent, 1/100
+  uint16_t  reserved;
+  uint32_t  obs;                      // Observations used
+};
+
+struct __attribute__((packed)) ab_tile_hdr_t {
+  uint32_t  magic;
+  int16_t   lat;
+  int16_t   lng;
+  uint16_t  count;
+  uint16_t  reserved;
+};
+
+struct __attribute__((packed)) ab_tile_ap_t {
+  uint8_t   bssid[6];
+  uint16_t  dlat;
+  uint16_t  dlng;
+};
+
+// Per thread counters
+struct ab_stats_t {
+  uint64_t  fitted;
+  uint64_t  few;                      // Heard too few times
+  uint64_t  outliers;
+  uint64_t  used;
+};
+
+static uint64_t mix(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+/**
+  A pool running tasks on threads, each with its own queue, stealing from
+  the others when its own is empty
+*/
+class StealPool {
+  public:
+    StealPool(int threads): threads(threads), queues(threads) {}
+    void run(size_t count, std::function<void(size_t, int)> fn);
+    uint64_t  steals = 0;
+  private:
+    bool take(int self, size_t *task);
+    struct Queue {
+      std::mutex lock;
+      std::deque<size_t> tasks;
+    };
+    int   threads;
+    std::vector<Queue> queues;
+    std::atomic<size_t> left;
+    std::atomic<uint64_t> stolen;
+};
+
+/**
+  Run the tasks, a contiguous share to each thread first
+
+  @param count the number of tasks
+  @param fn the task, with the task index and the thread index
+*/
+void StealPool::run(size_t count, std::function<void(size_t, int)> fn) {
+  for (int t = 0; t < threads; t++)
+    for (size_t i = count * t / threads; i < count * (t + 1) / threads; i++)
+      queues[t].tasks.push_back(i);
+  left = count;
+  stolen = 0;
+  std::vector<std::thread> pool;
+  for (int t = 0; t < threads; t++)
+    pool.emplace_back([this, t, &fn] {
+      size_t task;
+      while (left.load() > 0) {
+        if (take(t, &task)) {
+          fn(task, t);
+          left--;
+        }
+        else std::this_thread::yield();
+      }
+    });
+  for (std::thread &th : pool)
+    th.join();
+  steals += stolen;
+}
+
+/**
+  The newest task of the own queue, else the oldest of another
+*/
+bool StealPool::take(int self, size_t *task) {
+  {
+    std::lock_guard<std::mutex> g(queues[self].lock);
+    if (not queues[self].tasks.empty()) {
+      *task = queues[self].tasks.back();
+      queues[self].tasks.pop_back();
+      return true;
+    }
+  }
+  for (int i = 1; i < threads; i++) {
+    Queue &q = queues[(self + i) % threads];
+    std::lock_guard<std::mutex> g(q.lock);
+    if (not q.tasks.empty()) {
+      *task = q.tasks.front();
+      q.tasks.pop_front();
+      stolen++;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+  Parse the observation lines
+
+  @param fp the input
+  @param obs the observations read
+  @return the lines not understood
+*/
+static size_t readObs(FILE *fp, std::vector<ab_obs_t> &obs) {
+  char line[256];
+  size_t bad = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    if (line[0] == '#' or line[0] == '\n') continue;
+    char *p = line, *e;
+    double lat = strtod(p, &e);
+    if (e == p or *e != ',') { bad++; continue; }
+    p = e + 1;
+    double lng = strtod(p, &e);
+    if (e == p or *e != ',') { bad++; continue; }
+    p = e + 1;
+    long acc = strtol(p, &e, 10);
+    if (e == p or *e != ',') { bad++; continue; }
+    p = e + 1;
+    uint64_t key = 0;
+    int digits = 0;
+    while (*p and *p != ',') {
+      int v = -1;
+      if      (*p >= '0' and *p <= '9') v = *p - '0';
+      else if (*p >= 'a' and *p <= 'f') v = *p - 'a' + 10;
+      else if (*p >= 'A' and *p <= 'F') v = *p - 'A' + 10;
+      if (v >= 0) {
+        key = (key << 4) | v;
+        digits++;
+      }
+      p++;
+    }
+    if (digits != 12 or *p != ',') { bad++; continue; }
+    long rssi = strtol(p + 1, &e, 10);
+    if (e == p + 1 or fabs(lat) > 90 or fabs(lng) > 180 or rssi < -127 or rssi > 0) { bad++; continue; }
+    ab_obs_t o;
+    o.key = key;
+    o.lat = (int32_t)lround(lat * 1e7);
+    o.lng = (int32_t)lround(lng * 1e7);
+    o.acc = (uint16_t)std::max(1L, std::min(acc, 65535L));
+    o.rssi = (int8_t)rssi;
+    o.reserved = 0;
+    obs.push_back(o);
+  }
+  return bad;
+}
+
+/**
+  Fit the position and the path loss of one AP
+
+  @param o the observations of the AP
+  @param n the number of observations
+  @param ap the AP fitted
+  @param st the counters
+  @return false if heard too few times
+*/
+static bool fitAP(const ab_obs_t *o, int n, ab_ap_t *ap, ab_stats_t &st) {
+  if (n < AB_MINOBS) {
+    st.few++;
+    return false;
+  }
+  // The fixes, in meters from the first one
+  double lat0 = o[0].lat / 1e7, lng0 = o[0].lng / 1e7;
+  double ky = 111194.93, kx = ky * cos(lat0 * M_PI / 180);
+  std::vector<double> x(n), y(n), r(n), s2(n), res(n);
+  std::vector<bool> on(n, true);
+  for (int i = 0; i < n; i++) {
+    x[i] = (o[i].lng / 1e7 - lng0) * kx;
+    y[i] = (o[i].lat / 1e7 - lat0) * ky;
+    r[i] = o[i].rssi;
+    double a = std::max((double)o[i].acc, AB_MINACC);
+    s2[i] = a * a;
+  }
+  // Start at the centroid, weighted by the received power
+  double sw = 0, px = 0, py = 0;
+  for (int i = 0; i < n; i++) {
+    double w = pow(10.0, r[i] / 10.0) / s2[i];
+    sw += w;
+    px += w * x[i];
+    py += w * y[i];
+  }
+  px /= sw;
+  py /= sw;
+  double p0 = AB_P0, pn = AB_PATHN;
+  double hxx = 0, hxy = 0, hyy = 0, chi2 = 0;
+  int m = n;
+  bool solved = false;
+  for (int round = 0; round < AB_ROUNDS; round++) {
+    for (int step = 0; step < AB_STEPS; step++) {
+      // The path loss, at the current position
+      double sw = 0, sl = 0, sr = 0, sll = 0, slr = 0;
+      for (int i = 0; i < n; i++) {
+        if (not on[i]) continue;
+        double l = log10(std::max(1.0, hypot(px - x[i], py - y[i])));
+        sw  += 1;
+        sl  += l;
+        sr  += r[i];
+        sll += l * l;
+        slr += l * r[i];
+      }
+      double var = sll / sw - (sl / sw) * (sl / sw);
+      pn = AB_PATHN;
+      if (m >= AB_FITOBS and var > 0.01)
+        pn = std::max(AB_MINN, std::min(AB_MAXN, -(slr / sw - sl / sw * sr / sw) / var / 10));
+      p0 = (sr + 10 * pn * sl) / sw;
+      // One Gauss-Newton step on the ranges
+      double gx = 0, gy = 0;
+      hxx = hxy = hyy = chi2 = 0;
+      for (int i = 0; i < n; i++) {
+        double dx = px - x[i], dy = py - y[i];
+        double d = std::max(0.5, hypot(dx, dy));
+        double rng = std::min(AB_MAXRANGE, std::max(1.0, pow(10.0, (p0 - r[i]) / (10 * pn))));
+        res[i] = d - rng;
+        if (not on[i]) continue;
+        double w = 1 / (s2[i] + (AB_RANGEERR * rng) * (AB_RANGEERR * rng));
+        double ux = dx / d, uy = dy / d;
+        hxx += w * ux * ux;
+        hxy += w * ux * uy;
+        hyy += w * uy * uy;
+        gx  += w * ux * res[i];
+        gy  += w * uy * res[i];
+        chi2 += w * res[i] * res[i];
+      }
+      // Damped, for the fixes all on a line
+      double damp = 1e-6 * (hxx + hyy);
+      double det = (hxx + damp) * (hyy + damp) - hxy * hxy;
+      if (det <= 0) break;
+      double sx = -((hyy + damp) * gx - hxy * gy) / det;
+      double sy = -((hxx + damp) * gy - hxy * gx) / det;
+      double len = hypot(sx, sy);
+      if (len > 200) {
+        sx *= 200 / len;
+        sy *= 200 / len;
+      }
+      px += sx;
+      py += sy;
+      solved = true;
+      if (len < 0.1) break;
+    }
+    // Drop the observations over AB_OUTMAD times the median deviation
+    std::vector<double> dev;
+    for (int i = 0; i < n; i++)
+      if (on[i]) dev.push_back(fabs(res[i]));
+    std::nth_element(dev.begin(), dev.begin() + dev.size() / 2, dev.end());
+    double limit = std::max(AB_OUTMIN, AB_OUTMAD * 1.4826 * dev[dev.size() / 2]);
+    int dropped = 0;
+    for (int i = 0; i < n; i++)
+      if (on[i] and fabs(res[i]) > limit) dropped++;
+    if (dropped == 0 or m - dropped < AB_MINOBS) break;
+    for (int i = 0; i < n; i++)
+      if (on[i] and fabs(res[i]) > limit) on[i] = false;
+    m -= dropped;
+    st.outliers += dropped;
+  }
+  // The accuracy, from the covariance of the fit
+  double acc;
+  double det = hxx * hyy - hxy * hxy;
+  if (solved and det > 1e-12) {
+    double scale = std::max(1.0, chi2 / std::max(1, m - 2));
+    acc = sqrt((hxx + hyy) / det * scale);
+  }
+  else {
+    // The spread of the fixes
+    double s = 0;
+    for (int i = 0; i < n; i++)
+      s += (px - x[i]) * (px - x[i]) + (py - y[i]) * (py - y[i]) + s2[i];
+    acc = sqrt(s / n);
+  }
+  ap->key = o[0].key;
+  ap->lat = (int32_t)lround((lat0 + py / ky) * 1e7);
+  ap->lng = (int32_t)lround((lng0 + px / kx) * 1e7);
+  ap->acc = (uint16_t)std::max(1.0, std::min(acc, 65535.0));
+  ap->p0  = (int16_t)lround(p0 * 10);
+  ap->n   = (uint16_t)lround(pn * 100);
+  ap->reserved = 0;
+  ap->obs = m;
+  st.fitted++;
+  st.used += m;
+  return true;
+}
+
+/**
+  Read a state file: a magic, a count and the records
+*/
+template <typename T>
+static bool loadState(const std::string &path, uint32_t magic, std::vector<T> &out) {
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (fp == NULL) return false;
+  uint32_t hdr[2];
+  bool ok = fread(hdr, sizeof(hdr), 1, fp) == 1 and hdr[0] == magic;
+  if (ok) {
+    size_t at = out.size();
+    out.resize(at + hdr[1]);
+    ok = fread(out.data() + at, sizeof(T), hdr[1], fp) == hdr[1];
+  }
+  fclose(fp);
+  return ok;
+}
+
+template <typename T>
+static bool saveState(const std::string &path, uint32_t magic, const std::vector<T> &in) {
+  std::string tmp = path + ".tmp";
+  FILE *fp = fopen(tmp.c_str(), "wb");
+  if (fp == NULL) return false;
+  uint32_t hdr[2] = {magic, (uint32_t)in.size()};
+  bool ok = fwrite(hdr, sizeof(hdr), 1, fp) == 1 and
+            fwrite(in.data(), sizeof(T), in.size(), fp) == in.size();
+  ok = fclose(fp) == 0 and ok;
+  return ok and rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+static int32_t tileOf(int32_t v) {
+  return (int32_t)floor(v / (1e7 / AB_TILESCALE));
+}
+
+/**
+  Write the tiles, all of them or those listed
+
+  @param dir the tiles directory
+  @param aps the APs, sorted by BSSID
+  @param only the tiles to write, all if NULL
+  @return the tiles written, -1 on error
+*/
+static long writeTiles(const char *dir, const std::vector<ab_ap_t> &aps, const std::unordered_set<uint64_t> *only) {
+  std::vector<std::pair<uint64_t, uint32_t>> order;
+  order.reserve(aps.size());
+  for (uint32_t i = 0; i < aps.size(); i++) {
+    uint64_t tile = ((uint64_t)(uint32_t)tileOf(aps[i].lat) << 32) | (uint32_t)tileOf(aps[i].lng);
+    if (only == NULL or only->count(tile)) order.push_back({tile, i});
+  }
+  // By tile, by BSSID within the tile, as the APs are
+  std::stable_sort(order.begin(), order.end(), [](const std::pair<uint64_t, uint32_t> &a,
+                                                   const std::pair<uint64_t, uint32_t> &b) {
+    return a.first < b.first;
+  });
+  mkdir(dir, 0755);
+  long written = 0;
+  for (size_t i = 0; i < order.size();) {
+    size_t j = i;
+    while (j < order.size() and order[j].first == order[i].first and j - i < UINT16_MAX) j++;
+    int16_t tlat = (int16_t)(int32_t)(order[i].first >> 32);
+    int16_t tlng = (int16_t)(int32_t)(order[i].first & 0xFFFFFFFF);
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%d", dir, tlat);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/%d/%d.bin", dir, tlat, tlng);
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) return -1;
+    ab_tile_hdr_t hdr = {AB_TILEMAGIC, tlat, tlng, (uint16_t)(j - i), 0};
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    for (size_t k = i; k < j; k++) {
+      const ab_ap_t &ap = aps[order[k].second];
+      ab_tile_ap_t t;
+      for (int b = 0; b < 6; b++) t.bssid[b] = ap.key >> (40 - 8 * b);
+      t.dlat = (uint16_t)std::min(10000L, (long)(ap.lat - (int64_t)tlat * (10000000 / AB_TILESCALE)) / 10);
+      t.dlng = (uint16_t)std::min(10000L, (long)(ap.lng - (int64_t)tlng * (10000000 / AB_TILESCALE)) / 10);
+      fwrite(&t, sizeof(t), 1, fp);
+    }
+    if (fclose(fp) != 0) return -1;
+    written++;
+    i = j;
+  }
+  return written;
+}
+
+/**
+  Write the database file, with the tile index, replacing it at once
+
+  @param path the file
+  @param aps the APs, sorted by BSSID
+  @return true if written
+*/
+static bool writeDB(const char *path, const std::vector<ab_ap_t> &aps) {
+  // By tile, biased to sort as signed, by BSSID within the tile
+  std::vector<std::pair<uint32_t, uint32_t>> order;
+  order.reserve(aps.size());
+  for (uint32_t i = 0; i < aps.size(); i++)
+    order.push_back({((uint32_t)(tileOf(aps[i].lat) + 32768) << 16) | (uint32_t)(tileOf(aps[i].lng) + 32768), i});
+  std::stable_sort(order.begin(), order.end(), [](const std::pair<uint32_t, uint32_t> &a,
+                                                   const std::pair<uint32_t, uint32_t> &b) {
+    return a.first < b.first;
+  });
+  std::vector<apdb_tile_t> tiles;
+  for (uint32_t i = 0; i < order.size(); i++)
+    if (i == 0 or order[i].first != order[i - 1].first)
+      tiles.push_back({(int16_t)((order[i].first >> 16) - 32768), (int16_t)((order[i].first & 0xFFFF) - 32768), i, 0});
+  for (size_t t = 0; t < tiles.size(); t++)
+    tiles[t].count = (t + 1 < tiles.size() ? tiles[t + 1].first : order.size()) - tiles[t].first;
+  apdb_hdr_t hdr;
+  apdb_layout(&hdr, aps.size(), tiles.size(), AB_TILESCALE);
+  std::vector<uint8_t> img(hdr.size, 0);
+  memcpy(img.data(), &hdr, sizeof(hdr));
+  for (uint32_t i = 0; i < aps.size(); i++) {
+    for (int b = 0; b < APDB_KEYLEN; b++)
+      img[hdr.keys + i * APDB_KEYLEN + b] = aps[i].key >> (40 - 8 * b);
+    memcpy(&img[hdr.lat + i * sizeof(int32_t)],  &aps[i].lat, sizeof(int32_t));
+    memcpy(&img[hdr.lng + i * sizeof(int32_t)],  &aps[i].lng, sizeof(int32_t));
+    memcpy(&img[hdr.acc + i * sizeof(uint16_t)], &aps[i].acc, sizeof(uint16_t));
+  }
+  if (not tiles.empty())
+    memcpy(&img[hdr.tile], tiles.data(), tiles.size() * sizeof(apdb_tile_t));
+  for (uint32_t i = 0; i < order.size(); i++)
+    memcpy(&img[hdr.member + i * sizeof(uint32_t)], &order[i].second, sizeof(uint32_t));
+  // A new file, the readers keep the old one mapped
+  std::string tmp = std::string(path) + ".tmp";
+  FILE *fp = fopen(tmp.c_str(), "wb");
+  if (fp == NULL) return false;
+  bool ok = fwrite(img.data(), 1, img.size(), fp) == img.size();
+  ok = fclose(fp) == 0 and ok;
+  return ok and rename(tmp.c_str(), path) == 0;
+}
+
+static bool writeCSV(const char *path, const std::vector<ab_ap_t> &aps) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) return false;
+  for (const ab_ap_t &ap : aps)
+    fprintf(fp, "%02x:%02x:%02x:%02x:%02x:%02x,%.7f,%.7f,%u,%.1f,%.2f,%u\n",
+            (unsigned)(ap.key >> 40) & 0xFF, (unsigned)(ap.key >> 32) & 0xFF,
+            (unsigned)(ap.key >> 24) & 0xFF, (unsigned)(ap.key >> 16) & 0xFF,
+            (unsigned)(ap.key >> 8) & 0xFF, (unsigned)ap.key & 0xFF,
+            ap.lat / 1e7, ap.lng / 1e7, ap.acc, ap.p0 / 10.0, ap.n / 100.0, ap.obs);
+  return fclose(fp) == 0;
+}
+
+int main(int argc, char *argv[]) {
+  int threads = std::thread::hardware_concurrency();
+  if (threads < 1) threads = 1;
+  const char *state = NULL, *tileDir = NULL, *db = NULL, *csv = NULL;
+  bool full = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:s:o:d:c:f")) != -1) {
+    if      (opt == 't') threads = std::max(1, atoi(optarg));
+    else if (opt == 's') state = optarg;
+    else if (opt == 'o') tileDir = optarg;
+    else if (opt == 'd') db = optarg;
+    else if (opt == 'c') csv = optarg;
+    else if (opt == 'f') full = true;
+    else {
+      fprintf(stderr, "Usage: %s [-t THREADS] [-s STATE] [-o DIR] [-d DB] [-c FILE] [-f] [FILE...]\n", argv[0]);
+      return 1;
+    }
+  }
+  auto start = std::chrono::steady_clock::now();
+
+  // The new observations
+  std::vector<ab_obs_t> fresh;
+  size_t bad = 0;
+  if (optind == argc) bad += readObs(stdin, fresh);
+  for (int i = optind; i < argc; i++) {
+    FILE *fp = fopen(argv[i], "r");
+    if (fp == NULL) {
+      perror(argv[i]);
+      return 1;
+    }
+    bad += readObs(fp, fresh);
+    fclose(fp);
+  }
+
+  // With a state, the old observations too, all or only of the APs heard again
+  std::vector<ab_obs_t> obs;
+  std::vector<ab_ap_t> old;
+  std::unordered_set<uint64_t> dirty;
+  std::string obsPath, apsPath;
+  if (state != NULL) {
+    mkdir(state, 0755);
+    obsPath = std::string(state) + "/obs.bin";
+    apsPath = std::string(state) + "/aps.bin";
+    if (not full and not loadState(apsPath, AB_APSMAGIC, old)) full = true;
+    if (not loadState(obsPath, AB_OBSMAGIC, obs) and errno != ENOENT) {
+      fprintf(stderr, "apbuild: bad state %s\n", obsPath.c_str());
+      return 1;
+    }
+  }
+  else full = true;
+  size_t before = obs.size();
+  obs.insert(obs.end(), fresh.begin(), fresh.end());
+  if (state != NULL and not saveState(obsPath, AB_OBSMAGIC, obs)) {
+    perror(obsPath.c_str());
+    return 1;
+  }
+  if (not full)
+    for (const ab_obs_t &o : fresh) dirty.insert(o.key);
+
+  // Split in buckets by BSSID, only the dirty APs when incremental
+  std::vector<std::vector<ab_obs_t>> buckets(AB_BUCKETS);
+  size_t work = 0;
+  for (const ab_obs_t &o : obs)
+    if (full or dirty.count(o.key)) {
+      buckets[mix(o.key) % AB_BUCKETS].push_back(o);
+      work++;
+    }
+  std::vector<ab_obs_t>().swap(obs);
+
+  // Fit the buckets in parallel
+  std::vector<std::vector<ab_ap_t>> fitted(AB_BUCKETS);
+  std::vector<ab_stats_t> stats(threads);
+  memset(stats.data(), 0, stats.size() * sizeof(ab_stats_t));
+  StealPool pool(threads);
+  pool.run(AB_BUCKETS, [&](size_t b, int t) {
+    std::vector<ab_obs_t> &v = buckets[b];
+    std::stable_sort(v.begin(), v.end(), [](const ab_obs_t &a, const ab_obs_t &c) {
+      return a.key < c.key;
+    });
+    for (size_t i = 0; i < v.size();) {
+      size_t j = i;
+      while (j < v.size() and v[j].key == v[i].key) j++;
+      ab_ap_t ap;
+      if (fitAP(v.data() + i, (int)(j - i), &ap, stats[t])) fitted[b].push_back(ap);
+      i = j;
+    }
+    std::vector<ab_obs_t>().swap(v);
+  });
+
+  // Merge with the APs not heard again, sorted by BSSID
+  std::vector<ab_ap_t> aps;
+  std::unordered_set<uint64_t> touched;
+  for (const ab_ap_t &ap : old) {
+    if (dirty.count(ap.key)) touched.insert(((uint64_t)(uint32_t)tileOf(ap.lat) << 32) | (uint32_t)tileOf(ap.lng));
+    else                     aps.push_back(ap);
+  }
+  for (auto &f : fitted)
+    for (const ab_ap_t &ap : f) {
+      aps.push_back(ap);
+      touched.insert(((uint64_t)(uint32_t)tileOf(ap.lat) << 32) | (uint32_t)tileOf(ap.lng));
+    }
+  std::sort(aps.begin(), aps.end(), [](const ab_ap_t &a, const ab_ap_t &b) {
+    return a.key < b.key;
+  });
+  if (state != NULL and not saveState(apsPath, AB_APSMAGIC, aps)) {
+    perror(apsPath.c_str());
+    return 1;
+  }
+  long tiles = 0;
+  if (tileDir != NULL and (tiles = writeTiles(tileDir, aps, full ? NULL : &touched)) < 0) {
+    perror(tileDir);
+    return 1;
+  }
+  if (db != NULL and not writeDB(db, aps)) {
+    perror(db);
+    return 1;
+  }
+  if (csv != NULL and not writeCSV(csv, aps)) {
+    perror(csv);
+    return 1;
+  }
+
+  // Report
+  ab_stats_t total;
+  memset(&total, 0, sizeof(total));
+  for (const ab_stats_t &s : stats) {
+    total.fitted   += s.fitted;
+    total.few      += s.few;
+    total.outliers += s.outliers;
+    total.used     += s.used;
+  }
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  fprintf(stderr, "apbuild: %zu observations, %zu new, %zu bad; %zu refitted, %s\n",
+          before + fresh.size(), fresh.size(), bad, work, full ? "full" : "incremental");
+  fprintf(stderr, "apbuild: %llu APs fitted, %llu heard too few times, %llu outliers; %zu APs, %ld tiles written\n",
+          (unsigned long long)total.fitted, (unsigned long long)total.few,
+          (unsigned long long)total.outliers, aps.size(), tiles);
+  fprintf(stderr, "apbuild: %d threads, %llu steals, %.2f s\n",
+          threads, (unsigned long long)pool.steals, wall);
+  return 0;
+}
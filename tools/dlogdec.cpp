@@ -0,0 +1,179 @@
+/**
+  dlogdec.cpp - Host decoder for the deferred formatting log
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  Build:  g++ -O2 -o dlogdec tools/dlogdec.cpp
+  Usage:  dlogdec [-l] [FILE]
+
+  Reads the serial output of a tracker built with DLOG_BINARY (from FILE,
+  or stdin), renders the binary frames using the same message catalog the
+  firmware was built with, and passes any plain text through unchanged.
+  With -l, print the catalog and exit.
+*/
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include "../dlogmsg.h"
+
+struct dlog_msg_t {
+  const char *name;
+  const char *sig;
+  const char *fmt;
+};
+
+// The catalog, generated from the same list as on the device
+#define DLOG_ENTRY(id, sig, fmt) {#id, sig, fmt},
+static const dlog_msg_t catalog[] = {
+  DLOG_CATALOG(DLOG_ENTRY)
+};
+#undef DLOG_ENTRY
+static const size_t catalogSize = sizeof(catalog) / sizeof(catalog[0]);
+
+/**
+  Render a frame payload using the catalog format
+
+  @param msg the catalog entry
+  @param data the payload
+  @param len the payload length
+*/
+static void render(const dlog_msg_t *msg, const uint8_t *data, size_t len, FILE *out) {
+  const char *f = msg->fmt;
+  const char *s = msg->sig;
+  size_t pos = 0;
+  while (*f) {
+    if (*f != '%') {
+      fputc(*f++, out);
+      continue;
+    }
+    if (f[1] == '%') {
+      fputc('%', out);
+      f += 2;
+      continue;
+    }
+    // Collect the flags, width and precision, drop the length modifiers
+    char spec[32] = "%";
+    size_t sl = 1;
+    f++;
+    while (*f and strchr("-+ #0123456789.", *f) and sl < sizeof(spec) - 4)
+      spec[sl++] = *f++;
+    while (*f and strchr("hlLqjzt", *f))
+      f++;
+    char conv = *f ? *f++ : 'd';
+    // Missing argument, the frame was truncated
+    if (*s == '\0') {
+      fputs("?", out);
+      continue;
+    }
+    char sig = *s++;
+    if (sig == 's') {
+      if (pos >= len) break;
+      size_t slen = data[pos++];
+      if (pos + slen > len) slen = len - pos;
+      char str[256];
+      memcpy(str, data + pos, slen);
+      str[slen] = '\0';
+      pos += slen;
+      spec[sl++] = 's';
+      spec[sl] = '\0';
+      fprintf(out, spec, str);
+    }
+    else {
+      if (pos + 4 > len) break;
+      uint32_t raw = (uint32_t)data[pos] | ((uint32_t)data[pos + 1] << 8) |
+                     ((uint32_t)data[pos + 2] << 16) | ((uint32_t)data[pos + 3] << 24);
+      pos += 4;
+      if (sig == 'f') {
+        float val;
+        memcpy(&val, &raw, sizeof(val));
+        spec[sl++] = strchr("eEfFgG", conv) ? conv : 'f';
+        spec[sl] = '\0';
+        fprintf(out, spec, (double)val);
+      }
+      else {
+        spec[sl++] = 'l';
+        spec[sl++] = 'l';
+        spec[sl++] = strchr("diouxXc", conv) ? conv : 'd';
+        spec[sl] = '\0';
+        if (sig == 'i') fprintf(out, spec, (long long)(int32_t)raw);
+        else            fprintf(out, spec, (unsigned long long)raw);
+      }
+    }
+  }
+}
+
+/**
+  List the catalog
+*/
+static void list(FILE *out) {
+  for (size_t i = 0; i < catalogSize; i++) {
+    fprintf(out, "%3zu %-12s %-10s ", i, catalog[i].name, catalog[i].sig);
+    // Escape the line endings
+    for (const char *f = catalog[i].fmt; *f; f++) {
+      if      (*f == '\r') fputs("\\r", out);
+      else if (*f == '\n') fputs("\\n", out);
+      else                 fputc(*f, out);
+    }
+    fputc('\n', out);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  FILE *in = stdin;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-l") == 0) {
+      list(stdout);
+      return 0;
+    }
+    else if ((in = fopen(argv[i], "rb")) == NULL) {
+      perror(argv[i]);
+      return 1;
+    }
+  }
+
+  int c;
+  unsigned long bad = 0;
+  while ((c = fgetc(in)) != EOF) {
+    // Plain text, pass it through
+    if (c != DLOG_SYNC) {
+      fputc(c, stdout);
+      continue;
+    }
+    // Frame header
+    int id  = fgetc(in);
+    int len = fgetc(in);
+    if (id == EOF or len == EOF) break;
+    uint8_t data[256];
+    if (fread(data, 1, len, in) != (size_t)len) break;
+    int ck = fgetc(in);
+    if (ck == EOF) break;
+    // Validate
+    uint8_t sum = id ^ len;
+    for (int i = 0; i < len; i++)
+      sum ^= data[i];
+    if (sum != ck or (size_t)id >= catalogSize) {
+      bad++;
+      continue;
+    }
+    render(&catalog[id], data, len, stdout);
+    fflush(stdout);
+  }
+  if (bad) fprintf(stderr, "dlogdec: %lu bad frames\n", bad);
+  if (in != stdin) fclose(in);
+  return 0;
+}
@@ -0,0 +1,273 @@
+/**
+  geocache.cpp - LAN geolocation cache service, the gateway resolver
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  Build:  g++ -O2 -pthread -o geocache tools/geocache.cpp
+  Usage:  geocache [-p PORT] [-t THREADS] [-e SECONDS] [-m PCT]
+
+  Answers the trackers on the LAN (UDP port 10111, lanmsg.h) with the
+  fixes other trackers stored for the same APs, so only the first of
+  them asks the geolocation server.  The fixes are kept up to SECONDS
+  (86400), a query needs PCT (60) of its APs in common with a stored
+  fingerprint.  The trackers find the service by mDNS, advertise it on
+  the host, for example:
+
+    avahi-publish -s wipsgeo _wipsgeo._udp 10111
+
+  or set LAN_SERVER in the tracker configuration.
+
+  Each worker thread owns a SO_REUSEPORT socket and an epoll set,
+  receives in batches with recvmmsg() and answers with sendmmsg().  The
+  cache is shared, a hash map in shards with a lock each (geocache.h).
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <csignal>
+#include <ctime>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "geocache.h"
+
+// Datagrams received in one recvmmsg() call
+#define GC_BATCH    64
+// Maximum datagram size
+#define GC_DGRAM    512
+// Sweep the old fixes this often (s)
+#define GC_SWEEP    60
+
+// Per worker counters
+struct gc_stats_t {
+  uint64_t  packets;
+  uint64_t  bad;
+  uint64_t  answers;
+};
+
+static std::atomic<bool> running(true);
+
+static void onSignal(int) {
+  running = false;
+}
+
+static uint32_t nowSec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)ts.tv_sec;
+}
+
+class Worker {
+  public:
+    Worker(int id, const sockaddr_in &addr, GeoCache *cache): id(id), addr(addr), cache(cache) {
+      memset(&stats, 0, sizeof(stats));
+    }
+    bool open();
+    void run();
+    gc_stats_t stats;
+  private:
+    int  handle(const uint8_t *msg, size_t len, uint8_t *rsp, uint32_t now);
+    int  id;
+    int  sock = -1;
+    int  ep   = -1;
+    sockaddr_in addr;
+    GeoCache *cache;
+};
+
+bool Worker::open() {
+  sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (sock < 0) return false;
+  int one = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+  if (bind(sock, (const sockaddr*)&addr, sizeof(addr)) < 0) return false;
+  ep = epoll_create1(0);
+  if (ep < 0) return false;
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = sock;
+  return epoll_ctl(ep, EPOLL_CTL_ADD, sock, &ev) == 0;
+}
+
+void Worker::run() {
+  // Receive and answer buffers, allocated once
+  static thread_local uint8_t bufs[GC_BATCH][GC_DGRAM];
+  static thread_local uint8_t rsps[GC_BATCH][sizeof(lan_hdr_t) + sizeof(lan_fix_t)];
+  mmsghdr msgs[GC_BATCH], outs[GC_BATCH];
+  iovec iovs[GC_BATCH], oiovs[GC_BATCH];
+  sockaddr_in srcs[GC_BATCH];
+  uint32_t lastSweep = nowSec();
+  while (running) {
+    epoll_event ev;
+    int ne = epoll_wait(ep, &ev, 1, 500);
+    uint32_t now = nowSec();
+    if (ne > 0) {
+      // Drain the socket in batches
+      while (true) {
+        for (int i = 0; i < GC_BATCH; i++) {
+          iovs[i].iov_base = bufs[i];
+          iovs[i].iov_len  = GC_DGRAM;
+          memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+          msgs[i].msg_hdr.msg_iov     = &iovs[i];
+          msgs[i].msg_hdr.msg_iovlen  = 1;
+          msgs[i].msg_hdr.msg_name    = &srcs[i];
+          msgs[i].msg_hdr.msg_namelen = sizeof(srcs[i]);
+        }
+        int nr = recvmmsg(sock, msgs, GC_BATCH, MSG_DONTWAIT, NULL);
+        if (nr <= 0) break;
+        stats.packets += nr;
+        // The answers of the batch, sent together
+        int no = 0;
+        for (int i = 0; i < nr; i++) {
+          int len = handle(bufs[i], msgs[i].msg_len, rsps[no], now);
+          if (len <= 0) continue;
+          oiovs[no].iov_base = rsps[no];
+          oiovs[no].iov_len  = len;
+          memset(&outs[no].msg_hdr, 0, sizeof(outs[no].msg_hdr));
+          outs[no].msg_hdr.msg_iov     = &oiovs[no];
+          outs[no].msg_hdr.msg_iovlen  = 1;
+          outs[no].msg_hdr.msg_name    = &srcs[i];
+          outs[no].msg_hdr.msg_namelen = sizeof(srcs[i]);
+          no++;
+        }
+        for (int sent = 0; sent < no;) {
+          int ns = sendmmsg(sock, outs + sent, no - sent, 0);
+          if (ns <= 0) break;
+          sent += ns;
+          stats.answers += ns;
+        }
+        if (nr < GC_BATCH) break;
+      }
+    }
+    // One worker sweeps the cache
+    if (id == 0 and now - lastSweep >= GC_SWEEP) {
+      cache->expire(now);
+      lastSweep = now;
+    }
+  }
+  close(ep);
+  close(sock);
+}
+
+/**
+  Handle one datagram
+
+  @param msg the datagram
+  @param len the datagram length
+  @param rsp the answer buffer
+  @param now the time (s)
+  @return the answer length, zero if none
+*/
+int Worker::handle(const uint8_t *msg, size_t len, uint8_t *rsp, uint32_t now) {
+  lan_hdr_t hdr;
+  if (len < sizeof(hdr)) {
+    stats.bad++;
+    return 0;
+  }
+  memcpy(&hdr, msg, sizeof(hdr));
+  size_t fixLen = hdr.op == LAN_STORE ? sizeof(lan_fix_t) : 0;
+  if (hdr.magic != LAN_MAGIC or hdr.count == 0 or hdr.count > LAN_APS or
+      (hdr.op != LAN_QUERY and hdr.op != LAN_STORE) or
+      len < sizeof(hdr) + fixLen + hdr.count * sizeof(lan_ap_t)) {
+    stats.bad++;
+    return 0;
+  }
+  lan_ap_t aps[LAN_APS];
+  memcpy(aps, msg + sizeof(hdr) + fixLen, hdr.count * sizeof(lan_ap_t));
+  if (hdr.op == LAN_STORE) {
+    lan_fix_t fix;
+    memcpy(&fix, msg + sizeof(hdr), sizeof(fix));
+    cache->store(aps, hdr.count, fix, now);
+    return 0;
+  }
+  lan_fix_t fix;
+  bool hit = cache->lookup(aps, hdr.count, now, &fix);
+  lan_hdr_t rhdr = {LAN_MAGIC, (uint8_t)(hit ? LAN_FIX : LAN_MISS), 0, hdr.seq};
+  memcpy(rsp, &rhdr, sizeof(rhdr));
+  if (not hit) return sizeof(rhdr);
+  memcpy(rsp + sizeof(rhdr), &fix, sizeof(fix));
+  return sizeof(rhdr) + sizeof(fix);
+}
+
+int main(int argc, char *argv[]) {
+  int port = LAN_PORT;
+  int threads = std::thread::hardware_concurrency();
+  if (threads < 1) threads = 1;
+  uint32_t maxAge = 86400;
+  int samePct = LAN_SAMEPCT;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:t:e:m:")) != -1) {
+    if      (opt == 'p') port = atoi(optarg);
+    else if (opt == 't') threads = atoi(optarg);
+    else if (opt == 'e') maxAge = atol(optarg);
+    else if (opt == 'm') samePct = atoi(optarg);
+    else {
+      fprintf(stderr, "Usage: %s [-p PORT] [-t THREADS] [-e SECONDS] [-m PCT]\n", argv[0]);
+      return 1;
+    }
+  }
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  GeoCache *cache = new GeoCache(maxAge, samePct);
+  std::vector<Worker*> workers;
+  for (int i = 0; i < threads; i++) {
+    Worker *w = new Worker(i, addr, cache);
+    if (not w->open()) {
+      perror("socket");
+      return 1;
+    }
+    workers.push_back(w);
+  }
+  std::vector<std::thread> pool;
+  for (Worker *w : workers)
+    pool.emplace_back(&Worker::run, w);
+  fprintf(stderr, "geocache: listening on UDP %d, %d threads\n", port, threads);
+  for (std::thread &t : pool)
+    t.join();
+
+  // Report
+  gc_stats_t total;
+  memset(&total, 0, sizeof(total));
+  for (Worker *w : workers) {
+    total.packets += w->stats.packets;
+    total.bad     += w->stats.bad;
+    total.answers += w->stats.answers;
+    delete w;
+  }
+  fprintf(stderr, "geocache: %llu packets, %llu bad, %llu answers, %llu queries, %llu hits, %llu stores\n",
+          (unsigned long long)total.packets, (unsigned long long)total.bad,
+          (unsigned long long)total.answers, (unsigned long long)cache->queries.load(),
+          (unsigned long long)cache->hits.load(), (unsigned long long)cache->stores.load());
+  delete cache;
+  return 0;
+}
@@ -0,0 +1,249 @@
+/**
+  geocache.h - Concurrent geolocation cache, keyed by the AP fingerprints
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  The fixes are kept by the fingerprint key, the hash of the three
+  strongest BSSIDs, and each BSSID indexes the last keys it was stored
+  with.  A query votes the keys of its BSSIDs, then checks the best few
+  against the share of APs in common, LAN_SAMEPCT by default.
+
+  Both maps are split in shards, each with its own lock, by the hash of
+  the key or of the BSSID.  No lock is held while taking another one, a
+  query copies what it needs out of a shard.  Used by tools/geocache and,
+  single threaded, by the fleet simulator.
+*/
+
+#ifndef GEOCACHE_H
+#define GEOCACHE_H
+
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <unordered_map>
+
+#include "../lanmsg.h"
+
+// Lock shards, a power of two
+#define GC_SHARDS     64
+// Keys remembered per BSSID
+#define GC_REFS       8
+// Candidate keys checked per query
+#define GC_CANDIDATES 4
+// Query BSSIDs voting, the strongest
+#define GC_VOTERS     8
+
+class GeoCache {
+  public:
+    GeoCache(uint32_t maxAge = 86400, int samePct = LAN_SAMEPCT): maxAge(maxAge), samePct(samePct) {}
+
+    /**
+      Find a fix of a fingerprint
+
+      @param aps the APs
+      @param count the number of APs
+      @param now the time (s)
+      @param fix the fix found, with its age
+      @return true if found
+    */
+    bool lookup(const lan_ap_t *aps, int count, uint32_t now, lan_fix_t *fix) {
+      queries.fetch_add(1, std::memory_order_relaxed);
+      uint64_t bss[LAN_APS];
+      int n = fingerprint(aps, count, bss);
+      if (n == 0) return false;
+      // The votes of the strongest APs
+      uint64_t keys[GC_VOTERS * GC_REFS];
+      int votes[GC_VOTERS * GC_REFS];
+      int nkeys = 0;
+      for (int i = 0; i < n and i < GC_VOTERS; i++) {
+        uint64_t refs[GC_REFS];
+        int nrefs = 0;
+        Shard &s = shards[mix(bss[i]) & (GC_SHARDS - 1)];
+        {
+          std::lock_guard<std::mutex> g(s.lock);
+          auto it = s.index.find(bss[i]);
+          if (it == s.index.end() or expired(it->second.time, now)) continue;
+          nrefs = it->second.count;
+          memcpy(refs, it->second.keys, nrefs * sizeof(uint64_t));
+        }
+        for (int r = 0; r < nrefs; r++) {
+          int k = 0;
+          while (k < nkeys and keys[k] != refs[r]) k++;
+          if (k == nkeys) {
+            keys[nkeys] = refs[r];
+            votes[nkeys++] = 0;
+          }
+          votes[k]++;
+        }
+      }
+      // Check the candidates with the most votes, keep the best overlap
+      std::sort(bss, bss + n);
+      int best = -1;
+      for (int c = 0; c < GC_CANDIDATES and nkeys > 0; c++) {
+        int k = std::max_element(votes, votes + nkeys) - votes;
+        uint64_t key = keys[k];
+        keys[k] = keys[--nkeys];
+        votes[k] = votes[nkeys];
+        Shard &s = shards[key & (GC_SHARDS - 1)];
+        std::lock_guard<std::mutex> g(s.lock);
+        auto it = s.fixes.find(key);
+        if (it == s.fixes.end() or expired(it->second.time, now)) continue;
+        const Entry &e = it->second;
+        int same = 0;
+        for (int i = 0; i < n; i++)
+          if (std::binary_search(e.bss, e.bss + e.count, bss[i])) same++;
+        if (same * 100 >= n * samePct and same > best) {
+          best = same;
+          *fix = e.fix;
+          fix->age = std::min<uint32_t>(now - e.time, UINT16_MAX);
+        }
+      }
+      if (best < 0) return false;
+      hits.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+
+    /**
+      Store the fix of a fingerprint, replacing the one with the same key
+
+      @param aps the APs
+      @param count the number of APs
+      @param fix the fix
+      @param now the time (s)
+    */
+    void store(const lan_ap_t *aps, int count, const lan_fix_t &fix, uint32_t now) {
+      Entry e;
+      e.count = fingerprint(aps, count, e.bss);
+      if (e.count == 0) return;
+      stores.fetch_add(1, std::memory_order_relaxed);
+      uint64_t key = keyOf(e.bss, e.count);
+      // The index first, by the strongest APs
+      for (int i = 0; i < e.count; i++) {
+        Shard &s = shards[mix(e.bss[i]) & (GC_SHARDS - 1)];
+        std::lock_guard<std::mutex> g(s.lock);
+        Ref &r = s.index[e.bss[i]];
+        r.time = now;
+        if (std::find(r.keys, r.keys + r.count, key) != r.keys + r.count) continue;
+        r.keys[r.next] = key;
+        r.next = (r.next + 1) % GC_REFS;
+        if (r.count < GC_REFS) r.count++;
+      }
+      e.fix = fix;
+      e.fix.age = 0;
+      e.time = now;
+      std::sort(e.bss, e.bss + e.count);
+      Shard &s = shards[key & (GC_SHARDS - 1)];
+      std::lock_guard<std::mutex> g(s.lock);
+      s.fixes[key] = e;
+    }
+
+    /**
+      Forget the fixes and the index entries too old
+
+      @param now the time (s)
+      @return the fixes forgotten
+    */
+    size_t expire(uint32_t now) {
+      size_t gone = 0;
+      for (Shard &s : shards) {
+        std::lock_guard<std::mutex> g(s.lock);
+        for (auto it = s.fixes.begin(); it != s.fixes.end();)
+          if (now - it->second.time > maxAge) {
+            it = s.fixes.erase(it);
+            gone++;
+          }
+          else ++it;
+        for (auto it = s.index.begin(); it != s.index.end();)
+          if (now - it->second.time > maxAge) it = s.index.erase(it);
+          else                                ++it;
+      }
+      return gone;
+    }
+
+    std::atomic<uint64_t> queries{0};
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> stores{0};
+
+  private:
+    struct Entry {
+      lan_fix_t fix;
+      uint32_t  time;                 // Stored (s)
+      uint8_t   count;
+      uint64_t  bss[LAN_APS];         // Sorted
+    };
+    struct Ref {
+      uint64_t  keys[GC_REFS];
+      uint8_t   count = 0;
+      uint8_t   next  = 0;
+      uint32_t  time  = 0;            // Last stored (s)
+    };
+    struct Shard {
+      std::mutex lock;
+      std::unordered_map<uint64_t, Entry> fixes;
+      std::unordered_map<uint64_t, Ref>   index;
+    };
+
+    /**
+      The BSSIDs as 48 bit integers, the strongest first
+    */
+    static int fingerprint(const lan_ap_t *aps, int count, uint64_t *bss) {
+      int order[LAN_APS];
+      int n = std::min(count, LAN_APS);
+      for (int i = 0; i < n; i++) order[i] = i;
+      std::stable_sort(order, order + n, [&](int a, int b) {
+        return aps[a].rssi > aps[b].rssi;
+      });
+      for (int i = 0; i < n; i++) {
+        uint64_t b = 0;
+        for (int j = 0; j < 6; j++) b = (b << 8) | aps[order[i]].bssid[j];
+        bss[i] = b;
+      }
+      return n;
+    }
+
+    /**
+      The key of a fingerprint, from its three strongest BSSIDs, in any order
+    */
+    static uint64_t keyOf(const uint64_t *bss, int n) {
+      uint64_t top[3] = {0, 0, 0};
+      n = std::min(n, 3);
+      std::copy(bss, bss + n, top);
+      std::sort(top, top + n);
+      uint64_t h = 0;
+      for (int i = 0; i < n; i++) h = mix(h ^ top[i]);
+      return h;
+    }
+
+    static uint64_t mix(uint64_t x) {
+      x += 0x9E3779B97F4A7C15ULL;
+      x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+      return x ^ (x >> 31);
+    }
+
+    // Stored too long ago, or later, in the simulated time
+    bool expired(uint32_t time, uint32_t now) const {
+      return time > now or now - time > maxAge;
+    }
+
+    Shard     shards[GC_SHARDS];
+    uint32_t  maxAge;
+    int       samePct;
+};
+
+#endif /* GEOCACHE_H */
@@ -0,0 +1,742 @@
+/**
+  geoserver.cpp - Self-hosted geolocation server, the /v1/geolocate API
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  Build:  g++ -O2 -march=native -pthread -o geoserver tools/geoserver.cpp
+  Usage:  geoserver -a DB | -d DIR [-p PORT] [-t THREADS]
+
+  Answers POST /v1/geolocate with the subset of the Mozilla Location
+  Service API the trackers use, from a local AP database: the database
+  file DB, in the format of apdb.h, or the tiles the tile server serves,
+  DIR/LAT/LNG.bin, in the format of tiles.h.  The position is the
+  centroid of the APs found, weighted by the signal strength, after
+  dropping the APs too far from it, the accuracy their spread and that
+  of the AP positions.  Plain HTTP, on port 8000; the trackers talk TLS, so put a TLS
+  proxy in front and set GEO_SERVER, GEO_PORT and the pinned key in
+  their configuration.
+
+  The database file is mapped and used as it is, no parsing; the tiles
+  are laid out the same in memory.  The APs of a request are looked up
+  together, a branchless binary search over the sorted 6 byte keys, all
+  queries a step at a time, so the cache misses overlap.
+
+  Each worker thread owns a SO_REUSEPORT listening socket and an epoll
+  set, and keeps its connections.  The database is read only, shared.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <csignal>
+#include <cmath>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <numeric>
+#include <unordered_map>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "../apdb.h"
+
+// The tile files, as in tiles.h
+#define GS_TILEMAGIC  0x31545057UL
+#define GS_TILESCALE  100
+// APs looked up per request, the rest are ignored
+#define GS_QUERY      64
+// Fix only with this many APs found
+#define GS_MINAPS     2
+// Uncertainty of the AP positions from the tiles (m)
+#define GS_APACC      25
+// Drop the APs this far from the centroid (m), with three or more
+#define GS_OUTLIER    300
+// Epoll events per call
+#define GS_EVENTS     64
+// The longest request, headers and body (bytes)
+#define GS_REQMAX     16384
+
+struct __attribute__((packed)) gs_tile_hdr_t {
+  uint32_t  magic;
+  int16_t   lat;
+  int16_t   lng;
+  uint16_t  count;
+  uint16_t  reserved;
+};
+
+struct __attribute__((packed)) gs_tile_ap_t {
+  uint8_t   bssid[6];
+  uint16_t  dlat;
+  uint16_t  dlng;
+};
+
+// Per worker counters
+struct gs_stats_t {
+  uint64_t  requests;
+  uint64_t  found;
+  uint64_t  notfound;
+  uint64_t  bad;
+  uint64_t  aps;
+  uint64_t  nanos;              // Spent resolving
+};
+
+static std::atomic<bool> running(true);
+
+static void onSignal(int) {
+  running = false;
+}
+
+static uint64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+  The AP database, in the layout of apdb.h, mapped from the file or
+  built in memory from the tiles, read only
+*/
+class APIndex {
+  public:
+    ~APIndex();
+    bool    open(const char *path);
+    bool    loadTiles(const char *dir);
+    void    finish();
+    void    find(const uint64_t *query, int n, int32_t *idx) const;
+    size_t  count = 0;
+    size_t  tiles = 0;
+    const int32_t  *lat = NULL;         // 1e-7 degrees
+    const int32_t  *lng = NULL;
+    const uint16_t *acc = NULL;         // m
+  private:
+    bool    loadTile(const char *path);
+    void    attach(const uint8_t *base);
+    uint64_t key(size_t i) const;
+    const uint8_t *keys = NULL;         // 6 bytes each, sorted
+    void   *map    = NULL;
+    size_t  mapLen = 0;
+    std::vector<uint64_t> image;        // Built from the tiles
+    // The tiles being read
+    std::vector<uint64_t> tKeys;
+    std::vector<int32_t>  tLat, tLng;
+};
+
+APIndex::~APIndex() {
+  if (map != NULL) munmap(map, mapLen);
+}
+
+/**
+  Map the database file, as it is
+
+  @param path the file
+  @return true if valid
+*/
+bool APIndex::open(const char *path) {
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  apdb_hdr_t hdr;
+  bool ok = fstat(fd, &st) == 0 and st.st_size >= (off_t)sizeof(hdr) and
+            pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) and apdb_valid(&hdr, st.st_size);
+  if (ok) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ok = map != MAP_FAILED;
+    if (ok) {
+      mapLen = st.st_size;
+      madvise(map, mapLen, MADV_WILLNEED);
+      attach((const uint8_t*)map);
+      tiles = hdr.tiles;
+    }
+    else map = NULL;
+  }
+  else errno = EINVAL;
+  close(fd);
+  return ok;
+}
+
+void APIndex::attach(const uint8_t *base) {
+  const apdb_hdr_t *hdr = (const apdb_hdr_t*)base;
+  count = hdr->count;
+  keys  = base + hdr->keys;
+  lat   = (const int32_t*)(base + hdr->lat);
+  lng   = (const int32_t*)(base + hdr->lng);
+  acc   = (const uint16_t*)(base + hdr->acc);
+}
+
+/**
+  Read the tiles in DIR/LAT/LNG.bin
+
+  @param dir the tiles directory
+  @return true if the directory could be read
+*/
+bool APIndex::loadTiles(const char *dir) {
+  DIR *top = opendir(dir);
+  if (top == NULL) return false;
+  dirent *d;
+  while ((d = readdir(top)) != NULL) {
+    if (d->d_name[0] == '.') continue;
+    std::string sub = std::string(dir) + "/" + d->d_name;
+    DIR *lat = opendir(sub.c_str());
+    if (lat == NULL) continue;
+    dirent *f;
+    while ((f = readdir(lat)) != NULL) {
+      size_t len = strlen(f->d_name);
+      if (len > 4 and strcmp(f->d_name + len - 4, ".bin") == 0)
+        if (loadTile((sub + "/" + f->d_name).c_str())) tiles++;
+    }
+    closedir(lat);
+  }
+  closedir(top);
+  return true;
+}
+
+bool APIndex::loadTile(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) return false;
+  gs_tile_hdr_t hdr;
+  bool ok = fread(&hdr, sizeof(hdr), 1, fp) == 1 and hdr.magic == GS_TILEMAGIC;
+  for (int i = 0; ok and i < hdr.count; i++) {
+    gs_tile_ap_t ap;
+    if (fread(&ap, sizeof(ap), 1, fp) != 1) break;
+    uint64_t key = 0;
+    for (int j = 0; j < 6; j++) key = (key << 8) | ap.bssid[j];
+    tKeys.push_back(key);
+    tLat.push_back(hdr.lat * (10000000 / GS_TILESCALE) + ap.dlat * 10);
+    tLng.push_back(hdr.lng * (10000000 / GS_TILESCALE) + ap.dlng * 10);
+  }
+  fclose(fp);
+  return ok;
+}
+
+/**
+  Sort the APs read from the tiles by key, keep the first of the
+  duplicates, lay them out as the database file, with no tile index
+*/
+void APIndex::finish() {
+  std::vector<uint32_t> order(tKeys.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return tKeys[a] < tKeys[b];
+  });
+  std::vector<uint32_t> uniq;
+  for (uint32_t i : order)
+    if (uniq.empty() or tKeys[uniq.back()] != tKeys[i]) uniq.push_back(i);
+  apdb_hdr_t hdr;
+  apdb_layout(&hdr, uniq.size(), 0, 0);
+  image.assign((hdr.size + 7) / 8, 0);
+  uint8_t *base = (uint8_t*)image.data();
+  memcpy(base, &hdr, sizeof(hdr));
+  for (uint32_t k = 0; k < uniq.size(); k++) {
+    uint32_t i = uniq[k];
+    for (int b = 0; b < APDB_KEYLEN; b++)
+      base[hdr.keys + k * APDB_KEYLEN + b] = tKeys[i] >> (40 - 8 * b);
+    ((int32_t*)(base + hdr.lat))[k]  = tLat[i];
+    ((int32_t*)(base + hdr.lng))[k]  = tLng[i];
+    ((uint16_t*)(base + hdr.acc))[k] = GS_APACC;
+  }
+  std::vector<uint64_t>().swap(tKeys);
+  std::vector<int32_t>().swap(tLat);
+  std::vector<int32_t>().swap(tLng);
+  attach(base);
+}
+
+/**
+  The key of an AP, the 6 bytes as a big endian number, read as 8;
+  the padding after the last key keeps it in the file
+*/
+inline uint64_t APIndex::key(size_t i) const {
+  uint64_t v;
+  memcpy(&v, keys + i * APDB_KEYLEN, sizeof(v));
+  return __builtin_bswap64(v) >> 16;
+}
+
+/**
+  Look up a batch of keys: a branchless binary search over the keys as
+  they are in the file, all queries a step at a time, so the cache misses
+  overlap; with AVX2, four queries in a vector, the keys read by gathers
+
+  @param query the keys
+  @param n the number of keys, up to GS_QUERY
+  @param idx the AP index of each key, -1 if not found
+*/
+void APIndex::find(const uint64_t *query, int n, int32_t *idx) const {
+  if (count == 0) {
+    for (int i = 0; i < n; i++) idx[i] = -1;
+    return;
+  }
+  // The last AP whose key is not above the query
+  alignas(32) uint64_t base[GS_QUERY];
+  size_t len = count;
+#if defined(__AVX2__)
+  const __m256i swap = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+  const long long *kp = (const long long*)keys;
+  int groups = (n + 3) / 4;
+  __m256i qv[GS_QUERY / 4], bv[GS_QUERY / 4];
+  for (int g = 0; g < groups; g++) {
+    alignas(32) uint64_t q[4];
+    for (int j = 0; j < 4; j++) q[j] = query[std::min(g * 4 + j, n - 1)];
+    qv[g] = _mm256_load_si256((const __m256i*)q);
+    bv[g] = _mm256_setzero_si256();
+  }
+  while (len > 1) {
+    size_t half = len / 2;
+    __m256i h = _mm256_set1_epi64x(half);
+    for (int g = 0; g < groups; g++) {
+      __m256i mid = _mm256_add_epi64(bv[g], h);
+      __m256i off = _mm256_add_epi64(_mm256_slli_epi64(mid, 2), _mm256_slli_epi64(mid, 1));
+      __m256i k = _mm256_srli_epi64(_mm256_shuffle_epi8(_mm256_i64gather_epi64(kp, off, 1), swap), 16);
+      // Both below 2^48, the signed compare is right
+      bv[g] = _mm256_blendv_epi8(mid, bv[g], _mm256_cmpgt_epi64(k, qv[g]));
+    }
+    len -= half;
+  }
+  for (int g = 0; g < groups; g++)
+    _mm256_store_si256((__m256i*)(base + g * 4), bv[g]);
+#else
+  for (int i = 0; i < n; i++) base[i] = 0;
+  while (len > 1) {
+    size_t half = len / 2;
+    for (int i = 0; i < n; i++) {
+      base[i] = key(base[i] + half) <= query[i] ? base[i] + half : base[i];
+      __builtin_prefetch(keys + (base[i] + half / 2) * APDB_KEYLEN);
+    }
+    len -= half;
+  }
+#endif
+  for (int i = 0; i < n; i++)
+    idx[i] = key(base[i]) == query[i] ? (int32_t)base[i] : -1;
+}
+
+/**
+  Parse the APs of a request body: each "macAddress", and the
+  "signalStrength" up to the next one
+
+  @return the number of APs
+*/
+static int parseAPs(const char *p, const char *end, uint64_t *keys, int8_t *rssi) {
+  static const char macTag[] = "\"macAddress\"";
+  static const char sigTag[] = "\"signalStrength\"";
+  int n = 0;
+  const char *mac = (const char*)memmem(p, end - p, macTag, sizeof(macTag) - 1);
+  while (mac != NULL and n < GS_QUERY) {
+    const char *next = (const char*)memmem(mac + 1, end - mac - 1, macTag, sizeof(macTag) - 1);
+    const char *stop = next ? next : end;
+    // The value, hex digits with any separators
+    const char *q = (const char*)memchr(mac + sizeof(macTag) - 1, '"', stop - mac - sizeof(macTag) + 1);
+    uint64_t key = 0;
+    int digits = 0;
+    for (q = q ? q + 1 : stop; q < stop and *q != '"' and digits < 12; q++) {
+      int v = -1;
+      if      (*q >= '0' and *q <= '9') v = *q - '0';
+      else if (*q >= 'a' and *q <= 'f') v = *q - 'a' + 10;
+      else if (*q >= 'A' and *q <= 'F') v = *q - 'A' + 10;
+      if (v < 0) continue;
+      key = (key << 4) | v;
+      digits++;
+    }
+    if (digits == 12) {
+      int sig = -100;
+      const char *s = (const char*)memmem(mac, stop - mac, sigTag, sizeof(sigTag) - 1);
+      if (s != NULL) {
+        s += sizeof(sigTag) - 1;
+        while (s < stop and (*s == ' ' or *s == ':')) s++;
+        sig = atoi(s);
+      }
+      keys[n] = key;
+      rssi[n] = (int8_t)std::max(-128, std::min(0, sig));
+      n++;
+    }
+    mac = next;
+  }
+  return n;
+}
+
+/**
+  The weighted centroid of the APs found, the far ones dropped once
+
+  @return the accuracy (m), or -1 if too few APs
+*/
+static int solve(const APIndex &db, const int32_t *idx, const int8_t *rssi, int n, double *lat, double *lng) {
+  int use[GS_QUERY], m = 0;
+  for (int i = 0; i < n; i++)
+    if (idx[i] >= 0) use[m++] = i;
+  if (m < GS_MINAPS) return -1;
+  // Relative to the first AP, in meters
+  double lat0 = db.lat[idx[use[0]]] / 1e7, lng0 = db.lng[idx[use[0]]] / 1e7;
+  double ky = 111194.93, kx = ky * cos(lat0 * M_PI / 180);
+  double x[GS_QUERY], y[GS_QUERY], w[GS_QUERY], a[GS_QUERY];
+  for (int k = 0; k < m; k++) {
+    int i = use[k];
+    x[k] = (db.lng[idx[i]] / 1e7 - lng0) * kx;
+    y[k] = (db.lat[idx[i]] / 1e7 - lat0) * ky;
+    w[k] = pow(10.0, rssi[i] / 20.0);
+    a[k] = db.acc[idx[i]];
+  }
+  double cx = 0, cy = 0, spread = 0, apAcc = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    double sw = 0, sx = 0, sy = 0, sxx = 0, syy = 0, sa = 0;
+    for (int k = 0; k < m; k++) {
+      sw  += w[k];
+      sa  += w[k] * a[k];
+      sx  += w[k] * x[k];
+      sy  += w[k] * y[k];
+      sxx += w[k] * x[k] * x[k];
+      syy += w[k] * y[k] * y[k];
+    }
+    cx = sx / sw;
+    cy = sy / sw;
+    spread = sqrt(fabs(sxx / sw - cx * cx) + fabs(syy / sw - cy * cy));
+    apAcc = sa / sw;
+    if (pass or m < 3) break;
+    // Drop the outliers, the APs moved or wrongly placed
+    int kept = 0;
+    for (int k = 0; k < m; k++)
+      if (hypot(x[k] - cx, y[k] - cy) <= GS_OUTLIER) {
+        x[kept] = x[k];
+        y[kept] = y[k];
+        w[kept] = w[k];
+        a[kept] = a[k];
+        kept++;
+      }
+    if (kept == m or kept < GS_MINAPS) break;
+    m = kept;
+  }
+  *lat = lat0 + cy / ky;
+  *lng = lng0 + cx / kx;
+  return (int)(spread + apAcc);
+}
+
+// A client connection
+struct gs_conn_t {
+  std::string in;
+  std::string out;
+  size_t      sent  = 0;
+  bool        close = false;    // After the answer is sent
+};
+
+class Worker {
+  public:
+    Worker(int id, const sockaddr_in &addr, const APIndex *db): id(id), addr(addr), db(db) {
+      memset(&stats, 0, sizeof(stats));
+    }
+    bool open();
+    void run();
+    gs_stats_t stats;
+  private:
+    void accept();
+    bool input(int fd, gs_conn_t &c);
+    bool output(int fd, gs_conn_t &c);
+    bool request(gs_conn_t &c);
+    void reply(gs_conn_t &c, int status, const char *body, size_t len);
+    void geolocate(gs_conn_t &c, const char *body, size_t len);
+    int  id;
+    int  sock = -1;
+    int  ep   = -1;
+    sockaddr_in addr;
+    const APIndex *db;
+    std::unordered_map<int, gs_conn_t> conns;
+};
+
+bool Worker::open() {
+  sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (sock < 0) return false;
+  int one = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+  if (bind(sock, (const sockaddr*)&addr, sizeof(addr)) < 0) return false;
+  if (listen(sock, 1024) < 0) return false;
+  ep = epoll_create1(0);
+  if (ep < 0) return false;
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = sock;
+  return epoll_ctl(ep, EPOLL_CTL_ADD, sock, &ev) == 0;
+}
+
+void Worker::run() {
+  epoll_event evs[GS_EVENTS];
+  while (running) {
+    int ne = epoll_wait(ep, evs, GS_EVENTS, 500);
+    for (int i = 0; i < ne; i++) {
+      int fd = evs[i].data.fd;
+      if (fd == sock) {
+        accept();
+        continue;
+      }
+      auto it = conns.find(fd);
+      if (it == conns.end()) continue;
+      bool keep = true;
+      if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) keep = input(fd, it->second);
+      if (keep) keep = output(fd, it->second);
+      if (not keep) {
+        close(fd);
+        conns.erase(it);
+      }
+    }
+  }
+  for (auto &c : conns)
+    close(c.first);
+  close(ep);
+  close(sock);
+}
+
+void Worker::accept() {
+  int fd;
+  while ((fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.fd = fd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+    conns[fd];
+  }
+}
+
+/**
+  Read what came, answer the complete requests
+
+  @return false to close the connection
+*/
+bool Worker::input(int fd, gs_conn_t &c) {
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    c.in.append(buf, n);
+  if (n == 0 or (n < 0 and errno != EAGAIN and errno != EWOULDBLOCK)) {
+    // Closed by the client, answer what came
+    c.close = true;
+    while (request(c));
+    return not c.out.empty();
+  }
+  while (not c.close and request(c));
+  return true;
+}
+
+/**
+  Send what is pending, wait for the socket to drain if needed
+
+  @return false to close the connection
+*/
+bool Worker::output(int fd, gs_conn_t &c) {
+  while (c.sent < c.out.size()) {
+    ssize_t n = write(fd, c.out.data() + c.sent, c.out.size() - c.sent);
+    if (n > 0) {
+      c.sent += n;
+      continue;
+    }
+    if (n < 0 and (errno == EAGAIN or errno == EWOULDBLOCK)) {
+      epoll_event ev;
+      ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+      ev.data.fd = fd;
+      epoll_ctl(ep, EPOLL_CTL_MOD, fd, &ev);
+      return true;
+    }
+    return false;
+  }
+  c.out.clear();
+  c.sent = 0;
+  return not c.close;
+}
+
+/**
+  Answer the first complete request in the input
+
+  @return true if there was one
+*/
+bool Worker::request(gs_conn_t &c) {
+  size_t hend = c.in.find("\r\n\r\n");
+  if (hend == std::string::npos) {
+    if (c.in.size() > GS_REQMAX) {
+      static const char body[] = "{\"error\": {\"errors\": [], \"code\": 413, \"message\": \"Request too large\"}}\n";
+      c.close = true;
+      reply(c, 413, body, sizeof(body) - 1);
+      c.in.clear();
+    }
+    return false;
+  }
+  // The headers, lower case, for the search
+  std::string head = c.in.substr(0, hend + 2);
+  for (char &ch : head) ch = tolower(ch);
+  size_t clen = 0;
+  size_t p = head.find("\r\ncontent-length:");
+  if (p != std::string::npos) clen = strtoul(head.c_str() + p + 17, NULL, 10);
+  if (clen > GS_REQMAX) {
+    static const char body[] = "{\"error\": {\"errors\": [], \"code\": 413, \"message\": \"Request too large\"}}\n";
+    c.close = true;
+    reply(c, 413, body, sizeof(body) - 1);
+    c.in.clear();
+    return false;
+  }
+  if (c.in.size() < hend + 4 + clen) return false;
+  if (head.find("\r\nconnection: close") != std::string::npos or
+      head.find(" http/1.0\r\n") != std::string::npos) c.close = true;
+  if (head.compare(0, 18, "post /v1/geolocate") == 0)
+    geolocate(c, c.in.data() + hend + 4, clen);
+  else {
+    static const char body[] = "{\"error\": {\"errors\": [], \"code\": 404, \"message\": \"Not found\"}}\n";
+    reply(c, 404, body, sizeof(body) - 1);
+  }
+  c.in.erase(0, hend + 4 + clen);
+  return true;
+}
+
+void Worker::reply(gs_conn_t &c, int status, const char *body, size_t len) {
+  char head[160];
+  const char *reason = status == 200 ? "OK" : status == 400 ? "Bad Request" :
+                       status == 404 ? "Not Found" : "Payload Too Large";
+  int n = snprintf(head, sizeof(head),
+                   "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n%s\r\n",
+                   status, reason, len, c.close ? "Connection: close\r\n" : "");
+  c.out.append(head, n);
+  c.out.append(body, len);
+}
+
+/**
+  Resolve a request body and queue the answer
+*/
+void Worker::geolocate(gs_conn_t &c, const char *body, size_t len) {
+  uint64_t start = nowNs();
+  stats.requests++;
+  uint64_t keys[GS_QUERY];
+  int8_t rssi[GS_QUERY];
+  int32_t idx[GS_QUERY];
+  int n = parseAPs(body, body + len, keys, rssi);
+  if (n == 0) {
+    stats.bad++;
+    static const char err[] = "{\"error\": {\"errors\": [], \"code\": 400, \"message\": \"Parse Error\"}}\n";
+    reply(c, 400, err, sizeof(err) - 1);
+    return;
+  }
+  stats.aps += n;
+  db->find(keys, n, idx);
+  double lat, lng;
+  int acc = solve(*db, idx, rssi, n, &lat, &lng);
+  stats.nanos += nowNs() - start;
+  if (acc < 0) {
+    stats.notfound++;
+    static const char err[] = "{\"error\": {\"errors\": [], \"code\": 404, \"message\": \"Not found\"}}\n";
+    reply(c, 404, err, sizeof(err) - 1);
+    return;
+  }
+  stats.found++;
+  char out[128];
+  int olen = snprintf(out, sizeof(out), "{\"location\": {\"lat\": %.7f, \"lng\": %.7f}, \"accuracy\": %d}\n",
+                      lat, lng, acc);
+  reply(c, 200, out, olen);
+}
+
+int main(int argc, char *argv[]) {
+  int port = 8000;
+  int threads = std::thread::hardware_concurrency();
+  if (threads < 1) threads = 1;
+  const char *dir = NULL, *file = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:t:d:a:")) != -1) {
+    if      (opt == 'p') port = atoi(optarg);
+    else if (opt == 't') threads = atoi(optarg);
+    else if (opt == 'd') dir = optarg;
+    else if (opt == 'a') file = optarg;
+    else {
+      fprintf(stderr, "Usage: %s -a DB | -d DIR [-p PORT] [-t THREADS]\n", argv[0]);
+      return 1;
+    }
+  }
+  if ((dir == NULL) == (file == NULL)) {
+    fprintf(stderr, "Usage: %s -a DB | -d DIR [-p PORT] [-t THREADS]\n", argv[0]);
+    return 1;
+  }
+
+  // The AP database, mapped or built from the tiles
+  APIndex db;
+  if (file != NULL) {
+    if (not db.open(file)) {
+      perror(file);
+      return 1;
+    }
+  }
+  else {
+    if (not db.loadTiles(dir)) {
+      perror(dir);
+      return 1;
+    }
+    db.finish();
+  }
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  signal(SIGPIPE, SIG_IGN);
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  std::vector<Worker*> workers;
+  for (int i = 0; i < threads; i++) {
+    Worker *w = new Worker(i, addr, &db);
+    if (not w->open()) {
+      perror("socket");
+      return 1;
+    }
+    workers.push_back(w);
+  }
+  std::vector<std::thread> pool;
+  for (Worker *w : workers)
+    pool.emplace_back(&Worker::run, w);
+  fprintf(stderr, "geoserver: %zu APs from %zu tiles, listening on TCP %d, %d threads\n",
+          db.count, db.tiles, port, threads);
+  for (std::thread &t : pool)
+    t.join();
+
+  // Report
+  gs_stats_t total;
+  memset(&total, 0, sizeof(total));
+  for (Worker *w : workers) {
+    total.requests += w->stats.requests;
+    total.found    += w->stats.found;
+    total.notfound += w->stats.notfound;
+    total.bad      += w->stats.bad;
+    total.aps      += w->stats.aps;
+    total.nanos    += w->stats.nanos;
+    delete w;
+  }
+  fprintf(stderr, "geoserver: %llu requests, %llu found, %llu not found, %llu bad, %.1f APs, %.2f us mean\n",
+          (unsigned long long)total.requests, (unsigned long long)total.found,
+          (unsigned long long)total.notfound, (unsigned long long)total.bad,
+          total.requests ? (double)total.aps / total.requests : 0.0,
+          total.requests ? total.nanos / 1000.0 / total.requests : 0.0);
+  return 0;
+}
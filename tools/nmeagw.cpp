@@ -0,0 +1,535 @@
+/**
+  nmeagw.cpp - Fleet NMEA UDP ingest gateway
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  Build:  g++ -O2 -pthread -o nmeagw tools/nmeagw.cpp
+  Usage:  nmeagw [-p PORT] [-t THREADS] [-o FILE]
+
+  Receives the NMEA sentences the trackers broadcast on UDP (port 10110),
+  validates the checksums, decodes GGA and RMC into fixed point records,
+  merges the sentences of the same fix, drops the duplicates and writes
+  one CSV line per fix:
+
+    source,date,time,lat,lng,fix,sats,knots,course
+
+  with lat/lng in 1e-7 degrees, time in ms of day, knots in 1/1000 and
+  course in 1/10 degrees.
+
+  Each worker thread owns a SO_REUSEPORT socket and an epoll set, and
+  receives in batches with recvmmsg().  The kernel hashes each source to
+  the same socket, so the per source state is private to one thread and
+  needs no locking.  Only the output is shared.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <csignal>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Datagrams received in one recvmmsg() call
+#define GW_BATCH    64
+// Maximum datagram size
+#define GW_DGRAM    512
+// Flush the output buffer at this size
+#define GW_OUTBUF   65536
+// Emit an incomplete fix after this long (ms)
+#define GW_PENDING  2000
+
+// Sentence types
+#define GW_GGA      0x01
+#define GW_RMC      0x02
+#define GW_ALL      (GW_GGA | GW_RMC)
+#define GW_SENT     0x80        // Already emitted
+
+// One fix, fixed point
+struct gw_fix_t {
+  uint8_t   types;              // Sentence types merged in
+  uint8_t   fix;                // GGA fix quality
+  uint8_t   sats;               // GGA satellites
+  int32_t   tod;                // Time of day (ms)
+  int32_t   date;               // ddmmyy
+  int32_t   lat;                // 1e-7 degrees
+  int32_t   lng;                // 1e-7 degrees
+  int32_t   knots;              // 1/1000 knots
+  int32_t   course;             // 1/10 degrees
+};
+
+// Per source state
+struct gw_src_t {
+  gw_fix_t  fix;
+  uint64_t  seen;               // Last update (ms)
+};
+
+// Per worker counters
+struct gw_stats_t {
+  uint64_t  packets;
+  uint64_t  sentences;
+  uint64_t  badsum;
+  uint64_t  unknown;
+  uint64_t  dups;
+  uint64_t  records;
+};
+
+static std::atomic<bool> running(true);
+static std::mutex outLock;
+static FILE *out = stdout;
+
+static void onSignal(int) {
+  running = false;
+}
+
+static uint64_t nowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+  XOR all bytes, 16 at a time when SSE2 is available
+
+  @param p the data
+  @param len the data length
+  @return the XOR of all bytes
+*/
+static uint8_t xorBytes(const uint8_t *p, size_t len) {
+  uint8_t c = 0;
+  size_t i = 0;
+#ifdef __SSE2__
+  if (len >= 16) {
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 16 <= len; i += 16)
+      acc = _mm_xor_si128(acc, _mm_loadu_si128((const __m128i*)(p + i)));
+    // Fold 16 bytes to one
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 8));
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 4));
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 2));
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 1));
+    c = (uint8_t)_mm_cvtsi128_si32(acc);
+  }
+#endif
+  for (; i < len; i++)
+    c ^= p[i];
+  return c;
+}
+
+static int hexDigit(char c) {
+  if (c >= '0' and c <= '9') return c - '0';
+  if (c >= 'A' and c <= 'F') return c - 'A' + 10;
+  if (c >= 'a' and c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+/**
+  Validate a sentence checksum
+
+  @param s the sentence, starting with '$'
+  @param len the sentence length, without the line ending
+  @return the length of the payload between '$' and '*', or -1
+*/
+static int checkSentence(const char *s, size_t len) {
+  if (len < 4 or s[0] != '$') return -1;
+  const char *star = (const char*)memchr(s, '*', len);
+  if (star == NULL or star + 3 > s + len) return -1;
+  int hi = hexDigit(star[1]), lo = hexDigit(star[2]);
+  if (hi < 0 or lo < 0) return -1;
+  size_t plen = star - s - 1;
+  if (xorBytes((const uint8_t*)s + 1, plen) != ((hi << 4) | lo)) return -1;
+  return (int)plen;
+}
+
+/**
+  Parse a decimal number into a fixed point integer
+
+  @param f the field
+  @param end the field end
+  @param scale the number of decimals to keep
+  @return the scaled integer
+*/
+static int64_t parseFixed(const char *f, const char *end, int scale) {
+  int64_t v = 0;
+  bool neg = false;
+  if (f < end and *f == '-') {
+    neg = true;
+    f++;
+  }
+  while (f < end and *f >= '0' and *f <= '9')
+    v = v * 10 + (*f++ - '0');
+  if (f < end and *f == '.') f++;
+  for (int d = 0; d < scale; d++) {
+    v *= 10;
+    if (f < end and *f >= '0' and *f <= '9') v += *f++ - '0';
+  }
+  return neg ? -v : v;
+}
+
+/**
+  Convert a ddmm.mmmm or dddmm.mmmm field to 1e-7 degrees
+
+  @param f the field
+  @param end the field end
+  @param hemi the hemisphere char
+  @return the coordinate
+*/
+static int32_t parseCoord(const char *f, const char *end, char hemi) {
+  // Minutes times 1e7
+  int64_t mm = parseFixed(f, end, 7);
+  int64_t deg = mm / 1000000000LL;
+  int64_t min = mm % 1000000000LL;
+  int64_t val = deg * 10000000LL + min / 60;
+  if (hemi == 'S' or hemi == 'W') val = -val;
+  return (int32_t)val;
+}
+
+/**
+  Parse the time of day hhmmss.sss to ms
+*/
+static int32_t parseTime(const char *f, const char *end) {
+  if (end - f < 6) return -1;
+  for (int i = 0; i < 6; i++)
+    if (f[i] < '0' or f[i] > '9') return -1;
+  int32_t hh = (f[0] - '0') * 10 + (f[1] - '0');
+  int32_t mm = (f[2] - '0') * 10 + (f[3] - '0');
+  int32_t ss = (f[4] - '0') * 10 + (f[5] - '0');
+  int32_t ms = (int32_t)parseFixed(f + 6, end, 3);
+  return ((hh * 60 + mm) * 60 + ss) * 1000 + ms;
+}
+
+/**
+  Decode a GGA or RMC sentence
+
+  @param s the sentence, starting with '$'
+  @param plen the payload length
+  @param fix the record to fill
+  @return the sentence type, or 0
+*/
+static int decode(const char *s, int plen, gw_fix_t *fix) {
+  // Split the fields
+  const char *fld[16];
+  const char *end[16];
+  int n = 0;
+  const char *p = s + 1, *stop = s + 1 + plen;
+  fld[0] = p;
+  while (p < stop and n < 15) {
+    if (*p == ',') {
+      end[n++] = p;
+      fld[n] = p + 1;
+    }
+    p++;
+  }
+  end[n++] = stop;
+  if (end[0] - fld[0] != 5) return 0;
+  memset(fix, 0, sizeof(*fix));
+  fix->date = -1;
+  if (memcmp(fld[0] + 2, "GGA", 3) == 0 and n >= 8) {
+    // $GPGGA,time,lat,N,lng,E,fix,sats,...
+    fix->types = GW_GGA;
+    fix->tod   = parseTime(fld[1], end[1]);
+    fix->lat   = parseCoord(fld[2], end[2], *fld[3]);
+    fix->lng   = parseCoord(fld[4], end[4], *fld[5]);
+    fix->fix   = (uint8_t)parseFixed(fld[6], end[6], 0);
+    fix->sats  = (uint8_t)parseFixed(fld[7], end[7], 0);
+    return GW_GGA;
+  }
+  if (memcmp(fld[0] + 2, "RMC", 3) == 0 and n >= 10) {
+    // $GPRMC,time,A,lat,N,lng,E,knots,course,date,...
+    if (*fld[2] != 'A') return 0;
+    fix->types  = GW_RMC;
+    fix->tod    = parseTime(fld[1], end[1]);
+    fix->lat    = parseCoord(fld[3], end[3], *fld[4]);
+    fix->lng    = parseCoord(fld[5], end[5], *fld[6]);
+    fix->knots  = (int32_t)parseFixed(fld[7], end[7], 3);
+    fix->course = (int32_t)parseFixed(fld[8], end[8], 1);
+    fix->date   = (int32_t)parseFixed(fld[9], end[9], 0);
+    return GW_RMC;
+  }
+  return 0;
+}
+
+class Worker {
+  public:
+    Worker(int id, const sockaddr_in &addr): id(id), addr(addr) {
+      memset(&stats, 0, sizeof(stats));
+    }
+    bool open();
+    void run();
+    gw_stats_t stats;
+  private:
+    void sentence(uint64_t key, const char *s, size_t len, uint64_t now);
+    void emit(uint64_t key, const gw_fix_t &fix);
+    void expire(uint64_t now);
+    void flush();
+    int  id;
+    int  sock = -1;
+    int  ep   = -1;
+    sockaddr_in addr;
+    std::string obuf;
+    std::unordered_map<uint64_t, gw_src_t> sources;
+};
+
+bool Worker::open() {
+  sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (sock < 0) return false;
+  int one = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+  setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one));
+  int rcvbuf = 4 << 20;
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  if (bind(sock, (const sockaddr*)&addr, sizeof(addr)) < 0) return false;
+  ep = epoll_create1(0);
+  if (ep < 0) return false;
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = sock;
+  return epoll_ctl(ep, EPOLL_CTL_ADD, sock, &ev) == 0;
+}
+
+void Worker::run() {
+  // Receive buffers, allocated once
+  static thread_local char bufs[GW_BATCH][GW_DGRAM];
+  mmsghdr msgs[GW_BATCH];
+  iovec iovs[GW_BATCH];
+  sockaddr_in srcs[GW_BATCH];
+  uint64_t lastExpire = nowMs();
+  while (running) {
+    epoll_event ev;
+    int ne = epoll_wait(ep, &ev, 1, 500);
+    uint64_t now = nowMs();
+    if (ne > 0) {
+      // Drain the socket in batches
+      while (true) {
+        for (int i = 0; i < GW_BATCH; i++) {
+          iovs[i].iov_base = bufs[i];
+          iovs[i].iov_len  = GW_DGRAM;
+          memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+          msgs[i].msg_hdr.msg_iov     = &iovs[i];
+          msgs[i].msg_hdr.msg_iovlen  = 1;
+          msgs[i].msg_hdr.msg_name    = &srcs[i];
+          msgs[i].msg_hdr.msg_namelen = sizeof(srcs[i]);
+        }
+        int nr = recvmmsg(sock, msgs, GW_BATCH, MSG_DONTWAIT, NULL);
+        if (nr <= 0) break;
+        stats.packets += nr;
+        for (int i = 0; i < nr; i++) {
+          uint64_t key = ((uint64_t)ntohl(srcs[i].sin_addr.s_addr) << 16) | ntohs(srcs[i].sin_port);
+          const char *p = bufs[i], *stop = bufs[i] + msgs[i].msg_len;
+          // One or more sentences per datagram
+          while (p < stop) {
+            const char *eol = (const char*)memchr(p, '\n', stop - p);
+            const char *lend = eol ? eol : stop;
+            size_t len = lend - p;
+            if (len and p[len - 1] == '\r') len--;
+            if (len) sentence(key, p, len, now);
+            p = lend + 1;
+          }
+        }
+        if (nr < GW_BATCH) break;
+      }
+    }
+    if (now - lastExpire >= 500) {
+      expire(now);
+      lastExpire = now;
+    }
+    if (obuf.size() >= GW_OUTBUF or ne == 0) flush();
+  }
+  expire(UINT64_MAX);
+  flush();
+  close(ep);
+  close(sock);
+}
+
+/**
+  Handle one sentence from a source, merging the sentences of the same fix
+*/
+void Worker::sentence(uint64_t key, const char *s, size_t len, uint64_t now) {
+  stats.sentences++;
+  int plen = checkSentence(s, len);
+  if (plen < 0) {
+    stats.badsum++;
+    return;
+  }
+  gw_fix_t fix;
+  int type = decode(s, plen, &fix);
+  if (type == 0 or fix.tod < 0) {
+    stats.unknown++;
+    return;
+  }
+  auto it = sources.find(key);
+  if (it == sources.end()) {
+    sources[key] = gw_src_t{fix, now};
+  }
+  else {
+    gw_src_t &src = it->second;
+    if (src.fix.types and src.fix.tod == fix.tod) {
+      // The same fix
+      if (src.fix.types & type) {
+        stats.dups++;
+        return;
+      }
+      src.fix.types |= type;
+      if (type == GW_GGA) {
+        src.fix.fix  = fix.fix;
+        src.fix.sats = fix.sats;
+      }
+      else {
+        src.fix.date   = fix.date;
+        src.fix.knots  = fix.knots;
+        src.fix.course = fix.course;
+      }
+    }
+    else {
+      // A new fix, emit the pending one
+      if (src.fix.types) emit(key, src.fix);
+      src.fix = fix;
+    }
+    src.seen = now;
+  }
+  // Emit as soon as it is complete
+  gw_src_t &src = sources[key];
+  if ((src.fix.types & GW_ALL) == GW_ALL) {
+    emit(key, src.fix);
+    // Keep the time, to catch the duplicates
+    src.fix.types = GW_ALL | GW_SENT;
+  }
+}
+
+/**
+  Format a fix as a CSV line into the output buffer
+*/
+void Worker::emit(uint64_t key, const gw_fix_t &fix) {
+  if (fix.types & GW_SENT) return;
+  char line[160];
+  uint32_t ip = key >> 16;
+  int n = snprintf(line, sizeof(line), "%u.%u.%u.%u:%u,%d,%d,%d,%d,%u,%u,%d,%d\n",
+                   ip >> 24, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF,
+                   (unsigned)(key & 0xFFFF),
+                   fix.date, fix.tod, fix.lat, fix.lng, fix.fix, fix.sats,
+                   fix.knots, fix.course);
+  obuf.append(line, n);
+  stats.records++;
+}
+
+/**
+  Emit the incomplete fixes that waited too long, forget idle sources
+*/
+void Worker::expire(uint64_t now) {
+  for (auto it = sources.begin(); it != sources.end();) {
+    gw_src_t &src = it->second;
+    if (now - src.seen >= GW_PENDING or now == UINT64_MAX) {
+      if (src.fix.types) emit(it->first, src.fix);
+      src.fix.types = 0;
+    }
+    if (now == UINT64_MAX or now - src.seen >= 60 * GW_PENDING) it = sources.erase(it);
+    else                                                         ++it;
+  }
+}
+
+/**
+  Write the output buffer to the merged stream
+*/
+void Worker::flush() {
+  if (obuf.empty()) return;
+  std::lock_guard<std::mutex> lock(outLock);
+  fwrite(obuf.data(), 1, obuf.size(), out);
+  fflush(out);
+  obuf.clear();
+}
+
+int main(int argc, char *argv[]) {
+  int port = 10110;
+  int threads = std::thread::hardware_concurrency();
+  if (threads < 1) threads = 1;
+  const char *outFile = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:t:o:")) != -1) {
+    if      (opt == 'p') port = atoi(optarg);
+    else if (opt == 't') threads = atoi(optarg);
+    else if (opt == 'o') outFile = optarg;
+    else {
+      fprintf(stderr, "Usage: %s [-p PORT] [-t THREADS] [-o FILE]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (outFile and (out = fopen(outFile, "a")) == NULL) {
+    perror(outFile);
+    return 1;
+  }
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  // Open all sockets before receiving, so the kernel spreads the sources
+  std::vector<Worker*> workers;
+  for (int i = 0; i < threads; i++) {
+    Worker *w = new Worker(i, addr);
+    if (not w->open()) {
+      perror("socket");
+      return 1;
+    }
+    workers.push_back(w);
+  }
+  std::vector<std::thread> pool;
+  for (Worker *w : workers)
+    pool.emplace_back(&Worker::run, w);
+  fprintf(stderr, "nmeagw: listening on UDP %d, %d threads\n", port, threads);
+  for (std::thread &t : pool)
+    t.join();
+
+  // Report
+  gw_stats_t total;
+  memset(&total, 0, sizeof(total));
+  for (Worker *w : workers) {
+    total.packets   += w->stats.packets;
+    total.sentences += w->stats.sentences;
+    total.badsum    += w->stats.badsum;
+    total.unknown   += w->stats.unknown;
+    total.dups      += w->stats.dups;
+    total.records   += w->stats.records;
+    delete w;
+  }
+  fprintf(stderr, "nmeagw: %llu packets, %llu sentences, %llu bad, %llu other, %llu dups, %llu fixes\n",
+          (unsigned long long)total.packets, (unsigned long long)total.sentences,
+          (unsigned long long)total.badsum, (unsigned long long)total.unknown,
+          (unsigned long long)total.dups, (unsigned long long)total.records);
+  if (out != stdout) fclose(out);
+  return 0;
+}
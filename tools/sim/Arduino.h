@@ -0,0 +1,145 @@
+/**
+  Arduino.h - Host shim for the fleet simulator
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+/*
+  Just enough of the Arduino and ESP8266 core to build the firmware
+  modules on the host.  Every call acts on the simulated node the
+  current thread is running (simCur, see sim.h), so many nodes can run
+  in one process, each with its own virtual clock.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cstdarg>
+#include <cctype>
+#include <cmath>
+
+using std::abs;
+using std::max;
+using std::min;
+
+typedef uint8_t byte;
+typedef bool    boolean;
+
+// Flash is plain memory here
+#define PROGMEM
+#define PSTR(s)               (s)
+#define F(s)                  (s)
+#define pgm_read_byte(p)      (*(const uint8_t*)(p))
+#define pgm_read_ptr(p)       (*(p))
+#define strcpy_P              strcpy
+#define strncpy_P             strncpy
+#define strcat_P              strcat
+#define strstr_P              strstr
+#define strcmp_P              strcmp
+#define strlen_P              strlen
+#define memcpy_P              memcpy
+#define sprintf_P             sprintf
+#define snprintf_P            snprintf
+#define vsnprintf_P           vsnprintf
+
+#define radians(deg)          ((deg) * M_PI / 180.0)
+#define degrees(rad)          ((rad) * 180.0 / M_PI)
+#define sq(x)                 ((x) * (x))
+
+#define B00000000 0x00
+#define B00000001 0x01
+#define B00000010 0x02
+#define B00000100 0x04
+#define B00001000 0x08
+#define B00010000 0x10
+#define B00100000 0x20
+#define B10000000 0x80
+
+char *itoa(int value, char *str, int base);
+
+// Virtual time of the current node
+unsigned long millis();
+void delay(unsigned long ms);
+void yield();
+
+// Serial input
+class Stream {
+  public:
+    virtual ~Stream() {}
+    virtual int available() = 0;
+    virtual int read() = 0;
+};
+
+// Serial port of the current node, the GPS receiver on its input
+class SimSerial: public Stream {
+  public:
+    size_t setRxBufferSize(size_t size);
+    int    available();
+    int    read();
+    size_t write(const uint8_t *buf, size_t len);
+    size_t print(const char *s);
+    size_t printf_P(const char *fmt, ...);
+};
+extern SimSerial Serial;
+
+// IPv4 address
+class IPAddress {
+  public:
+    IPAddress() {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+      octets[0] = a; octets[1] = b; octets[2] = c; octets[3] = d;
+    }
+    IPAddress(uint32_t addr) {
+      memcpy(octets, &addr, sizeof(octets));
+    }
+    uint8_t operator[](int i) const {
+      return octets[i];
+    }
+    operator uint32_t() const {
+      uint32_t addr;
+      memcpy(&addr, octets, sizeof(addr));
+      return addr;
+    }
+  private:
+    uint8_t octets[4] = {0, 0, 0, 0};
+};
+
+// Reset information
+struct rst_info {
+  uint32_t reason;
+};
+enum { REASON_DEFAULT_RST, REASON_WDT_RST, REASON_EXCEPTION_RST, REASON_SOFT_WDT_RST,
+       REASON_SOFT_RESTART, REASON_DEEP_SLEEP_AWAKE, REASON_EXT_SYS_RST
+     };
+
+class SimESP {
+  public:
+    uint32_t  getChipId();
+    uint16_t  getVcc();
+    uint32_t  getFreeHeap();
+    uint32_t  getMaxFreeBlockSize();
+    rst_info *getResetInfoPtr();
+    bool      rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size);
+    bool      rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size);
+};
+extern SimESP ESP;
+
+#endif /* SIM_ARDUINO_H */
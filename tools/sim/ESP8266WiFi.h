@@ -0,0 +1,105 @@
+/**
+  ESP8266WiFi.h - Host shim for the fleet simulator
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIM_ESP8266WIFI_H
+#define SIM_ESP8266WIFI_H
+
+#include "Arduino.h"
+#include <string>
+
+#define WL_MAC_ADDR_LENGTH    6
+#define WL_SSID_MAX_LENGTH    32
+#define WL_WPA_KEY_MAX_LENGTH 64
+
+class SimService;
+
+/*
+  A TCP client connected to one of the in-process stand-in servers.
+  The server produces its response when the client reads, so all the
+  traffic stays on the calling thread.
+*/
+class WiFiClient {
+  public:
+    virtual ~WiFiClient() {}
+    int     connect(const char *host, uint16_t port);
+    int     connect(IPAddress ip, uint16_t port);
+    bool    connected();
+    void    stop();
+    void    setTimeout(unsigned long ms) { timeout = ms; }
+    void    setNoDelay(bool) {}
+    size_t  write(const char *s) { return write((const uint8_t*)s, strlen(s)); }
+    size_t  write(const uint8_t *buf, size_t len);
+    size_t  print(const char *s) { return write(s); }
+    int     available();
+    int     read();
+    int     read(uint8_t *buf, size_t len);
+    int     peek();
+    size_t  readBytesUntil(char terminator, char *buf, size_t len);
+    bool    findUntil(const char *target, const char *terminator);
+    float   parseFloat();
+    long    parseInt();
+    void    flush() {}
+    operator bool() { return service != NULL; }
+    // Simulator side
+    std::string   txBuf;              // Sent by the node, not yet served
+    std::string   rxBuf;              // To be read by the node
+    size_t        rxPos   = 0;
+    bool          open    = false;    // The server keeps the connection
+  protected:
+    int     timedRead();
+    int     timedPeek();
+    SimService   *service = NULL;
+    uint16_t      port    = 0;        // The server port
+    bool          secure  = false;    // Each write is a TLS record
+    unsigned long timeout = 1000;
+    unsigned long idle    = 0;        // Time spent waiting for data
+};
+
+// The encryption of a scanned network, as the SDK codes it
+#define ENC_TYPE_CCMP 4
+#define ENC_TYPE_NONE 7
+
+struct bss_info;
+
+// The scan results, as the core keeps them
+class ESP8266WiFiScanClass {
+  protected:
+    static void *_getScanInfoByIndex(int i);
+};
+
+class ESP8266WiFiClass: public ESP8266WiFiScanClass {
+  public:
+    int       scanNetworks();
+    void      scanDelete();
+    uint8_t  *BSSID();
+    uint8_t  *BSSID(int i);
+    int32_t   RSSI();
+    int32_t   RSSI(int i);
+    int32_t   channel();
+    int32_t   channel(int i);
+    uint8_t   encryptionType(int i);
+    bool      begin(const char *ssid, const char *pass = NULL, int32_t channel = 0, const uint8_t *bssid = NULL);
+    bool      disconnect(bool wifioff = false);
+    bool      isConnected();
+    IPAddress localIP();
+    int       hostByName(const char *name, IPAddress &ip, uint32_t timeout = 10000);
+};
+extern ESP8266WiFiClass WiFi;
+
+#endif /* SIM_ESP8266WIFI_H */
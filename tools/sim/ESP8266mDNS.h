@@ -1,5 +1,5 @@
 /**
-  server.h - Simple TCP server
+  ESP8266mDNS.h - Host stand-in for the mDNS responder
 
   Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
 
@@ -17,28 +17,20 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#ifndef SERVER_H
-#define SERVER_H
+#ifndef SIM_ESP8266MDNS_H
+#define SIM_ESP8266MDNS_H
 
-#define MAX_CLIENTS 4
+#include "Arduino.h"
 
-#include <Arduino.h>
-#include <ESP8266WiFi.h>
-#include <ESP8266mDNS.h>
-#include "version.h"
-
-class TCPServer: public WiFiServer {
+// Finds the LAN resolver stand-in, if there is one
+class MDNSResponder {
   public:
-    TCPServer(uint16_t serverPort);
-    void init(const char *serverName, const char *welcome);
-    int  check();
-    void sendAll(char *buf);
-    int  clients;
-  private:
-    int  port;
-    char name[16];
-    char wlcm[100];
-    WiFiClient TCPClient[MAX_CLIENTS];
+    bool addService(const char *name, const char *proto, int port) { return true; }
+    int       queryService(const char *service, const char *proto);
+    IPAddress IP(int i);
+    uint16_t  port(int i);
 };
 
-#endif /* SERVER_H */
+inline MDNSResponder MDNS;
+
+#endif /* SIM_ESP8266MDNS_H */
@@ -0,0 +1,76 @@
+/**
+  LittleFS.h - Host shim for the fleet simulator
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIM_LITTLEFS_H
+#define SIM_LITTLEFS_H
+
+#include "Arduino.h"
+#include <string>
+#include <vector>
+
+// Flash file system size per node (bytes) and block size
+#define SIM_FSSIZE    1048576
+#define SIM_FSBLOCK   4096
+
+// A file in the node flash, kept in memory
+class File {
+  public:
+    File() {}
+    File(std::string *data): data(data) {}
+    operator bool() const { return data != NULL; }
+    size_t  read(uint8_t *buf, size_t len);
+    size_t  write(const uint8_t *buf, size_t len);
+    bool    seek(uint32_t pos);
+    size_t  size() const { return data ? data->size() : 0; }
+    void    flush() {}
+    void    close() { data = NULL; }
+  private:
+    std::string  *data = NULL;
+    size_t        pos  = 0;
+};
+
+struct FSInfo {
+  size_t  totalBytes;
+  size_t  usedBytes;
+};
+
+// The entries of a directory, listed when opened
+class Dir {
+  public:
+    bool    next();
+    const std::string &fileName() const { return names[idx - 1]; }
+    std::vector<std::string> names;
+  private:
+    size_t  idx = 0;
+};
+
+class SimFS {
+  public:
+    bool    begin() { return true; }
+    bool    mkdir(const char *path) { return true; }
+    bool    exists(const char *path);
+    File    open(const char *path, const char *mode);
+    bool    remove(const char *path);
+    bool    rename(const char *from, const char *to);
+    bool    info(FSInfo &info);
+    Dir     openDir(const char *path);
+};
+extern SimFS LittleFS;
+
+#endif /* SIM_LITTLEFS_H */
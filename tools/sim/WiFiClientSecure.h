@@ -0,0 +1,88 @@
+/**
+  WiFiClientSecure.h - Host shim for the fleet simulator
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIM_WIFICLIENTSECURE_H
+#define SIM_WIFICLIENTSECURE_H
+
+#include <memory>
+#include "ESP8266WiFi.h"
+
+// The key of the stand-in geolocation server
+#define SIM_GEOKEY    "sim-geo"
+// Server key not matching
+#define BR_ERR_X509_NOT_TRUSTED 62
+// BearSSL per record overhead, receive and transmit
+#define SIM_BRRCVOVER 325
+#define SIM_BRXMTOVER 85
+
+namespace BearSSL {
+// Only keeps the key text, it is compared as is
+class PublicKey {
+  public:
+    bool parse(const char *pem) {
+      key = pem;
+      return true;
+    }
+    const char *key = NULL;
+};
+
+class Session {
+  public:
+    bool valid = false;
+};
+}
+
+// No encryption, only the handshake latency and the key check; the
+// buffers are allocated on connect and freed on stop, as the core does
+class WiFiClientSecure: public WiFiClient {
+  public:
+    int   connect(const char *host, uint16_t port);
+    int   connect(IPAddress ip, uint16_t port);
+    void  stop();
+    void  setInsecure() {
+      known = NULL;
+    }
+    void  setKnownKey(const BearSSL::PublicKey *pk) {
+      known = pk;
+    }
+    void  setSession(BearSSL::Session *s) {
+      session = s;
+    }
+    int   getLastSSLError() {
+      return error;
+    }
+    void  setBufferSizes(int recv, int xmit) {
+      rcvSize = recv + SIM_BRRCVOVER;
+      xmtSize = xmit + SIM_BRXMTOVER;
+    }
+    // The stand-in servers accept any fragment length
+    static bool probeMaxFragmentLength(const char*, uint16_t, uint16_t) {
+      return true;
+    }
+  private:
+    const BearSSL::PublicKey *known   = NULL;
+    BearSSL::Session         *session = NULL;
+    int                       error   = 0;
+    int                       rcvSize = 16384 + SIM_BRRCVOVER;
+    int                       xmtSize = 512 + SIM_BRXMTOVER;
+    std::unique_ptr<uint8_t[]> rcvBuf;
+    std::unique_ptr<uint8_t[]> xmtBuf;
+};
+
+#endif /* SIM_WIFICLIENTSECURE_H */
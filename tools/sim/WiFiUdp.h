@@ -0,0 +1,51 @@
+/**
+  WiFiUdp.h - Host shim for the fleet simulator
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIM_WIFIUDP_H
+#define SIM_WIFIUDP_H
+
+#include "Arduino.h"
+#include <string>
+
+// UDP socket, only talks to the stand-in NTP server and LAN resolver
+class WiFiUDP {
+  public:
+    uint8_t begin(uint16_t port) { return 1; }
+    void    stop() {}
+    void    flush() { rxLen = rxPos = 0; }
+    int     beginPacket(const char *host, uint16_t port);
+    int     beginPacket(IPAddress ip, uint16_t port);
+    size_t  write(const uint8_t *buf, size_t len);
+    int     endPacket();
+    int     parsePacket();
+    int     read();
+    int     read(uint8_t *buf, size_t len);
+    IPAddress remoteIP() { return IPAddress(192, 168, 4, 2); }
+    uint16_t  remotePort() { return dstPort; }
+  private:
+    uint16_t  dstPort = 0;
+    std::string tx;                   // The datagram being written
+    uint8_t   rx[256];
+    int       rxLen   = 0;
+    int       rxPos   = 0;
+    unsigned long rxDue = 0;          // Virtual time of the answer
+    bool      sent    = false;
+};
+
+#endif /* SIM_WIFIUDP_H */
@@ -0,0 +1,196 @@
+/**
+  bcnreplay.cpp - Replay captured beacon frames to the passive collector
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  Build:  g++ -O2 -Itools/sim -I. -o bcnreplay \
+              tools/sim/bcnreplay.cpp tools/sim/shim.cpp beacons.cpp \
+              energy.cpp
+  Usage:  bcnreplay [-a SECONDS] [-v] FILE
+
+  Reads a pcap capture of 802.11 frames, plain or with radiotap headers,
+  and hands each frame to the Beacons collector of the firmware the way
+  the SDK does: the RSSI, then only the first 112 bytes of the frame.  The
+  collector runs on the capture clock.  At the end, prints the APs heard
+  in the last SECONDS (default BCN_MAXAGE), as a fix would use them.  Each
+  frame is also parsed whole, to count the ones the 112 bytes cut short.
+  With -v, prints each frame kept.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+#include "sim.h"
+#include "beacons.h"
+
+// The pcap link types
+#define LINK_80211    105
+#define LINK_RADIOTAP 127
+
+/**
+  Read a little or big endian number from the pcap headers
+*/
+static uint32_t get32(const uint8_t *p, bool swap) {
+  if (swap) return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+  return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+/**
+  Find the signal strength in a radiotap header, the fields before it
+  only need to be skipped
+
+  @param hdr the radiotap header
+  @param len the header length
+  @param rssi the signal strength (dBm)
+  @param fcs set if the frame ends with the FCS
+  @return false if not found
+*/
+static bool radiotap(const uint8_t *hdr, size_t len, int8_t *rssi, bool *fcs) {
+  // Field sizes and alignments, up to the antenna signal
+  static const uint8_t sizes[]  = {8, 1, 1, 4, 2, 1};
+  static const uint8_t aligns[] = {8, 1, 1, 2, 2, 1};
+  if (len < 8) return false;
+  uint32_t present = get32(hdr + 4, false);
+  // Skip the extended presence bitmaps
+  size_t pos = 8;
+  for (uint32_t p = present; p & 0x80000000UL and pos + 4 <= len; pos += 4)
+    p = get32(hdr + pos, false);
+  for (uint8_t bit = 0; bit < sizeof(sizes); bit++) {
+    if (not (present & (1UL << bit))) continue;
+    pos = (pos + aligns[bit] - 1) & ~(size_t)(aligns[bit] - 1);
+    if (pos + sizes[bit] > len) return false;
+    if (bit == 1) *fcs = hdr[pos] & 0x10;
+    if (bit == 5) {
+      *rssi = (int8_t)hdr[pos];
+      return true;
+    }
+    pos += sizes[bit];
+  }
+  return false;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long maxAge = BCN_MAXAGE;
+  bool verbose = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "a:v")) != -1) {
+    if      (opt == 'a') maxAge = atol(optarg);
+    else if (opt == 'v') verbose = true;
+    else {
+      fprintf(stderr, "Usage: %s [-a SECONDS] [-v] FILE\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "Usage: %s [-a SECONDS] [-v] FILE\n", argv[0]);
+    return 1;
+  }
+  FILE *in = fopen(argv[optind], "rb");
+  if (in == NULL) {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  // The pcap global header
+  uint8_t ghdr[24];
+  if (fread(ghdr, 1, sizeof(ghdr), in) != sizeof(ghdr)) {
+    fprintf(stderr, "bcnreplay: short file\n");
+    return 1;
+  }
+  uint32_t magic = get32(ghdr, false);
+  bool swap  = magic == 0xD4C3B2A1UL or magic == 0x4D3CB2A1UL;
+  bool nsec  = magic == 0xA1B23C4DUL or magic == 0x4D3CB2A1UL;
+  if (not swap and magic != 0xA1B2C3D4UL and magic != 0xA1B23C4DUL) {
+    fprintf(stderr, "bcnreplay: not a pcap file\n");
+    return 1;
+  }
+  uint32_t link = get32(ghdr + 20, swap);
+  if (link != LINK_80211 and link != LINK_RADIOTAP) {
+    fprintf(stderr, "bcnreplay: link type %u, not 802.11\n", link);
+    return 1;
+  }
+
+  // One node, listening from the start
+  SimNode node;
+  simCur = &node;
+  Beacons beacons;
+  beacons.init();
+  beacons.loop();
+
+  unsigned long frames = 0, cut = 0;
+  uint64_t first = 0;
+  uint8_t rhdr[16];
+  static uint8_t pkt[65536];
+  while (fread(rhdr, 1, sizeof(rhdr), in) == sizeof(rhdr)) {
+    uint64_t sec  = get32(rhdr, swap);
+    uint64_t frac = get32(rhdr + 4, swap);
+    uint32_t len  = get32(rhdr + 8, swap);
+    if (len > sizeof(pkt) or fread(pkt, 1, len, in) != len) break;
+    uint64_t ms = sec * 1000 + (nsec ? frac / 1000000 : frac / 1000);
+    if (frames++ == 0) first = ms;
+    node.clock = ms - first;
+    // The frame and its signal strength
+    const uint8_t *frame = pkt;
+    size_t flen = len;
+    int8_t rssi = -70;
+    if (link == LINK_RADIOTAP) {
+      if (len < 4) continue;
+      size_t rlen = pkt[2] | pkt[3] << 8;
+      bool fcs = false;
+      if (rlen > len) continue;
+      radiotap(pkt, rlen, &rssi, &fcs);
+      frame += rlen;
+      flen  -= rlen;
+      if (fcs and flen >= 4) flen -= 4;
+    }
+    // As the SDK gives it
+    uint8_t buf[128] = {0};
+    buf[0] = (uint8_t)rssi;
+    memcpy(buf + 12, frame, flen < 112 ? flen : 112);
+    buf[124] = 1;
+    buf[126] = flen & 0xFF;
+    buf[127] = (flen >> 8) & 0xFF;
+    unsigned long heard = beacons.heard;
+    if (node.sniffer != NULL) node.sniffer(buf, sizeof(buf));
+    // Parsed whole, to compare
+    bcn_frame_t whole, part;
+    if (Beacons::parse(frame, flen, &whole)) {
+      Beacons::parse(frame, flen < 112 ? flen : 112, &part);
+      if (whole.channel != part.channel) cut++;
+      if (verbose and beacons.heard != heard)
+        printf("%8lu.%03lu %02x:%02x:%02x:%02x:%02x:%02x ch %2u %4d dBm %s\n",
+               node.clock / 1000, node.clock % 1000,
+               whole.bssid[0], whole.bssid[1], whole.bssid[2],
+               whole.bssid[3], whole.bssid[4], whole.bssid[5],
+               whole.channel, rssi, whole.ssid);
+    }
+  }
+  fclose(in);
+
+  bcn_ap_t list[BCN_SLOTS];
+  uint8_t count = beacons.collect(list, BCN_SLOTS, maxAge * 1000UL);
+  printf("frames %lu, kept %lu, dropped %lu, channel cut off %lu\n",
+         frames, beacons.heard, beacons.dropped, cut);
+  printf("%u APs heard in the last %lu s\n", count, maxAge);
+  for (uint8_t i = 0; i < count; i++)
+    printf("%02x:%02x:%02x:%02x:%02x:%02x ch %2u %4d dBm %6.1f s ago\n",
+           list[i].bssid[0], list[i].bssid[1], list[i].bssid[2],
+           list[i].bssid[3], list[i].bssid[4], list[i].bssid[5],
+           list[i].channel, list[i].rssi, (node.clock - list[i].seen) / 1000.0);
+  return 0;
+}
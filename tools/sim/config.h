@@ -0,0 +1,52 @@
+/**
+  config.h - Fleet simulator settings
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+// The network of the fleet, known to all the nodes
+#define WIFI_RS       ";"
+#define WIFI_FS       ","
+#define WIFI_SSIDPASS "wips-fleet,wips-fleet-psk"
+
+// Geolocation
+#define GEO_APIKEY    "SIM"
+#define GEO_MAXACC    250
+#define GEO_MINACC    50
+
+// Offline AP tiles server
+#define TILE_SERVER   "tiles.sim"
+#define TILE_PORT     8080
+
+// Track simplification tolerance (m)
+#define TRACK_TOL     50
+
+// APRS settings
+#define APRS_SERVER   "aprs.sim"
+#define APRS_PORT     14580
+
+// A retired key first, so the pin rotation is exercised
+#define TLS_PINS(X) \
+  X(GEO1, "location.services.mozilla.com", "sim-old") \
+  X(GEO2, "location.services.mozilla.com", "sim-geo")
+
+// NTP
+#define NTP_SERVER    "ntp.sim"
+
+#endif /* CONFIG_H */
@@ -0,0 +1,145 @@
+/**
+  fanout.cpp - Memory and time of the NMEA fan-out server
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  Build:  g++ -O2 -Itools/sim -I. -o fanout tools/sim/fanout.cpp rawserver.cpp
+  Usage:  fanout [-e EPOCHS] [-r BYTES] [-v]
+
+  Runs the RawServer of the firmware over the lwIP stand-in, with 1 to
+  RAW_CLIENTS clients, for EPOCHS fixes of five sentences each.  Every
+  fourth client is slow and reads only BYTES per epoch, the others read
+  all.  Reports the peak pbuf memory held by the server, the peak data
+  queued in all the PCBs (what a copy per client would hold), the epochs
+  skipped by the slow clients and the time to flush one epoch.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <unistd.h>
+
+#include "rawserver.h"
+#include "dlog.h"
+
+static bool verbose = false;
+
+#define DLOG_FMT(id, sig, fmt) fmt,
+static const char *dlogFormats[] = {
+  DLOG_CATALOG(DLOG_FMT)
+};
+#undef DLOG_FMT
+
+DLOG dlog;
+
+DLOG::DLOG() {
+}
+
+void DLOG::write(uint8_t id, ...) {
+  if (id >= DLOG_COUNT or not verbose) return;
+  va_list args;
+  va_start(args, id);
+  vprintf(dlogFormats[id], args);
+  va_end(args);
+}
+
+// The sentences of one fix
+static const char *sentences[] = {
+  "$GPGGA,120000.00,4425.6080,N,02606.1500,E,1,08,1.0,80.0,M,36.0,M,,*6A\r\n",
+  "$GPRMC,120000.00,A,4425.6080,N,02606.1500,E,12.3,045.0,181026,,,A*5C\r\n",
+  "$GPGLL,4425.6080,N,02606.1500,E,120000.00,A,A*6E\r\n",
+  "$GPVTG,045.0,T,,M,12.3,N,22.8,K,A*1F\r\n",
+  "$GPZDA,120000.00,18,10,2026,00,00*6B\r\n",
+};
+
+/**
+  Run the server with some clients
+
+  @return false if a fast client lost data or memory leaked
+*/
+static bool run(int count, int epochs, uint32_t slowRate) {
+  memset(&lwipStats, 0, sizeof(lwipStats));
+  RawServer *srv = new RawServer(10110);
+  srv->init("nmea-0183", "$PWELCOME,fanout\r\n");
+  tcp_pcb *pcbs[RAW_CLIENTS + 1];
+  for (int i = 0; i < count; i++)
+    pcbs[i] = simTcpConnect(simListener, 0x0001A8C0 + ((10 + i) << 24));
+  // One more is rejected
+  bool rejected = count < RAW_CLIENTS or simTcpConnect(simListener, 0xFE01A8C0) == NULL;
+  // Read the welcome
+  for (int i = 0; i < count; i++)
+    simTcpAck(pcbs[i], TCP_SND_BUF);
+
+  uint32_t epochLen = 0;
+  for (const char *s : sentences)
+    epochLen += strlen(s);
+  double flushNs = 0;
+  for (int e = 0; e < epochs; e++) {
+    for (const char *s : sentences)
+      srv->sendAll((char*)s);
+    auto t0 = std::chrono::steady_clock::now();
+    srv->flush();
+    flushNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+    for (int i = 0; i < count; i++)
+      simTcpAck(pcbs[i], i % 4 == 3 ? slowRate : TCP_SND_BUF);
+  }
+
+  // The fast clients got every epoch
+  bool ok = rejected;
+  for (int i = 0; i < count; i++)
+    if (i % 4 != 3 and pcbs[i]->received != epochLen * epochs + strlen("$PWELCOME,fanout\r\n"))
+      ok = false;
+
+  printf("%7d %9u %10ld %10ld %6.2f %10ld %9lu %10.0f",
+         count, epochLen, lwipStats.pbufPeak, lwipStats.segPeak,
+         lwipStats.pbufPeak ? (double)lwipStats.segPeak / lwipStats.pbufPeak : 0.0,
+         lwipStats.copyPeak, srv->skipped, flushNs / epochs);
+
+  // The first client is reset, the others close
+  if (count > 0) simTcpReset(pcbs[0]);
+  for (int i = 1; i < count; i++)
+    simTcpClose(pcbs[i]);
+  if (srv->clients != 0 or lwipStats.pbufBytes != 0 or lwipStats.copyBytes != 0)
+    ok = false;
+  printf("  %s\n", ok ? "ok" : "FAIL");
+  // The firmware never stops listening
+  tcp_close(simListener);
+  delete srv;
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  int epochs = 3600;
+  uint32_t slowRate = 200;
+  int opt;
+  while ((opt = getopt(argc, argv, "e:r:v")) != -1) {
+    switch (opt) {
+      case 'e': epochs   = atoi(optarg); break;
+      case 'r': slowRate = atoi(optarg); break;
+      case 'v': verbose  = true; break;
+      default:
+        fprintf(stderr, "Usage: %s [-e EPOCHS] [-r BYTES] [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  printf("clients     epoch  pbuf peak  queue peak  ratio  copy peak   skipped   flush ns\n");
+  bool ok = true;
+  for (int count = 1; count <= RAW_CLIENTS; count *= 2)
+    ok = run(count, epochs, slowRate) and ok;
+  return ok ? 0 : 1;
+}
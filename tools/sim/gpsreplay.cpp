@@ -0,0 +1,153 @@
+/**
+  gpsreplay.cpp - Replay a recorded NMEA stream through the GPS parser
+
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  Build:  g++ -O2 -Itools/sim -I. -o gpsreplay \
+              tools/sim/gpsreplay.cpp tools/sim/shim.cpp gps.cpp energy.cpp
+  Usage:  gpsreplay [-b BAUD] [-v] [FILE]
+
+  Reads the output of a GPS receiver, as recorded from its serial port
+  (from FILE, or stdin), and feeds it to the GPS parser of the firmware
+  one character at a time.  The clock advances with each character, as
+  at BAUD (default 9600), and with the UTC time of the GGA and RMC
+  sentences, so the silences of the receiver count too and the age of
+  the fixes is the one the tracker would see.  Prints the sentences
+  parsed, the checksum errors and overruns, and the fixes, good enough
+  or not to replace the WiFi geolocation, lost or gone stale.  With -v,
+  prints each fix.
+
+  The recording tools/sim/gps.nmea has a cold start, a drive with a bad
+  checksum, a line cut short, an overrun, a silence of the receiver long
+  enough for the fix to go stale, a tunnel and a poor fix.  Its replay
+  must print tools/sim/gps.out:
+
+    gpsreplay -v tools/sim/gps.nmea | diff - tools/sim/gps.out
+*/
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+#include "sim.h"
+#include "gps.h"
+
+/**
+  The UTC time of a GGA or RMC sentence with a good checksum
+
+  @param line the sentence, from '$' to the checksum
+  @return the time of the day (ms), negative if none
+*/
+long utcTime(const char *line) {
+  const char *star = strrchr(line, '*');
+  if (line[0] != '$' or star == NULL) return -1;
+  uint8_t ck = 0;
+  for (const char *p = line + 1; p < star; p++)
+    ck ^= *p;
+  if (ck != strtol(star + 1, NULL, 16)) return -1;
+  if (strncmp(line + 3, "GGA,", 4) != 0 and strncmp(line + 3, "RMC,", 4) != 0) return -1;
+  const char *t = line + 7;
+  if (strspn(t, "0123456789") < 6) return -1;
+  long hms = atol(t);
+  return ((hms / 10000 * 60 + hms / 100 % 100) * 60 + hms % 100) * 1000L +
+         (t[6] == '.' ? lround(atof(t + 6) * 1000) : 0);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long baud = 9600;
+  bool verbose = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "b:v")) != -1) {
+    if      (opt == 'b') baud = atol(optarg);
+    else if (opt == 'v') verbose = true;
+    else {
+      fprintf(stderr, "Usage: %s [-b BAUD] [-v] [FILE]\n", argv[0]);
+      return 1;
+    }
+  }
+  FILE *in = stdin;
+  if (optind < argc and (in = fopen(argv[optind], "rb")) == NULL) {
+    perror(argv[optind]);
+    return 1;
+  }
+  if (baud < 300) baud = 300;
+
+  // One node, the receiver on its serial input
+  SimNode node;
+  simCur = &node;
+  GPS gps;
+  gps.init(&Serial);
+
+  unsigned long chars = 0, fixes = 0, good = 0, lost = 0, stale = 0;
+  // The clock, by the characters and by the time in the sentences
+  unsigned long skew = 0, base = 0;
+  long utc0 = -1;
+  char line[256];
+  size_t len = 0;
+  bool had = false, fresh = false;
+  int c;
+  while ((c = fgetc(in)) != EOF) {
+    // Ten bits a character
+    node.clock = (unsigned long)(++chars * 10000ULL / baud) + skew;
+    if (c == '$') len = 0;
+    if (c == '\r' or c == '\n') {
+      line[len] = '\0';
+      len = 0;
+      // The receiver sends each second, what it did not send took time too
+      long utc = utcTime(line);
+      if (utc >= 0) {
+        if (utc0 < 0) {
+          utc0 = utc;
+          base = node.clock;
+        }
+        unsigned long due = base + (utc - utc0 + 86400000L) % 86400000L;
+        if (due > node.clock) {
+          skew += due - node.clock;
+          node.clock = due;
+        }
+      }
+    }
+    else if (len < sizeof(line) - 1)
+      line[len++] = c;
+    // The fix got old before a new one came
+    if (fresh and not gps.valid() and gps.fix.valid) stale++;
+    fresh = gps.valid();
+    if (gps.feed(c)) {
+      fixes++;
+      fresh = true;
+      if (gps.good()) good++;
+      if (verbose)
+        printf("%8lu.%03lu %11.6f %11.6f %2u sats hdop %4.1f %3d m %5.1f kn %3d' %s\n",
+               node.clock / 1000, node.clock % 1000, gps.fix.lat, gps.fix.lng,
+               gps.fix.sats, gps.fix.hdop, gps.accuracy(), gps.fix.knots,
+               gps.fix.course, gps.good() ? "good" : "poor");
+    }
+    // The fix was lost, as indoors
+    if (had and not gps.fix.valid) lost++;
+    had = gps.fix.valid;
+  }
+  if (in != stdin) fclose(in);
+
+  printf("%lu bytes, %.1f s at %lu baud\n", chars, node.clock / 1000.0, baud);
+  printf("sentences %lu, errors %lu\n", gps.sentences, gps.errors);
+  printf("fixes     %lu, good %lu, lost %lu times, stale %lu times\n", fixes, good, lost, stale);
+  if (gps.valid())
+    printf("last      %.6f %.6f, %u sats, %d m\n", gps.fix.lat, gps.fix.lng, gps.fix.sats, gps.accuracy());
+  return 0;
+}
@@ -0,0 +1,61 @@
+/**
+  heap.h - Host heap allocation count for the fleet simulator
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  The shim replaces operator new and malloc with counting ones.  Only
+  the allocations made while simCounting is set are counted, per thread,
+  so per node.  The stand-ins, the servers, the radio and the file system
+  allocate as they like: they run quiet, not counted, their memory is
+  not on the device.  The core and lwIP allocate on the device too, from
+  the same heap as the sketch: the connection contexts, the PCBs, the
+  pbufs, the segments and the BearSSL buffers.  Their host stand-ins
+  allocate differently, so they count those apart, with simStack(), where
+  the device allocates.  The lwIP and SDK callbacks are the firmware
+  again, counted even when called from a stand-in.
+*/
+
+#ifndef SIM_HEAP_H
+#define SIM_HEAP_H
+
+// The heap allocations of the firmware on this thread, counted while set
+inline thread_local bool simCounting = false;
+inline thread_local unsigned long simAllocs = 0;
+// In a stand-in, not counted
+inline thread_local bool simQuiet = false;
+// The allocations of the core and lwIP on this thread, counted apart
+inline thread_local unsigned long simStackAllocs = 0;
+
+// The core or lwIP allocates on the heap of the sketch, count it apart
+inline void simStack(unsigned long count = 1) {
+  if (simCounting) simStackAllocs += count;
+}
+
+// Leaves the allocations of a stand-in out of the count, for its scope;
+// SimQuiet(false) counts them again, in the callbacks to the firmware
+class SimQuiet {
+  public:
+    SimQuiet(bool quiet = true): was(simQuiet) {
+      simQuiet = quiet;
+    }
+    ~SimQuiet() {
+      simQuiet = was;
+    }
+  private:
+    bool  was;
+};
+
+#endif /* SIM_HEAP_H */
@@ -0,0 +1,37 @@
+/**
+  lwip/ip_addr.h - Host stand-in for the lwIP IPv4 addresses
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIM_LWIP_IP_ADDR_H
+#define SIM_LWIP_IP_ADDR_H
+
+#include <cstdint>
+
+// IPv4 only, as the core builds lwIP
+struct ip_addr_t {
+  uint32_t addr;
+};
+typedef ip_addr_t ip4_addr_t;
+
+inline const ip_addr_t ip_addr_any = {0};
+#define IP_ADDR_ANY         (&ip_addr_any)
+#define ip_2_ip4(ipaddr)    (ipaddr)
+#define ip4_addr_get_u32(a) ((a)->addr)
+#define ip_addr_set_ip4_u32(ipaddr, val)  ((ipaddr)->addr = (val))
+
+#endif /* SIM_LWIP_IP_ADDR_H */
@@ -0,0 +1,52 @@
+/**
+  lwip/netif.h - Host stand-in for the lwIP network interface
+
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  Each node has its own station interface.  The shim passes the frames
+  of the simulated traffic through its link functions, headers only, with
+  the full frame length, so they can be hooked as on the device.
+*/
+
+#ifndef SIM_LWIP_NETIF_H
+#define SIM_LWIP_NETIF_H
+
+#include "lwip/err.h"
+#include "lwip/pbuf.h"
+
+struct netif;
+typedef err_t (*netif_input_fn)(struct pbuf *p, struct netif *inp);
+typedef err_t (*netif_linkoutput_fn)(struct netif *netif, struct pbuf *p);
+
+// The frames go nowhere
+inline err_t simLinkInput(struct pbuf *p, struct netif *inp) {
+  return ERR_OK;
+}
+inline err_t simLinkOutput(struct netif *netif, struct pbuf *p) {
+  return ERR_OK;
+}
+
+struct netif {
+  netif_input_fn      input       = simLinkInput;
+  netif_linkoutput_fn linkoutput  = simLinkOutput;
+};
+
+// The station interface of the current node
+struct netif *simNetif();
+#define netif_default simNetif()
+
+#endif /* SIM_LWIP_NETIF_H */
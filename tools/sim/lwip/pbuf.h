@@ -0,0 +1,82 @@
+/**
+  lwip/pbuf.h - Host stand-in for the lwIP packet buffers
+
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  The live pbuf bytes are counted in lwipStats, with the TCP segments.
+  Each pbuf is an allocation on the heap of the sketch, on the device.
+*/
+
+#ifndef SIM_LWIP_PBUF_H
+#define SIM_LWIP_PBUF_H
+
+#include <cstdint>
+#include <cstdlib>
+
+#include "heap.h"
+
+enum pbuf_layer { PBUF_TRANSPORT, PBUF_IP, PBUF_LINK, PBUF_RAW };
+enum pbuf_type  { PBUF_RAM, PBUF_ROM, PBUF_REF, PBUF_POOL };
+
+struct pbuf {
+  pbuf     *next;
+  void     *payload;
+  uint16_t  tot_len;
+  uint16_t  len;
+  uint16_t  ref;
+};
+
+// Live memory, current and peak bytes
+struct lwip_stats_t {
+  long pbufBytes, pbufPeak;           // Allocated pbufs
+  long copyBytes, copyPeak;           // Copied by tcp_write
+  long segBytes,  segPeak;            // Queued in all the PCBs, not acknowledged
+  unsigned long writes, aborts;
+};
+inline lwip_stats_t lwipStats;
+
+inline void lwip_count(long &cur, long &peak, long delta) {
+  cur += delta;
+  if (cur > peak) peak = cur;
+}
+
+inline pbuf *pbuf_alloc(pbuf_layer layer, uint16_t length, pbuf_type type) {
+  SimQuiet quiet;
+  simStack();
+  pbuf *p = (pbuf*)malloc(sizeof(pbuf) + length);
+  if (p == NULL) return NULL;
+  p->next     = NULL;
+  p->payload  = (uint8_t*)p + sizeof(pbuf);
+  p->tot_len  = length;
+  p->len      = length;
+  p->ref      = 1;
+  lwip_count(lwipStats.pbufBytes, lwipStats.pbufPeak, length);
+  return p;
+}
+
+inline void pbuf_ref(pbuf *p) {
+  p->ref++;
+}
+
+inline uint8_t pbuf_free(pbuf *p) {
+  if (p == NULL or --p->ref > 0) return 0;
+  lwip_count(lwipStats.pbufBytes, lwipStats.pbufPeak, -(long)p->tot_len);
+  free(p);
+  return 1;
+}
+
+#endif /* SIM_LWIP_PBUF_H */
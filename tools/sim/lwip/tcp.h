@@ -0,0 +1,233 @@
+/**
+  lwip/tcp.h - Host stand-in for the lwIP raw TCP API
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  Only what the servers and the APRS client use.  Written data stays
+  queued on the PCB until the test acknowledges it with simTcpAck(), which
+  reads the bytes back, so a payload freed too early shows up under the
+  address sanitizer.  The live pbuf and segment bytes are counted in
+  lwipStats, the PCBs and the segments as allocations of the stack, see
+  heap.h.  The client connections go to the stand-in servers of the
+  simulator, through the simTcp hooks it sets.
+*/
+
+#ifndef SIM_LWIP_TCP_H
+#define SIM_LWIP_TCP_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+#include "lwip/pbuf.h"
+
+#define TCP_WRITE_FLAG_COPY 0x01
+// Send buffer, as in the core lwIP build
+#define TCP_MSS       1460
+#define TCP_SND_BUF   (2 * TCP_MSS)
+
+struct tcp_pcb;
+typedef err_t (*tcp_accept_fn)(void *arg, tcp_pcb *newpcb, err_t err);
+typedef err_t (*tcp_recv_fn)(void *arg, tcp_pcb *tpcb, pbuf *p, err_t err);
+typedef err_t (*tcp_sent_fn)(void *arg, tcp_pcb *tpcb, uint16_t len);
+typedef void  (*tcp_err_fn)(void *arg, err_t err);
+typedef err_t (*tcp_connected_fn)(void *arg, tcp_pcb *tpcb, err_t err);
+
+// A segment written, not acknowledged
+struct sim_seg_t {
+  const uint8_t *data;
+  uint16_t       len;
+  uint16_t       off;                 // Bytes already acknowledged
+  bool           copied;
+};
+
+struct tcp_pcb {
+  ip_addr_t     remote_ip;
+  uint16_t      local_port;
+  bool          listening;
+  bool          nodelay;
+  void         *callback_arg;
+  tcp_accept_fn accept;
+  tcp_recv_fn   recv;
+  tcp_sent_fn   sent;
+  tcp_err_fn    errf;
+  tcp_connected_fn connected;
+  void         *sim;                  // The stand-in connection of a client
+  uint32_t      unacked;
+  uint32_t      received;             // Bytes acknowledged, as read by the peer
+  uint32_t      checksum;             // Sum of the bytes read by the peer
+  std::deque<sim_seg_t> segs;
+};
+
+// The simulator side of the client connections: open, data written, closed
+inline err_t (*simTcpOpen)(tcp_pcb *pcb, uint16_t port) = NULL;
+inline void  (*simTcpSend)(tcp_pcb *pcb, const void *data, uint16_t len) = NULL;
+inline void  (*simTcpDrop)(tcp_pcb *pcb) = NULL;
+
+inline tcp_pcb *tcp_new() {
+  SimQuiet quiet;
+  simStack();
+  tcp_pcb *pcb = new tcp_pcb();
+  return pcb;
+}
+
+inline void tcp_free_segs(tcp_pcb *pcb) {
+  for (sim_seg_t &seg : pcb->segs) {
+    lwip_count(lwipStats.segBytes, lwipStats.segPeak, -(long)(seg.len - seg.off));
+    if (seg.copied) {
+      lwip_count(lwipStats.copyBytes, lwipStats.copyPeak, -(long)seg.len);
+      free((void*)seg.data);
+    }
+  }
+  pcb->segs.clear();
+  pcb->unacked = 0;
+}
+
+inline err_t tcp_bind(tcp_pcb *pcb, const ip_addr_t *ipaddr, uint16_t port) {
+  pcb->local_port = port;
+  return ERR_OK;
+}
+
+// The last listening PCB, for the test to connect to
+inline tcp_pcb *simListener = NULL;
+
+inline tcp_pcb *tcp_listen(tcp_pcb *pcb) {
+  pcb->listening = true;
+  simListener = pcb;
+  return pcb;
+}
+
+inline void tcp_arg(tcp_pcb *pcb, void *arg)            { pcb->callback_arg = arg; }
+inline void tcp_accept(tcp_pcb *pcb, tcp_accept_fn fn)  { pcb->accept = fn; }
+inline void tcp_recv(tcp_pcb *pcb, tcp_recv_fn fn)      { pcb->recv = fn; }
+inline void tcp_sent(tcp_pcb *pcb, tcp_sent_fn fn)      { pcb->sent = fn; }
+inline void tcp_err(tcp_pcb *pcb, tcp_err_fn fn)        { pcb->errf = fn; }
+inline void tcp_nagle_disable(tcp_pcb *pcb)             { pcb->nodelay = true; }
+inline uint32_t tcp_sndbuf(tcp_pcb *pcb)                { return TCP_SND_BUF - pcb->unacked; }
+inline void tcp_recved(tcp_pcb *pcb, uint16_t len)      { }
+inline err_t tcp_output(tcp_pcb *pcb)                   { return ERR_OK; }
+
+inline err_t tcp_write(tcp_pcb *pcb, const void *data, uint16_t len, uint8_t flags) {
+  if (len > tcp_sndbuf(pcb)) return ERR_MEM;
+  SimQuiet quiet;
+  // A segment, with its pbuf
+  simStack(2);
+  sim_seg_t seg = {(const uint8_t*)data, len, 0, (flags & TCP_WRITE_FLAG_COPY) != 0};
+  if (seg.copied) {
+    uint8_t *copy = (uint8_t*)malloc(len);
+    if (copy == NULL) return ERR_MEM;
+    memcpy(copy, data, len);
+    seg.data = copy;
+    lwip_count(lwipStats.copyBytes, lwipStats.copyPeak, len);
+  }
+  lwip_count(lwipStats.segBytes, lwipStats.segPeak, len);
+  pcb->segs.push_back(seg);
+  pcb->unacked += len;
+  lwipStats.writes++;
+  if (pcb->sim != NULL) simTcpSend(pcb, data, len);
+  return ERR_OK;
+}
+
+inline err_t tcp_connect(tcp_pcb *pcb, const ip_addr_t *ipaddr, uint16_t port, tcp_connected_fn connected) {
+  if (simTcpOpen == NULL) return ERR_CONN;
+  pcb->remote_ip = *ipaddr;
+  pcb->connected = connected;
+  return simTcpOpen(pcb, port);
+}
+
+inline err_t tcp_close(tcp_pcb *pcb) {
+  if (pcb->sim != NULL) simTcpDrop(pcb);
+  tcp_free_segs(pcb);
+  delete pcb;
+  return ERR_OK;
+}
+
+inline void tcp_abort(tcp_pcb *pcb) {
+  tcp_err_fn errf = pcb->errf;
+  void *arg = pcb->callback_arg;
+  if (pcb->sim != NULL) simTcpDrop(pcb);
+  tcp_free_segs(pcb);
+  delete pcb;
+  lwipStats.aborts++;
+  if (errf != NULL) errf(arg, ERR_ABRT);
+}
+
+/**
+  A new connection to a listening PCB
+
+  @return the new PCB, NULL if rejected
+*/
+inline tcp_pcb *simTcpConnect(tcp_pcb *listener, uint32_t ip) {
+  tcp_pcb *pcb = tcp_new();
+  pcb->remote_ip.addr = ip;
+  pcb->callback_arg = listener->callback_arg;
+  if (listener->accept(listener->callback_arg, pcb, ERR_OK) != ERR_OK) return NULL;
+  return pcb;
+}
+
+/**
+  The peer reads and acknowledges up to some bytes
+
+  @return the bytes acknowledged
+*/
+inline uint16_t simTcpAck(tcp_pcb *pcb, uint32_t max) {
+  uint32_t acked = 0;
+  while (not pcb->segs.empty() and acked < max) {
+    sim_seg_t &seg = pcb->segs.front();
+    uint16_t len = seg.len - seg.off;
+    if (acked + len > max) len = max - acked;
+    // Read the data, as the NIC would when sending it
+    for (uint16_t i = 0; i < len; i++)
+      pcb->checksum += seg.data[seg.off + i];
+    seg.off += len;
+    acked   += len;
+    lwip_count(lwipStats.segBytes, lwipStats.segPeak, -(long)len);
+    if (seg.off < seg.len) break;
+    if (seg.copied) {
+      lwip_count(lwipStats.copyBytes, lwipStats.copyPeak, -(long)seg.len);
+      free((void*)seg.data);
+    }
+    pcb->segs.pop_front();
+  }
+  pcb->unacked  -= acked;
+  pcb->received += acked;
+  if (acked > 0 and pcb->sent != NULL)
+    pcb->sent(pcb->callback_arg, pcb, acked);
+  return acked;
+}
+
+/**
+  The peer closes the connection
+*/
+inline void simTcpClose(tcp_pcb *pcb) {
+  if (pcb->recv != NULL) pcb->recv(pcb->callback_arg, pcb, NULL, ERR_OK);
+}
+
+/**
+  The connection is reset, lwIP frees the PCB before the error callback
+*/
+inline void simTcpReset(tcp_pcb *pcb) {
+  tcp_err_fn errf = pcb->errf;
+  void *arg = pcb->callback_arg;
+  tcp_free_segs(pcb);
+  delete pcb;
+  if (errf != NULL) errf(arg, ERR_RST);
+}
+
+#endif /* SIM_LWIP_TCP_H */
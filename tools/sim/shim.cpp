@@ -0,0 +1,1664 @@
+/**
+  shim.cpp - Host shim and stand-in servers for the fleet simulator
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "ESP8266WiFi.h"
+#include "WiFiUdp.h"
+#include "WiFiClientSecure.h"
+#include "ESP8266mDNS.h"
+#include "LittleFS.h"
+#include "sim.h"
+#include "dlog.h"
+#include "stall.h"
+#include "energy.h"
+#include "tiles.h"
+#include "lwip/tcp.h"
+#include <algorithm>
+#include <ctime>
+#include <new>
+
+thread_local SimNode *simCur = NULL;
+
+SimSerial         Serial;
+SimESP            ESP;
+ESP8266WiFiClass  WiFi;
+SimGeo            simGeo;
+SimAPRS           simAPRS;
+SimTiles          simTiles;
+SimFS             LittleFS;
+SimNTP            simNTP;
+SimDNS            simDNS;
+SimLAN            simLAN;
+SimRadio          simRadio;
+
+/*
+  Heap
+*/
+
+static void simCount() {
+  if (simCounting and not simQuiet) simAllocs++;
+}
+
+#ifdef __SANITIZE_ADDRESS__
+// The sanitizer brings its own malloc, only operator new is counted
+static void *simHeap(size_t size) {
+  simCount();
+  return malloc(size);
+}
+
+static void simFree(void *p) {
+  free(p);
+}
+#else
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+extern "C" void  __libc_free(void *p);
+
+static void *simHeap(size_t size) {
+  simCount();
+  return __libc_malloc(size);
+}
+
+static void simFree(void *p) {
+  __libc_free(p);
+}
+
+void *malloc(size_t size) noexcept {
+  return simHeap(size);
+}
+
+void *calloc(size_t n, size_t size) noexcept {
+  simCount();
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) noexcept {
+  simCount();
+  return __libc_realloc(p, size);
+}
+#endif
+
+void *operator new(size_t size) {
+  void *p = simHeap(size ? size : 1);
+  if (p == NULL) throw std::bad_alloc();
+  return p;
+}
+
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t&) noexcept {
+  return simHeap(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return simHeap(size ? size : 1);
+}
+
+void operator delete(void *p) noexcept {
+  simFree(p);
+}
+
+void operator delete[](void *p) noexcept {
+  simFree(p);
+}
+
+void operator delete(void *p, size_t size) noexcept {
+  simFree(p);
+}
+
+void operator delete[](void *p, size_t size) noexcept {
+  simFree(p);
+}
+
+void operator delete(void *p, const std::nothrow_t&) noexcept {
+  simFree(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t&) noexcept {
+  simFree(p);
+}
+
+/*
+  Network interface
+*/
+
+// The local port of the clients, the server ports tell them apart
+#define SIM_LOCALPORT 49152
+// Ethernet, IPv4 and TCP headers
+#define SIM_TCPHDR    54
+// TLS record header and tag
+#define SIM_TLSREC    29
+
+struct netif *simNetif() {
+  return &simCur->nif;
+}
+
+/**
+  An exchange lost on the way, at the loss rate of the node
+*/
+bool simLost() {
+  return simCur->loss > 0 and simCur->random(100) < simCur->loss;
+}
+
+/**
+  Pass the frames of a transfer through the station interface, split in
+  segments, headers only with the full length
+
+  @param out true if sent
+  @param proto the IP protocol, TCP or UDP
+  @param rport the remote port
+  @param lport the local port
+  @param len the payload length
+*/
+void simWire(bool out, uint8_t proto, uint16_t rport, uint16_t lport, size_t len) {
+  SimNode *n = simCur;
+  uint8_t hdr[SIM_TCPHDR] = {0};
+  hdr[12] = 0x08;
+  hdr[14] = 0x45;
+  hdr[23] = proto;
+  uint16_t src = out ? lport : rport, dst = out ? rport : lport;
+  hdr[34] = src >> 8;
+  hdr[35] = src;
+  hdr[36] = dst >> 8;
+  hdr[37] = dst;
+  size_t hlen = proto == 6 ? SIM_TCPHDR : 42;
+  do {
+    size_t seg = len < TCP_MSS ? len : TCP_MSS;
+    pbuf p = {NULL, hdr, (uint16_t)(hlen + seg), (uint16_t)hlen, 1};
+    if (out) n->nif.linkoutput(&n->nif, &p);
+    else     n->nif.input(&p, &n->nif);
+    len -= seg;
+  } while (len > 0);
+}
+
+/**
+  A TCP transfer, with the delayed acknowledgements the other way
+*/
+void simWireTcp(bool out, uint16_t rport, uint16_t lport, size_t len) {
+  simWire(out, 6, rport, lport, len);
+  for (size_t segs = (len + TCP_MSS - 1) / TCP_MSS; segs > 0; segs -= segs > 1 ? 2 : 1)
+    simWire(not out, 6, rport, lport, 0);
+}
+
+/*
+  Raw TCP client
+*/
+
+/**
+  The stand-in server of a port
+*/
+static SimService *simService(uint16_t port) {
+  if (simCur->replay != NULL) return simCur->replay->service(port);
+  if (port == 443)       return &simGeo;
+  if (port == APRS_PORT) return &simAPRS;
+  if (port == TILE_PORT) return &simTiles;
+  return NULL;
+}
+
+/**
+  Let a stand-in server handle the data written, without spending the
+  time it takes
+
+  @return the time the server took (ms)
+*/
+static unsigned long simServeTime(SimService *srv, WiFiClient *c) {
+  SimQuiet quiet;
+  unsigned long start = simCur->clock;
+  srv->serve(c);
+  unsigned long took = simCur->clock - start;
+  simCur->clock = start;
+  return took;
+}
+
+/**
+  Let a stand-in server handle the data written, blocking
+*/
+static void simServe(SimService *srv, WiFiClient *c) {
+  simElapse(simServeTime(srv, c));
+}
+
+static void simTcpPush(sim_conn_t *conn, uint8_t type, uint32_t len, unsigned long due) {
+  SimQuiet quiet;
+  simCur->tcpPending.push_back({conn, type, len, due});
+}
+
+/**
+  Send the new output of the server, and the end of its stream
+*/
+static void simTcpOutput(sim_conn_t *conn, size_t from, unsigned long due) {
+  if (conn->peer.rxBuf.size() > from)
+    simTcpPush(conn, SIM_TCPRECV, conn->peer.rxBuf.size() - from, due);
+  if (not conn->peer.open and not conn->fin) {
+    conn->fin = true;
+    simTcpPush(conn, SIM_TCPFIN, 0, due);
+  }
+}
+
+/**
+  Start a connection, the handshake completes after a round trip, if
+  not lost
+*/
+static err_t simRawOpen(tcp_pcb *pcb, uint16_t port) {
+  SimQuiet quiet;
+  SimService *srv = simService(port);
+  if (srv == NULL) return ERR_CONN;
+  // No route without an AP
+  if (not simCur->joined()) return ERR_RTE;
+  sim_conn_t *conn = new sim_conn_t();
+  conn->pcb = pcb;
+  conn->service = srv;
+  conn->port = port;
+  pcb->sim = conn;
+  simCur->tcpConns.push_back(conn);
+  simWire(true, 6, port, SIM_LOCALPORT, 0);
+  unsigned long ms = simCur->rtt;
+  // Nothing through a captive portal, the handshake times out
+  if (simCur->replay != NULL ? simCur->replay->connect(port, &ms) : not simLost() and not simCur->portal)
+    simTcpPush(conn, SIM_TCPCONN, 0, simCur->clock + ms);
+  return ERR_OK;
+}
+
+/**
+  The data written reaches the server at once, its answer and the
+  acknowledgement come back after a round trip, or after the time the
+  server takes
+*/
+static void simRawSend(tcp_pcb *pcb, const void *data, uint16_t len) {
+  sim_conn_t *conn = (sim_conn_t*)pcb->sim;
+  simWireTcp(true, conn->port, SIM_LOCALPORT, len);
+  size_t from = conn->peer.rxBuf.size();
+  conn->peer.txBuf.append((const char*)data, len);
+  unsigned long took = simServeTime(conn->service, &conn->peer);
+  unsigned long rtt = simCur->rtt;
+  simTcpPush(conn, SIM_TCPACK, len, simCur->clock + rtt);
+  simTcpOutput(conn, from, simCur->clock + std::max(took, rtt));
+}
+
+/**
+  The PCB is closed or aborted, both FINs if the connection was up, and
+  nothing more is delivered
+*/
+static void simRawDrop(tcp_pcb *pcb) {
+  SimNode *n = simCur;
+  sim_conn_t *conn = (sim_conn_t*)pcb->sim;
+  if (conn->up)
+    for (int i = 0; i < 4; i++)
+      simWire(i % 2 == 0, 6, conn->port, SIM_LOCALPORT, 0);
+  n->tcpPending.erase(std::remove_if(n->tcpPending.begin(), n->tcpPending.end(),
+                      [conn](const sim_tcp_t &ev) {
+                        return ev.conn == conn;
+                      }), n->tcpPending.end());
+  n->tcpConns.erase(std::find(n->tcpConns.begin(), n->tcpConns.end(), conn));
+  pcb->sim = NULL;
+  delete conn;
+}
+
+// The client connections of the firmware go to the stand-in servers
+static bool simRawHooked = (simTcpOpen = simRawOpen, simTcpSend = simRawSend,
+                            simTcpDrop = simRawDrop, true);
+
+/**
+  Deliver a raw TCP event to the lwIP callbacks of the PCB; a callback
+  may close it, the connection is not used after
+*/
+static void simTcpEvent(const sim_tcp_t &ev) {
+  sim_conn_t *conn = ev.conn;
+  tcp_pcb *pcb = conn->pcb;
+  if (ev.type == SIM_TCPCONN) {
+    simWire(false, 6, conn->port, SIM_LOCALPORT, 0);
+    simWire(true, 6, conn->port, SIM_LOCALPORT, 0);
+    conn->up = true;
+    conn->peer.open = true;
+    // The greeting, after the client callback
+    {
+      SimQuiet quiet;
+      conn->service->connect(&conn->peer);
+      simTcpOutput(conn, 0, simCur->clock);
+    }
+    if (pcb->connected != NULL) pcb->connected(pcb->callback_arg, pcb, ERR_OK);
+  }
+  else if (ev.type == SIM_TCPRECV) {
+    simWireTcp(false, conn->port, SIM_LOCALPORT, ev.len);
+    pbuf *p = pbuf_alloc(PBUF_RAW, ev.len, PBUF_RAM);
+    memcpy(p->payload, conn->peer.rxBuf.data(), ev.len);
+    conn->peer.rxBuf.erase(0, ev.len);
+    if (pcb->recv != NULL) pcb->recv(pcb->callback_arg, pcb, p, ERR_OK);
+    else                   pbuf_free(p);
+  }
+  else if (ev.type == SIM_TCPFIN) {
+    simWire(false, 6, conn->port, SIM_LOCALPORT, 0);
+    if (pcb->recv != NULL) pcb->recv(pcb->callback_arg, pcb, NULL, ERR_OK);
+  }
+  else if (ev.type == SIM_TCPACK)
+    simTcpAck(pcb, ev.len);
+}
+
+/**
+  The connections left open at the end
+*/
+SimNode::~SimNode() {
+  for (sim_conn_t *conn : tcpConns) {
+    tcp_free_segs(conn->pcb);
+    delete conn->pcb;
+    delete conn;
+  }
+}
+
+/*
+  Arduino core
+*/
+
+unsigned long millis() {
+  return simCur->clock;
+}
+
+// Every name resolves to 10.0.0.1
+static const ip_addr_t simAddr = {0x0100000A};
+
+/**
+  Call the lwIP callbacks due, as the core does out of the loop, in the
+  order they are due, the lookups first
+
+  @param until the virtual time to call them up to
+*/
+static void simCallbacks(unsigned long until) {
+  SimNode *n = simCur;
+  // The firmware, even when called from a stand-in
+  SimQuiet loud(false);
+  while (true) {
+    int dns = -1, tcp = -1;
+    for (size_t i = 0; i < n->dnsPending.size(); i++)
+      if (n->dnsPending[i].due <= until and (dns < 0 or n->dnsPending[i].due < n->dnsPending[dns].due))
+        dns = i;
+    for (size_t i = 0; i < n->tcpPending.size(); i++)
+      if (n->tcpPending[i].due <= until and (tcp < 0 or n->tcpPending[i].due < n->tcpPending[tcp].due))
+        tcp = i;
+    if (dns >= 0 and (tcp < 0 or n->dnsPending[dns].due <= n->tcpPending[tcp].due)) {
+      sim_dns_t ev = std::move(n->dnsPending[dns]);
+      n->dnsPending.erase(n->dnsPending.begin() + dns);
+      if (ev.due > n->clock) n->clock = ev.due;
+      ev.found(ev.name.c_str(), &simAddr, ev.arg);
+    }
+    else if (tcp >= 0) {
+      sim_tcp_t ev = n->tcpPending[tcp];
+      n->tcpPending.erase(n->tcpPending.begin() + tcp);
+      if (ev.due > n->clock) n->clock = ev.due;
+      simTcpEvent(ev);
+    }
+    else
+      break;
+  }
+}
+
+void simElapse(unsigned long ms) {
+  unsigned long until = simCur->clock + ms;
+  simCallbacks(until);
+  simCur->clock = until;
+}
+
+/**
+  The beacons heard in promiscuous mode, at most every beacon interval
+*/
+static void simBeacons() {
+  SimNode *n = simCur;
+  if (not n->sniffing or n->sniffer == NULL or n->clock - n->sniffed < 102) return;
+  n->sniffed = n->clock;
+  std::vector<sim_ap_t> aps;
+  n->hear(aps);
+  for (const sim_ap_t &ap : aps) {
+    if (ap.channel != n->channel) continue;
+    // The SDK layout: radio metadata, the first 112 bytes, count and length
+    uint8_t buf[128] = {0};
+    buf[0] = (uint8_t)(int8_t)ap.rssi;
+    uint8_t *f = buf + 12;
+    f[0] = 0x80;
+    memset(f + 4, 0xFF, WL_MAC_ADDR_LENGTH);
+    memcpy(f + 10, ap.bssid, WL_MAC_ADDR_LENGTH);
+    memcpy(f + 16, ap.bssid, WL_MAC_ADDR_LENGTH);
+    f[32] = 0x64;
+    f[34] = 0x01;
+    int len = 36;
+    len += snprintf((char*)f + len + 2, 32, "sim-%02X%02X%02X", ap.bssid[2], ap.bssid[3], ap.bssid[4]);
+    f[36] = 0;
+    f[37] = len - 36;
+    len += 2;
+    const uint8_t rates[] = {1, 4, 0x82, 0x84, 0x8B, 0x96, 3, 1};
+    memcpy(f + len, rates, sizeof(rates));
+    len += sizeof(rates);
+    f[len++] = ap.channel;
+    buf[124] = 1;
+    buf[126] = len & 0xFF;
+    buf[127] = len >> 8;
+    simRadio.frames.add(n->clock);
+    n->sniffer(buf, sizeof(buf));
+  }
+}
+
+void delay(unsigned long ms) {
+  simElapse(ms);
+  simBeacons();
+}
+
+void yield() {
+  simCallbacks(simCur->clock);
+  simBeacons();
+}
+
+char *itoa(int value, char *str, int base) {
+  char tmp[34];
+  unsigned int v = (base == 10 and value < 0) ? -value : (unsigned int)value;
+  int i = 0;
+  do {
+    int d = v % base;
+    tmp[i++] = d < 10 ? '0' + d : 'a' + d - 10;
+    v /= base;
+  } while (v);
+  char *p = str;
+  if (base == 10 and value < 0) *p++ = '-';
+  while (i) *p++ = tmp[--i];
+  *p = '\0';
+  return str;
+}
+
+/**
+  The sentences of the GPS receiver, once a second: a fix near the true
+  position while moving, none while parked indoors
+*/
+static void simGPS() {
+  SimQuiet quiet;
+  SimNode *n = simCur;
+  if (not n->hasGPS or n->clock < n->gpsNext) return;
+  // Only the last ones fit the buffer anyway, about 125 bytes a second
+  if (n->clock - n->gpsNext > n->uartSize * 8) n->gpsNext = n->clock - n->clock % 1000;
+  n->move();
+  bool fix = n->clock >= n->pauseUntil and n->speed > 0;
+  for (; n->gpsNext <= n->clock; n->gpsNext += 1000) {
+    time_t t = SIM_EPOCH + n->gpsNext / 1000;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    char hms[40], dmy[40], pos[64] = ",,,";
+    snprintf(hms, sizeof(hms), "%02d%02d%02d.00", tm.tm_hour, tm.tm_min, tm.tm_sec);
+    snprintf(dmy, sizeof(dmy), "%02d%02d%02d", tm.tm_mday, tm.tm_mon + 1, tm.tm_year % 100);
+    double hdop = 0.8 + n->random(8) / 10.0;
+    if (fix) {
+      double lat, lng;
+      simXYToLatLng(n->x + (int)n->random(9) - 4, n->y + (int)n->random(9) - 4, &lat, &lng);
+      snprintf(pos, sizeof(pos), "%02d%08.5f,%c,%03d%08.5f,%c",
+               (int)fabs(lat), fmod(fabs(lat), 1.0) * 60, lat >= 0 ? 'N' : 'S',
+               (int)fabs(lng), fmod(fabs(lng), 1.0) * 60, lng >= 0 ? 'E' : 'W');
+    }
+    int crs = (int)(degrees(atan2(n->dstX - n->x, n->dstY - n->y)) + 360) % 360;
+    char line[2][200];
+    if (fix) {
+      snprintf(line[0], sizeof(line[0]), "$GPGGA,%s,%s,1,%02u,%.1f,80.0,M,36.0,M,,", hms, pos, 6 + n->random(6), hdop);
+      snprintf(line[1], sizeof(line[1]), "$GPRMC,%s,A,%s,%.1f,%d,%s,,,A", hms, pos, n->speed * 1.94384449, crs, dmy);
+    }
+    else {
+      snprintf(line[0], sizeof(line[0]), "$GPGGA,%s,,,,,0,00,99.9,,,,,,", hms);
+      snprintf(line[1], sizeof(line[1]), "$GPRMC,%s,V,,,,,,,%s,,,N", hms, dmy);
+    }
+    for (int i = 0; i < 2; i++) {
+      uint8_t ck = 0;
+      for (const char *p = line[i] + 1; *p; p++)
+        ck ^= *p;
+      char tail[8];
+      snprintf(tail, sizeof(tail), "*%02X\r\n", ck);
+      n->uartRx += line[i];
+      n->uartRx += tail;
+    }
+  }
+  if (n->uartRx.size() > n->uartSize)
+    n->uartRx.erase(0, n->uartRx.size() - n->uartSize);
+}
+
+size_t SimSerial::setRxBufferSize(size_t size) {
+  simCur->uartSize = size;
+  return size;
+}
+
+int SimSerial::available() {
+  simGPS();
+  return simCur->uartRx.size();
+}
+
+int SimSerial::read() {
+  if (simCur->uartRx.empty()) return -1;
+  int c = (uint8_t)simCur->uartRx[0];
+  simCur->uartRx.erase(0, 1);
+  return c;
+}
+
+size_t SimSerial::write(const uint8_t *buf, size_t len) {
+  if (simCur and simCur->verbose) fwrite(buf, 1, len, stdout);
+  return len;
+}
+
+size_t SimSerial::print(const char *s) {
+  return write((const uint8_t*)s, strlen(s));
+}
+
+size_t SimSerial::printf_P(const char *fmt, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  return print(buf);
+}
+
+uint32_t SimESP::getChipId() {
+  return simCur->chipId;
+}
+
+uint16_t SimESP::getVcc() {
+  return 3300;
+}
+
+uint32_t SimESP::getFreeHeap() {
+  return 30000;
+}
+
+uint32_t SimESP::getMaxFreeBlockSize() {
+  return 20000;
+}
+
+rst_info *SimESP::getResetInfoPtr() {
+  static rst_info ri = {REASON_DEFAULT_RST};
+  return &ri;
+}
+
+bool SimESP::rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size) {
+  memset(data, 0, size);
+  return true;
+}
+
+bool SimESP::rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size) {
+  return true;
+}
+
+/**
+  The RTC timer, in microseconds of the virtual clock
+*/
+uint32_t system_get_rtc_time() {
+  return simCur->clock * 1000;
+}
+
+/**
+  The RTC calibration, one microsecond a tick (Q12)
+*/
+uint32_t system_rtc_clock_cali_proc() {
+  return 1 << 12;
+}
+
+/*
+  Firmware services that keep global state: the log prints only for the
+  verbose node, the stall detector only marks the stages and the calls for
+  the energy accounting of the node
+*/
+
+#define DLOG_FMT(id, sig, fmt) fmt,
+static const char *dlogFormats[] = {
+  DLOG_CATALOG(DLOG_FMT)
+};
+#undef DLOG_FMT
+
+DLOG dlog;
+
+DLOG::DLOG() {
+}
+
+void DLOG::write(uint8_t id, ...) {
+  if (id >= DLOG_COUNT or not simCur->verbose) return;
+  char line[DLOG_MAXLEN];
+  va_list args;
+  va_start(args, id);
+  vsnprintf(line, sizeof(line), dlogFormats[id], args);
+  va_end(args);
+  printf("[%lu.%03lu] %s", simCur->clock / 1000, simCur->clock % 1000, line);
+}
+
+STALL stall;
+
+STALL::STALL() {
+}
+
+void STALL::init() {
+}
+
+void STALL::setEnergy(Energy *nrg) {
+}
+
+void STALL::setGPS(GPS *rcv) {
+}
+
+void STALL::begin() {
+}
+
+void STALL::end() {
+  stage(STALL_IDLE);
+}
+
+void STALL::stage(uint8_t stage) {
+  if (simCur->meter != NULL) simCur->meter->stage(stage);
+}
+
+void STALL::enter(uint8_t call) {
+  simCur->drain();
+  if (simCur->meter != NULL) simCur->meter->enter(call);
+}
+
+void STALL::leave() {
+  if (simCur->meter != NULL) simCur->meter->leave();
+  simCur->drain();
+}
+
+void STALL::wait(unsigned long ms) {
+  enter(STALL_DELAY);
+  unsigned long start = millis();
+  while (millis() - start < ms) {
+    delay(min(ms - (millis() - start), (unsigned long)STALL_DRAINMS));
+    simCur->drain();
+  }
+  leave();
+}
+
+/*
+  Flash file system, per node
+*/
+
+size_t File::read(uint8_t *buf, size_t len) {
+  if (data == NULL or pos >= data->size()) return 0;
+  size_t n = std::min(len, data->size() - pos);
+  memcpy(buf, data->data() + pos, n);
+  pos += n;
+  return n;
+}
+
+size_t File::write(const uint8_t *buf, size_t len) {
+  SimQuiet quiet;
+  if (data == NULL) return 0;
+  FSInfo fi;
+  LittleFS.info(fi);
+  if (fi.usedBytes + len > fi.totalBytes) return 0;
+  data->replace(pos, std::min(len, data->size() - pos), (const char*)buf, len);
+  pos += len;
+  return len;
+}
+
+bool File::seek(uint32_t p) {
+  if (data == NULL or p > data->size()) return false;
+  pos = p;
+  return true;
+}
+
+bool Dir::next() {
+  return idx++ < names.size();
+}
+
+bool SimFS::exists(const char *path) {
+  SimQuiet quiet;
+  return simCur->files.count(path) > 0;
+}
+
+File SimFS::open(const char *path, const char *mode) {
+  SimQuiet quiet;
+  auto it = simCur->files.find(path);
+  if (mode[0] == 'r')
+    return it == simCur->files.end() ? File() : File(&it->second);
+  std::string &data = simCur->files[path];
+  data.clear();
+  return File(&data);
+}
+
+bool SimFS::remove(const char *path) {
+  SimQuiet quiet;
+  return simCur->files.erase(path) > 0;
+}
+
+bool SimFS::rename(const char *from, const char *to) {
+  SimQuiet quiet;
+  auto it = simCur->files.find(from);
+  if (it == simCur->files.end()) return false;
+  simCur->files[to].swap(it->second);
+  simCur->files.erase(from);
+  return true;
+}
+
+bool SimFS::info(FSInfo &fi) {
+  fi.totalBytes = SIM_FSSIZE;
+  fi.usedBytes  = 0;
+  for (auto &f : simCur->files)
+    fi.usedBytes += (f.second.size() / SIM_FSBLOCK + 1) * SIM_FSBLOCK;
+  return true;
+}
+
+Dir SimFS::openDir(const char *path) {
+  SimQuiet quiet;
+  Dir dir;
+  std::string prefix = std::string(path) + "/";
+  for (auto &f : simCur->files)
+    if (f.first.compare(0, prefix.size(), prefix) == 0)
+      dir.names.push_back(f.first.substr(prefix.size()));
+  return dir;
+}
+
+/*
+  The simulated world
+*/
+
+void simXYToLatLng(double x, double y, double *lat, double *lng) {
+  *lat = SIM_LAT0 + y / 111132.0;
+  *lng = SIM_LNG0 + x / (111320.0 * cos(radians(SIM_LAT0)));
+}
+
+void simLatLngToXY(double lat, double lng, double *x, double *y) {
+  *y = (lat - SIM_LAT0) * 111132.0;
+  *x = (lng - SIM_LNG0) * (111320.0 * cos(radians(SIM_LAT0)));
+}
+
+void simCellBSSID(int cx, int cy, uint8_t *bssid) {
+  bssid[0] = 0x02;
+  bssid[1] = (cx >> 8) & 0xFF;
+  bssid[2] = cx & 0xFF;
+  bssid[3] = (cy >> 8) & 0xFF;
+  bssid[4] = cy & 0xFF;
+  bssid[5] = 0x5A;
+}
+
+/**
+  Most APs on the channels that do not overlap
+*/
+uint8_t simCellChannel(int cx, int cy) {
+  static const uint8_t channels[] = {1, 6, 11, 1, 6, 11, 3, 9};
+  return channels[(uint32_t)(cx * 7919 + cy * 104729) % 8];
+}
+
+bool simBSSIDCell(const uint8_t *bssid, int *cx, int *cy) {
+  if (bssid[0] != 0x02 or bssid[5] != 0x5A) return false;
+  *cx = (int16_t)((bssid[1] << 8) | bssid[2]);
+  *cy = (int16_t)((bssid[3] << 8) | bssid[4]);
+  return true;
+}
+
+/**
+  The network of the AP of a cell
+
+  @param ssid the buffer for the SSID, WL_SSID_MAX_LENGTH + 1
+  @param psk the buffer for the PSK, WL_WPA_KEY_MAX_LENGTH + 1, empty if open
+  @return the kind of network
+*/
+uint8_t simCellNet(int cx, int cy, char *ssid, char *psk) {
+  // Mixed well, the networks and their names do not follow the grid
+  uint32_t h = (uint32_t)cx * 0x9E3779B1UL ^ (uint32_t)cy * 0x85EBCA77UL;
+  h ^= h >> 16;
+  h *= 0x85EBCA6BUL;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35UL;
+  h ^= h >> 16;
+  uint8_t kind = h % SIM_NETS == 0 ? SIM_NETFLEET :
+                 h % SIM_NETS == 1 ? SIM_NETOPEN :
+                 h % SIM_NETS == 2 ? SIM_NETPORTAL : SIM_NETPRIV;
+  psk[0] = '\0';
+  if (kind == SIM_NETFLEET) {
+    strcpy(ssid, SIM_FLEETSSID);
+    strcpy(psk, SIM_FLEETPSK);
+  }
+  else if (kind == SIM_NETOPEN)
+    snprintf(ssid, WL_SSID_MAX_LENGTH + 1, "open-%04X", (unsigned)(h >> 16));
+  else if (kind == SIM_NETPORTAL)
+    snprintf(ssid, WL_SSID_MAX_LENGTH + 1, "guest-%04X", (unsigned)(h >> 16));
+  else {
+    snprintf(ssid, WL_SSID_MAX_LENGTH + 1, "ap-%04X", (unsigned)(h >> 16));
+    snprintf(psk, WL_WPA_KEY_MAX_LENGTH + 1, "psk-%08X", (unsigned)h);
+  }
+  return kind;
+}
+
+uint32_t SimNode::random(uint32_t n) {
+  // xorshift32
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return n ? rng % n : rng;
+}
+
+/**
+  Random waypoint movement: drive to a waypoint, then park for a while
+  or drive to the next one
+*/
+void SimNode::move() {
+  double dt = (clock - lastMove) / 1000.0;
+  lastMove = clock;
+  if (clock < pauseUntil) return;
+  if (speed <= 0) {
+    // Pick the next waypoint and speed
+    dstX  = (random(10000) / 10000.0 - 0.5) * SIM_AREA;
+    dstY  = (random(10000) / 10000.0 - 0.5) * SIM_AREA;
+    speed = 3 + random(18);
+    return;
+  }
+  double dx = dstX - x, dy = dstY - y;
+  double d = sqrt(dx * dx + dy * dy);
+  double step = speed * dt;
+  if (step >= d) {
+    // Arrived, maybe park
+    x = dstX;
+    y = dstY;
+    speed = 0;
+    if (random(10) < 6) pauseUntil = clock + 1000UL * (60 + random(1800));
+  }
+  else {
+    x += dx * step / d;
+    y += dy * step / d;
+  }
+}
+
+/*
+  WiFi
+*/
+
+/**
+  The APs in range now
+
+  @param aps the APs heard
+*/
+void SimNode::hear(std::vector<sim_ap_t> &aps) {
+  SimQuiet quiet;
+  move();
+  aps.clear();
+  int cx0 = (int)floor(x / SIM_CELL), cy0 = (int)floor(y / SIM_CELL);
+  int r = (int)ceil(SIM_RANGE / SIM_CELL);
+  for (int cy = cy0 - r; cy <= cy0 + r; cy++)
+    for (int cx = cx0 - r; cx <= cx0 + r; cx++) {
+      double dx = (cx + 0.5) * SIM_CELL - x, dy = (cy + 0.5) * SIM_CELL - y;
+      double d = sqrt(dx * dx + dy * dy);
+      if (d > SIM_RANGE) continue;
+      // Log distance path loss, with some noise
+      int rssi = (int)(-35 - 27 * log10(d < 1 ? 1 : d)) + (int)random(9) - 4;
+      if (rssi < -92) continue;
+      sim_ap_t ap;
+      simCellBSSID(cx, cy, ap.bssid);
+      ap.rssi = rssi;
+      ap.channel = simCellChannel(cx, cy);
+      aps.push_back(ap);
+    }
+}
+
+/**
+  The station follows the AP joined: out of range, or switched off, the
+  SDK joins the network again on its own, the nearest AP of it in range,
+  if the PSK matches
+
+  @return true if joined
+*/
+bool SimNode::joined() {
+  if (not roam) return true;
+  SimQuiet quiet;
+  move();
+  char home[WL_SSID_MAX_LENGTH + 1];
+  snprintf(home, sizeof(home), SIM_HOMESSID, id);
+  if (staUp) {
+    double dx = atHome ? homeX - x : (apX + 0.5) * SIM_CELL - x;
+    double dy = atHome ? homeY - y : (apY + 0.5) * SIM_CELL - y;
+    bool off = atHome and homeOff != 0 and clock >= homeOff;
+    if (off or sqrt(dx * dx + dy * dy) > SIM_JOIN) {
+      staUp = portal = false;
+      staDrops++;
+      downSince = clock;
+      staDue = clock + SIM_ASSOC;
+    }
+  }
+  if (staUp or not staOn or clock < staDue) return staUp;
+  // The home AP, not in the grid
+  double dx = homeX - x, dy = homeY - y;
+  if (strcmp(staSSID, home) == 0 and strcmp(staPSK, SIM_HOMEPSK) == 0 and
+      (homeOff == 0 or clock < homeOff) and sqrt(dx * dx + dy * dy) <= SIM_JOIN) {
+    staUp = atHome = true;
+  }
+  else {
+    // The nearest AP of the network
+    char ssid[WL_SSID_MAX_LENGTH + 1], psk[WL_WPA_KEY_MAX_LENGTH + 1];
+    double best = SIM_JOIN;
+    int cx0 = (int)floor(x / SIM_CELL), cy0 = (int)floor(y / SIM_CELL);
+    int r = (int)ceil(SIM_JOIN / SIM_CELL);
+    for (int cy = cy0 - r; cy <= cy0 + r; cy++)
+      for (int cx = cx0 - r; cx <= cx0 + r; cx++) {
+        dx = (cx + 0.5) * SIM_CELL - x;
+        dy = (cy + 0.5) * SIM_CELL - y;
+        double d = sqrt(dx * dx + dy * dy);
+        if (d > best) continue;
+        uint8_t kind = simCellNet(cx, cy, ssid, psk);
+        if (strcmp(ssid, staSSID) != 0 or (psk[0] != '\0' and strcmp(psk, staPSK) != 0)) continue;
+        best = d;
+        apX = cx;
+        apY = cy;
+        staUp = true;
+        atHome = false;
+        portal = kind == SIM_NETPORTAL;
+      }
+    if (staUp) channel = simCellChannel(apX, apY);
+  }
+  if (staUp) {
+    staJoins++;
+    downMs += clock - downSince;
+  }
+  else
+    staDue = clock + SIM_ASSOC;
+  return staUp;
+}
+
+bool ESP8266WiFiClass::begin(const char *ssid, const char *pass, int32_t channel, const uint8_t *bssid) {
+  SimNode *n = simCur;
+  if (n->staUp) {
+    n->staUp = n->portal = false;
+    n->downSince = n->clock;
+  }
+  snprintf(n->staSSID, sizeof(n->staSSID), "%s", ssid);
+  snprintf(n->staPSK, sizeof(n->staPSK), "%s", pass != NULL ? pass : "");
+  n->staOn = true;
+  n->staDue = n->clock + SIM_ASSOC;
+  return true;
+}
+
+bool ESP8266WiFiClass::disconnect(bool wifioff) {
+  SimNode *n = simCur;
+  if (n->staUp) {
+    n->staUp = n->portal = false;
+    n->downSince = n->clock;
+  }
+  n->staOn = false;
+  return true;
+}
+
+bool wifi_station_get_config(struct station_config *config) {
+  memset(config, 0, sizeof(*config));
+  memcpy(config->ssid, simCur->staSSID, strnlen(simCur->staSSID, sizeof(config->ssid)));
+  memcpy(config->password, simCur->staPSK, strnlen(simCur->staPSK, sizeof(config->password)));
+  return true;
+}
+
+int ESP8266WiFiClass::scanNetworks() {
+  SimQuiet quiet;
+  SimNode *n = simCur;
+  // An active scan over all the channels, or the recorded one
+  if (n->replay != NULL)
+    simElapse(n->replay->scan(n->scan));
+  else {
+    n->hear(n->scan);
+    simElapse(2100);
+  }
+  simRadio.scans.add(n->clock);
+  return n->scan.size();
+}
+
+void ESP8266WiFiClass::scanDelete() {
+}
+
+uint8_t *ESP8266WiFiClass::BSSID() {
+  static thread_local uint8_t none[WL_MAC_ADDR_LENGTH];
+  return none;
+}
+
+uint8_t *ESP8266WiFiClass::BSSID(int i) {
+  return simCur->scan[i].bssid;
+}
+
+int32_t ESP8266WiFiClass::RSSI() {
+  return -60;
+}
+
+int32_t ESP8266WiFiClass::RSSI(int i) {
+  return simCur->scan[i].rssi;
+}
+
+int32_t ESP8266WiFiClass::channel() {
+  return simCur->channel;
+}
+
+int32_t ESP8266WiFiClass::channel(int i) {
+  return simCur->scan[i].channel;
+}
+
+/**
+  The encryption of a scanned network, by the grid cell; the recorded APs
+  are not open
+*/
+uint8_t ESP8266WiFiClass::encryptionType(int i) {
+  int cx, cy;
+  char ssid[WL_SSID_MAX_LENGTH + 1], psk[WL_WPA_KEY_MAX_LENGTH + 1];
+  if (not simBSSIDCell(simCur->scan[i].bssid, &cx, &cy)) return ENC_TYPE_CCMP;
+  simCellNet(cx, cy, ssid, psk);
+  return psk[0] == '\0' ? ENC_TYPE_NONE : ENC_TYPE_CCMP;
+}
+
+/**
+  A scanned network, the SSID by the grid cell, none for the recorded APs
+*/
+void *ESP8266WiFiScanClass::_getScanInfoByIndex(int i) {
+  static thread_local bss_info info;
+  SimNode *n = simCur;
+  if (i < 0 or i >= (int)n->scan.size()) return NULL;
+  const sim_ap_t &ap = n->scan[i];
+  memset(&info, 0, sizeof(info));
+  memcpy(info.bssid, ap.bssid, sizeof(info.bssid));
+  info.channel = ap.channel;
+  info.rssi = ap.rssi;
+  int cx, cy;
+  char ssid[WL_SSID_MAX_LENGTH + 1], psk[WL_WPA_KEY_MAX_LENGTH + 1];
+  if (simBSSIDCell(ap.bssid, &cx, &cy)) {
+    simCellNet(cx, cy, ssid, psk);
+    info.ssid_len = strlen(ssid);
+    memcpy(info.ssid, ssid, info.ssid_len);
+    info.authmode = psk[0] == '\0' ? 0 : 3;
+  }
+  return &info;
+}
+
+/*
+  Promiscuous mode
+*/
+
+void wifi_set_promiscuous_rx_cb(wifi_promiscuous_cb_t cb) {
+  simCur->sniffer = cb;
+}
+
+void wifi_promiscuous_enable(uint8_t promiscuous) {
+  simCur->sniffing = promiscuous != 0;
+}
+
+bool ESP8266WiFiClass::isConnected() {
+  return simCur->joined();
+}
+
+IPAddress ESP8266WiFiClass::localIP() {
+  if (not simCur->joined()) return IPAddress(0, 0, 0, 0);
+  return IPAddress(192, 168, 4, 100 + simCur->id % 100);
+}
+
+/**
+  The LAN resolver answers the service query, after a second of listening
+*/
+int MDNSResponder::queryService(const char *service, const char *proto) {
+  if (not simCur->joined()) return 0;
+  simElapse(1000);
+  simWire(true, 17, 5353, 5353, 40 + strlen(service));
+  if (not simLAN.enabled) return 0;
+  simWire(false, 17, 5353, 5353, 120 + strlen(service));
+  return 1;
+}
+
+IPAddress MDNSResponder::IP(int i) {
+  return IPAddress(192, 168, 4, 2);
+}
+
+uint16_t MDNSResponder::port(int i) {
+  return LAN_PORT;
+}
+
+/**
+  A recursive lookup, one round trip
+*/
+int ESP8266WiFiClass::hostByName(const char *name, IPAddress &ip, uint32_t timeout) {
+  SimQuiet quiet;
+  if (not simCur->joined()) return 0;
+  simElapse(simCur->rtt);
+  simDNS.requests.add(simCur->clock);
+  // The query and the answer, one address
+  simWire(true, 17, 53, SIM_LOCALPORT, 18 + strlen(name));
+  simWire(false, 17, 53, SIM_LOCALPORT, 34 + strlen(name));
+  ip = IPAddress(10, 0, 0, 1);
+  return 1;
+}
+
+/**
+  Resolve in the background, the answer comes after the resolver latency
+*/
+err_t dns_gethostbyname(const char *hostname, ip_addr_t *addr,
+                        dns_found_callback found, void *callback_arg) {
+  SimQuiet quiet;
+  // No resolver without an AP
+  if (not simCur->joined()) return ERR_VAL;
+  // The query and the answer pbufs
+  simStack(2);
+  simDNS.requests.add(simCur->clock);
+  // The query and the answer, one address
+  simWire(true, 17, 53, SIM_LOCALPORT, 18 + strlen(hostname));
+  simWire(false, 17, 53, SIM_LOCALPORT, 34 + strlen(hostname));
+  simCur->dnsPending.push_back({hostname, found, callback_arg, simCur->clock + simCur->dnsTime});
+  return ERR_INPROGRESS;
+}
+
+/*
+  TCP client
+*/
+
+/**
+  The stand-in servers are told apart by port, the host is not needed
+*/
+int WiFiClient::connect(const char *host, uint16_t port) {
+  return connect(IPAddress(), port);
+}
+
+int WiFiClient::connect(IPAddress ip, uint16_t port) {
+  SimQuiet quiet;
+  stop();
+  SimService *srv = simService(port);
+  if (srv == NULL) return 0;
+  // The connection context and its PCB, for each attempt
+  simStack(2);
+  // No route without an AP
+  if (not simCur->joined()) return 0;
+  this->port = port;
+  secure = false;
+  simWire(true, 6, port, SIM_LOCALPORT, 0);
+  // Nothing through a captive portal
+  if (simCur->portal) {
+    simElapse(timeout);
+    return 0;
+  }
+  // The SYN or its answer lost, or too slow
+  unsigned long ms = simCur->rtt;
+  if (simCur->replay != NULL) {
+    if (not simCur->replay->connect(port, &ms)) {
+      simElapse(timeout);
+      return 0;
+    }
+  }
+  else if (simLost() or simCur->rtt > timeout) {
+    simElapse(timeout);
+    return 0;
+  }
+  // TCP handshake
+  service = srv;
+  simElapse(ms);
+  simWire(false, 6, port, SIM_LOCALPORT, 0);
+  simWire(true, 6, port, SIM_LOCALPORT, 0);
+  open = true;
+  idle = 0;
+  service->connect(this);
+  if (rxBuf.size() > 0) simWireTcp(false, port, SIM_LOCALPORT, rxBuf.size());
+  return 1;
+}
+
+/**
+  The TLS handshake: a full one costs two round trips and the key
+  exchange, a resumed one only a round trip.  The stand-in geolocation
+  server owns the SIM_GEOKEY key.
+*/
+int WiFiClientSecure::connect(const char *host, uint16_t port) {
+  return connect(IPAddress(), port);
+}
+
+int WiFiClientSecure::connect(IPAddress ip, uint16_t port) {
+  SimQuiet quiet;
+  error = 0;
+  if (not WiFiClient::connect(ip, port)) return 0;
+  secure = true;
+  // The buffers of the engine, sized by setBufferSizes()
+  simStack(2);
+  rcvBuf.reset(new (std::nothrow) uint8_t[rcvSize]);
+  xmtBuf.reset(new (std::nothrow) uint8_t[xmtSize]);
+  // The recorded connection time has the handshake in, only the traffic
+  bool replay = simCur->replay != NULL;
+  if (session != NULL and session->valid) {
+    if (not replay) simElapse(simCur->rtt + 10);
+    // Hellos with the session ticket, change cipher spec and finished
+    simWireTcp(true, port, SIM_LOCALPORT, 250);
+    simWireTcp(false, port, SIM_LOCALPORT, 150);
+    simWireTcp(true, port, SIM_LOCALPORT, 60);
+    return 1;
+  }
+  // Too slow, the handshake times out
+  if (not replay and 2 * simCur->rtt + 150 > timeout) {
+    simElapse(timeout);
+    stop();
+    return 0;
+  }
+  if (not replay) simElapse(2 * simCur->rtt + 150);
+  // Hellos, the certificate chain, the key exchange and finished
+  simWireTcp(true, port, SIM_LOCALPORT, 250);
+  simWireTcp(false, port, SIM_LOCALPORT, 4200);
+  simWireTcp(true, port, SIM_LOCALPORT, 130);
+  simWireTcp(false, port, SIM_LOCALPORT, 60);
+  if (known != NULL and strcmp(known->key, SIM_GEOKEY) != 0) {
+    stop();
+    error = BR_ERR_X509_NOT_TRUSTED;
+    return 0;
+  }
+  if (session != NULL) session->valid = true;
+  return 1;
+}
+
+/**
+  Close the connection and free the buffers
+*/
+void WiFiClientSecure::stop() {
+  SimQuiet quiet;
+  rcvBuf.reset();
+  xmtBuf.reset();
+  WiFiClient::stop();
+}
+
+bool WiFiClient::connected() {
+  return service != NULL and (open or rxPos < rxBuf.size());
+}
+
+void WiFiClient::stop() {
+  // Both FINs, both acknowledged
+  if (service != NULL)
+    for (int i = 0; i < 4; i++)
+      simWire(i % 2 == 0, 6, port, SIM_LOCALPORT, 0);
+  service = NULL;
+  open = false;
+  txBuf.clear();
+  rxBuf.clear();
+  rxPos = 0;
+}
+
+size_t WiFiClient::write(const uint8_t *buf, size_t len) {
+  SimQuiet quiet;
+  if (service == NULL or not open) return 0;
+  size_t rx = rxBuf.size();
+  txBuf.append((const char*)buf, len);
+  simWireTcp(true, port, SIM_LOCALPORT, len + (secure ? SIM_TLSREC : 0));
+  simServe(service, this);
+  // The response, in records of the maximum fragment length
+  if (rxBuf.size() > rx)
+    simWireTcp(false, port, SIM_LOCALPORT, rxBuf.size() - rx +
+               (secure ? (rxBuf.size() - rx + 511) / 512 * SIM_TLSREC : 0));
+  return len;
+}
+
+int WiFiClient::available() {
+  return rxBuf.size() - rxPos;
+}
+
+int WiFiClient::timedRead() {
+  int c = timedPeek();
+  if (c >= 0) rxPos++;
+  return c;
+}
+
+int WiFiClient::timedPeek() {
+  if (rxPos < rxBuf.size()) return (uint8_t)rxBuf[rxPos];
+  // Nothing to read, wait for the timeout
+  simElapse(timeout);
+  idle += timeout;
+  if (idle >= 30000) open = false;
+  return -1;
+}
+
+int WiFiClient::read() {
+  return rxPos < rxBuf.size() ? (uint8_t)rxBuf[rxPos++] : -1;
+}
+
+int WiFiClient::read(uint8_t *buf, size_t len) {
+  size_t n = std::min(len, rxBuf.size() - rxPos);
+  memcpy(buf, rxBuf.data() + rxPos, n);
+  rxPos += n;
+  return n;
+}
+
+int WiFiClient::peek() {
+  return rxPos < rxBuf.size() ? (uint8_t)rxBuf[rxPos] : -1;
+}
+
+size_t WiFiClient::readBytesUntil(char terminator, char *buf, size_t len) {
+  size_t n = 0;
+  while (n < len) {
+    int c = timedRead();
+    if (c < 0 or c == terminator) break;
+    buf[n++] = (char)c;
+  }
+  return n;
+}
+
+bool WiFiClient::findUntil(const char *target, const char *terminator) {
+  size_t tl = strlen(target), ml = strlen(terminator);
+  size_t ti = 0, mi = 0;
+  int c;
+  while ((c = timedRead()) >= 0) {
+    ti = (c == target[ti]) ? ti + 1 : (c == target[0]);
+    if (ti == tl) return true;
+    mi = (c == terminator[mi]) ? mi + 1 : (c == terminator[0]);
+    if (ml and mi == ml) return false;
+  }
+  return false;
+}
+
+float WiFiClient::parseFloat() {
+  int c;
+  // Skip to the number
+  while ((c = timedPeek()) >= 0 and not (isdigit(c) or c == '-' or c == '.'))
+    rxPos++;
+  char num[32];
+  size_t n = 0;
+  while ((c = peek()) >= 0 and (isdigit(c) or c == '-' or c == '.') and n < sizeof(num) - 1) {
+    num[n++] = (char)c;
+    rxPos++;
+  }
+  num[n] = '\0';
+  return n ? atof(num) : 0;
+}
+
+long WiFiClient::parseInt() {
+  int c;
+  while ((c = timedPeek()) >= 0 and not (isdigit(c) or c == '-'))
+    rxPos++;
+  char num[32];
+  size_t n = 0;
+  while ((c = peek()) >= 0 and (isdigit(c) or c == '-') and n < sizeof(num) - 1) {
+    num[n++] = (char)c;
+    rxPos++;
+  }
+  num[n] = '\0';
+  return n ? atol(num) : 0;
+}
+
+/*
+  UDP, NTP and the LAN resolver
+*/
+
+// NTP packet
+#define SIM_NTPLEN    48
+
+int WiFiUDP::beginPacket(const char *host, uint16_t port) {
+  dstPort = port;
+  tx.clear();
+  return 1;
+}
+
+int WiFiUDP::beginPacket(IPAddress ip, uint16_t port) {
+  SimQuiet quiet;
+  // The pbuf of the datagram
+  simStack();
+  dstPort = port;
+  tx.clear();
+  return 1;
+}
+
+size_t WiFiUDP::write(const uint8_t *buf, size_t len) {
+  SimQuiet quiet;
+  // The NTP request is not read, it is written from a shorter buffer
+  if (dstPort == LAN_PORT) tx.append((const char*)buf, len);
+  return len;
+}
+
+int WiFiUDP::endPacket() {
+  SimQuiet quiet;
+  // No route without an AP
+  if (not simCur->joined()) return 0;
+  if (dstPort == LAN_PORT and simLAN.enabled) {
+    simWire(true, 17, dstPort, LAN_PORT, tx.size());
+    rxLen = simLAN.exchange(tx, rx);
+    rxPos = 0;
+    rxDue = simCur->clock + simLAN.rtt;
+    if (rxLen > 0) {
+      simStack();
+      simWire(false, 17, dstPort, LAN_PORT, rxLen);
+    }
+    return 1;
+  }
+  if (dstPort != 123) return 0;
+  simWire(true, 17, dstPort, SIM_LOCALPORT, SIM_NTPLEN);
+  rxLen = rxPos = 0;
+  memset(rx, 0, SIM_NTPLEN);
+  // The answer comes after a round trip, or as recorded
+  unsigned long rtt = simCur->rtt;
+  if (simCur->replay != NULL) {
+    if (not simCur->replay->ntp(rx, &rtt)) return 1;
+  }
+  else if (simLost() or simCur->portal) return 1;
+  // The pbuf of the answer
+  simStack();
+  rxDue = simCur->clock + rtt;
+  simWire(false, 17, dstPort, SIM_LOCALPORT, SIM_NTPLEN);
+  simNTP.requests.add(rxDue);
+  // The response, transmit time only
+  if (simCur->replay == NULL) {
+    unsigned long ms = rxDue;
+    uint32_t secs = SIM_EPOCH + ms / 1000 + 2208988800UL;
+    rx[40] = secs >> 24;
+    rx[41] = secs >> 16;
+    rx[42] = secs >> 8;
+    rx[43] = secs;
+    rx[44] = (ms % 1000) * 256 / 1000;
+  }
+  rxLen = SIM_NTPLEN;
+  rxPos = 0;
+  return 1;
+}
+
+int WiFiUDP::parsePacket() {
+  SimQuiet quiet;
+  return simCur->clock >= rxDue ? rxLen - rxPos : 0;
+}
+
+int WiFiUDP::read() {
+  return rxPos < rxLen ? rx[rxPos++] : -1;
+}
+
+int WiFiUDP::read(uint8_t *buf, size_t len) {
+  size_t n = std::min(len, (size_t)(rxLen - rxPos));
+  memcpy(buf, rx + rxPos, n);
+  rxPos += n;
+  return n;
+}
+
+/**
+  Store or look up a fingerprint, on the time of the node
+
+  @param msg the datagram from the node
+  @param rsp the answer
+  @return the answer length, zero if none
+*/
+size_t SimLAN::exchange(const std::string &msg, uint8_t *rsp) {
+  lan_hdr_t hdr;
+  if (msg.size() < sizeof(hdr)) return 0;
+  memcpy(&hdr, msg.data(), sizeof(hdr));
+  size_t fixLen = hdr.op == LAN_STORE ? sizeof(lan_fix_t) : 0;
+  if (hdr.magic != LAN_MAGIC or hdr.count > LAN_APS or
+      msg.size() < sizeof(hdr) + fixLen + hdr.count * sizeof(lan_ap_t)) return 0;
+  lan_ap_t aps[LAN_APS];
+  memcpy(aps, msg.data() + sizeof(hdr) + fixLen, hdr.count * sizeof(lan_ap_t));
+  uint32_t now = simCur->clock / 1000;
+  if (hdr.op == LAN_STORE) {
+    lan_fix_t fix;
+    memcpy(&fix, msg.data() + sizeof(hdr), sizeof(fix));
+    cache.store(aps, hdr.count, fix, now);
+    return 0;
+  }
+  requests.add(simCur->clock);
+  lan_fix_t fix;
+  bool hit = cache.lookup(aps, hdr.count, now, &fix);
+  lan_hdr_t rhdr = {LAN_MAGIC, (uint8_t)(hit ? LAN_FIX : LAN_MISS), 0, hdr.seq};
+  memcpy(rsp, &rhdr, sizeof(rhdr));
+  if (not hit) return sizeof(rhdr);
+  memcpy(rsp + sizeof(rhdr), &fix, sizeof(fix));
+  return sizeof(rhdr) + sizeof(fix);
+}
+
+/*
+  Stand-in servers
+*/
+
+void SimCounter::init(size_t seconds) {
+  std::vector<std::atomic<uint32_t>> tmp(seconds + 1);
+  for (auto &s : tmp) s.store(0);
+  slots.swap(tmp);
+}
+
+void SimCounter::add(unsigned long ms, uint32_t n) {
+  size_t s = ms / 1000;
+  if (s < slots.size()) slots[s].fetch_add(n, std::memory_order_relaxed);
+}
+
+uint64_t SimCounter::total() const {
+  uint64_t t = 0;
+  for (auto &s : slots) t += s.load();
+  return t;
+}
+
+uint32_t SimCounter::peak() const {
+  uint32_t p = 0;
+  for (auto &s : slots) if (s.load() > p) p = s.load();
+  return p;
+}
+
+uint64_t SimCounter::excess(uint32_t capacity) const {
+  uint64_t e = 0;
+  for (auto &s : slots) if (s.load() > capacity) e += s.load() - capacity;
+  return e;
+}
+
+/**
+  Geolocate when the whole request has arrived: weighted centroid of
+  the known APs, or a 404 error
+*/
+void SimGeo::serve(WiFiClient *c) {
+  // The check of a network joined, the headers only
+  if (c->txBuf.compare(0, 5, "HEAD ") == 0) {
+    if (c->txBuf.find("\r\n\r\n") == std::string::npos) return;
+    c->txBuf.clear();
+    c->rxBuf += "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    c->open = false;
+    return;
+  }
+  if (c->txBuf.find("]}\n") == std::string::npos) return;
+  requests.add(simCur->clock);
+  double sw = 0, sx = 0, sy = 0, sxx = 0, syy = 0;
+  const char *p = c->txBuf.c_str();
+  while ((p = strstr(p, "\"macAddress\": \"")) != NULL) {
+    p += 15;
+    unsigned int b[6];
+    int rssi = -100;
+    if (sscanf(p, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6) continue;
+    const char *q = strstr(p, "\"signalStrength\": ");
+    if (q) rssi = atoi(q + 18);
+    uint8_t bssid[6];
+    for (int i = 0; i < 6; i++) bssid[i] = b[i];
+    int cx, cy;
+    if (not simBSSIDCell(bssid, &cx, &cy)) continue;
+    double w = pow(10.0, rssi / 20.0);
+    double x = (cx + 0.5) * SIM_CELL, y = (cy + 0.5) * SIM_CELL;
+    sw += w;
+    sx += w * x;
+    sy += w * y;
+    sxx += w * x * x;
+    syy += w * y * y;
+  }
+  char body[160];
+  char head[160];
+  if (sw > 0) {
+    double x = sx / sw, y = sy / sw;
+    double spread = sqrt(fabs(sxx / sw - x * x) + fabs(syy / sw - y * y));
+    double lat, lng;
+    simXYToLatLng(x, y, &lat, &lng);
+    snprintf(body, sizeof(body), "{\"location\": {\"lat\": %.7f, \"lng\": %.7f}, \"accuracy\": %d}\n",
+             lat, lng, (int)(spread + SIM_CELL / 2));
+    snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n",
+             strlen(body));
+  }
+  else {
+    snprintf(body, sizeof(body), "{\"error\": {\"errors\": [], \"code\": 404, \"message\": \"Not found\"}}\n");
+    snprintf(head, sizeof(head), "HTTP/1.1 404 Not Found\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n",
+             strlen(body));
+  }
+  c->txBuf.clear();
+  c->rxBuf += head;
+  c->rxBuf += body;
+  // Connection: close
+  c->open = false;
+  simCur->clock += simCur->rtt + 40;
+}
+
+/**
+  Serve a tile: the grid cells whose AP falls inside it, sorted by BSSID
+*/
+void SimTiles::serve(WiFiClient *c) {
+  if (c->txBuf.find("\r\n\r\n") == std::string::npos) return;
+  requests.add(simCur->clock);
+  int tlat, tlng;
+  if (sscanf(c->txBuf.c_str(), "GET /tiles/%d/%d.bin", &tlat, &tlng) != 2) {
+    c->rxBuf += "HTTP/1.0 400 Bad Request\r\n\r\n";
+    c->open = false;
+    return;
+  }
+  c->txBuf.clear();
+  // The cells around the tile
+  double lat0 = (double)tlat / TILE_SCALE, lng0 = (double)tlng / TILE_SCALE;
+  double x0, y0, x1, y1;
+  simLatLngToXY(lat0, lng0, &x0, &y0);
+  simLatLngToXY(lat0 + 1.0 / TILE_SCALE, lng0 + 1.0 / TILE_SCALE, &x1, &y1);
+  std::vector<tile_ap_t> aps;
+  for (int cy = (int)floor(y0 / SIM_CELL) - 1; cy <= (int)ceil(y1 / SIM_CELL); cy++)
+    for (int cx = (int)floor(x0 / SIM_CELL) - 1; cx <= (int)ceil(x1 / SIM_CELL); cx++) {
+      double lat, lng;
+      simXYToLatLng((cx + 0.5) * SIM_CELL, (cy + 0.5) * SIM_CELL, &lat, &lng);
+      long dlat = lround((lat - lat0) * 1e6), dlng = lround((lng - lng0) * 1e6);
+      if (dlat < 0 or dlat >= 1000000 / TILE_SCALE or dlng < 0 or dlng >= 1000000 / TILE_SCALE) continue;
+      // The APs installed after the database was built
+      if (unmapped and (((uint32_t)cx * 73856093U) ^ ((uint32_t)cy * 19349663U)) % unmapped == 0) continue;
+      tile_ap_t ap;
+      simCellBSSID(cx, cy, ap.bssid);
+      ap.dlat = dlat;
+      ap.dlng = dlng;
+      aps.push_back(ap);
+    }
+  std::sort(aps.begin(), aps.end(), [](const tile_ap_t &a, const tile_ap_t &b) {
+    return memcmp(a.bssid, b.bssid, WL_MAC_ADDR_LENGTH) < 0;
+  });
+  tile_hdr_t hdr = {TILE_MAGIC, (int16_t)tlat, (int16_t)tlng, (uint16_t)aps.size(), 0};
+  size_t len = sizeof(hdr) + aps.size() * sizeof(tile_ap_t);
+  char head[100];
+  snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Length: %zu\r\n\r\n", len);
+  c->rxBuf += head;
+  c->rxBuf.append((const char*)&hdr, sizeof(hdr));
+  c->rxBuf.append((const char*)aps.data(), aps.size() * sizeof(tile_ap_t));
+  c->open = false;
+  bytes.add(simCur->clock, len);
+  // A round trip and 1 Mbit/s
+  simCur->clock += simCur->rtt + len / 125;
+}
+
+void SimAPRS::connect(WiFiClient *c) {
+  requests.add(simCur->clock);
+  c->rxBuf += "# aprsc sim\r\n";
+}
+
+/**
+  Handle the complete lines: verify the login, count the beacons
+*/
+void SimAPRS::serve(WiFiClient *c) {
+  size_t eol;
+  while ((eol = c->txBuf.find('\n')) != std::string::npos) {
+    std::string line = c->txBuf.substr(0, eol);
+    c->txBuf.erase(0, eol + 1);
+    if (line.compare(0, 5, "user ") == 0) {
+      std::string call = line.substr(5, line.find(' ', 5) - 5);
+      c->rxBuf += "# logresp " + call + " verified, server SIM\r\n";
+      simCur->clock += simCur->rtt;
+    }
+    else if (line.find(":!") != std::string::npos or line.find(":;") != std::string::npos)
+      beacons.add(simCur->clock);
+  }
+}
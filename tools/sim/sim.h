@@ -0,0 +1,274 @@
+/**
+  sim.h - Fleet simulator nodes and stand-in servers
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIM_H
+#define SIM_H
+
+#include "Arduino.h"
+#include "ESP8266WiFi.h"
+#include "heap.h"
+#include "lwip/dns.h"
+#include "lwip/netif.h"
+#include "lwip/tcp.h"
+#include "tools/geocache.h"
+extern "C" {
+#include "user_interface.h"
+}
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+
+// Simulated world: one AP per grid cell (m), heard up to a range (m)
+#define SIM_CELL      40.0
+#define SIM_RANGE     150.0
+// The world origin
+#define SIM_LAT0      44.4268
+#define SIM_LNG0      26.1025
+// Random waypoints inside this square (m)
+#define SIM_AREA      8000.0
+// Unix time of the virtual clock origin
+#define SIM_EPOCH     1600000000UL
+// The serial receive buffer (bytes), unless set, the oldest bytes are lost
+#define SIM_UARTBUF   256
+// The station joins an AP up to this range (m), in this time (ms)
+#define SIM_JOIN      100.0
+#define SIM_ASSOC     2000
+// The networks of the APs: one in SIM_NETS is on the network of the fleet,
+// one open, one open behind a captive portal, the rest private
+#define SIM_NETS      24
+#define SIM_FLEETSSID "wips-fleet"
+#define SIM_FLEETPSK  "wips-fleet-psk"
+// The stored network of a node, on its own AP, by the node number
+#define SIM_HOMESSID  "home-%04X"
+#define SIM_HOMEPSK   "home-psk"
+
+// One scanned AP
+struct sim_ap_t {
+  uint8_t bssid[WL_MAC_ADDR_LENGTH];
+  int32_t rssi;
+  uint8_t channel;
+};
+
+// The kinds of networks
+enum sim_net_t {SIM_NETPRIV, SIM_NETFLEET, SIM_NETOPEN, SIM_NETPORTAL};
+
+// Per second counters over the simulated time
+class SimCounter {
+  public:
+    void          init(size_t seconds);
+    void          add(unsigned long ms, uint32_t n = 1);
+    uint64_t      total() const;
+    uint32_t      peak() const;
+    uint64_t      excess(uint32_t capacity) const;
+  private:
+    std::vector<std::atomic<uint32_t>> slots;
+};
+
+// A lookup in flight
+struct sim_dns_t {
+  std::string         name;
+  dns_found_callback  found;
+  void               *arg;
+  unsigned long       due;            // Virtual time of the answer
+};
+
+class SimService;
+class Energy;
+
+// The world as a tracker recorded it, in place of the simulated one: the
+// scans, the connections and the answers, each in the recorded order
+class SimReplay {
+  public:
+    virtual ~SimReplay() {}
+    // The next scan, the time it took (ms)
+    virtual unsigned long scan(std::vector<sim_ap_t> &aps) = 0;
+    // The next connection to a port, false if lost, else the time it took (ms)
+    virtual bool  connect(uint16_t port, unsigned long *ms) = 0;
+    // The server of a port, NULL if none
+    virtual SimService *service(uint16_t port) = 0;
+    // The next NTP answer, false if lost, and its round trip (ms)
+    virtual bool  ntp(uint8_t *pkt, unsigned long *rtt) = 0;
+};
+
+// A raw TCP client connection to a stand-in server
+struct sim_conn_t {
+  tcp_pcb      *pcb;
+  SimService   *service;
+  WiFiClient    peer;               // The server side, its buffers
+  uint16_t      port;
+  bool          up;                 // The handshake done
+  bool          fin;                // The end of the stream sent by the server
+};
+
+// The raw TCP events: the handshake, data and the end of the stream in,
+// the data written acknowledged
+enum sim_tcp_ev_t {SIM_TCPCONN, SIM_TCPRECV, SIM_TCPFIN, SIM_TCPACK};
+
+// A raw TCP event in flight
+struct sim_tcp_t {
+  sim_conn_t   *conn;
+  uint8_t       type;
+  uint32_t      len;
+  unsigned long due;                // Virtual time of the event
+};
+
+// A simulated node, the state the shim works on
+class SimNode {
+  public:
+    virtual ~SimNode();
+    void          move();
+    void          hear(std::vector<sim_ap_t> &aps);
+    bool          joined();
+    uint32_t      random(uint32_t n);
+    // Read the serial input, around the blocking calls and in the delays
+    virtual void  drain() {}
+    int           id;
+    uint32_t      chipId;
+    unsigned long clock   = 0;        // Virtual millis()
+    unsigned long rtt     = 80;       // Network round trip (ms)
+    unsigned long dnsTime = 80;       // Resolver latency (ms)
+    uint8_t       loss    = 0;        // Exchanges lost (%)
+    std::vector<sim_dns_t> dnsPending;
+    std::vector<sim_tcp_t> tcpPending;
+    std::vector<sim_conn_t*> tcpConns;
+    struct netif  nif;                // The station interface
+    uint8_t       channel = 1;        // The channel of the connected AP
+    // The station: with roam, it joins the APs in range by network, else
+    // it is always connected
+    bool          roam     = false;
+    char          staSSID[WL_SSID_MAX_LENGTH + 1] = "";     // The network last joined
+    char          staPSK[WL_WPA_KEY_MAX_LENGTH + 1] = "";
+    bool          staOn    = false;   // Joining, or joined
+    bool          staUp    = false;   // Joined
+    bool          portal   = false;   // Behind a captive portal
+    unsigned long staDue   = 0;       // The next association (ms)
+    bool          atHome   = false;   // Joined to the home AP
+    int           apX, apY;           // Else the cell of the AP joined
+    double        homeX, homeY;       // The AP of the stored network, not in the grid
+    unsigned long homeOff  = 0;       // It is switched off then (ms), never if zero
+    unsigned long staJoins = 0, staDrops = 0;
+    unsigned long downSince = 0, downMs = 0;  // Time not joined (ms)
+    wifi_promiscuous_cb_t sniffer = NULL;
+    bool          sniffing = false;
+    unsigned long sniffed  = 0;       // Time of the last beacons heard
+    bool          hasGPS   = false;   // A GPS receiver on the serial input
+    unsigned long gpsNext  = 0;       // Time of the next sentences
+    std::string   uartRx;             // The serial receive buffer
+    size_t        uartSize = SIM_UARTBUF;
+    double        x, y;               // True position (m)
+    double        dstX, dstY;         // Waypoint (m)
+    double        speed;              // m/s
+    unsigned long lastMove;           // Virtual time of the last move
+    unsigned long pauseUntil;         // Parked until
+    uint32_t      rng;                // Private random generator state
+    std::vector<sim_ap_t> scan;
+    std::map<std::string, std::string> files;   // The flash file system
+    SimReplay    *replay  = NULL;     // A recorded world, if replaying
+    Energy       *meter   = NULL;     // The energy accounting, by the stall marks
+    bool          verbose = false;
+};
+
+// The node the current thread runs
+extern thread_local SimNode *simCur;
+
+// A stand-in server
+class SimService {
+  public:
+    virtual ~SimService() {}
+    virtual void  connect(WiFiClient *c) {}
+    virtual void  serve(WiFiClient *c) = 0;
+    SimCounter    requests;
+};
+
+// Geolocation stand-in, speaks the /v1/geolocate subset MLS uses
+class SimGeo: public SimService {
+  public:
+    void  serve(WiFiClient *c);
+};
+
+// APRS-IS stand-in, verifies the logins and counts the beacons
+class SimAPRS: public SimService {
+  public:
+    void  connect(WiFiClient *c);
+    void  serve(WiFiClient *c);
+    SimCounter    beacons;
+};
+
+// AP tiles stand-in, serves the APs of the grid
+class SimTiles: public SimService {
+  public:
+    void  serve(WiFiClient *c);
+    SimCounter    bytes;
+    int           unmapped = 0;       // One AP in this many is missing, if not zero
+};
+
+// NTP stand-in
+class SimNTP {
+  public:
+    SimCounter    requests;
+};
+
+// LAN resolver stand-in, the host cache service on the simulated time
+class SimLAN {
+  public:
+    size_t        exchange(const std::string &msg, uint8_t *rsp);
+    GeoCache      cache;
+    SimCounter    requests;
+    bool          enabled = false;
+    unsigned long rtt     = 5;        // LAN round trip (ms)
+};
+
+// The radio, scans and beacon frames
+class SimRadio {
+  public:
+    SimCounter    scans;
+    SimCounter    frames;
+};
+
+// DNS stand-in, resolves any name
+class SimDNS {
+  public:
+    SimCounter    requests;
+};
+
+extern SimGeo  simGeo;
+extern SimAPRS simAPRS;
+extern SimTiles simTiles;
+extern SimNTP  simNTP;
+extern SimDNS  simDNS;
+extern SimLAN  simLAN;
+extern SimRadio simRadio;
+
+// The frames of the simulated traffic, through the station interface
+void simWire(bool out, uint8_t proto, uint16_t rport, uint16_t lport, size_t len);
+void simWireTcp(bool out, uint16_t rport, uint16_t lport, size_t len);
+bool simLost();
+// Let the virtual time pass, the lwIP callbacks due are called on the way
+void simElapse(unsigned long ms);
+
+// Grid cell BSSID coding, shared by the scan and the geolocation server
+void simCellBSSID(int cx, int cy, uint8_t *bssid);
+uint8_t simCellNet(int cx, int cy, char *ssid, char *psk);
+uint8_t simCellChannel(int cx, int cy);
+bool simBSSIDCell(const uint8_t *bssid, int *cx, int *cy);
+void simXYToLatLng(double x, double y, double *lat, double *lng);
+void simLatLngToXY(double lat, double lng, double *x, double *y);
+
+#endif /* SIM_H */
@@ -0,0 +1,59 @@
+/**
+  user_interface.h - Host stand-in for the SDK station, RTC and sniffer
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  The station configuration is the network last joined.  The scan results
+  are in the SDK layout.  The RTC timer counts the microseconds of the
+  virtual clock.  While enabled, the node hears the beacons of the
+  APs in range on the channel of its AP, from yield(), in the SDK buffer
+  layout.
+*/
+
+#ifndef SIM_USER_INTERFACE_H
+#define SIM_USER_INTERFACE_H
+
+#include <stdint.h>
+
+// The station configuration, the fields used
+struct station_config {
+  uint8_t ssid[32];
+  uint8_t password[64];
+  uint8_t bssid_set;
+  uint8_t bssid[6];
+};
+
+// A scanned network, the fields used
+struct bss_info {
+  uint8_t bssid[6];
+  uint8_t ssid[32];
+  uint8_t ssid_len;
+  uint8_t channel;
+  int8_t  rssi;
+  uint8_t authmode;
+};
+
+bool wifi_station_get_config(struct station_config *config);
+
+uint32_t system_get_rtc_time();
+uint32_t system_rtc_clock_cali_proc();
+
+typedef void (*wifi_promiscuous_cb_t)(uint8_t *buf, uint16_t len);
+
+void wifi_set_promiscuous_rx_cb(wifi_promiscuous_cb_t cb);
+void wifi_promiscuous_enable(uint8_t promiscuous);
+
+#endif /* SIM_USER_INTERFACE_H */
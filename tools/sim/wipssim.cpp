@@ -0,0 +1,1065 @@
+/**
+  wipssim.cpp - Fleet simulator, many virtual WiPS nodes in one process
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  Build:  g++ -O2 -pthread -Itools/sim -I. -o wipssim \
+              tools/sim/wipssim.cpp tools/sim/shim.cpp \
+              dnscache.cpp tls.cpp tiles.cpp beacons.cpp gps.cpp mls.cpp \
+              track.cpp nmea.cpp aprs.cpp ntp.cpp budget.cpp shaper.cpp \
+              link.cpp lancache.cpp trace.cpp energy.cpp wlan.cpp \
+              resume.cpp cycle.cpp
+  Usage:  wipssim [-n NODES] [-t THREADS] [-d SECONDS] [-s SEED]
+                  [-g HOST:PORT] [-r MS] [-b KB] [-l PCT] [-w MS]
+                  [-a CYCLES] [-O FILE] [-A DB] [-T FILE | -R FILE]
+                  [-p] [-x] [-G] [-F] [-S] [-L] [-J] [-v]
+
+  Runs NODES independent trackers, each with its own MLS, NMEA, APRS and
+  NTP objects from the firmware and the fix cycle of the main loop, each
+  moving around with a random waypoint model.  The network is made of
+  in-process stand-in servers: geolocation over a grid of simulated APs,
+  the offline AP tiles of the same grid, APRS-IS and NTP.  Every node has its own virtual clock, advanced by the
+  simulated scan and network latencies, so the nodes run in parallel on
+  a thread pool, in epochs of virtual time.  The results do not depend
+  on the number of threads.
+
+  With -g, the NMEA sentences are also sent as UDP datagrams, one socket
+  per node, to a gateway such as tools/nmeagw.  With -r, the resolver
+  answers after MS milliseconds, instead of a network round trip.  With
+  -p, the nodes collect the APs from the beacons between the fixes.  With
+  -x, the nodes do not use the offline AP tiles.  With -G, the nodes
+  have a GPS receiver, with a fix only while moving, and the tiles miss
+  some of the APs, for the GPS fixes to label.  With -b, the nodes have
+  a daily data budget of KB, metered on the link layer; the hooks are
+  shared, as on the device, so the nodes run on one thread.  With -l,
+  PCT of the connections and NTP requests are lost.  With -w, the round
+  trips go up to MS milliseconds, instead of 280.  With -F, the timeouts
+  are the fixed ones, not timed from the exchanges.  With -S, the APRS-IS
+  session starts only when reporting, after the geolocation, not during
+  the scan, and is not kept while moving.  With -L, the nodes find a LAN
+  resolver by mDNS and ask it before the server, the cache is shared, so
+  the nodes run on one thread.  With -J, the nodes join the networks as
+  stations: each one its home AP at the start, switched off in the first
+  ten minutes, then the network of the fleet, known to all, and the open
+  networks around, some behind a captive portal; off the network, the
+  nodes only geolocate by GPS.  With -O, the APs of each scan are written
+  to FILE with the fix, as observations for tools/apbuild.  With -A, the
+  nodes have the database file DB from tools/apbuild in flash, for the
+  APs not in the tiles.  With -v, node 0 prints its log.
+
+  With -a, the heap allocations are counted in the loop passes after the
+  first CYCLES fix cycles of each node, the warm-up: the idle passes, the
+  joins with -J and the fix cycle of the sketch.  The run fails if the
+  firmware objects allocate: their steady state does not.  The core and
+  lwIP allocate on the same heap on the device, for each connection,
+  lookup and datagram: the contexts, the PCBs, the pbufs and the BearSSL
+  buffers.  The stand-ins count these apart, where the device allocates,
+  and they are reported, not failed: the core allocates the BearSSL
+  buffers on each connect and frees them on stop, they can not be given
+  to it preallocated.  The servers and the radio are left out.
+
+  The energy of each node is accounted as on the device, by the stages of
+  the loop and the blocking calls, and reported as the mean current per
+  subsystem.  The frames sent are on the air only with -b, from the hooks
+  of the data budget.
+
+  With -T, node 0 records its I/O trace, as a tracker built with TRACE
+  does, and it is written to FILE at the end.  With -R, one node replays
+  the trace FILE, from a tracker or from -T, for the length of the trace:
+  the scans, the connections, the geolocation answers, NTP and APRS-IS
+  come from the trace, each in the recorded order, and the virtual clock
+  is moved to the recorded times when behind.  The requests to the
+  geolocation server and the lines sent to APRS-IS are checked against
+  the recorded ones.  The tracker options, -s, -w, -b, -F and -S, are
+  not in the trace, give the recorded ones.  There are no tiles, beacons,
+  GPS or LAN resolver in a replay, so only a trace recorded without them
+  replays exactly, as with -x; the round trips not in the trace, as the
+  acknowledgements, are the simulated ones.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "sim.h"
+#include "dnscache.h"
+#include "tls.h"
+#include "tiles.h"
+#include <LittleFS.h>
+#include "beacons.h"
+#include "gps.h"
+#include "mls.h"
+#include "track.h"
+#include "nmea.h"
+#include "aprs.h"
+#include "ntp.h"
+#include "budget.h"
+#include "shaper.h"
+#include "link.h"
+#include "lancache.h"
+#include "trace.h"
+#include "stall.h"
+#include "energy.h"
+#include "wlan.h"
+#include "resume.h"
+#include "cycle.h"
+
+// Virtual time run between two barriers (ms)
+#define SIM_EPOCHMS   60000UL
+
+static SimCounter gwDatagrams;
+// The observations for the AP database builder
+static FILE *obsFile = NULL;
+static std::mutex obsLock;
+// The database file in the flash of the nodes
+static std::string apdbImage;
+static sockaddr_in gwAddr;
+static bool gwSend = false;
+static bool useTiles = true;
+static bool usePassive = false;
+static bool useGPS = false;
+// Daily data budget (KB), none if zero
+static uint32_t bdgDaily = 0;
+// Exchanges lost (%), the worst round trip (ms) and the fixed timeouts
+static uint8_t lossPct = 0;
+static unsigned long rttMax = 280;
+static bool fixedTimeouts = false;
+// Start the APRS-IS session only when reporting
+static bool sequential = false;
+// Ask the LAN resolver first
+static bool useLAN = false;
+// Resolver latency (ms), the round trip of each node if zero
+static unsigned long dnsTime = 0;
+// Count the heap allocations after this many fix cycles, if not zero
+static unsigned long allocWarm = 0;
+// Record the trace of node 0 to this file
+static const char *traceOut = NULL;
+// Join the networks as stations
+static bool useRoam = false;
+
+class TraceReplay;
+
+// Geolocation from the trace: the recorded answers, in order
+class TraceGeo: public SimService {
+  public:
+    void  serve(WiFiClient *c);
+    TraceReplay *replay;
+};
+
+// APRS-IS from the trace: the recorded server lines, in order
+class TraceAPRS: public SimService {
+  public:
+    void  connect(WiFiClient *c);
+    void  serve(WiFiClient *c);
+    TraceReplay *replay;
+};
+
+/**
+  A recorded trace in place of the simulated world, each kind of record
+  consumed in order: the scans, the geolocation exchanges, NTP, and the
+  APRS-IS sessions, their handshakes, lines out and in together
+*/
+class TraceReplay: public SimReplay {
+  public:
+    bool  load(const char *name);
+    unsigned long scan(std::vector<sim_ap_t> &aps);
+    bool  connect(uint16_t port, unsigned long *ms);
+    SimService *service(uint16_t port);
+    bool  ntp(uint8_t *pkt, unsigned long *rtt);
+    void  geoServe(WiFiClient *c);
+    void  aprsLines(WiFiClient *c);
+    void  aprsServe(WiFiClient *c);
+    uint32_t  chip;
+    unsigned long end = 0;            // The time of the last record (ms)
+    unsigned long used = 0;           // Records replayed
+    unsigned long missing = 0;        // Asked for past the end of their stream
+    unsigned long geoDiff = 0;        // Requests not as recorded
+    unsigned long aprsDiff = 0;       // Lines out not as recorded
+    unsigned long synced = 0;         // Virtual time skipped to the records (ms)
+    size_t  records() const {
+      return recs.size();
+    }
+  private:
+    struct rec_t {
+      trc_rec_t   hdr;
+      std::string data;
+    };
+    enum {RPL_SCAN, RPL_GEO, RPL_NTP, RPL_APRS, RPL_STREAMS};
+    const rec_t *peek(int stream);
+    const rec_t *take(int stream);
+    void  sync(unsigned long at);
+    std::vector<rec_t> recs;
+    std::vector<size_t> streams[RPL_STREAMS];
+    size_t    pos[RPL_STREAMS] = {0};
+    uint8_t   geoTry = 0;             // Connection tries of the current exchange
+    unsigned long geoReq = 0;         // The time the request started
+    bool      geoBusy = false;
+    TraceGeo  geo;
+    TraceAPRS aprs;
+};
+
+static TraceReplay traceReplay;
+static bool replaying = false;
+
+/**
+  Read a trace file, split in streams
+
+  @return true if read
+*/
+bool TraceReplay::load(const char *name) {
+  FILE *fp = fopen(name, "rb");
+  if (fp == NULL) return false;
+  trc_file_t hdr;
+  bool ok = fread(&hdr, sizeof(hdr), 1, fp) == 1 and hdr.magic == TRC_MAGIC;
+  chip = hdr.chip;
+  rec_t rec;
+  while (ok and fread(&rec.hdr, sizeof(rec.hdr), 1, fp) == 1) {
+    rec.data.resize(rec.hdr.len);
+    if (rec.hdr.len > 0 and fread(&rec.data[0], rec.hdr.len, 1, fp) != 1) break;
+    int stream = rec.hdr.type == TRC_SCAN ? RPL_SCAN :
+                 rec.hdr.type == TRC_GEO  ? RPL_GEO :
+                 rec.hdr.type == TRC_NTP  ? RPL_NTP :
+                 rec.hdr.type >= TRC_APRSCONN and rec.hdr.type <= TRC_APRSIN ? RPL_APRS : -1;
+    if (stream < 0) continue;
+    streams[stream].push_back(recs.size());
+    recs.push_back(rec);
+    end = rec.hdr.ms;
+  }
+  fclose(fp);
+  geo.replay = this;
+  aprs.replay = this;
+  return ok;
+}
+
+const TraceReplay::rec_t *TraceReplay::peek(int stream) {
+  return pos[stream] < streams[stream].size() ? &recs[streams[stream][pos[stream]]] : NULL;
+}
+
+const TraceReplay::rec_t *TraceReplay::take(int stream) {
+  const rec_t *rec = peek(stream);
+  if (rec == NULL) missing++;
+  else {
+    pos[stream]++;
+    used++;
+  }
+  return rec;
+}
+
+/**
+  Move the virtual time up to a recorded one, never back
+*/
+void TraceReplay::sync(unsigned long at) {
+  if ((long)(at - simCur->clock) <= 0) return;
+  synced += at - simCur->clock;
+  simElapse(at - simCur->clock);
+}
+
+unsigned long TraceReplay::scan(std::vector<sim_ap_t> &aps) {
+  aps.clear();
+  const rec_t *rec = take(RPL_SCAN);
+  if (rec == NULL) return 2100;
+  trc_scan_t hdr;
+  memcpy(&hdr, rec->data.data(), sizeof(hdr));
+  sync(rec->hdr.ms - hdr.ms);
+  for (uint8_t i = 0; i < hdr.count; i++) {
+    trc_ap_t ap;
+    memcpy(&ap, rec->data.data() + sizeof(hdr) + i * sizeof(ap), sizeof(ap));
+    sim_ap_t sap;
+    memcpy(sap.bssid, ap.bssid, WL_MAC_ADDR_LENGTH);
+    sap.rssi = ap.rssi;
+    sap.channel = ap.channel;
+    aps.push_back(sap);
+  }
+  return hdr.ms;
+}
+
+/**
+  The geolocation connections try as recorded, the last one connecting
+  when recorded; an APRS-IS handshake completes in the recorded time.
+  The lost ones are timed out by the firmware.
+*/
+bool TraceReplay::connect(uint16_t port, unsigned long *ms) {
+  if (port == GEO_PORT) {
+    const rec_t *rec = peek(RPL_GEO);
+    if (rec == NULL) {
+      missing++;
+      return false;
+    }
+    trc_geo_t hdr;
+    memcpy(&hdr, rec->data.data(), sizeof(hdr));
+    uint8_t tries = hdr.tries > 0 ? hdr.tries : 1;
+    if (geoTry == 0) sync(rec->hdr.ms - hdr.rspMs - hdr.connMs);
+    if (++geoTry < tries) return false;
+    geoTry = 0;
+    // The exchange goes on if connected, its record is taken when served
+    geoBusy = false;
+    if (rec->hdr.flags & TRC_OK) {
+      unsigned long at = rec->hdr.ms - hdr.rspMs;
+      *ms = (long)(at - simCur->clock) > 0 ? at - simCur->clock : 0;
+      return true;
+    }
+    take(RPL_GEO);
+    return false;
+  }
+  if (port == APRS_PORT) {
+    const rec_t *rec = peek(RPL_APRS);
+    if (rec == NULL or rec->hdr.type != TRC_APRSCONN) {
+      missing++;
+      return false;
+    }
+    take(RPL_APRS);
+    uint16_t hms;
+    memcpy(&hms, rec->data.data(), sizeof(hms));
+    if (not (rec->hdr.flags & TRC_OK)) return false;
+    sync(rec->hdr.ms - hms);
+    *ms = hms;
+    return true;
+  }
+  return false;
+}
+
+SimService *TraceReplay::service(uint16_t port) {
+  if (port == GEO_PORT)  return &geo;
+  if (port == APRS_PORT) return &aprs;
+  return NULL;
+}
+
+bool TraceReplay::ntp(uint8_t *pkt, unsigned long *rtt) {
+  const rec_t *rec = take(RPL_NTP);
+  if (rec == NULL) return false;
+  trc_ntp_t hdr;
+  memcpy(&hdr, rec->data.data(), sizeof(hdr));
+  sync(rec->hdr.ms - hdr.ms);
+  if (not (rec->hdr.flags & TRC_OK)) return false;
+  pkt[40] = hdr.secs >> 24;
+  pkt[41] = hdr.secs >> 16;
+  pkt[42] = hdr.secs >> 8;
+  pkt[43] = hdr.secs;
+  pkt[44] = hdr.frac;
+  *rtt = hdr.ms;
+  return true;
+}
+
+/**
+  Check the request against the recorded APs and answer as recorded,
+  after the recorded wait
+*/
+void TraceReplay::geoServe(WiFiClient *c) {
+  if (not geoBusy) {
+    geoReq = simCur->clock;
+    geoBusy = true;
+  }
+  if (c->txBuf.find("]}\n") == std::string::npos) return;
+  geoBusy = false;
+  // The APs asked for, as recorded
+  std::string nets;
+  const char *p = c->txBuf.c_str();
+  while ((p = strstr(p, "\"macAddress\": \"")) != NULL) {
+    p += 15;
+    unsigned int b[6];
+    const char *q = strstr(p, "\"signalStrength\": ");
+    if (sscanf(p, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6 or q == NULL) continue;
+    trc_net_t net;
+    for (int i = 0; i < 6; i++) net.bssid[i] = b[i];
+    net.rssi = atoi(q + 18);
+    nets.append((const char*)&net, sizeof(net));
+  }
+  c->txBuf.clear();
+  c->open = false;
+  const rec_t *rec = take(RPL_GEO);
+  if (rec == NULL) {
+    c->rxBuf += "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    return;
+  }
+  trc_geo_t hdr;
+  memcpy(&hdr, rec->data.data(), sizeof(hdr));
+  if (nets != rec->data.substr(sizeof(hdr))) geoDiff++;
+  char body[160];
+  if (hdr.code != 0)
+    snprintf(body, sizeof(body), "{\"error\": {\"errors\": [], \"code\": %d, \"message\": \"Replayed\"}}\n", hdr.code);
+  else if (hdr.acc >= 0)
+    snprintf(body, sizeof(body), "{\"location\": {\"lat\": %.7f, \"lng\": %.7f}, \"accuracy\": %d}\n",
+             hdr.lat / 1e7, hdr.lng / 1e7, hdr.acc);
+  else
+    snprintf(body, sizeof(body), "{}\n");
+  char head[120];
+  snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n",
+           hdr.code != 0 ? "404 Not Found" : "200 OK", strlen(body));
+  c->rxBuf += head;
+  c->rxBuf += body;
+  if ((long)(geoReq + hdr.waitMs - simCur->clock) > 0) simCur->clock = geoReq + hdr.waitMs;
+}
+
+/**
+  The server lines recorded up to the next line out or handshake, at
+  the time of the last one
+*/
+void TraceReplay::aprsLines(WiFiClient *c) {
+  const rec_t *rec;
+  while ((rec = peek(RPL_APRS)) != NULL and rec->hdr.type == TRC_APRSIN) {
+    take(RPL_APRS);
+    c->rxBuf += rec->data + "\r\n";
+    if ((long)(rec->hdr.ms - simCur->clock) > 0) simCur->clock = rec->hdr.ms;
+  }
+}
+
+/**
+  Check the data written against the next line out, then answer
+*/
+void TraceReplay::aprsServe(WiFiClient *c) {
+  const rec_t *rec = peek(RPL_APRS);
+  if (rec == NULL or rec->hdr.type != TRC_APRSOUT) {
+    missing++;
+    aprsDiff++;
+  }
+  else {
+    take(RPL_APRS);
+    if (c->txBuf != rec->data) {
+      aprsDiff++;
+      if (simCur->verbose) printf("replay: sent %s  recorded %s", c->txBuf.c_str(), rec->data.c_str());
+    }
+  }
+  c->txBuf.clear();
+  aprsLines(c);
+}
+
+void TraceGeo::serve(WiFiClient *c) {
+  replay->geoServe(c);
+}
+
+void TraceAPRS::connect(WiFiClient *c) {
+  requests.add(simCur->clock);
+  replay->aprsLines(c);
+}
+
+void TraceAPRS::serve(WiFiClient *c) {
+  replay->aprsServe(c);
+}
+
+/**
+  A tracker: the firmware objects and the fix cycle of the main loop,
+  stepped the way loop() steps them
+*/
+class Tracker: public SimNode {
+  public:
+    void  boot();
+    void  step();
+    void  broadcast(const char *buf, size_t len);
+    void  observe(int acc);
+    unsigned long wake() {
+      return cycle.geoNextTime * 1000;
+    }
+    void  drain() {
+      gps.loop();
+    }
+    static void send(void *arg, char *buf, size_t len);
+    static void show(void *arg, uint8_t event);
+    DNSCache dnsCache;
+    TLS   tls;
+    Tiles tiles;
+    Beacons beacons;
+    GPS   gps;
+    MLS   mls;
+    Track track;
+    NMEA  nmea;
+    APRS  aprs;
+    NTP   ntp;
+    Budget budget;
+    Shaper shaper;
+    Link  uplink;
+    LANCache lan;
+    Trace trace;
+    Energy energy;
+    WLAN  wlan;
+    Resume resume;
+    Cycle cycle;
+    int   sock        = -1;
+    // Statistics
+    unsigned long fixes;
+    unsigned long nofixes;
+    double        errSum;
+    unsigned long cycles, rpCycles;   // Fix cycles, those with a report
+    unsigned long cycleMs, rpCycleMs; // Their total time (ms)
+    unsigned long allocs, allocCycles;  // Heap allocations, in the cycles counted
+    unsigned long stackAllocs;        // Those of the core and lwIP
+};
+
+/**
+  The setup() part that matters for the servers
+*/
+void Tracker::boot() {
+  // Drawn first, the same with no losses to draw, as in a replay
+  uint32_t tlmSeq = random(1000);
+  energy.init();
+  meter = &energy;
+  if (bdgDaily > 0) {
+    budget.init(bdgDaily, 0);
+    budget.setPort(GEO_PORT, BDG_GEO);
+    budget.setPort(APRS_PORT, BDG_APRS);
+    budget.setPort(123, BDG_NTP);
+    budget.setPort(53, BDG_DNS);
+    budget.setPort(TILE_PORT, BDG_TILE);
+    budget.setEnergy(&energy);
+    mls.setBudget(&budget);
+  }
+  dnsCache.init();
+  tls.init();
+  tls.setResolver(&dnsCache);
+  mls.init(&tls);
+  tiles.setResolver(&dnsCache);
+  if (not apdbImage.empty())
+    LittleFS.open(TILE_APDB, "w").write((const uint8_t*)apdbImage.data(), apdbImage.size());
+  if (useTiles and tiles.init(TILE_SERVER, TILE_PORT)) mls.setTiles(&tiles);
+  if (usePassive) {
+    beacons.init();
+    mls.setBeacons(&beacons);
+    energy.setBeacons(&beacons);
+  }
+  if (useGPS) {
+    hasGPS = true;
+    Serial.setRxBufferSize(GPS_RXBUF);
+    gps.init(&Serial);
+    mls.setGPS(&gps);
+  }
+  shaper.init();
+  tiles.setShaper(&shaper);
+  ntp.setShaper(&shaper);
+  uplink.init();
+  if (not fixedTimeouts) {
+    mls.setLink(&uplink);
+    aprs.setLink(&uplink);
+    ntp.setLink(&uplink);
+    tiles.setLink(&uplink);
+    wlan.setLink(&uplink);
+  }
+  if (useLAN) {
+    lan.init();
+    mls.setLAN(&lan);
+  }
+  if (traceOut != NULL and id == 0 and trace.init()) {
+    mls.setTrace(&trace);
+    ntp.setTrace(&trace);
+    aprs.setTrace(&trace);
+  }
+  track.init();
+  ntp.setResolver(&dnsCache);
+  aprs.setResolver(&dnsCache);
+  resume.init();
+  cycle.init(&mls, &nmea, &aprs, &ntp);
+  cycle.setTrack(&track);
+  if (bdgDaily > 0) cycle.setBudget(&budget);
+  cycle.setShaper(&shaper);
+  cycle.setTiles(&tiles);
+  if (useGPS) cycle.setGPS(&gps);
+  cycle.setEnergy(&energy);
+  cycle.setResume(&resume);
+  cycle.setSend(send, this);
+  cycle.setShow(show, this);
+  cycle.sequential = sequential;
+  // The home network stored, its AP off after a while
+  if (useRoam) {
+    roam = true;
+    homeX = x;
+    homeY = y;
+    homeOff = clock + 60000 + random(540000);
+    downSince = clock;
+    snprintf(staSSID, sizeof(staSSID), SIM_HOMESSID, id);
+    snprintf(staPSK, sizeof(staPSK), "%s", SIM_HOMEPSK);
+  }
+  wlan.init();
+  wlan.setTLS(&tls);
+  wlan.setResolver(&dnsCache);
+  wlan.begin();
+  nmea.getWelcome("WiPS", "sim");
+  dnsCache.prefetch(GEO_SERVER);
+  dnsCache.prefetch(NTP_SERVER);
+  dnsCache.prefetch(APRS_SERVER);
+  if (useTiles) dnsCache.prefetch(TILE_SERVER);
+  // Synced with the first fix, the names resolved meanwhile
+  ntp.setServer(NTP_SERVER);
+  aprs.init(APRS_SERVER, APRS_PORT);
+  char call[10];
+  snprintf(call, sizeof(call), "SIM%04X", chipId & 0xFFFF);
+  aprs.setCallSign(call);
+  aprs.aprsTlmSeq = tlmSeq;
+  cycle.geoNextTime = millis() / 1000;
+}
+
+/**
+  UDP broadcast, counted, and sent to the gateway if requested
+*/
+void Tracker::broadcast(const char *buf, size_t len) {
+  gwDatagrams.add(clock);
+  if (gwSend) {
+    if (sock < 0) sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock >= 0) sendto(sock, buf, len, 0, (const sockaddr*)&gwAddr, sizeof(gwAddr));
+  }
+}
+
+/**
+  The sentences of the fix, broadcast
+*/
+void Tracker::send(void *arg, char *buf, size_t len) {
+  ((Tracker*)arg)->broadcast(buf, len);
+}
+
+/**
+  The fixes, counted with their error, and written as observations
+*/
+void Tracker::show(void *arg, uint8_t event) {
+  Tracker *t = (Tracker*)arg;
+  if (event == CYC_FIX) {
+    t->fixes++;
+    if (obsFile != NULL and t->cycle.acc >= 0) t->observe(t->cycle.acc);
+    double tx, ty;
+    simLatLngToXY(t->mls.current.latitude, t->mls.current.longitude, &tx, &ty);
+    t->errSum += sqrt((tx - t->x) * (tx - t->x) + (ty - t->y) * (ty - t->y));
+  }
+  else if (event == CYC_NOFIX)
+    t->nofixes++;
+}
+
+/**
+  Write the APs of the last scan with the fix, once
+*/
+void Tracker::observe(int acc) {
+  std::string out;
+  char line[80];
+  for (const sim_ap_t &ap : scan) {
+    snprintf(line, sizeof(line), "%.7f,%.7f,%d,%02x:%02x:%02x:%02x:%02x:%02x,%d\n",
+             mls.current.latitude, mls.current.longitude, acc,
+             ap.bssid[0], ap.bssid[1], ap.bssid[2], ap.bssid[3], ap.bssid[4], ap.bssid[5], ap.rssi);
+    out += line;
+  }
+  scan.clear();
+  std::lock_guard<std::mutex> g(obsLock);
+  fwrite(out.data(), 1, out.size(), obsFile);
+}
+
+/**
+  One pass of the geolocation block of loop()
+*/
+void Tracker::step() {
+  // The heap allocations of the cycles after the warm-up
+  simCounting = allocWarm > 0 and cycles >= allocWarm;
+  simAllocs = simStackAllocs = 0;
+  // The idle passes before the fix, one a second, or faster while listening:
+  // refresh the names, listen for the beacons and get the tiles.  The core
+  // calls the lwIP and SDK callbacks between the loop passes.
+  while (clock < wake()) {
+    yield();
+    stall.stage(STALL_GPS);
+    gps.loop();
+    stall.stage(STALL_DNS);
+    dnsCache.loop();
+    stall.stage(STALL_APRS);
+    aprs.loop();
+    stall.stage(STALL_SRV);
+    if (useLAN) lan.loop();
+    stall.stage(STALL_BCN);
+    if (usePassive) beacons.loop();
+    stall.stage(STALL_WIFI);
+    wlan.loop();
+    shaper.update(WiFi.RSSI(), wake(), uplink.lossy());
+    stall.stage(STALL_TILE);
+    if (mls.current.valid and not beacons.listening)
+      tiles.loop(mls.current.latitude, mls.current.longitude, cycle.sCrs, mls.speed);
+    stall.end();
+    // The loop polls, so the fix starts right when it is due
+    if (clock < wake()) simElapse(std::min(clock + (beacons.listening ? 100 : 1000), wake()) - clock);
+  }
+  stall.stage(STALL_BCN);
+  beacons.stop();
+  yield();
+  stall.stage(STALL_GPS);
+  gps.loop();
+  stall.stage(STALL_DNS);
+  dnsCache.loop();
+  stall.stage(STALL_APRS);
+  aprs.loop();
+  stall.stage(STALL_WIFI);
+  wlan.loop();
+  // The cycle of the firmware, skipped off the network without a GPS fix
+  unsigned long start = clock;
+  bool ran = cycle.loop();
+  if (cycle.located) {
+    cycles++;
+    cycleMs += clock - start;
+    if (cycle.reported) {
+      rpCycles++;
+      rpCycleMs += clock - start;
+    }
+  }
+  stall.end();
+  if (simCounting) {
+    allocs += simAllocs;
+    stackAllocs += simStackAllocs;
+    if (ran) allocCycles++;
+  }
+  simCounting = false;
+}
+
+/**
+  A minimal thread pool running an index range in parallel
+*/
+class Pool {
+  public:
+    Pool(int threads);
+    ~Pool();
+    void  run(size_t count, std::function<void(size_t)> fn);
+  private:
+    void  worker();
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable wakeup, done;
+    std::function<void(size_t)> job;
+    std::atomic<size_t> next;
+    size_t    count   = 0;
+    int       busy    = 0;
+    unsigned  gen     = 0;
+    bool      quit    = false;
+};
+
+Pool::Pool(int n) {
+  for (int i = 0; i < n; i++)
+    threads.emplace_back(&Pool::worker, this);
+}
+
+Pool::~Pool() {
+  {
+    std::lock_guard<std::mutex> g(lock);
+    quit = true;
+  }
+  wakeup.notify_all();
+  for (std::thread &t : threads) t.join();
+}
+
+void Pool::worker() {
+  unsigned seen = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> g(lock);
+      wakeup.wait(g, [&] { return quit or gen != seen; });
+      if (quit) return;
+      seen = gen;
+    }
+    // Take the indices in small chunks
+    size_t i;
+    while ((i = next.fetch_add(16)) < count)
+      for (size_t j = i; j < i + 16 and j < count; j++)
+        job(j);
+    {
+      std::lock_guard<std::mutex> g(lock);
+      if (--busy == 0) done.notify_one();
+    }
+  }
+}
+
+void Pool::run(size_t n, std::function<void(size_t)> fn) {
+  std::unique_lock<std::mutex> g(lock);
+  job = fn;
+  count = n;
+  next = 0;
+  busy = threads.size();
+  gen++;
+  wakeup.notify_all();
+  done.wait(g, [&] { return busy == 0; });
+}
+
+int main(int argc, char *argv[]) {
+  int nodes = 100;
+  int threads = std::thread::hardware_concurrency();
+  if (threads < 1) threads = 1;
+  unsigned long duration = 3600;
+  uint32_t seed = 1;
+  bool verbose = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:t:d:s:g:r:b:l:w:a:O:A:T:R:pxGFSLJv")) != -1) {
+    if      (opt == 'n') nodes = atoi(optarg);
+    else if (opt == 't') threads = atoi(optarg);
+    else if (opt == 'd') duration = atol(optarg);
+    else if (opt == 's') seed = atol(optarg);
+    else if (opt == 'r') dnsTime = atol(optarg);
+    else if (opt == 'b') bdgDaily = atol(optarg);
+    else if (opt == 'l') lossPct = atoi(optarg);
+    else if (opt == 'w') rttMax = atol(optarg);
+    else if (opt == 'a') allocWarm = atol(optarg);
+    else if (opt == 'F') fixedTimeouts = true;
+    else if (opt == 'S') sequential = true;
+    else if (opt == 'L') useLAN = true;
+    else if (opt == 'J') useRoam = true;
+    else if (opt == 'O') {
+      if ((obsFile = fopen(optarg, "w")) == NULL) {
+        perror(optarg);
+        return 1;
+      }
+    }
+    else if (opt == 'A') {
+      FILE *fp = fopen(optarg, "rb");
+      if (fp == NULL) {
+        perror(optarg);
+        return 1;
+      }
+      char buf[4096];
+      size_t n;
+      while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) apdbImage.append(buf, n);
+      fclose(fp);
+    }
+    else if (opt == 'T') traceOut = optarg;
+    else if (opt == 'R') {
+      if (not traceReplay.load(optarg)) {
+        fprintf(stderr, "wipssim: bad trace %s\n", optarg);
+        return 1;
+      }
+      replaying = true;
+    }
+    else if (opt == 'p') usePassive = true;
+    else if (opt == 'x') useTiles = false;
+    else if (opt == 'G') useGPS = true;
+    else if (opt == 'v') verbose = true;
+    else if (opt == 'g') {
+      std::string hp(optarg);
+      size_t c = hp.rfind(':');
+      hostent *he = gethostbyname(hp.substr(0, c).c_str());
+      if (c == std::string::npos or he == NULL) {
+        fprintf(stderr, "wipssim: bad gateway %s\n", optarg);
+        return 1;
+      }
+      memset(&gwAddr, 0, sizeof(gwAddr));
+      gwAddr.sin_family = AF_INET;
+      gwAddr.sin_port = htons(atoi(hp.c_str() + c + 1));
+      memcpy(&gwAddr.sin_addr, he->h_addr, sizeof(gwAddr.sin_addr));
+      gwSend = true;
+    }
+    else {
+      fprintf(stderr, "Usage: %s [-n NODES] [-t THREADS] [-d SECONDS] [-s SEED] [-g HOST:PORT] [-r MS] [-b KB] [-l PCT] [-w MS] [-a CYCLES] [-O FILE] [-A DB] [-T FILE | -R FILE] [-p] [-x] [-G] [-F] [-S] [-L] [-J] [-v]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  // One node in the recorded world, for as long as recorded
+  if (replaying) {
+    nodes = threads = 1;
+    useTiles = usePassive = useGPS = useLAN = useRoam = false;
+    traceOut = NULL;
+    duration = traceReplay.end / 1000 + 1;
+  }
+  simGeo.requests.init(duration + 600);
+  simAPRS.requests.init(duration + 600);
+  simAPRS.beacons.init(duration + 600);
+  simNTP.requests.init(duration + 600);
+  simDNS.requests.init(duration + 600);
+  simRadio.scans.init(duration + 600);
+  simRadio.frames.init(duration + 600);
+  // The link hooks are global, as on the device
+  if (bdgDaily > 0) threads = 1;
+  // The LAN cache is shared, the nodes ask it in the simulated time order
+  simLAN.enabled = useLAN;
+  simLAN.requests.init(duration + 600);
+  if (useLAN) threads = 1;
+  simTiles.requests.init(duration + 600);
+  simTiles.bytes.init(duration + 600);
+  if (useGPS) simTiles.unmapped = 8;
+  gwDatagrams.init(duration + 600);
+
+  // Create the nodes, zero initialized like the firmware globals
+  std::vector<std::unique_ptr<Tracker>> fleet;
+  for (int i = 0; i < nodes; i++) {
+    Tracker *t = new Tracker();
+    t->id = i;
+    t->rng = (seed * 2654435761UL) ^ (i * 40503UL + 1);
+    t->chipId = t->random(0) & 0xFFFFFF;
+    t->rtt = 30 + t->random(rttMax - 30);
+    t->loss = lossPct;
+    t->dnsTime = dnsTime ? dnsTime : t->rtt;
+    t->channel = 1 + 5 * t->random(3);
+    t->x = (t->random(10000) / 10000.0 - 0.5) * SIM_AREA;
+    t->y = (t->random(10000) / 10000.0 - 0.5) * SIM_AREA;
+    // Power on at random times in the first minute
+    t->clock = t->random(60000);
+    t->lastMove = t->clock;
+    t->verbose = verbose and i == 0;
+    if (replaying) {
+      t->chipId = traceReplay.chip;
+      t->replay = &traceReplay;
+    }
+    fleet.emplace_back(t);
+  }
+
+  Pool pool(threads);
+  auto start = std::chrono::steady_clock::now();
+  std::atomic<unsigned long> steps(0);
+
+  // Boot
+  pool.run(fleet.size(), [&](size_t i) {
+    simCur = fleet[i].get();
+    fleet[i]->boot();
+  });
+  // Run in epochs of virtual time
+  for (unsigned long horizon = SIM_EPOCHMS; horizon < duration * 1000 + SIM_EPOCHMS; horizon += SIM_EPOCHMS) {
+    unsigned long stop = horizon < duration * 1000 ? horizon : duration * 1000;
+    pool.run(fleet.size(), [&](size_t i) {
+      Tracker *t = fleet[i].get();
+      simCur = t;
+      unsigned long n = 0;
+      while (t->wake() < stop) {
+        t->step();
+        n++;
+      }
+      steps += n;
+    });
+  }
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  // Report
+  unsigned long fixes = 0, nofixes = 0, kept = 0, dropped = 0;
+  unsigned long sentences = 0, gpsErrors = 0, labelled = 0;
+  unsigned long long bdgDest[BDG_DESTS] = {0};
+  unsigned long bdgLow = 0, bdgOut = 0;
+  unsigned long deferred[SHP_CLASSES] = {0};
+  double lnkTimeout[LNK_DESTS] = {0}, lnkLoss = 0;
+  double errSum = 0;
+  unsigned long cycles = 0, rpCycles = 0;
+  unsigned long lanQueries = 0, lanHits = 0;
+  unsigned long long cycleMs = 0, rpCycleMs = 0;
+  unsigned long long nrgSub[NRG_SUBS] = {0}, nrgAll = 0;
+  unsigned long allocs = 0, allocCycles = 0, stackAllocs = 0;
+  unsigned long staJoins = 0, staDrops = 0, wlanScans = 0, wlanPicked = 0;
+  unsigned long long downMs = 0;
+  for (auto &t : fleet) {
+    fixes += t->fixes;
+    nofixes += t->nofixes;
+    kept += t->track.kept;
+    dropped += t->track.dropped;
+    errSum += t->errSum;
+    cycles += t->cycles;
+    rpCycles += t->rpCycles;
+    cycleMs += t->cycleMs;
+    rpCycleMs += t->rpCycleMs;
+    sentences += t->gps.sentences;
+    gpsErrors += t->gps.errors;
+    labelled += t->tiles.labelled;
+    lanQueries += t->lan.queries;
+    lanHits += t->lan.hits;
+    for (int d = 0; d < BDG_DESTS; d++)
+      bdgDest[d] += t->budget.today(d);
+    if (t->cycle.bdgLevel == BDG_LOW) bdgLow++;
+    if (t->cycle.bdgLevel == BDG_OUT) bdgOut++;
+    for (int c = 0; c < SHP_CLASSES; c++)
+      deferred[c] += t->shaper.deferred[c];
+    for (int d = 0; d < LNK_DESTS; d++)
+      lnkTimeout[d] += t->uplink.timeout(d) / (double)nodes;
+    lnkLoss += (t->uplink.loss(LNK_GEO) + t->uplink.loss(LNK_APRS)) / (2.0 * nodes);
+    for (int n = 0; n < NRG_SUBS; n++)
+      nrgSub[n] += t->energy.charge(n);
+    nrgAll += t->energy.charge();
+    allocs += t->allocs;
+    allocCycles += t->allocCycles;
+    stackAllocs += t->stackAllocs;
+    staJoins += t->staJoins;
+    staDrops += t->staDrops;
+    wlanScans += t->wlan.scans;
+    wlanPicked += t->wlan.picked;
+    downMs += t->downMs + (t->staUp ? 0 : t->clock - t->downSince);
+    if (t->sock >= 0) close(t->sock);
+  }
+  if (obsFile != NULL) fclose(obsFile);
+  if (traceOut != NULL) {
+    const std::string &trc = fleet[0]->files[TRC_FILE];
+    FILE *fp = fopen(traceOut, "wb");
+    if (fp == NULL or fwrite(trc.data(), 1, trc.size(), fp) != trc.size()) perror(traceOut);
+    if (fp != NULL) fclose(fp);
+  }
+  double secs = duration;
+  printf("nodes %d, threads %d, %lu s simulated in %.2f s, %lu fix cycles (%.0f/s)\n",
+         nodes, threads, duration, wall, steps.load(), steps.load() / wall);
+  printf("fixes      %lu, no fix %lu, mean error %.1f m\n",
+         fixes, nofixes, fixes ? errSum / fixes : 0.0);
+  printf("cycle      %.0f ms mean, %.0f ms with a report\n",
+         cycles ? (double)cycleMs / cycles : 0.0, rpCycles ? (double)rpCycleMs / rpCycles : 0.0);
+  printf("track      %lu vertices, %lu fixes dropped\n", kept, dropped);
+  printf("geolocate  %llu requests, %.2f/s mean, %u/s peak\n",
+         (unsigned long long)simGeo.requests.total(), simGeo.requests.total() / secs, simGeo.requests.peak());
+  if (useLAN)
+    printf("lan        %lu queries, %lu hits (%.1f%%), %llu fixes cached\n",
+           lanQueries, lanHits, lanQueries ? 100.0 * lanHits / lanQueries : 0.0,
+           (unsigned long long)simLAN.cache.stores.load());
+  printf("ntp        %llu requests, %.2f/s mean, %u/s peak\n",
+         (unsigned long long)simNTP.requests.total(), simNTP.requests.total() / secs, simNTP.requests.peak());
+  printf("tiles      %llu downloads, %llu KB\n",
+         (unsigned long long)simTiles.requests.total(), (unsigned long long)simTiles.bytes.total() / 1024);
+  if (useGPS)
+    printf("gps        %lu sentences, %lu errors, %lu APs labelled\n", sentences, gpsErrors, labelled);
+  if (bdgDaily > 0)
+    printf("budget     %llu KB: geo %llu, aprs %llu, ntp %llu, tile %llu, dns %llu; %lu low, %lu out\n",
+           (bdgDest[BDG_GEO] + bdgDest[BDG_APRS] + bdgDest[BDG_NTP] + bdgDest[BDG_TILE] + bdgDest[BDG_DNS] + bdgDest[BDG_OTHER]) / 1024,
+           bdgDest[BDG_GEO] / 1024, bdgDest[BDG_APRS] / 1024, bdgDest[BDG_NTP] / 1024,
+           bdgDest[BDG_TILE] / 1024, bdgDest[BDG_DNS] / 1024, bdgLow, bdgOut);
+  printf("shaper     deferred %lu time, %lu info, %lu bulk\n",
+         deferred[SHP_TIME], deferred[SHP_INFO], deferred[SHP_BULK]);
+  if (not fixedTimeouts)
+    printf("link       timeouts geo %.0f, aprs %.0f, ntp %.0f, tile %.0f ms, %.1f%% lost\n",
+           lnkTimeout[LNK_GEO], lnkTimeout[LNK_APRS], lnkTimeout[LNK_NTP], lnkTimeout[LNK_TILE], lnkLoss);
+  if (useRoam)
+    printf("wifi       %lu joins, %lu lost, %lu scans for a network, %lu kept, %.1f%% of the time off\n",
+           staJoins, staDrops, wlanScans, wlanPicked, 100.0 * downMs / (nodes * secs * 1000));
+  // The mean currents of a node (mA), from the uAh of all the nodes
+  double nrgHours = nodes * secs / 3.6;
+  printf("energy     %.1f mA, %.0f uAh a fix cycle: scan %.1f, geo %.1f, aprs %.1f, ntp %.1f, tile %.1f, dns %.1f, bcn %.1f, base %.1f mA\n",
+         nrgAll / nrgHours, steps.load() ? (double)nrgAll / steps.load() : 0.0,
+         nrgSub[NRG_SCAN] / nrgHours, nrgSub[NRG_GEO] / nrgHours, nrgSub[NRG_APRS] / nrgHours,
+         nrgSub[NRG_NTP] / nrgHours, nrgSub[NRG_TILE] / nrgHours, nrgSub[NRG_DNS] / nrgHours,
+         nrgSub[NRG_BCN] / nrgHours, nrgSub[NRG_BASE] / nrgHours);
+  printf("radio      %llu scans, %llu beacons heard\n",
+         (unsigned long long)simRadio.scans.total(), (unsigned long long)simRadio.frames.total());
+  printf("dns        %llu requests, %.2f/s mean, %u/s peak\n",
+         (unsigned long long)simDNS.requests.total(), simDNS.requests.total() / secs, simDNS.requests.peak());
+  printf("aprs-is    %llu logins, %.2f/s mean, %u/s peak\n",
+         (unsigned long long)simAPRS.requests.total(), simAPRS.requests.total() / secs, simAPRS.requests.peak());
+  printf("beacons    %llu, %.2f/s mean, %u/s peak, %llu sharing a second\n",
+         (unsigned long long)simAPRS.beacons.total(), simAPRS.beacons.total() / secs,
+         simAPRS.beacons.peak(), (unsigned long long)simAPRS.beacons.excess(1));
+  if (traceOut != NULL)
+    printf("trace      %lu records, %lu dropped, %zu bytes\n",
+           fleet[0]->trace.records, fleet[0]->trace.dropped, fleet[0]->files[TRC_FILE].size());
+  if (replaying)
+    printf("replay     %lu of %zu records, %lu missing, %lu requests and %lu lines differ, %lu ms synced\n",
+           traceReplay.used, traceReplay.records(), traceReplay.missing,
+           traceReplay.geoDiff, traceReplay.aprsDiff, traceReplay.synced);
+  printf("gateway    %llu datagrams, %.2f/s mean, %u/s peak\n",
+         (unsigned long long)gwDatagrams.total(), gwDatagrams.total() / secs, gwDatagrams.peak());
+  if (allocWarm > 0) {
+    printf("heap       %lu allocations in %lu fix cycles, after %lu each; core and lwIP %lu, %.1f a cycle\n",
+           allocs, allocCycles, allocWarm, stackAllocs, allocCycles ? (double)stackAllocs / allocCycles : 0.0);
+    // Steady, the fix cycle does not allocate
+    if (allocs > 0 or allocCycles == 0) return 1;
+  }
+  return 0;
+}
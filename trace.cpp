@@ -0,0 +1,188 @@
+/**
+  trace.cpp - I/O trace capture, for the host replay
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "trace.h"
+#include "dlog.h"
+
+Trace::Trace() {
+}
+
+/**
+  Start a new trace and listen for a client
+
+  @param stream only stream the records to the client, not in flash
+  @return true if recording
+*/
+bool Trace::init(bool stream) {
+  streaming = stream;
+  if (not streaming) {
+    if (not LittleFS.begin()) return false;
+    file = LittleFS.open(TRC_FILE, "w");
+    if (not file) return false;
+    trc_file_t hdr = {TRC_MAGIC, ESP.getChipId()};
+    file.write((const uint8_t*)&hdr, sizeof(hdr));
+  }
+  MDNS.addService(TRC_SERVICE, "tcp", TRC_PORT);
+  DLOG_P(SRV_MDNS, TRC_SERVICE, 1, TRC_PORT);
+  tcp_pcb *pcb = tcp_new();
+  if (pcb == NULL) return true;
+  if (tcp_bind(pcb, IP_ADDR_ANY, TRC_PORT) != ERR_OK or
+      (listener = tcp_listen(pcb)) == NULL) {
+    tcp_close(pcb);
+    return true;
+  }
+  tcp_arg(listener, this);
+  tcp_accept(listener, onAccept);
+  return true;
+}
+
+/**
+  Send the client the part of the trace file it did not get yet
+*/
+void Trace::loop() {
+  if (streaming or client == NULL or not file) return;
+  file.flush();
+  uint16_t room = tcp_sndbuf(client);
+  if (sent >= file.size() or room == 0) return;
+  File in = LittleFS.open(TRC_FILE, "r");
+  if (not in) return;
+  uint8_t buf[TRC_CHUNK];
+  in.seek(sent);
+  int len = in.read(buf, room < sizeof(buf) ? room : sizeof(buf));
+  in.close();
+  if (len > 0 and send(buf, len)) {
+    sent += len;
+    tcp_output(client);
+  }
+}
+
+/**
+  Record an input, a fixed part and the variable one
+
+  @param type the record type
+  @param flags the record flags
+  @param data the fixed part
+  @param len its length
+  @param more the variable part, if any
+  @param moreLen its length
+*/
+void Trace::record(uint8_t type, uint8_t flags, const void *data, uint16_t len,
+                   const void *more, uint16_t moreLen) {
+  trc_rec_t rec = {type, flags, (uint16_t)(len + moreLen), (uint32_t)millis()};
+  uint32_t size = sizeof(rec) + len + moreLen;
+  if (streaming) {
+    // Live only, lost with no client or when it lags
+    if (client == NULL or tcp_sndbuf(client) < size) {
+      dropped++;
+      return;
+    }
+    send(&rec, sizeof(rec));
+    send(data, len);
+    if (moreLen > 0) send(more, moreLen);
+    tcp_output(client);
+  }
+  else {
+    if (not file or file.size() + size > TRC_MAXSIZE) {
+      if (file and not full) DLOG_P(TRC_FULL, file.size());
+      full = true;
+      dropped++;
+      return;
+    }
+    file.write((const uint8_t*)&rec, sizeof(rec));
+    file.write((const uint8_t*)data, len);
+    if (moreLen > 0) file.write((const uint8_t*)more, moreLen);
+  }
+  records++;
+}
+
+/**
+  Write to the client, copied
+
+  @return true if queued
+*/
+bool Trace::send(const void *data, uint16_t len) {
+  return tcp_write(client, data, len, TCP_WRITE_FLAG_COPY) == ERR_OK;
+}
+
+/**
+  Drop the client connection
+*/
+void Trace::close() {
+  tcp_arg(client, NULL);
+  tcp_recv(client, NULL);
+  tcp_err(client, NULL);
+  tcp_abort(client);
+  client = NULL;
+  DLOG_P(SRV_DIS, TRC_SERVICE, 0, 0);
+}
+
+/**
+  A new connection, only one client at a time
+*/
+err_t Trace::onAccept(void *arg, tcp_pcb *pcb, err_t err) {
+  Trace *trc = (Trace*)arg;
+  if (err != ERR_OK or pcb == NULL) return ERR_VAL;
+  uint32_t ip = ip4_addr_get_u32(ip_2_ip4(&pcb->remote_ip));
+  if (trc->client != NULL) {
+    DLOG_P(SRV_REJ, TRC_SERVICE, 1, 1,
+           ip & 0xFF, (ip >> 8) & 0xFF, (ip >> 16) & 0xFF, ip >> 24);
+    tcp_abort(pcb);
+    return ERR_ABRT;
+  }
+  trc->client = pcb;
+  tcp_arg(pcb, trc);
+  tcp_recv(pcb, onRecv);
+  tcp_err(pcb, onError);
+  tcp_nagle_disable(pcb);
+  DLOG_P(SRV_CON, TRC_SERVICE, 1, 0,
+         ip & 0xFF, (ip >> 8) & 0xFF, (ip >> 16) & 0xFF, ip >> 24);
+  // The file from the start, or the header of the stream
+  trc->sent = 0;
+  if (trc->streaming) {
+    trc_file_t hdr = {TRC_MAGIC, ESP.getChipId()};
+    trc->send(&hdr, sizeof(hdr));
+    tcp_output(pcb);
+  }
+  return ERR_OK;
+}
+
+/**
+  Data from the client is dropped, the end of the stream closes it
+*/
+err_t Trace::onRecv(void *arg, tcp_pcb *pcb, pbuf *p, err_t err) {
+  Trace *trc = (Trace*)arg;
+  if (p == NULL) {
+    trc->close();
+    return ERR_ABRT;
+  }
+  tcp_recved(pcb, p->tot_len);
+  pbuf_free(p);
+  return ERR_OK;
+}
+
+/**
+  The connection failed, lwIP already freed the PCB
+*/
+void Trace::onError(void *arg, err_t err) {
+  Trace *trc = (Trace*)arg;
+  if (trc == NULL) return;
+  trc->client = NULL;
+  DLOG_P(SRV_DIS, TRC_SERVICE, 0, 0);
+}
@@ -0,0 +1,69 @@
+/**
+  trace.h - I/O trace capture, for the host replay
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  Records the scans, the geolocation, NTP and APRS-IS exchanges, in the
+  format of tracemsg.h.  A new trace each boot, kept in flash up to
+  TRC_MAXSIZE, or only streamed.  A client connecting to TRC_PORT gets
+  the trace so far and then follows it:
+
+    nc tracker.local 10112 > trace.bin
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "Arduino.h"
+#include <ESP8266WiFi.h>
+#include <ESP8266mDNS.h>
+#include <LittleFS.h>
+#include <lwip/tcp.h>
+#include "tracemsg.h"
+
+// The trace file
+#define TRC_FILE      "/trace.bin"
+// Stop recording in flash at this size (bytes)
+#ifndef TRC_MAXSIZE
+#define TRC_MAXSIZE   262144UL
+#endif
+// Send this much of the file to the client at once (bytes)
+#define TRC_CHUNK     512
+
+class Trace {
+  public:
+    Trace();
+    bool  init(bool stream = false);
+    void  loop();
+    void  record(uint8_t type, uint8_t flags, const void *data, uint16_t len,
+                 const void *more = NULL, uint16_t moreLen = 0);
+    unsigned long records = 0;          // Records kept
+    unsigned long dropped = 0;          // Records lost, the flash full or no client
+  private:
+    static err_t onAccept(void *arg, tcp_pcb *pcb, err_t err);
+    static err_t onRecv(void *arg, tcp_pcb *pcb, pbuf *p, err_t err);
+    static void  onError(void *arg, err_t err);
+    bool  send(const void *data, uint16_t len);
+    void  close();
+    File      file;                     // The trace in flash
+    bool      streaming = false;        // Only to the client, not in flash
+    bool      full      = false;
+    tcp_pcb  *listener  = NULL;
+    tcp_pcb  *client    = NULL;
+    uint32_t  sent      = 0;            // File bytes sent to the client
+};
+
+#endif /* TRACE_H */
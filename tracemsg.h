@@ -0,0 +1,105 @@
+/**
+  tracemsg.h - I/O trace records
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  The inputs of a tracker from the outside, as it got them, for the host
+  replay (tools/sim/wipssim -R), shared by both sides.  Little endian, a
+  file header, then the records, each with its time since the boot:
+
+    file      trc_file_t
+    record    trc_rec_t, len bytes
+
+  The records, and what follows their header:
+
+    scan      trc_scan_t, count x trc_ap_t        the active scans
+    geo       trc_geo_t, count x trc_net_t        the geolocation server
+    ntp       trc_ntp_t                           the NTP exchanges
+    aprs conn uint16 ms                           each APRS-IS handshake
+    aprs out  the bytes written                   to APRS-IS
+    aprs in   the line, no end of line            from APRS-IS
+
+  TRC_OK in the flags is set if connected, or answered.
+*/
+
+#ifndef TRACEMSG_H
+#define TRACEMSG_H
+
+#include <stdint.h>
+
+// "WTR1"
+#define TRC_MAGIC     0x31525457UL
+// The TCP port and the mDNS service, _wipstrace._tcp
+#define TRC_PORT      10112
+#define TRC_SERVICE   "wipstrace"
+// The most APs in a record
+#define TRC_APS       32
+
+// The record types
+enum trc_type_t {TRC_SCAN = 1, TRC_GEO, TRC_NTP, TRC_APRSCONN, TRC_APRSOUT, TRC_APRSIN};
+
+// The record flags
+#define TRC_OK        0x01
+
+struct __attribute__((packed)) trc_file_t {
+  uint32_t  magic;
+  uint32_t  chip;                     // The chip id
+};
+
+struct __attribute__((packed)) trc_rec_t {
+  uint8_t   type;
+  uint8_t   flags;
+  uint16_t  len;                      // Bytes following
+  uint32_t  ms;                       // Since the boot
+};
+
+struct __attribute__((packed)) trc_scan_t {
+  uint16_t  ms;                       // The scan time
+  uint8_t   count;                    // APs following
+  uint8_t   reserved;
+};
+
+struct __attribute__((packed)) trc_ap_t {
+  uint8_t   bssid[6];
+  int8_t    rssi;
+  uint8_t   channel;
+};
+
+struct __attribute__((packed)) trc_geo_t {
+  uint16_t  connMs;                   // Connecting, all the tries
+  uint16_t  rspMs;                    // From the request sent to the answer read
+  uint16_t  waitMs;                   // From the request sent to the answer header
+  int32_t   lat;                      // 1e-7 degrees
+  int32_t   lng;                      // 1e-7 degrees
+  int16_t   acc;                      // m, -1 if none
+  int16_t   code;                     // The error code, 0 if none
+  uint8_t   tries;                    // Connection tries
+  uint8_t   count;                    // APs in the request, following
+};
+
+struct __attribute__((packed)) trc_net_t {
+  uint8_t   bssid[6];
+  int8_t    rssi;
+};
+
+struct __attribute__((packed)) trc_ntp_t {
+  uint16_t  ms;                       // The round trip, or the time waited
+  uint8_t   frac;                     // The first byte of the fraction
+  uint8_t   reserved;
+  uint32_t  secs;                     // The transmit time, NTP seconds
+};
+
+#endif /* TRACEMSG_H */
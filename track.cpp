@@ -0,0 +1,108 @@
+/**
+  track.cpp - Online track simplification
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "track.h"
+
+// Meters per degree of latitude
+#define TRACK_MDEG    111194.93
+
+Track::Track() {
+}
+
+/**
+  Start a new track
+*/
+void Track::init() {
+  count   = 0;
+  started = false;
+  kept    = 0;
+  dropped = 0;
+}
+
+/**
+  Distance from a point to a segment, on a local flat projection
+
+  @param a the segment start
+  @param b the segment end
+  @param p the point
+  @return the distance (m)
+*/
+float Track::offset(const track_pt_t &a, const track_pt_t &b, const track_pt_t &p) {
+  float kx = TRACK_MDEG * cos(radians(a.lat));
+  float bx = (b.lng - a.lng) * kx, by = (b.lat - a.lat) * TRACK_MDEG;
+  float px = (p.lng - a.lng) * kx, py = (p.lat - a.lat) * TRACK_MDEG;
+  float len = bx * bx + by * by;
+  // Project on the segment, clamped to its ends
+  float t = len > 0 ? (px * bx + py * by) / len : 0;
+  if      (t < 0) t = 0;
+  else if (t > 1) t = 1;
+  float dx = px - t * bx, dy = py - t * by;
+  return sqrt(dx * dx + dy * dy);
+}
+
+/**
+  Add a fix to the track.  The fixes are held back while the segment from
+  the last vertex to the newest fix passes within the tolerance of all of
+  them.  When it does not, or the window is full, the previous fix becomes
+  a vertex: an opening window Douglas-Peucker, one fix behind.
+
+  @param pt the fix
+  @param tol the tolerance (m)
+  @param vertex the new vertex, if any
+  @return true if there is a new vertex
+*/
+bool Track::add(const track_pt_t &pt, float tol, track_pt_t *vertex) {
+  // The first fix is a vertex
+  if (not started) {
+    reset(pt);
+    *vertex = pt;
+    return true;
+  }
+  bool fits = count < TRACK_WINDOW;
+  for (uint8_t i = 0; i < count and fits; i++)
+    if (offset(anchor, pt, window[i]) > tol)
+      fits = false;
+  if (fits) {
+    window[count++] = pt;
+    return false;
+  }
+  // The previous fix is a vertex, the ones before it are redundant
+  *vertex = window[count - 1];
+  dropped += count - 1;
+  kept++;
+  anchor = *vertex;
+  window[0] = pt;
+  count = 1;
+  return true;
+}
+
+/**
+  Make a fix the last vertex, as when it was reported anyway
+
+  @param pt the fix
+*/
+void Track::reset(const track_pt_t &pt) {
+  // The held fixes before it are redundant
+  if (count > 0) dropped += count - 1;
+  kept++;
+  anchor  = pt;
+  count   = 0;
+  started = true;
+}
@@ -0,0 +1,58 @@
+/**
+  track.h - Online track simplification
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRACK_H
+#define TRACK_H
+
+#include "Arduino.h"
+#include "config.h"
+
+// Minimum distance (m) a fix must be off the track to be kept
+#ifndef TRACK_TOL
+#define TRACK_TOL     50
+#endif
+// Maximum number of fixes held back, the lookahead window
+#define TRACK_WINDOW  8
+
+// A track point
+struct track_pt_t {
+  float         lat;
+  float         lng;
+  unsigned long utm;
+  int16_t       crs;
+  int16_t       knots;
+};
+
+class Track {
+  public:
+    Track();
+    void  init();
+    bool  add(const track_pt_t &pt, float tol, track_pt_t *vertex);
+    void  reset(const track_pt_t &pt);
+    unsigned long kept;                   // Fixes kept as vertices
+    unsigned long dropped;                // Fixes dropped as redundant
+  private:
+    float offset(const track_pt_t &a, const track_pt_t &b, const track_pt_t &p);
+    track_pt_t  anchor;                   // The last vertex
+    track_pt_t  window[TRACK_WINDOW];     // The fixes after it
+    uint8_t     count;
+    bool        started;
+};
+
+#endif /* TRACK_H */
@@ -0,0 +1,514 @@
+/**
+  wlan.cpp - Joining the WiFi networks, in the background
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "wlan.h"
+#include "mls.h"
+#include "dlog.h"
+#include "stall.h"
+
+#ifdef WIFI_SSIDPASS
+// The known networks, records of SSID and PSK, in flash
+static const char wlanList[] PROGMEM = WIFI_SSIDPASS;
+static const char wlanRS[] = WIFI_RS;
+static const char wlanFS[] = WIFI_FS;
+#endif
+
+// The scan results, without the String of WiFi.SSID()
+class WLANScan: public ESP8266WiFiScanClass {
+  public:
+    static bss_info *info(int i) {
+      return (bss_info*)_getScanInfoByIndex(i);
+    }
+};
+
+WLAN::WLAN() {
+}
+
+/**
+  Keep the stored network, to join it again
+*/
+void WLAN::init() {
+#ifdef WIFI_SSID
+  strncpy(home, WIFI_SSID, WL_SSID_MAX_LENGTH);
+  home[WL_SSID_MAX_LENGTH] = '\0';
+  strncpy(homePSK, WIFI_PASS, WL_WPA_KEY_MAX_LENGTH);
+  homePSK[WL_WPA_KEY_MAX_LENGTH] = '\0';
+#else
+  ssid(home, sizeof(home));
+  psk(homePSK, sizeof(homePSK));
+#endif
+  state = WLAN_STORED;
+  count = cur = fails = 0;
+  timing = false;
+}
+
+/**
+  Time the associations, they time out as long as they take
+
+  @param lnk the uplink quality estimator
+*/
+void WLAN::setLink(Link *lnk) {
+  link = lnk;
+}
+
+/**
+  Check a network joined with the shared TLS context
+
+  @param ctx the TLS context
+*/
+void WLAN::setTLS(TLS *ctx) {
+  tls = ctx;
+}
+
+/**
+  Wait for the server name with the shared DNS cache
+
+  @param resolver the DNS cache
+*/
+void WLAN::setResolver(DNSCache *resolver) {
+  dns = resolver;
+}
+
+/**
+  Show the joins, on a display
+
+  @param fn the function to call
+  @param arg its argument
+*/
+void WLAN::setShow(wlan_show_t fn, void *arg) {
+  showFn = fn;
+  showArg = arg;
+}
+
+void WLAN::show(uint8_t event, const char *ssid) {
+  if (showFn != NULL) showFn(showArg, event, ssid);
+}
+
+/**
+  The association timeout (ms)
+*/
+unsigned long WLAN::timeout() {
+  return link != NULL ? link->timeout(LNK_WIFI) : 15000;
+}
+
+/**
+  Get the SSID of the stored station configuration or of a scanned network,
+  copying it to a fixed buffer instead of creating a String
+
+  @param buf the buffer to copy the SSID to
+  @param len the buffer length
+  @param i the scan result index, negative for the stored configuration
+  @return the SSID length
+*/
+size_t WLAN::ssid(char *buf, size_t len, int i) {
+  const char *ssid = NULL;
+  size_t ssidLen = 0;
+  struct station_config conf;
+  if (i < 0) {
+    // The stored station configuration
+    wifi_station_get_config(&conf);
+    ssid = (const char*)conf.ssid;
+    ssidLen = strnlen(ssid, sizeof(conf.ssid));
+  }
+  else {
+    // The scan result
+    bss_info *it = WLANScan::info(i);
+    if (it != NULL) {
+      ssid = (const char*)it->ssid;
+      ssidLen = it->ssid_len;
+    }
+  }
+  // Copy and make sure it ends with null
+  if (ssidLen >= len) ssidLen = len - 1;
+  if (ssid != NULL) memcpy(buf, ssid, ssidLen);
+  buf[ssidLen] = '\0';
+  return ssidLen;
+}
+
+/**
+  Get the PSK of the stored station configuration, without creating a String
+
+  @param buf the buffer to copy the PSK to
+  @param len the buffer length
+  @return the PSK length
+*/
+size_t WLAN::psk(char *buf, size_t len) {
+  struct station_config conf;
+  wifi_station_get_config(&conf);
+  size_t pskLen = strnlen((const char*)conf.password, sizeof(conf.password));
+  // Copy and make sure it ends with null
+  if (pskLen >= len) pskLen = len - 1;
+  memcpy(buf, conf.password, pskLen);
+  buf[pskLen] = '\0';
+  return pskLen;
+}
+
+/**
+  Try to connect to a HTTPS server
+
+  @param server the server name
+  @param port the server port
+  @param timeout connection timeout, twice the one of the geolocation if negative
+  @return true if the server answered
+*/
+bool WLAN::check(const char *server, int port, long timeout) {
+  bool result = false;
+  if (tls == NULL) return result;
+  if (timeout < 0) timeout = 2 * (link != NULL ? link->timeout(LNK_GEO) : 5000);
+  // Use the shared client, do not create a new one for each check
+  WiFiClientSecure &testClient = tls->client;
+  char buf[64] = "";
+  // Wait for the name, nothing is resolved yet on a network just joined,
+  // and a lookup in flight does not tell the network fails
+  IPAddress ip;
+  if (dns != NULL) dns->wait(server, ip);
+  if (tls->connect(server, port, timeout)) {
+    DLOG_P(HTTP_CON, server, port);
+    // Send a request
+    testClient.print("HEAD / HTTP/1.1\r\n");
+    testClient.print("Host: "); testClient.print(server); testClient.print("\r\n");
+    testClient.print("Connection: close\r\n\r\n");
+    // Check the response
+    int rlen = STALL_CALL(STALL_READ, testClient.readBytesUntil('\r', buf, sizeof(buf) - 1));
+    if (rlen > 0) {
+      buf[rlen] = '\0';
+      result = true;
+      DLOG_P(HTTP_RSP, buf);
+    }
+    else
+      DLOG_P(HTTP_DIS, server, port);
+  }
+  else
+    DLOG_P(HTTP_ERR, server, port);
+  // Stop the test
+  tls->stop();
+  // Return the result
+  return result;
+}
+
+/**
+  Try to connect to WiFi network, blocking
+
+  @param ssid the WiFi SSID, the stored one if NULL
+  @param pass the WiFi psk
+  @param timeout connection timeout (s), as long as the associations take if negative
+  @return connection result
+*/
+bool WLAN::join(const char *ssid, const char *pass, int timeout) {
+  bool result = false;
+  if (timeout < 0) timeout = this->timeout() / 1000;
+  if (ssid == NULL) {
+    // No stored and no specified SSID
+    if (home[0] == '\0') return result;
+    ssid = home;
+    pass = homePSK;
+  }
+
+  // Try to connect
+  DLOG_P(WIFI_BGN, ssid);
+  show(WLAN_BEGIN, ssid);
+  WiFi.begin(ssid, pass);
+  // Check the status
+  unsigned long start = millis();
+  int tries = 0;
+  while (not WiFi.isConnected() and tries < timeout) {
+    tries++;
+    DLOG_P(WIFI_TRY, tries, timeout, ssid);
+    show(WLAN_WAIT, ssid);
+    stall.wait(1000);
+  };
+  // Check the internet connection
+  if (WiFi.isConnected()) {
+    if (link != NULL) link->sample(LNK_WIFI, millis() - start);
+    joined();
+    result = check(GEO_SERVER, GEO_PORT);
+    if (result) {
+      keep();
+      state = WLAN_UP;
+    }
+    else
+      DLOG_P(WIFI_ERR, ssid);
+  }
+  else {
+    // Timed out
+    if (link != NULL) link->lost(LNK_WIFI);
+    DLOG_P(WIFI_END, ssid);
+  }
+  return result;
+}
+
+/**
+  Try to connect to the known networks around, blocking
+
+  @return connection result to a known WiFi
+*/
+bool WLAN::joinKnown() {
+  char ssid[WL_SSID_MAX_LENGTH + 1];
+  char pass[WL_WPA_KEY_MAX_LENGTH + 1];
+  pick(true, false);
+  for (uint8_t i = 0; i < count; i++) {
+    record(cands[i].rec, ssid, pass);
+    if (join(cands[i].ssid, pass)) return true;
+    yield();
+  }
+  return false;
+}
+
+/**
+  Try to connect to the open networks around, blocking
+
+  @return connection result to an open WiFi
+*/
+bool WLAN::joinOpen() {
+  pick(false, true);
+  for (uint8_t i = 0; i < count; i++) {
+    if (join(cands[i].ssid)) return true;
+    yield();
+  }
+  return false;
+}
+
+/**
+  Start joining the stored network, in the background
+
+  @param channel the channel of the AP, scan for it if zero
+  @param bssid the AP, any of the network if NULL
+  @return true if started, false if there is no stored network
+*/
+bool WLAN::begin(uint8_t channel, const uint8_t *bssid) {
+  if (home[0] == '\0') return false;
+  DLOG_P(WIFI_BGN, home);
+  WiFi.begin(home, homePSK, channel, bssid);
+  state = WLAN_STORED;
+  started = millis();
+  timing = true;
+  return true;
+}
+
+/**
+  Follow the link and join a network in the background: the stored one
+  again and, after a few associations timed out, the networks around
+*/
+void WLAN::loop() {
+  if (WiFi.isConnected()) {
+    if (state == WLAN_UP) return;
+    if (timing and link != NULL) link->sample(LNK_WIFI, millis() - started);
+    timing = false;
+    joined();
+    // A network of the scan is kept only if the server is reached
+    if (state == WLAN_TRY) {
+      if (not check(GEO_SERVER, GEO_PORT)) {
+        DLOG_P(WIFI_ERR, cands[cur].ssid);
+        WiFi.disconnect();
+        start(cur + 1);
+        return;
+      }
+      picked++;
+    }
+    keep();
+    state = WLAN_UP;
+    fails = 0;
+    return;
+  }
+
+  switch (state) {
+    case WLAN_UP:
+      // Lost, the SDK joins it again on its own, as long as an association takes
+      DLOG_P(WIFI_NOC);
+      state = WLAN_STORED;
+      started = millis();
+      timing = true;
+      break;
+    case WLAN_STORED:
+      if (millis() - started < timeout()) break;
+      if (timing) {
+        if (link != NULL) link->lost(LNK_WIFI);
+        DLOG_P(WIFI_END, home);
+        timing = false;
+      }
+      // Look for another network, or join the stored one again
+      if (++fails >= WLAN_TRIES or not begin()) state = WLAN_SCAN;
+      break;
+    case WLAN_SCAN:
+      // One scan, the known networks first, then the open ones
+      scans++;
+      fails = 0;
+      pick(true, true);
+      start(0);
+      break;
+    case WLAN_TRY:
+      if (millis() - started < timeout()) break;
+      if (link != NULL) link->lost(LNK_WIFI);
+      DLOG_P(WIFI_END, cands[cur].ssid);
+      timing = false;
+      start(cur + 1);
+      break;
+  }
+}
+
+/**
+  Start joining a network picked, or the stored one after the last
+
+  @param i the network picked
+  @return true if one of the picked is being joined
+*/
+bool WLAN::start(uint8_t i) {
+  char ssid[WL_SSID_MAX_LENGTH + 1];
+  char pass[WL_WPA_KEY_MAX_LENGTH + 1];
+  cur = i;
+  if (cur >= count) {
+    // None left, the stored network, or scan again after an association time
+    if (not begin()) {
+      state = WLAN_STORED;
+      started = millis();
+      fails = WLAN_TRIES;
+    }
+    return false;
+  }
+  record(cands[cur].rec, ssid, pass);
+  DLOG_P(WIFI_BGN, cands[cur].ssid);
+  WiFi.begin(cands[cur].ssid, cands[cur].rec == WLAN_OPEN ? NULL : pass);
+  state = WLAN_TRY;
+  started = millis();
+  timing = true;
+  return true;
+}
+
+/**
+  Joined a network, show it
+*/
+void WLAN::joined() {
+  char ssid[WL_SSID_MAX_LENGTH + 1];
+  this->ssid(ssid, sizeof(ssid));
+  show(WLAN_JOINED, ssid);
+}
+
+/**
+  Keep the network joined, the one to join again
+*/
+void WLAN::keep() {
+  char ssid[WL_SSID_MAX_LENGTH + 1];
+  if (this->ssid(ssid, sizeof(ssid)) == 0) return;
+  memcpy(home, ssid, sizeof(home));
+  psk(homePSK, sizeof(homePSK));
+}
+
+/**
+  Get a record of the known networks list
+
+  @param rec the record number
+  @param ssid the buffer for the SSID
+  @param pass the buffer for the PSK
+  @return true if found, false past the last one; a record not valid
+          is found empty
+*/
+bool WLAN::record(uint8_t rec, char *ssid, char *pass) {
+  ssid[0] = pass[0] = '\0';
+#ifdef WIFI_SSIDPASS
+  if (rec == WLAN_OPEN) return true;
+  // Copy the credentials to RAM
+  char list[WLAN_LISTLEN] = "";
+  strncpy_P(list, wlanList, sizeof(list) - 1);
+  char *end = list + strlen(list);
+  // The substrings/fields
+  char *f1 = list, *f2, *fs, *rs;
+  while (f1 < end) {
+    // Find the record separator, the list may end without one
+    rs = strstr(f1, wlanRS);
+    if (rs == NULL) rs = end;
+    if (rec-- == 0) {
+      // Find the field separator, check for valid lengths
+      fs = strstr(f1, wlanFS);
+      if (fs == NULL or fs > rs) return true;
+      f2 = fs + strlen(wlanFS);
+      if (fs - f1 > WL_SSID_MAX_LENGTH or rs - f2 > WL_WPA_KEY_MAX_LENGTH) return true;
+      // Make a copy of SSID and password and make sure they are null terminated
+      strncpy(ssid, f1, fs - f1); ssid[fs - f1] = '\0';
+      strncpy(pass, f2, rs - f2); pass[rs - f2] = '\0';
+      return true;
+    }
+    f1 = rs + (rs < end ? strlen(wlanRS) : 0);
+  }
+  return false;
+#else
+  return rec == WLAN_OPEN;
+#endif
+}
+
+/**
+  Add a network to try, once
+
+  @param ssid the SSID
+  @param rec the record of the PSK
+*/
+void WLAN::add(const char *ssid, uint8_t rec) {
+  if (count >= WLAN_CANDS or ssid[0] == '\0') return;
+  for (uint8_t i = 0; i < count; i++)
+    if (cands[i].rec == rec and strcmp(cands[i].ssid, ssid) == 0) return;
+  memcpy(cands[count].ssid, ssid, sizeof(cands[count].ssid));
+  cands[count].rec = rec;
+  count++;
+}
+
+/**
+  Scan and pick the networks to try
+
+  @param known pick the known networks around
+  @param open pick the open networks around
+  @return the networks picked
+*/
+uint8_t WLAN::pick(bool known, bool open) {
+  char scan[WL_SSID_MAX_LENGTH + 1];
+  char ssid[WL_SSID_MAX_LENGTH + 1];
+  char pass[WL_WPA_KEY_MAX_LENGTH + 1];
+  count = 0;
+  // Scan the networks
+  int netCount = STALL_CALL(STALL_WSCAN, WiFi.scanNetworks());
+  if (netCount > 0) DLOG_P(SWIFI_CNT, netCount);
+  for (int i = 0; i < netCount; i++) {
+    this->ssid(scan, sizeof(scan), i);
+    DLOG_P(SWIFI_NET, i + 1, WiFi.channel(i), WiFi.RSSI(i),
+           WiFi.encryptionType(i) == ENC_TYPE_NONE ? "open" : "", scan);
+  }
+  // The known networks around, in the order listed
+  for (uint8_t rec = 0; known and record(rec, ssid, pass); rec++)
+    for (int i = 0; i < netCount; i++) {
+      this->ssid(scan, sizeof(scan), i);
+      if (strcmp(ssid, scan) == 0) add(scan, rec);
+    }
+#ifdef WIFI_GREYHAT
+  // Then all the networks around, with each known password
+  for (uint8_t rec = 0; known and record(rec, ssid, pass); rec++)
+    for (int i = 0; i < netCount; i++) {
+      this->ssid(scan, sizeof(scan), i);
+      add(scan, rec);
+    }
+#endif
+  // The open networks around
+  for (int i = 0; open and i < netCount; i++)
+    if (WiFi.encryptionType(i) == ENC_TYPE_NONE) {
+      this->ssid(scan, sizeof(scan), i);
+      DLOG_P(WIFI_OPN, scan);
+      add(scan, WLAN_OPEN);
+    }
+  // Clear the scan results
+  WiFi.scanDelete();
+  return count;
+}
@@ -0,0 +1,111 @@
+/**
+  wlan.h - Joining the WiFi networks, in the background
+
+  Copyright (c) 2017-2020 Costin STROIE <costinstroie@eridu.eu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  The stored network is joined in the background, the SDK joins it again
+  on its own when lost.  After WLAN_TRIES associations timed out, one
+  scan picks the known networks around, then the open ones, and each is
+  joined in turn, in the background too, and kept only if the server is
+  reached through it.  Then the stored network again, the last one that
+  worked.  Each pass of the loop does at most one step: a scan, or a
+  check, so the fix cycle goes on meanwhile.  The blocking joins are for
+  the setup, before the portal.
+*/
+
+#ifndef WLAN_H
+#define WLAN_H
+
+#include "Arduino.h"
+#include <ESP8266WiFi.h>
+extern "C" {
+#include "user_interface.h"
+}
+#include "config.h"
+#include "dnscache.h"
+#include "tls.h"
+#include "link.h"
+
+// Associations timed out before looking for another network
+#ifndef WLAN_TRIES
+#define WLAN_TRIES    3
+#endif
+// Networks to try from one scan
+#define WLAN_CANDS    4
+// The known networks list, as copied from flash
+#define WLAN_LISTLEN  250
+// The network is open, no record in the known list
+#define WLAN_OPEN     0xFF
+
+// The background join states
+enum wlan_state_t {WLAN_STORED, WLAN_SCAN, WLAN_TRY, WLAN_UP};
+
+// What to show: joining a network, a second of it, joined
+enum wlan_event_t {WLAN_BEGIN, WLAN_WAIT, WLAN_JOINED};
+
+// Called on the joins, to show them
+typedef void (*wlan_show_t)(void *arg, uint8_t event, const char *ssid);
+
+// A network to try, from a scan
+struct wlan_cand_t {
+  char      ssid[WL_SSID_MAX_LENGTH + 1];
+  uint8_t   rec;                      // The record of its PSK, WLAN_OPEN if none
+};
+
+class WLAN {
+  public:
+    WLAN();
+    void    init();
+    void    setLink(Link *lnk);
+    void    setTLS(TLS *ctx);
+    void    setResolver(DNSCache *resolver);
+    void    setShow(wlan_show_t fn, void *arg);
+    size_t  ssid(char *buf, size_t len, int i = -1);
+    size_t  psk(char *buf, size_t len);
+    bool    check(const char *server, int port, long timeout = -1);
+    bool    join(const char *ssid = NULL, const char *pass = NULL, int timeout = -1);
+    bool    joinKnown();
+    bool    joinOpen();
+    bool    begin(uint8_t channel = 0, const uint8_t *bssid = NULL);
+    void    loop();
+    uint8_t state = WLAN_STORED;
+    unsigned long scans = 0;          // Scans for another network
+    unsigned long picked = 0;         // Networks kept from them
+  private:
+    unsigned long timeout();
+    bool    record(uint8_t rec, char *ssid, char *pass);
+    uint8_t pick(bool known, bool open);
+    void    add(const char *ssid, uint8_t rec);
+    bool    start(uint8_t i);
+    void    joined();
+    void    keep();
+    void    show(uint8_t event, const char *ssid);
+    char          home[WL_SSID_MAX_LENGTH + 1];       // The network to join again
+    char          homePSK[WL_WPA_KEY_MAX_LENGTH + 1];
+    wlan_cand_t   cands[WLAN_CANDS];
+    uint8_t       count = 0;          // Networks picked
+    uint8_t       cur = 0;            // The one being joined
+    uint8_t       fails = 0;          // Associations timed out in a row
+    unsigned long started = 0;        // The join started (ms)
+    bool          timing = false;     // The association is being timed
+    Link         *link = NULL;
+    TLS          *tls = NULL;
+    DNSCache     *dns = NULL;
+    wlan_show_t   showFn = NULL;
+    void         *showArg = NULL;
+};
+
+#endif /* WLAN_H */